@@ -13,6 +13,8 @@
 #include "precomp.h"
 #include "resources/resource.h"
 #include "font/DWritEx.h"
+#include "font/DownloadScheduler.h"
+#include "font/FontDownloader.h"
 #include "FontSetViewer.h"
 
 
@@ -70,6 +72,10 @@ namespace
         { L"tr-TR",        L"tr-TR"},
         };
 
+    // Files to consider when loading directories. Fonts are identified by
+    // their contents rather than extension, so misnamed ones are found too.
+    const static wchar_t* g_recursiveDirectoryFileMask = L"**\\*";
+
     const static wchar_t* g_fontCollectionFilterModeNames[] = {
         L"Ungrouped",            // DWRITE_FONT_PROPERTY_ID_NONE
         L"WssFamilyName",        // DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME
@@ -745,44 +751,152 @@ namespace
     }
 
 
-    HRESULT CreateFontSetFromFileNames(
+    HRESULT AddFontFilesToFontSetBuilder(
         IDWriteFactory5* dwriteFactory,
+        IDWriteFontSetBuilder1* fontSetBuilder,
         _In_opt_z_ wchar_t const* baseFilePath,
         _In_reads_bytes_(fileNamesCount) wchar_t const* fileNames,
         uint32_t fileNamesCount,
-        _Out_ IDWriteFontSet** fontSet,
-        std::wstring& failedFileNames
+        IN OUT std::wstring& failedFileNames,
+        IN OUT std::vector<std::wstring>& directoryPaths // Any directories expanded.
     )
     {
-        *fontSet = nullptr;
-
-        ComPtr<IDWriteFontSet> newFontSet;
-        ComPtr<IDWriteFontSetBuilder1> fontSetBuilder;
-        IFR(dwriteFactory->CreateFontSetBuilder(OUT &fontSetBuilder));
         auto fileNamesEnd = fileNames + fileNamesCount;
 
         if (baseFilePath == nullptr)
             baseFilePath = L"";
 
-        // Create font set with a single file.
-        for (wchar_t const* fileName = fileNames; fileName < fileNamesEnd && fileName[0] != '\0'; )
+        // Add the font file to the set, but don't fail the whole font set if an error happened.
+        // Instead, return success, but keep track of the failure.
+        auto addFontFile = [&](_In_z_ wchar_t const* filePath)
         {
-            // Get the full path in case relative filenames were passed.
-            wchar_t filePath[MAX_PATH + 1];
-            PathCombine(OUT filePath, baseFilePath, fileName);
             ComPtr<IDWriteFontFile> fontFile;
-
-            // Add the font file to the set, but don't fail the whole font set if an error happened.
-            // Instead, return success, but keep track of the failure.
             if (FAILED(dwriteFactory->CreateFontFileReference(filePath, nullptr, OUT &fontFile))
             ||  FAILED(fontSetBuilder->AddFontFile(fontFile)))
             {
                 failedFileNames.append(filePath);
                 failedFileNames.push_back('\0');
             }
+        };
+
+        std::vector<wchar_t const*> matchingFilePaths;
+        std::vector<FontFileFormat> matchingFileFormats;
+
+        // Sniffs a batch of files and adds only those that are actually fonts.
+        // Files of other formats are reported as failed.
+        auto addSniffedFontFiles = [&](bool reportUnknownFiles) -> HRESULT
+        {
+            IFR(GetFontFileFormats(matchingFilePaths, OUT matchingFileFormats));
+            for (size_t i = 0, ci = matchingFilePaths.size(); i < ci; ++i)
+            {
+                if (IsLoadableFontFileFormat(matchingFileFormats[i]))
+                {
+                    addFontFile(matchingFilePaths[i]);
+                }
+                else if (reportUnknownFiles)
+                {
+                    failedFileNames.append(matchingFilePaths[i]);
+                    failedFileNames.push_back('\0');
+                }
+            }
+            matchingFilePaths.clear();
+            return S_OK;
+        };
+
+        // Explicitly named files are also judged by content rather than by
+        // extension. They are sniffed together, but flushed before each
+        // folder so the files keep their order in the set.
+        std::vector<std::wstring> explicitFilePaths;
+        auto addExplicitFontFiles = [&]() -> HRESULT
+        {
+            if (explicitFilePaths.empty())
+                return S_OK;
+
+            matchingFilePaths.clear();
+            for (auto const& explicitFilePath : explicitFilePaths)
+            {
+                matchingFilePaths.push_back(explicitFilePath.c_str());
+            }
+            IFR(addSniffedFontFiles(/*reportUnknownFiles*/ true));
+            explicitFilePaths.clear();
+            return S_OK;
+        };
 
+        // Create font set with a single file.
+        for (wchar_t const* fileName = fileNames; fileName < fileNamesEnd && fileName[0] != '\0'; )
+        {
+            // Get the full path in case relative filenames were passed.
+            wchar_t filePath[MAX_PATH + 1];
+            PathCombine(OUT filePath, baseFilePath, fileName);
             fileName = std::find(fileName, fileNamesEnd, '\0') + 1;
+
+            // Expand folders (recursively) and wildcards into the font files
+            // they match. The files are added batch by batch as the walk finds
+            // them, so loading overlaps with reading the remaining folders.
+            // Each batch is sniffed first, so that only actual fonts reach
+            // DirectWrite, regardless of their extension.
+            DWORD fileAttributes = GetFileAttributes(filePath);
+            bool isDirectory = (fileAttributes != INVALID_FILE_ATTRIBUTES) && (fileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+            if (isDirectory || FileContainsWildcard({filePath, wcslen(filePath)}))
+            {
+                IFR(addExplicitFontFiles());
+
+                if (isDirectory)
+                    directoryPaths.push_back(filePath);
+
+                HRESULT hr = EnumerateMatchingFiles(
+                    isDirectory ? filePath : nullptr,
+                    isDirectory ? g_recursiveDirectoryFileMask : filePath,
+                    [&](array_ref<wchar_t const> matchingFileNames) -> HRESULT
+                    {
+                        matchingFilePaths.clear();
+                        for (wchar_t const* matchingFileName = matchingFileNames.begin();
+                             matchingFileName < matchingFileNames.end();
+                             matchingFileName = std::find(matchingFileName, matchingFileNames.end(), '\0') + 1)
+                        {
+                            matchingFilePaths.push_back(matchingFileName);
+                        }
+
+                        // Non-font files in a folder are expected, so skip them quietly.
+                        return addSniffedFontFiles(/*reportUnknownFiles*/ false);
+                    }
+                    );
+                if (FAILED(hr))
+                {
+                    failedFileNames.append(filePath);
+                    failedFileNames.push_back('\0');
+                }
+                continue;
+            }
+
+            explicitFilePaths.push_back(filePath);
         }
+
+        IFR(addExplicitFontFiles());
+
+        return S_OK;
+    }
+
+
+    HRESULT CreateFontSetFromFileNames(
+        IDWriteFactory5* dwriteFactory,
+        _In_opt_z_ wchar_t const* baseFilePath,
+        _In_reads_bytes_(fileNamesCount) wchar_t const* fileNames,
+        uint32_t fileNamesCount,
+        _Out_ IDWriteFontSet** fontSet,
+        std::wstring& failedFileNames,
+        _Out_ std::vector<std::wstring>& directoryPaths
+    )
+    {
+        TraceSpan traceSpan(L"CreateFontSetFromFileNames");
+
+        *fontSet = nullptr;
+        directoryPaths.clear();
+
+        ComPtr<IDWriteFontSet> newFontSet;
+        ComPtr<IDWriteFontSetBuilder1> fontSetBuilder;
+        IFR(dwriteFactory->CreateFontSetBuilder(OUT &fontSetBuilder));
+        IFR(AddFontFilesToFontSetBuilder(dwriteFactory, fontSetBuilder, baseFilePath, fileNames, fileNamesCount, IN OUT failedFileNames, IN OUT directoryPaths));
         IFR(fontSetBuilder->CreateFontSet(OUT &newFontSet));
         *fontSet = newFontSet.Detach();
 
@@ -926,6 +1040,11 @@ HRESULT MainWindow::Initialize()
         IFR(hr);
     }
 
+    directoryWatcher_.Initialize(hwnd_, WmWatchedFilesChanged, /*debounceMilliseconds*/ 300);
+
+    // Manifests may list fonts by URL, which are read through this loader.
+    RegisterRemoteFontFileLoader(dwriteFactory_);
+
     if (g_startBlankList)
     {
         InitializeBlankFontCollection();
@@ -958,7 +1077,7 @@ MainWindow::~MainWindow()
 {
     if (dwriteFactory_ != nullptr)
     {
-        //-dwriteFactory_->UnregisterFontFileLoader(RemoteStreamFontFileLoader::GetInstance());
+        UnregisterRemoteFontFileLoader(dwriteFactory_);
     }
 }
 
@@ -1061,6 +1180,14 @@ DialogProcResult CALLBACK MainWindow::DialogProc(HWND hwnd, UINT message, WPARAM
     case WM_DROPFILES:
         return OnDragAndDrop(hwnd, message, wParam, lParam);
 
+    case WmWatchedFilesChanged:
+        ApplyWatchedFileChanges();
+        break;
+
+    case WmRemoteFontsDownloaded:
+        OnRemoteFontsDownloaded(static_cast<HRESULT>(wParam));
+        break;
+
     default:
         return false; // unhandled.
     }
@@ -1097,13 +1224,44 @@ DialogProcResult CALLBACK MainWindow::OnCommand(HWND hwnd, WPARAM wParam, LPARAM
         ReloadSystemFontSet();
         break;
 
+    case IdcImportFontSetManifest:
+        ImportFontSetManifest();
+        break;
+
+    case IdcExportFontSetManifest:
+        ExportFontSetManifest();
+        break;
+
+    case IdcRecordTrace:
+        Tracer::Enable(!Tracer::IsEnabled());
+        AppendLog(AppendLogModeImmediate, Tracer::IsEnabled() ? L"Trace recording started\r\n" : L"Trace recording stopped\r\n");
+        break;
+
+    case IdcExportTrace:
+        ExportTrace();
+        break;
+
     case IdcDownloadRemoteFonts:
+        remoteFontDownloadPassCount_ = 0;
+        DownloadRemoteFonts();
         break;
 
     case IdcClearRemoteFontCache:
+        {
+            HRESULT hr = ClearRemoteFontCache();
+            if (SUCCEEDED(hr))
+                AppendLog(AppendLogModeImmediate, L"Cleared the remote font cache\r\n");
+            else
+                AppendLog(AppendLogModeImmediate, L"Could not clear the remote font cache (error 0x%08X)\r\n", hr);
+        }
         break;
 
     case IdcViewRemoteFontCache:
+        {
+            std::wstring summary;
+            GetRemoteFontCacheSummary(OUT summary);
+            AppendLog(AppendLogModeImmediate, L"Remote font cache:\r\n%s", summary.c_str());
+        }
         break;
 
     case IdcIncludeRemoteFonts:
@@ -1366,6 +1524,10 @@ DialogProcResult CALLBACK MainWindow::OnNotification(HWND hwnd, WPARAM wParam, L
             HandleListViewEmptyText(lParam, L"No visible font properties. Choose a different property or load a new font set.");
             return DialogProcResult(true, 1);
 
+        case LVN_ENDSCROLL:
+            UpdateRemoteFontDownloadPriorities();
+            break;
+
         case NM_CUSTOMDRAW:
             {
                 auto customDraw = (NMLVCUSTOMDRAW*) lParam;
@@ -1508,6 +1670,8 @@ void AppendTag(_Inout_ std::wstring& s, uint32_t tag)
 
 HRESULT MainWindow::DrawFontCollectionIconPreview(const NMLVCUSTOMDRAW* customDraw)
 {
+    TraceSpan traceSpan(L"DrawFontCollectionIconPreview");
+
     if (customDraw->nmcd.rc.bottom <= 0)
         return S_FALSE;
 
@@ -1659,6 +1823,58 @@ HRESULT MainWindow::DrawFontCollectionIconPreview(const NMLVCUSTOMDRAW* customDr
 }
 
 
+// Raises the waiting downloads of the rows in view, lowers those within a
+// page of it to near visible and the rest to background, so that scrolling
+// through remote fonts fetches what is shown before what was scrolled past.
+void MainWindow::UpdateRemoteFontDownloadPriorities()
+{
+    HWND listViewHwnd = GetDlgItem(hwnd_, IdcFontCollectionList);
+    RECT clientRect;
+    GetClientRect(listViewHwnd, OUT &clientRect);
+    long const pageHeight = clientRect.bottom - clientRect.top;
+
+    // Several rows may share a font, which takes the highest of their priorities.
+    std::map<IDWriteFontFaceReference*, DownloadScheduler::Priority> priorities;
+    for (uint32_t itemIndex = 0, itemCount = static_cast<uint32_t>(fontCollectionList_.size()); itemIndex < itemCount; ++itemIndex)
+    {
+        auto* fontFaceReference = fontCollectionList_[itemIndex].fontFaceReference.Get();
+        RECT itemRect;
+        if (fontFaceReference == nullptr
+        ||  fontFaceReference->GetLocality() == DWRITE_LOCALITY_LOCAL
+        ||  !ListView_GetItemRect(listViewHwnd, itemIndex, OUT &itemRect, LVIR_BOUNDS))
+        {
+            continue;
+        }
+
+        auto priority = DownloadScheduler::PriorityBackground;
+        if (itemRect.bottom > clientRect.top && itemRect.top < clientRect.bottom)
+            priority = DownloadScheduler::PriorityVisible;
+        else if (itemRect.bottom > clientRect.top - pageHeight && itemRect.top < clientRect.bottom + pageHeight)
+            priority = DownloadScheduler::PriorityNearVisible;
+
+        auto match = priorities.insert(std::make_pair(fontFaceReference, priority)).first;
+        match->second = std::min(match->second, priority);
+    }
+
+    for (auto const& priority : priorities)
+    {
+        SetRemoteFontDownloadPriority(priority.first, priority.second);
+    }
+}
+
+
+// Drops the waiting downloads of the rows about to leave the list. Rows of
+// the rebuilt list queue theirs again as they are drawn.
+void MainWindow::CancelRemoteFontDownloads()
+{
+    for (auto const& entry : fontCollectionList_)
+    {
+        if (entry.fontFaceReference != nullptr && entry.fontFaceReference->GetLocality() != DWRITE_LOCALITY_LOCAL)
+            CancelRemoteFontDownload(entry.fontFaceReference);
+    }
+}
+
+
 void MainWindow::OnMenuPopup(
     HMENU menu,
     UINT position,
@@ -1695,6 +1911,11 @@ void MainWindow::OnMenuPopup(
             IdcViewFontPreview,
             MF_BYCOMMAND | (showFontPreview_ ? MF_CHECKED : MF_UNCHECKED)
         );
+        CheckMenuItem(
+            menu,
+            IdcRecordTrace,
+            MF_BYCOMMAND | (Tracer::IsEnabled() ? MF_CHECKED : MF_UNCHECKED)
+            );
         
         break;
 
@@ -1997,14 +2218,16 @@ STDMETHODIMP MainWindow::OpenFontFiles()
     ofn.hwndOwner = hwnd_;
     ofn.lpstrFile = &fileNames[0];
     ofn.nMaxFile = fileNames.size() - 1;
+    // Files are identified by their contents once opened, so show all files
+    // by default. The extension filters remain for narrowing the listing.
     ofn.lpstrFilter =
-        L"Fonts\0*.ttf;*.ttc;*.otf;*.otc;*.tte\0"
+        L"All (fonts detected by content)\0*.*\0"
+        L"Font extensions\0*.ttf;*.ttc;*.otf;*.otc;*.tte\0"
         L"TrueType (ttf)\0*.ttf\0"
         L"TrueType Collection (ttc)\0*.ttc\0"
         L"OpenType (ttf)\0*.otf\0"
         L"OpenType Collection (ttc)\0*.otc\0"
         L"TrueType EUDC (tte)\0*.tte\0"
-        L"All\0*.*\0"
         ;
     ofn.nFilterIndex = 1;
     ofn.lpstrFileTitle = nullptr;
@@ -2050,6 +2273,7 @@ STDMETHODIMP MainWindow::RebuildFontCollectionListFromFileNames(_In_opt_z_ wchar
     fontSet_.clear();
     fontCollection_.clear();
     std::wstring failedFileNames;
+    std::vector<std::wstring> directoryPaths;
 
     IFR(CreateFontSetFromFileNames(
         factory5,
@@ -2057,10 +2281,21 @@ STDMETHODIMP MainWindow::RebuildFontCollectionListFromFileNames(_In_opt_z_ wchar
         fileNames.data(), // fontFileNames
         static_cast<uint32_t>(fileNames.size()), // fontFileNamesCharCount,
         OUT &fontSet_,
-        OUT failedFileNames
+        OUT failedFileNames,
+        OUT directoryPaths
         ));
     IFR(factory5->CreateFontCollectionFromFontSet(fontSet_, OUT reinterpret_cast<IDWriteFontCollection1**>(&fontCollection_)));
 
+    // Keep watching any directories loaded, so fonts added or removed there
+    // later show up without reloading.
+    for (auto const& directoryPath : directoryPaths)
+    {
+        if (FAILED(directoryWatcher_.AddDirectory(directoryPath.c_str())))
+        {
+            AppendLog(AppendLogModeImmediate, L"Cannot watch directory for changes: %s\r\n", directoryPath.c_str());
+        }
+    }
+
     RebuildFontCollectionList();
 
     if (!failedFileNames.empty())
@@ -2114,6 +2349,397 @@ STDMETHODIMP MainWindow::ReloadSystemFontSet()
 }
 
 
+STDMETHODIMP MainWindow::ImportFontSetManifest()
+{
+    // Builds the font set from a manifest written by ExportFontSetManifest,
+    // using the properties recorded there rather than opening every file.
+
+    ComPtr<IDWriteFactory3> factory3;
+    dwriteFactory_->QueryInterface(OUT &factory3);
+    if (factory3 == nullptr)
+    {
+        AppendLog(AppendLogModeMessageBox, L"Importing a font set manifest requires Windows 10 or later.\r\n");
+        return E_NOTIMPL;
+    }
+
+    wchar_t fileName[MAX_PATH + 1] = L"";
+
+    OPENFILENAME ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = hwnd_;
+    ofn.lpstrFile = fileName;
+    ofn.nMaxFile = ARRAYSIZE(fileName);
+    ofn.lpstrFilter =
+        L"Font set manifest (json, bin)\0*.json;*.bin\0"
+        L"All\0*.*\0"
+        ;
+    ofn.nFilterIndex = 1;
+    ofn.lpstrTitle = L"Import font set manifest";
+    ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST | OFN_EXPLORER | OFN_ENABLESIZING | OFN_HIDEREADONLY;
+
+    if (!GetOpenFileName(&ofn))
+    {
+        return S_FALSE;
+    }
+
+    std::vector<FontSetManifestEntry> entries;
+    HRESULT hr = ReadFontSetManifestFile(fileName, OUT entries);
+    if (FAILED(hr))
+    {
+        AppendLog(AppendLogModeMessageBox, L"Could not read font set manifest (error 0x%08X):\r\n%s\r\n", hr, fileName);
+        return hr;
+    }
+
+    ComPtr<IDWriteFontSetBuilder> fontSetBuilder;
+    IFR(factory3->CreateFontSetBuilder(OUT &fontSetBuilder));
+
+    std::vector<DWRITE_FONT_PROPERTY> properties;
+    uint32_t failedFontCount = 0;
+
+    for (auto const& entry : entries)
+    {
+        // Fonts listed by URL are only downloaded as they are drawn.
+        ComPtr<IDWriteFontFile> fontFile;
+        ComPtr<IDWriteFontFaceReference> fontFaceReference;
+        bool const isRemoteFont = IsRemoteFontUrl(entry.filePath.c_str());
+        if (FAILED(isRemoteFont ? CreateRemoteFontFileReference(factory3, entry.filePath.c_str(), OUT &fontFile)
+                                : factory3->CreateFontFileReference(entry.filePath.c_str(), nullptr, OUT &fontFile))
+        ||  FAILED(factory3->CreateFontFaceReference(fontFile, entry.faceIndex, DWRITE_FONT_SIMULATIONS_NONE, OUT &fontFaceReference)))
+        {
+            ++failedFontCount;
+            continue;
+        }
+
+        // Only pass the properties the manifest actually has.
+        properties.clear();
+        auto addProperty = [&](DWRITE_FONT_PROPERTY_ID propertyId, std::wstring const& value, _In_z_ wchar_t const* localeName)
+        {
+            if (!value.empty())
+            {
+                DWRITE_FONT_PROPERTY property = { propertyId, value.c_str(), localeName };
+                properties.push_back(property);
+            }
+        };
+        addProperty(DWRITE_FONT_PROPERTY_ID_FULL_NAME, entry.fullName, L"en-us");
+        addProperty(DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, entry.wssFamilyName, L"en-us");
+        addProperty(DWRITE_FONT_PROPERTY_ID_WEIGHT, entry.weight, L"");
+        addProperty(DWRITE_FONT_PROPERTY_ID_STRETCH, entry.stretch, L"");
+        addProperty(DWRITE_FONT_PROPERTY_ID_STYLE, entry.slope, L"");
+
+        if (FAILED(fontSetBuilder->AddFontFaceReference(fontFaceReference, properties.data(), static_cast<uint32_t>(properties.size()))))
+        {
+            ++failedFontCount;
+        }
+    }
+
+    PopFilter(0); // Confusing to leave filters which likely don't apply to the new fonts. So clear them.
+    ResetFontList();
+
+    IFR(fontSetBuilder->CreateFontSet(OUT &fontSet_));
+    IFR(factory3->CreateFontCollectionFromFontSet(fontSet_, OUT reinterpret_cast<IDWriteFontCollection1**>(&fontCollection_)));
+
+    RebuildFontCollectionList();
+    UpdateFontCollectionListUI();
+
+    AppendLog(
+        AppendLogModeImmediate,
+        L"Imported %u fonts from %s (%u could not be added)\r\n",
+        fontSet_->GetFontCount(),
+        fileName,
+        failedFontCount
+        );
+
+    return S_OK;
+}
+
+
+STDMETHODIMP MainWindow::ExportFontSetManifest()
+{
+    // Writes the currently filtered fonts as a manifest (see
+    // FontSetManifestEntry), so a scanned directory can be reloaded cheaply
+    // by ImportFontSetManifest.
+
+    if (fontSet_ == nullptr)
+    {
+        AppendLog(AppendLogModeMessageBox, L"Exporting a font set manifest requires Windows 10 or later.\r\n");
+        return E_NOTIMPL;
+    }
+
+    wchar_t fileName[MAX_PATH + 1] = L"FontSet.json";
+
+    OPENFILENAME ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = hwnd_;
+    ofn.lpstrFile = fileName;
+    ofn.nMaxFile = ARRAYSIZE(fileName);
+    ofn.lpstrFilter =
+        L"Font set manifest (json)\0*.json\0"
+        L"Font set manifest, binary snapshot (bin)\0*.bin\0"
+        L"All\0*.*\0"
+        ;
+    ofn.nFilterIndex = 1;
+    ofn.lpstrDefExt = L"json";
+    ofn.lpstrTitle = L"Export font set manifest";
+    ofn.Flags = OFN_PATHMUSTEXIST | OFN_OVERWRITEPROMPT | OFN_EXPLORER | OFN_ENABLESIZING | OFN_HIDEREADONLY;
+
+    if (!GetSaveFileName(&ofn))
+    {
+        return S_FALSE;
+    }
+
+    ComPtr<IDWriteFontSet> fontSet;
+    IFR(GetFilteredFontSet(OUT &fontSet));
+
+    HANDLE file = CreateFile(
+                    fileName,
+                    GENERIC_WRITE,
+                    0, // No sharing
+                    nullptr,
+                    CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL,
+                    nullptr
+                    );
+    FileHandle scopedHandle(file);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        AppendLog(AppendLogModeMessageBox, L"Could not create manifest file (error 0x%08X):\r\n%s\r\n", hr, fileName);
+        return hr;
+    }
+
+    // Stream each row out as it is written rather than building the whole
+    // document first, since catalogs can contain many thousands of fonts.
+    // A binary snapshot is parsed from the whole text, so it is kept instead.
+    const bool isBinarySnapshot = (ofn.nFilterIndex == 2);
+    JsonexWriter writer(JsonexWriter::OptionsDefault);
+    if (!isBinarySnapshot)
+    {
+        writer.SetOutputFile(file);
+    }
+    IFR(writer.BeginArray());
+
+    FontSetManifestEntry entry;
+    uint32_t exportedFontCount = 0;
+    uint32_t skippedFontCount = 0;
+
+    for (uint32_t fontIndex = 0, fontCount = fontSet->GetFontCount(); fontIndex < fontCount; ++fontIndex)
+    {
+        // Only local files can be reloaded by path, so skip any others.
+        ComPtr<IDWriteFontFaceReference> fontFaceReference;
+        if (FAILED(fontSet->GetFontFaceReference(fontIndex, OUT &fontFaceReference))
+        ||  FAILED(GetFilePath(fontFaceReference, OUT entry.filePath)))
+        {
+            ++skippedFontCount;
+            continue;
+        }
+
+        entry.faceIndex = fontFaceReference->GetFontFaceIndex();
+        GetLocalizedString(fontSet, fontIndex, DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"en-us", OUT entry.fullName);
+        GetLocalizedString(fontSet, fontIndex, DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"en-us", OUT entry.wssFamilyName);
+        GetLocalizedString(fontSet, fontIndex, DWRITE_FONT_PROPERTY_ID_WEIGHT, nullptr, OUT entry.weight);
+        GetLocalizedString(fontSet, fontIndex, DWRITE_FONT_PROPERTY_ID_STRETCH, nullptr, OUT entry.stretch);
+        GetLocalizedString(fontSet, fontIndex, DWRITE_FONT_PROPERTY_ID_STYLE, nullptr, OUT entry.slope);
+
+        IFR(WriteFontSetManifestEntry(writer, entry));
+
+        ++exportedFontCount;
+    }
+
+    IFR(writer.EndScope());
+
+    if (isBinarySnapshot)
+    {
+        std::wstring manifestText;
+        std::vector<uint8_t> data;
+        writer.GetText(OUT manifestText);
+        IFR(WriteFontSetManifestBinary(manifestText, OUT data));
+
+        DWORD bytesWritten;
+        if (!WriteFile(file, data.data(), static_cast<DWORD>(data.size()), OUT &bytesWritten, nullptr))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    else
+    {
+        IFR(writer.Flush());
+    }
+
+    AppendLog(
+        AppendLogModeImmediate,
+        L"Exported %d fonts to %s (%d skipped without a local file path)\r\n",
+        exportedFontCount,
+        fileName,
+        skippedFontCount
+        );
+
+    return S_OK;
+}
+
+
+STDMETHODIMP MainWindow::ExportTrace()
+{
+    // Writes the recorded spans as a Chrome trace, which can be opened in
+    // chrome://tracing or ui.perfetto.dev to see where a rebuild spends its
+    // time (enumeration, property reads, grouping, sorting, list population).
+
+    wchar_t fileName[MAX_PATH + 1] = L"FontSetViewer.trace.json";
+
+    OPENFILENAME ofn = {};
+    ofn.lStructSize = sizeof(ofn);
+    ofn.hwndOwner = hwnd_;
+    ofn.lpstrFile = fileName;
+    ofn.nMaxFile = ARRAYSIZE(fileName);
+    ofn.lpstrFilter =
+        L"Chrome trace (json)\0*.json\0"
+        L"All\0*.*\0"
+        ;
+    ofn.nFilterIndex = 1;
+    ofn.lpstrDefExt = L"json";
+    ofn.lpstrTitle = L"Export performance trace";
+    ofn.Flags = OFN_PATHMUSTEXIST | OFN_OVERWRITEPROMPT | OFN_EXPLORER | OFN_ENABLESIZING | OFN_HIDEREADONLY;
+
+    if (!GetSaveFileName(&ofn))
+    {
+        return S_FALSE;
+    }
+
+    HANDLE file = CreateFile(
+                    fileName,
+                    GENERIC_WRITE,
+                    0, // No sharing
+                    nullptr,
+                    CREATE_ALWAYS,
+                    FILE_ATTRIBUTE_NORMAL,
+                    nullptr
+                    );
+    FileHandle scopedHandle(file);
+
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(GetLastError());
+        AppendLog(AppendLogModeMessageBox, L"Could not create trace file (error 0x%08X):\r\n%s\r\n", hr, fileName);
+        return hr;
+    }
+
+    JsonexWriter writer(JsonexWriter::OptionsDefault);
+    writer.SetOutputFile(file);
+    IFR(Tracer::ExportChromeTrace(writer));
+    IFR(writer.Flush());
+
+    AppendLog(AppendLogModeImmediate, L"Exported trace to %s\r\n", fileName);
+
+    return S_OK;
+}
+
+
+namespace
+{
+    // Posts the result of a download back to the window, since listeners are
+    // called on the downloading thread.
+    class FontDownloadListener : public ComBase<IDWriteFontDownloadListener>
+    {
+    protected:
+        IFACEMETHODIMP QueryInterface(IID const& iid, __out void** object) OVERRIDE
+        {
+            COM_BASE_RETURN_INTERFACE(iid, IDWriteFontDownloadListener, object);
+            COM_BASE_RETURN_INTERFACE(iid, IUnknown, object);
+            COM_BASE_RETURN_NO_INTERFACE(object);
+        }
+
+    public:
+        FontDownloadListener(HWND hwnd, UINT message)
+        :   hwnd_(hwnd),
+            message_(message)
+        { }
+
+        IFACEMETHODIMP_(void) DownloadCompleted(
+            _In_ IDWriteFontDownloadQueue* downloadQueue,
+            _In_opt_ IUnknown* context,
+            HRESULT downloadResult
+            )
+        {
+            PostMessage(hwnd_, message_, static_cast<WPARAM>(downloadResult), 0);
+        }
+
+    protected:
+        HWND hwnd_;
+        UINT message_;
+    };
+}
+
+
+STDMETHODIMP MainWindow::DownloadRemoteFonts()
+{
+    // Fetches what drawing the list found missing, from both the URL fonts
+    // of imported manifests and the system's downloadable fonts. Each queue
+    // posts WmRemoteFontsDownloaded when done.
+
+    ComPtr<IDWriteFontDownloadQueue> systemDownloadQueue;
+    ComPtr<IDWriteFactory3> factory3;
+    dwriteFactory_->QueryInterface(OUT &factory3);
+    if (factory3 != nullptr)
+    {
+        factory3->GetFontDownloadQueue(OUT &systemDownloadQueue);
+    }
+
+    ComPtr<IDWriteFontDownloadListener> listener(new(std::nothrow) FontDownloadListener(hwnd_, WmRemoteFontsDownloaded));
+    if (listener == nullptr)
+        return E_OUTOFMEMORY;
+
+    IDWriteFontDownloadQueue* downloadQueues[] = { GetRemoteFontDownloadQueue(), systemDownloadQueue };
+    uint32_t begunDownloadCount = 0;
+    for (auto* downloadQueue : downloadQueues)
+    {
+        if (downloadQueue == nullptr || downloadQueue->IsEmpty())
+            continue;
+
+        HRESULT hr = downloadQueue->BeginDownload(listener);
+        if (FAILED(hr))
+        {
+            AppendLog(AppendLogModeImmediate, L"Could not begin the remote font download (error 0x%08X)\r\n", hr);
+            continue;
+        }
+        ++begunDownloadCount;
+    }
+
+    if (begunDownloadCount == 0 && remoteFontDownloadPassCount_ == 0)
+    {
+        AppendLog(AppendLogModeImmediate, L"No remote font data is waiting. Remote fonts are queued as they are drawn.\r\n");
+    }
+
+    return S_OK;
+}
+
+
+STDMETHODIMP MainWindow::OnRemoteFontsDownloaded(HRESULT downloadResult)
+{
+    if (FAILED(downloadResult))
+    {
+        AppendLog(AppendLogModeImmediate, L"Remote font download failed (error 0x%08X)\r\n", downloadResult);
+        return downloadResult;
+    }
+
+    // Redraw now, which queues whatever the new data leads to (such as the
+    // outlines once the tables arrive), and keep going until drawing finds
+    // nothing more missing. The pass limit stops a server that keeps
+    // returning too little from looping forever.
+    const uint32_t maximumDownloadPassCount = 8;
+    HWND listViewHwnd = GetDlgItem(hwnd_, IdcFontCollectionList);
+    InvalidateRect(listViewHwnd, nullptr, false);
+    UpdateWindow(listViewHwnd);
+
+    if (!GetRemoteFontDownloadQueue()->IsEmpty() && ++remoteFontDownloadPassCount_ < maximumDownloadPassCount)
+    {
+        return DownloadRemoteFonts();
+    }
+
+    AppendLog(AppendLogModeImmediate, L"Remote font download finished\r\n");
+    return S_OK;
+}
+
+
 STDMETHODIMP MainWindow::ChooseColor(IN OUT uint32_t& color)
 {
     static COLORREF customColors[16] = {};
@@ -2246,6 +2872,8 @@ HRESULT MainWindow::InitializeFontCollectionFilterUI()
 
 HRESULT MainWindow::UpdateFontCollectionListUI(uint32_t newSelectedItem)
 {
+    TraceSpan traceSpan(L"UpdateFontCollectionListUI");
+
     ListViewWriter lw(GetDlgItem(hwnd_, IdcFontCollectionList));
 
     lw.DisableDrawing();
@@ -2269,6 +2897,150 @@ HRESULT MainWindow::UpdateFontCollectionListUI(uint32_t newSelectedItem)
 }
 
 
+HRESULT MainWindow::UpdateChangedFontCollectionListUI(IN OUT std::vector<FontCollectionEntry>& previousFontCollectionList)
+{
+    ListViewWriter lw(GetDlgItem(hwnd_, IdcFontCollectionList));
+
+    // Without a consistent order, rows cannot be matched up, so redo them all.
+    if (!wantSortedFontList_)
+    {
+        int selectedItem = ListView_GetNextItem(lw.hwnd, -1, LVNI_SELECTED);
+        return UpdateFontCollectionListUI(std::max(selectedItem, 0));
+    }
+
+    lw.DisableDrawing();
+
+    // Both lists are sorted the same way, so walk them together, deleting rows
+    // only in the previous list and inserting rows only in the new one. Rows
+    // in both keep their selection and scroll position, just refreshed in
+    // case their font count changed.
+    size_t previousIndex = 0;
+    size_t const previousCount = previousFontCollectionList.size();
+    for (auto& f : fontCollectionList_)
+    {
+        while (previousIndex < previousCount && previousFontCollectionList[previousIndex] < f)
+        {
+            ListView_DeleteItem(lw.hwnd, lw.iItem);
+            ++previousIndex;
+        }
+
+        lw.iImage = (f.fontCount > 1) ? 1 : 0;
+        if (previousIndex < previousCount && !(f < previousFontCollectionList[previousIndex]))
+        {
+            lw.SetItemText(0, f.name.c_str());
+            ++previousIndex;
+        }
+        else
+        {
+            lw.InsertItem(f.name.c_str());
+        }
+        lw.AdvanceItem();
+    }
+    for (; previousIndex < previousCount; ++previousIndex)
+    {
+        ListView_DeleteItem(lw.hwnd, lw.iItem);
+    }
+
+    lw.EnableDrawing();
+    InvalidateRect(lw.hwnd, nullptr, false); // Previews may differ even where the names did not.
+
+    return S_OK;
+}
+
+
+HRESULT MainWindow::ApplyWatchedFileChanges()
+{
+    // Update the font set for just the paths that changed in the watched
+    // directories, keeping the other fonts as they are (without reading their
+    // files again), then update only the list rows that differ.
+
+    TraceSpan traceSpan(L"ApplyWatchedFileChanges");
+    std::vector<std::wstring> changedPaths;
+    directoryWatcher_.TakeChangedPaths(OUT changedPaths);
+    if (changedPaths.empty() || fontSet_ == nullptr)
+        return S_OK;
+
+    ComPtr<IDWriteFactory5> factory5;
+    ComPtr<IDWriteFontSet1> fontSet1;
+    dwriteFactory_->QueryInterface(OUT &factory5);
+    fontSet_->QueryInterface(OUT &fontSet1);
+    if (factory5 == nullptr || fontSet1 == nullptr)
+        return E_NOTIMPL;
+
+    // Keep every font not from a changed path.
+    std::vector<uint32_t> keptFontIndices;
+    std::wstring filePath;
+    for (uint32_t i = 0, ci = fontSet_->GetFontCount(); i < ci; ++i)
+    {
+        ComPtr<IDWriteFontFaceReference> fontFaceReference;
+        IFR(fontSet_->GetFontFaceReference(i, OUT &fontFaceReference));
+        GetFilePath(fontFaceReference, OUT filePath); // Empty for fonts not from local files.
+
+        bool isChanged = std::any_of(
+            changedPaths.begin(),
+            changedPaths.end(),
+            [&](std::wstring const& changedPath) -> bool { return IsPathWithinDirectory(filePath, changedPath); }
+            );
+        if (!isChanged)
+            keptFontIndices.push_back(i);
+    }
+
+    // Add back whatever fonts exist at the changed paths now. Removed paths
+    // simply add nothing, and changed files that are not fonts are skipped
+    // when sniffed (landing in the ignored failure list).
+    std::wstring presentFileNames;
+    for (auto const& changedPath : changedPaths)
+    {
+        if (GetFileAttributes(changedPath.c_str()) == INVALID_FILE_ATTRIBUTES)
+            continue;
+
+        presentFileNames.append(changedPath);
+        presentFileNames.push_back('\0');
+    }
+
+    ComPtr<IDWriteFontSetBuilder1> fontSetBuilder;
+    ComPtr<IDWriteFontSet1> keptFontSet;
+    ComPtr<IDWriteFontSet> newFontSet;
+    ComPtr<IDWriteFontCollection1> newFontCollection;
+    std::wstring failedFileNames;
+    std::vector<std::wstring> directoryPaths;
+
+    IFR(factory5->CreateFontSetBuilder(OUT &fontSetBuilder));
+    IFR(fontSet1->GetFilteredFonts(keptFontIndices.data(), static_cast<uint32_t>(keptFontIndices.size()), OUT &keptFontSet));
+    IFR(fontSetBuilder->AddFontSet(keptFontSet));
+    IFR(AddFontFilesToFontSetBuilder(
+        factory5,
+        fontSetBuilder,
+        /*baseFilePath*/ nullptr,
+        presentFileNames.data(),
+        static_cast<uint32_t>(presentFileNames.size()),
+        IN OUT failedFileNames,
+        IN OUT directoryPaths
+        ));
+    IFR(fontSetBuilder->CreateFontSet(OUT &newFontSet));
+    IFR(factory5->CreateFontCollectionFromFontSet(newFontSet, OUT &newFontCollection));
+
+    uint32_t const previousFontCount = fontSet_->GetFontCount();
+    fontSet_ = newFontSet;
+    fontCollection_ = newFontCollection.Get();
+
+    std::vector<FontCollectionEntry> previousFontCollectionList;
+    previousFontCollectionList.swap(fontCollectionList_);
+    IFR(RebuildFontCollectionList());
+    IFR(UpdateChangedFontCollectionListUI(IN OUT previousFontCollectionList));
+
+    AppendLog(
+        AppendLogModeImmediate,
+        L"Updated %u changed paths, fonts %u -> %u\r\n",
+        static_cast<uint32_t>(changedPaths.size()),
+        previousFontCount,
+        fontSet_->GetFontCount()
+        );
+
+    return S_OK;
+}
+
+
 HRESULT MainWindow::UpdateFontCollectionFilterUI()
 {
     ListViewWriter lw(GetDlgItem(hwnd_, IdcFontCollectionFilter));
@@ -2339,6 +3111,7 @@ void MainWindow::ResetFontList()
 {
     fontSet_.clear();
     fontCollection_.clear();
+    directoryWatcher_.Clear();
 }
 
 
@@ -2371,8 +3144,38 @@ HRESULT MainWindow::InitializeBlankFontCollection()
 }
 
 
+HRESULT MainWindow::GetFilteredFontSet(_COM_Outptr_ IDWriteFontSet** filteredFontSet)
+{
+    // Applies all the pushed filters to the current font set.
+
+    TraceSpan traceSpan(L"GetFilteredFontSet");
+    *filteredFontSet = nullptr;
+    if (fontSet_ == nullptr)
+        return E_NOT_VALID_STATE;
+
+    DWRITE_FONT_PROPERTY fontProperty = { DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"WssFamilyName", L"en-us" };
+
+    ComPtr<IDWriteFontSet> fontSet = fontSet_;
+    for (const auto& fontFilter : fontCollectionFilters_)
+    {
+        ComPtr<IDWriteFontSet> fontSubset;
+        fontProperty.propertyId = FilterModeToPropertyId(fontFilter.mode);
+        fontProperty.propertyValue = fontFilter.parameter.c_str();
+
+        IFR(fontSet->GetMatchingFonts(&fontProperty, 1, OUT &fontSubset));
+
+        std::swap(fontSet, fontSubset);
+    }
+
+    *filteredFontSet = fontSet.Detach();
+    return S_OK;
+}
+
+
 HRESULT MainWindow::RebuildFontCollectionList()
 {
+    TraceSpan traceSpan(L"RebuildFontCollectionList");
+
     if (fontCollection_ == nullptr)
     {
         ComPtr<IDWriteFactory3> dwriteFactory3;
@@ -2408,6 +3211,7 @@ HRESULT MainWindow::RebuildFontCollectionList()
     }
 
     // Initialization common to either case, whether a font set is available or not.
+    CancelRemoteFontDownloads();
     fontCollectionList_.clear();
     fontCollectionListStringMap_.clear();
     wchar_t const* languageName = g_locales[currentLanguageIndex_][1];
@@ -2419,17 +3223,8 @@ HRESULT MainWindow::RebuildFontCollectionList()
         ////////////////////
         // Apply all the filters.
 
-        ComPtr<IDWriteFontSet> fontSet = fontSet_;
-        for (const auto& fontFilter : fontCollectionFilters_)
-        {
-            ComPtr<IDWriteFontSet> fontSubset;
-            fontProperty.propertyId = FilterModeToPropertyId(fontFilter.mode);
-            fontProperty.propertyValue = fontFilter.parameter.c_str();
-
-            IFR(fontSet->GetMatchingFonts(&fontProperty, 1, OUT &fontSubset));
-
-            std::swap(fontSet, fontSubset);
-        }
+        ComPtr<IDWriteFontSet> fontSet;
+        IFR(GetFilteredFontSet(OUT &fontSet));
 
         ////////////////////
         // Get the list of all distinct properties for the current property type.
@@ -2437,6 +3232,7 @@ HRESULT MainWindow::RebuildFontCollectionList()
         auto currentPropertyId = FilterModeToPropertyId(filterMode_);
         bool const isUngroupedList = (filterMode_ == FontCollectionFilterMode::None);
         bool const isLanguageAgnosticProperty = IsLanguageAgnosticFilterMode(filterMode_);
+        TraceSpan propertyValuesTraceSpan(L"Read font set property values");
         ComPtr<IDWriteStringList> stringList;
         if (isLanguageAgnosticProperty)
             fontSet->GetPropertyValues(currentPropertyId, OUT &stringList);
@@ -2546,6 +3342,7 @@ HRESULT MainWindow::RebuildFontCollectionList()
                 GetFilePath(fontFaceReference, OUT fontCollectionEntry.filePath);
                 fontCollectionEntry.fontFaceIndex = fontFaceReference->GetFontFaceIndex();
                 fontCollectionEntry.fontSimulations = fontFaceReference->GetSimulations();
+                fontCollectionEntry.fontFaceReference = fontFaceReference.Get();
             }
 
             // Add the entry to the list.
@@ -2554,11 +3351,15 @@ HRESULT MainWindow::RebuildFontCollectionList()
     }
     else
     {
+        TraceSpan enumerationTraceSpan(L"Enumerate collection fonts");
+
         ////////////////////
         // Add all the IDWriteFont's to a single easy-to-use array (basically
         // flatten the heirarchy into addressable indices).
 
         std::vector<ComPtr<IDWriteFont> > fontCollectionFonts;
+        fontNameCatalog_.clear();
+        fontNameCatalog_.SetPreferredLanguage(languageName);
 
         for (uint32_t i = 0, ci = fontCollection_->GetFontFamilyCount(); i < ci; ++i)
         {
@@ -2577,6 +3378,8 @@ HRESULT MainWindow::RebuildFontCollectionList()
             }
         }
 
+        enumerationTraceSpan.End();
+
         ////////////////////
         // Reinitialize the lists.
         std::vector<uint32_t> fontCollectionFontIndices;
@@ -2590,6 +3393,7 @@ HRESULT MainWindow::RebuildFontCollectionList()
 
         ////////////////////
         // Apply all the filters.
+        TraceSpan filterTraceSpan(L"Apply font filters");
         for (const auto& fontFilter : fontCollectionFilters_)
         {
             uint32_t indicesCount = static_cast<uint32_t>(fontCollectionFontIndices.size());
@@ -2612,8 +3416,11 @@ HRESULT MainWindow::RebuildFontCollectionList()
             fontCollectionFontIndices.resize(newIndicesCount);
         }
 
+        filterTraceSpan.End();
+
         //////////
         // Add the fonts to the collection list. fontCollectionList_ is still empty at this point.
+        TraceSpan groupingTraceSpan(L"Group font properties");
         for (auto fontIndex : fontCollectionFontIndices)
         {
             assert(fontIndex < fontCollectionFonts.size());
@@ -2642,6 +3449,7 @@ HRESULT MainWindow::RebuildFontCollectionList()
 
     if (wantSortedFontList_)
     {
+        TraceSpan sortTraceSpan(L"Sort font list");
         std::sort(fontCollectionList_.begin(), fontCollectionList_.end());
     }
 
@@ -2812,11 +3620,22 @@ HRESULT MainWindow::GetFontProperty(
         return E_INVALIDARG;
     }
 
-    // Get the string.
-    ComPtr<IDWriteLocalizedStrings> strings;
-    BOOL dummyExists;
-    font->GetInformationalStrings(stringId, OUT &strings, OUT &dummyExists);
-    GetLocalizedString(strings, languageName, OUT fontPropertyValue);
+    // Get the string, decoded once per font from its name table (since the
+    // filters ask again on every pass), else from DWrite.
+    uint32_t catalogFontIndex;
+    uint16_t nameId = FontNameCatalog::GetNameId(stringId);
+    if (nameId != 0 && SUCCEEDED(fontNameCatalog_.AddFont(font, OUT catalogFontIndex)))
+    {
+        auto name = fontNameCatalog_.GetName(catalogFontIndex, nameId);
+        fontPropertyValue.assign(name.begin(), name.end());
+    }
+    if (fontPropertyValue.empty())
+    {
+        ComPtr<IDWriteLocalizedStrings> strings;
+        BOOL dummyExists;
+        font->GetInformationalStrings(stringId, OUT &strings, OUT &dummyExists);
+        GetLocalizedString(strings, languageName, OUT fontPropertyValue);
+    }
 
     // The preferred name is often empty, so use the normal family name in that case.
     if (fontPropertyValue.empty() && stringId == DWRITE_INFORMATIONAL_STRING_PREFERRED_FAMILY_NAMES)
@@ -3145,112 +3964,3 @@ HRESULT ShowMessageIfFailed(HRESULT functionResult, const wchar_t* message)
     }
     return functionResult;
 }
-
-#if 0
-void MainWindow::ParseJsonFontSet(const wchar_t* filename)
-{
-    std::vector<uint8_t> rawJsonFile;
-
-    // Read all commands into a text tree.
-    std::wstring fontSetText;
-
-    IFR(ReadTextFile(filename, OUT fontSetText));
-
-    ConvertText(rawJsonFile, OUT fontSetText);
-    TextTree nodes;
-    uint32_t textLength = static_cast<uint32_t>(fontSetText.size());
-    JsonexParser parser(fontSetText.data(), textLength, TextTreeParser::OptionsNoEscapeSequence);
-    parser.ReadNodes(IN OUT nodes);
-
-    uint32_t nodeIndex = 0;
-    if (!nodes.AdvanceChildNode(IN OUT nodeIndex) // skip the root node.
-        || nodes.GetNode(nodeIndex).type != TextTree::Node::TypeArray
-        || !nodes.AdvanceChildNode(IN OUT nodeIndex))
-    {
-        return S_FALSE;
-    }
-
-    std::wstring filePath;
-    std::wstring familyName;
-    std::wstring fullName;
-    std::wstring weight;
-    std::wstring stretch;
-    std::wstring slope;
-    std::wstring value;
-    uint32_t faceIndex = 0;
-
-    DWRITE_FONT_PROPERTY properties[5] = {
-        { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"FullName", L"en-us" },
-        { DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"WssFamilyName", L"en-us" },
-        { DWRITE_FONT_PROPERTY_ID_WEIGHT, L"Weight", L"" },
-        { DWRITE_FONT_PROPERTY_ID_STRETCH, L"Stretch", L"" },
-        { DWRITE_FONT_PROPERTY_ID_STYLE, L"Slope", L"" },
-    };
-
-    while (nodeIndex < nodes.GetNodeCount())
-    {
-        if (nodes.GetNode(nodeIndex).type == TextTree::Node::TypeObject)
-        {
-            uint32_t subnodeIndex;
-            nodes.GetKeyValue(nodeIndex, L"Path", OUT filePath);
-
-            if (nodes.FindKey(nodeIndex, L"FullName", OUT subnodeIndex))
-            {
-                nodes.GetKeyValue(subnodeIndex, L"en-us", OUT fullName);
-            }
-            if (nodes.FindKey(nodeIndex, L"WssFamilyName", OUT subnodeIndex))
-            {
-                nodes.GetKeyValue(subnodeIndex, L"en-us", OUT familyName);
-            }
-            if (nodes.GetKeyValue(nodeIndex, L"FaceIndex", OUT value))
-            {
-                faceIndex = _wtoi(value.c_str());
-            }
-            nodes.GetKeyValue(nodeIndex, L"Weight", OUT weight);
-            nodes.GetKeyValue(nodeIndex, L"Stretch", OUT stretch);
-            nodes.GetKeyValue(nodeIndex, L"Slope", OUT slope);
-
-            ComPtr<IDWriteFontFile> fontFile;
-            ComPtr<IDWriteFontFaceReference> fontFaceReference;
-
-            wchar_t const* fontFileReferenceKey = filePath.data();
-            uint32_t fontFileReferenceKeySize = (static_cast<uint32_t>(filePath.size()) + 1) * sizeof(wchar_t);
-            IFR(dwriteFactory3p->CreateCustomFontFileReference(
-                fontFileReferenceKey,
-                fontFileReferenceKeySize,
-                fontFileLoader,
-                OUT &fontFile
-            ));
-
-            IFR(dwriteFactory3p->CreateFontFaceReference(
-                fontFile,
-                faceIndex,
-                DWRITE_FONT_SIMULATIONS_NONE,
-                OUT &fontFaceReference
-            ));
-
-            static_assert(ARRAYSIZE(properties) == 5, "Update this code to match the size");
-            properties[0].propertyValue = fullName.c_str();
-            properties[1].propertyValue = familyName.c_str();
-            properties[2].propertyValue = weight.c_str();
-            properties[3].propertyValue = stretch.c_str();
-            properties[4].propertyValue = slope.c_str();
-            fontSetBuilder->AddFontFaceReference(
-                fontFaceReference,
-                &properties[0],
-                ARRAYSIZE(properties) // propertiesCount
-            );
-        }
-
-        if (!nodes.AdvanceNextNode(IN OUT nodeIndex))
-            break;
-    }
-
-    // Create the font set.
-    IFR(fontSetBuilder->CreateFontSet(OUT &fontSet_));
-    uint32_t fontCount = fontSet_->GetFontCount();
-    IDWriteFontCollection1* fontCollection1;
-    IFR(dwriteFactory3->CreateFontCollectionFromFontSet(fontSet_, OUT &fontCollection1));
-    fontCollection_ = fontCollection1;
-}
-#endif
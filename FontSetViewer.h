@@ -26,6 +26,8 @@ public:
 
 public:
     const static wchar_t* g_windowClassName;
+    const static UINT WmWatchedFilesChanged = WM_APP + 1; // Posted by the directory watcher once changes settle.
+    const static UINT WmRemoteFontsDownloaded = WM_APP + 2; // Posted when a remote font download completes, with the result in wParam.
 
     enum class FontCollectionFilterMode
     {
@@ -68,6 +70,7 @@ protected:
         std::wstring filePath;
         uint32_t fontFaceIndex;         // Within an OpenType collection.
         DWRITE_FONT_SIMULATIONS fontSimulations;
+        ComPtr<IDWriteFontFaceReference> fontFaceReference; // For remote fonts, to order their downloads.
 
         int CompareStrings(const std::wstring& a, const std::wstring& b) const
         {
@@ -121,6 +124,11 @@ protected:
     STDMETHODIMP OnChooseFont();
     STDMETHODIMP OpenFontFiles();
     STDMETHODIMP ReloadSystemFontSet();
+    STDMETHODIMP ImportFontSetManifest();
+    STDMETHODIMP ExportFontSetManifest();
+    STDMETHODIMP ExportTrace();
+    STDMETHODIMP DownloadRemoteFonts();
+    STDMETHODIMP OnRemoteFontsDownloaded(HRESULT downloadResult);
     STDMETHODIMP ChooseColor(IN OUT uint32_t& color);
     STDMETHODIMP CopyToClipboard(bool copyPlainText = false);
     STDMETHODIMP CopyImageToClipboard();
@@ -132,8 +140,13 @@ protected:
     STDMETHODIMP UpdateFontCollectionListUI(uint32_t newSelectedItem = 0);
     STDMETHODIMP UpdateFontCollectionFilterUI();
     STDMETHODIMP RebuildFontCollectionList();
+    STDMETHODIMP GetFilteredFontSet(_COM_Outptr_ IDWriteFontSet** filteredFontSet);
     STDMETHODIMP DrawFontCollectionIconPreview(const NMLVCUSTOMDRAW* customDraw);
+    void UpdateRemoteFontDownloadPriorities();
+    void CancelRemoteFontDownloads();
     STDMETHODIMP RebuildFontCollectionListFromFileNames(_In_opt_z_ wchar_t const* baseFilePath, array_ref<wchar_t const> fileNames);
+    STDMETHODIMP ApplyWatchedFileChanges();
+    STDMETHODIMP UpdateChangedFontCollectionListUI(IN OUT std::vector<FontCollectionEntry>& previousFontCollectionList);
     STDMETHODIMP InitializeBlankFontCollection();
     void ResetFontList();
 
@@ -206,6 +219,7 @@ protected:
     uint32_t faintSelectionColor_ = 0xFF808080;
     uint32_t currentLanguageIndex_ = 0; // English US
     bool includeRemoteFonts_ = false;
+    uint32_t remoteFontDownloadPassCount_ = 0;
     bool wantSortedFontList_ = true;
     bool showFontPreview_ = true;
 
@@ -214,6 +228,8 @@ protected:
     std::wstring cachedLog_;
     std::map<std::wstring, uint32_t> fontCollectionListStringMap_;
     FontCollectionFilterMode filterMode_ = FontCollectionFilterMode::TypographicFamilyName;
+    DirectoryWatcher directoryWatcher_; // Directories loaded from, to pick up fonts added or removed later.
+    FontNameCatalog fontNameCatalog_;   // Names of the collection's fonts when no font set is available.
 
 private:
     // No copy construction allowed.
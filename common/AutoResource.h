@@ -478,3 +478,31 @@ struct OwnedMemoryPointerPolicy : public DefaultResourceTypePolicy<ResourceType>
 
 template<typename ResourceType>
 using OwnedMemoryPointer = AutoResource<ResourceType*, OwnedMemoryPointerPolicy<ResourceType*>, ResourceType*>;
+
+
+////////////////////////////////////////
+// Scoped exclusive hold of a slim reader/writer lock, released on leaving
+// the scope, including by an exception.
+//
+//  ExclusiveLockScope lockScope(lock_);
+
+class ExclusiveLockScope
+{
+public:
+    explicit ExclusiveLockScope(SRWLOCK& lock) throw() : lock_(lock)
+    {
+        AcquireSRWLockExclusive(&lock_);
+    }
+
+    ~ExclusiveLockScope() throw()
+    {
+        ReleaseSRWLockExclusive(&lock_);
+    }
+
+private:
+    SRWLOCK& lock_;
+
+    // No copy construction allowed.
+    ExclusiveLockScope(const ExclusiveLockScope&);
+    ExclusiveLockScope& operator=(const ExclusiveLockScope&);
+};
@@ -325,15 +325,13 @@ void ConvertText(
 
     utf16text.resize(utf8text.size());
 
-    // Convert UTF-8 to UTF-16.
-    int32_t charsConverted =
-        MultiByteToWideChar(
-            CP_UTF8,
-            0, // no flags for UTF8 (we allow invalid characters for testing)
-            (LPCSTR)&utf8text[startingOffset],
-            int32_t(utf8text.size() - startingOffset),
+    // Convert UTF-8 to UTF-16 (invalid characters become U+FFFD).
+    size_t charsConverted =
+        ConvertUtf8ToUtf16(
+            &utf8text[startingOffset],
+            utf8text.size() - startingOffset,
             OUT const_cast<wchar_t*>(utf16text.data()), // workaround issue http://www.open-std.org/jtc1/sc22/wg21/docs/lwg-active.html#2391
-            int32_t(utf16text.size())
+            utf16text.size()
             );
 
     // Shrink to actual size.
@@ -346,30 +344,13 @@ void ConvertText(
     OUT std::string& utf8text
     )
 {
-    // Convert UTF-8 to UTF-16.
-    int32_t charsConverted =
-        WideCharToMultiByte(
-        CP_UTF8,
-        0, // no flags for UTF8 (we allow invalid characters for testing)
-        utf16text.data(),
-        int32_t(utf16text.size()),
-        nullptr, // null destination buffer the first time to get estimate.
-        0,
-        nullptr, // defaultChar
-        nullptr // usedDefaultChar
-        );
-
-    utf8text.resize(charsConverted);
+    // Measure first, then convert UTF-16 to UTF-8.
+    utf8text.resize(GetUtf8Length(utf16text.data(), utf16text.size()));
 
-    // Convert UTF-8 to UTF-16.
-    WideCharToMultiByte(
-        CP_UTF8,
-        0, // no flags for UTF8 (we allow invalid characters for testing)
+    ConvertUtf16ToUtf8(
         utf16text.data(),
-        int32_t(utf16text.size()),
+        utf16text.size(),
         OUT &utf8text[0],
-        int32_t(utf8text.size()),
-        nullptr, // defaultChar
-        nullptr // usedDefaultChar
+        utf8text.size()
         );
 }
@@ -0,0 +1,599 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Fast LZ block compression, with a streaming frame format.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "Compression.h"
+
+
+namespace
+{
+    enum : uint32_t
+    {
+        CompressionFrameSignature = 'FZLC', // Reads as "CLZF" in a hex dump.
+        CompressionFrameVersion = 1,
+        CompressionFrameHeaderSize = 8,
+        CompressionFrameTrailerSize = 8,
+        StoredBlockFlag = 0x80000000,
+    };
+
+    const uint32_t hashLog = 14;
+    const uint32_t minimumMatchLength = 4;
+    const uint32_t lastLiteralsLength = 5;  // The block always ends with at least this many literals,
+    const uint32_t matchSearchLimit = 12;   // and no match starts within this distance from the end.
+    const uint32_t maximumOffset = 65535;
+
+
+    inline uint32_t ReadUint32(uint8_t const* p) throw()
+    {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+
+    inline void WriteUint32(uint8_t* p, uint32_t value) throw()
+    {
+        memcpy(p, &value, sizeof(value));
+    }
+
+
+    inline uint32_t GetPositionHash(uint8_t const* p) throw()
+    {
+        return (ReadUint32(p) * 2654435761u) >> (32 - hashLog);
+    }
+
+
+    // Worst case output size for a block of incompressible data.
+    inline size_t GetCompressedBlockBound(size_t sourceSize) throw()
+    {
+        return sourceSize + sourceSize / 255 + 16;
+    }
+
+
+    inline uint32_t GetMatchLength(uint8_t const* source, uint32_t position, uint32_t matchPosition, uint32_t limit) throw()
+    {
+        // Compare 8 bytes at a time, then finish the differing word bytewise.
+        uint32_t length = 0;
+        while (position + length + sizeof(uint64_t) <= limit)
+        {
+            uint64_t a, b;
+            memcpy(&a, source + position + length, sizeof(a));
+            memcpy(&b, source + matchPosition + length, sizeof(b));
+            if (a != b)
+                break;
+            length += sizeof(uint64_t);
+        }
+        while (position + length < limit && source[position + length] == source[matchPosition + length])
+        {
+            ++length;
+        }
+        return length;
+    }
+
+
+    inline uint8_t* WriteLengthExtension(uint8_t* output, size_t length) throw()
+    {
+        for ( ; length >= 255; length -= 255)
+        {
+            *output++ = 255;
+        }
+        *output++ = uint8_t(length);
+        return output;
+    }
+
+
+    // Writes the literals from the anchor up to the match, then the match
+    // (unless this is the final literal run).
+    uint8_t* WriteSequence(
+        uint8_t* output,
+        uint8_t const* literals,
+        size_t literalLength,
+        uint32_t matchOffset,
+        size_t matchLength // Zero for the final literal run.
+        ) throw()
+    {
+        uint8_t* token = output++;
+        *token = uint8_t(std::min<size_t>(literalLength, 15) << 4);
+        if (literalLength >= 15)
+            output = WriteLengthExtension(output, literalLength - 15);
+
+        memcpy(output, literals, literalLength);
+        output += literalLength;
+
+        if (matchLength > 0)
+        {
+            *output++ = uint8_t(matchOffset);
+            *output++ = uint8_t(matchOffset >> 8);
+
+            size_t const extraLength = matchLength - minimumMatchLength;
+            *token |= uint8_t(std::min<size_t>(extraLength, 15));
+            if (extraLength >= 15)
+                output = WriteLengthExtension(output, extraLength - 15);
+        }
+
+        return output;
+    }
+
+
+    // Compresses a block of at most MaximumBlockSize into the output, which
+    // must hold GetCompressedBlockBound bytes, and returns the size written.
+    size_t CompressBlock(
+        const_byte_array_ref sourceData,
+        uint32_t level,
+        _Out_writes_(_Inexpressible_(GetCompressedBlockBound)) uint8_t* output,
+        IN OUT std::vector<uint16_t>& hashTable,
+        IN OUT std::vector<uint16_t>& chainTable
+        )
+    {
+        uint8_t const* source = sourceData.data();
+        uint32_t const sourceSize = static_cast<uint32_t>(sourceData.size());
+        uint8_t* const outputStart = output;
+        uint32_t anchor = 0;
+
+        if (sourceSize > matchSearchLimit)
+        {
+            // Positions fit 16 bits since blocks are at most 64KB. A stale or
+            // empty (zero) entry is harmless, since candidates are verified.
+            hashTable.assign(size_t(1) << hashLog, 0);
+            bool const useChains = (level > CompressionLevelFast);
+            if (useChains)
+                chainTable.resize(CompressionFrameWriter::MaximumBlockSize);
+
+            uint32_t const searchDepth = useChains ? (1u << (level - 1)) : 1;
+            uint32_t const searchEnd = sourceSize - matchSearchLimit;   // Last position a match may start.
+            uint32_t const matchEnd = sourceSize - lastLiteralsLength;  // Matches must end before here.
+            uint32_t nextInsertPosition = 0;                            // For chains, every position is inserted in order.
+
+            auto insertPosition = [&](uint32_t position)
+            {
+                uint32_t hash = GetPositionHash(source + position);
+                if (useChains)
+                    chainTable[position] = hashTable[hash];
+                hashTable[hash] = uint16_t(position);
+            };
+
+            uint32_t position = 1; // Position zero has nothing before it to match.
+            insertPosition(0);
+            nextInsertPosition = 1;
+
+            while (position <= searchEnd)
+            {
+                // Find the longest earlier match, following the chain of
+                // positions with the same hash for higher levels.
+                uint32_t bestLength = 0;
+                uint32_t bestPosition = 0;
+                uint32_t const hash = GetPositionHash(source + position);
+                uint32_t candidate = hashTable[hash];
+                for (uint32_t depth = 0; depth < searchDepth && candidate < position && position - candidate <= maximumOffset; ++depth)
+                {
+                    if (ReadUint32(source + candidate) == ReadUint32(source + position))
+                    {
+                        uint32_t length = minimumMatchLength + GetMatchLength(source, position + minimumMatchLength, candidate + minimumMatchLength, matchEnd);
+                        if (length > bestLength)
+                        {
+                            bestLength = length;
+                            bestPosition = candidate;
+                        }
+                    }
+                    if (!useChains)
+                        break;
+
+                    // Chains only lead backwards, so anything else is the
+                    // end (or an empty bucket's zero).
+                    uint32_t previous = chainTable[candidate];
+                    if (previous >= candidate)
+                        break;
+                    candidate = previous;
+                }
+
+                if (useChains)
+                {
+                    for ( ; nextInsertPosition <= position; ++nextInsertPosition)
+                        insertPosition(nextInsertPosition);
+                }
+                else
+                {
+                    hashTable[hash] = uint16_t(position);
+                }
+
+                if (bestLength < minimumMatchLength)
+                {
+                    // Skip faster the longer nothing has matched, so
+                    // incompressible data passes through quickly.
+                    position += useChains ? 1 : 1 + ((position - anchor) >> 6);
+                    continue;
+                }
+
+                // Extend the match backwards into the pending literals.
+                while (position > anchor && bestPosition > 0 && source[position - 1] == source[bestPosition - 1])
+                {
+                    --position;
+                    --bestPosition;
+                    ++bestLength;
+                }
+
+                output = WriteSequence(output, source + anchor, position - anchor, position - bestPosition, bestLength);
+                position += bestLength;
+                anchor = position;
+
+                if (useChains)
+                {
+                    for ( ; nextInsertPosition < position && nextInsertPosition <= searchEnd; ++nextInsertPosition)
+                        insertPosition(nextInsertPosition);
+                }
+                else if (position - 2 <= searchEnd)
+                {
+                    hashTable[GetPositionHash(source + position - 2)] = uint16_t(position - 2);
+                }
+            }
+        }
+
+        output = WriteSequence(output, source + anchor, sourceSize - anchor, 0, 0);
+        return output - outputStart;
+    }
+
+
+    HRESULT DecompressBlock(
+        const_byte_array_ref sourceData,
+        byte_array_ref destinationData,
+        OUT size_t& destinationSize
+        ) throw()
+    {
+        destinationSize = 0;
+
+        uint8_t const* input = sourceData.data();
+        uint8_t const* const inputEnd = input + sourceData.size();
+        uint8_t* const outputStart = destinationData.data();
+        uint8_t* output = outputStart;
+        uint8_t* const outputEnd = output + destinationData.size();
+
+        auto readLengthExtension = [&](IN OUT size_t& length) -> bool
+        {
+            uint8_t value;
+            do
+            {
+                if (input >= inputEnd)
+                    return false;
+                value = *input++;
+                length += value;
+            } while (value == 255);
+            return true;
+        };
+
+        for (;;)
+        {
+            if (input >= inputEnd)
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            uint32_t const token = *input++;
+            size_t literalLength = token >> 4;
+            if (literalLength == 15 && !readLengthExtension(IN OUT literalLength))
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            size_t const inputLeft = inputEnd - input;
+            size_t const outputLeft = outputEnd - output;
+            if (literalLength > inputLeft || literalLength > outputLeft)
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            // Away from the ends, copy in fixed 16 byte steps, which compile
+            // to single moves. Overshooting is harmless since later output
+            // overwrites it.
+            if (literalLength + 16 <= inputLeft && literalLength + 16 <= outputLeft)
+            {
+                for (size_t i = 0; i < literalLength; i += 16)
+                    memcpy(output + i, input + i, 16);
+            }
+            else
+            {
+                memcpy(output, input, literalLength);
+            }
+            input += literalLength;
+            output += literalLength;
+
+            if (input == inputEnd)
+                break; // The final sequence has only literals.
+
+            if (inputEnd - input < 2)
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            size_t const offset = input[0] | (input[1] << 8);
+            input += 2;
+            if (offset == 0 || offset > size_t(output - outputStart))
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            size_t matchLength = token & 15;
+            if (matchLength == 15 && !readLengthExtension(IN OUT matchLength))
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            matchLength += minimumMatchLength;
+            if (matchLength > size_t(outputEnd - output))
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            // Copy in fixed 8 byte steps when they cannot overlap. Otherwise
+            // the match repeats the last offset bytes, so copy whole periods
+            // from the match start, doubling each time, so that no single
+            // copy overlaps itself.
+            uint8_t const* match = output - offset;
+            if (offset >= 8 && matchLength + 8 <= size_t(outputEnd - output))
+            {
+                for (size_t i = 0; i < matchLength; i += 8)
+                    memcpy(output + i, match + i, 8);
+            }
+            else
+            {
+                for (size_t copiedLength = 0; copiedLength < matchLength; )
+                {
+                    size_t const chunkLength = std::min(matchLength - copiedLength, offset + copiedLength);
+                    memcpy(output + copiedLength, match, chunkLength);
+                    copiedLength += chunkLength;
+                }
+            }
+            output += matchLength;
+        }
+
+        destinationSize = output - outputStart;
+        return S_OK;
+    }
+}
+
+
+HRESULT CompressionFrameWriter::Begin(OutputSink const& outputSink, uint32_t level)
+{
+    level_ = std::max<uint32_t>(CompressionLevelFast, std::min<uint32_t>(level, CompressionLevelMaximum));
+    totalSize_ = 0;
+
+    uint8_t header[CompressionFrameHeaderSize] = {};
+    WriteUint32(header, CompressionFrameSignature);
+    header[4] = CompressionFrameVersion;
+    header[5] = 16; // log2(MaximumBlockSize)
+
+    try
+    {
+        outputSink_ = outputSink;
+        block_.clear();
+        block_.reserve(MaximumBlockSize);
+        compressedBlock_.resize(sizeof(uint32_t) + GetCompressedBlockBound(MaximumBlockSize));
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return outputSink_(const_byte_array_ref(header, sizeof(header)));
+}
+
+
+HRESULT CompressionFrameWriter::Write(const_byte_array_ref data)
+{
+    while (!data.empty())
+    {
+        size_t const copySize = std::min<size_t>(data.size(), MaximumBlockSize - block_.size());
+        block_.insert(block_.end(), data.begin(), data.begin() + copySize); // Never reallocates after the reserve.
+        data.remove_prefix(copySize);
+
+        if (block_.size() >= MaximumBlockSize)
+            IFR(WriteBlock());
+    }
+
+    return S_OK;
+}
+
+
+HRESULT CompressionFrameWriter::Finish()
+{
+    if (!block_.empty())
+        IFR(WriteBlock());
+
+    uint8_t trailer[sizeof(uint32_t) + CompressionFrameTrailerSize] = {};
+    memcpy(&trailer[sizeof(uint32_t)], &totalSize_, sizeof(totalSize_));
+    return outputSink_(const_byte_array_ref(trailer, sizeof(trailer)));
+}
+
+
+HRESULT CompressionFrameWriter::WriteBlock()
+{
+    size_t compressedSize;
+    try
+    {
+        compressedSize = CompressBlock(block_, level_, &compressedBlock_[sizeof(uint32_t)], IN OUT hashTable_, IN OUT chainTable_);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // Store it as-is if compression did not help.
+    if (compressedSize >= block_.size())
+    {
+        compressedSize = block_.size();
+        memcpy(&compressedBlock_[sizeof(uint32_t)], block_.data(), compressedSize);
+        WriteUint32(compressedBlock_.data(), uint32_t(compressedSize) | StoredBlockFlag);
+    }
+    else
+    {
+        WriteUint32(compressedBlock_.data(), uint32_t(compressedSize));
+    }
+
+    totalSize_ += block_.size();
+    block_.clear();
+
+    return outputSink_(const_byte_array_ref(compressedBlock_.data(), sizeof(uint32_t) + compressedSize));
+}
+
+
+HRESULT CompressionFrameReader::Begin(OutputSink const& outputSink)
+{
+    totalSize_ = 0;
+    hasHeader_ = false;
+    isFinished_ = false;
+
+    try
+    {
+        outputSink_ = outputSink;
+        pending_.clear();
+        block_.resize(CompressionFrameWriter::MaximumBlockSize);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
+}
+
+
+HRESULT CompressionFrameReader::Write(const_byte_array_ref frameData)
+{
+    if (isFinished_)
+        return frameData.empty() ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+    try
+    {
+        pending_.insert(pending_.end(), frameData.begin(), frameData.end());
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // Consume every whole piece available, leaving any partial one pending.
+    size_t offset = 0;
+    auto available = [&]() -> size_t { return pending_.size() - offset; };
+
+    HRESULT hr = S_OK;
+    while (SUCCEEDED(hr) && !isFinished_)
+    {
+        if (!hasHeader_)
+        {
+            if (available() < CompressionFrameHeaderSize)
+                break;
+
+            if (ReadUint32(&pending_[offset]) != CompressionFrameSignature)
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            else if (pending_[offset + 4] != CompressionFrameVersion || pending_[offset + 5] != 16)
+                hr = HRESULT_FROM_WIN32(ERROR_UNSUPPORTED_TYPE);
+
+            offset += CompressionFrameHeaderSize;
+            hasHeader_ = true;
+            continue;
+        }
+
+        if (available() < sizeof(uint32_t))
+            break;
+
+        uint32_t const sizeWord = ReadUint32(&pending_[offset]);
+        if (sizeWord == 0)
+        {
+            // End mark, then the total size to confirm nothing was lost.
+            if (available() < sizeof(uint32_t) + CompressionFrameTrailerSize)
+                break;
+
+            uint64_t expectedTotalSize;
+            memcpy(&expectedTotalSize, &pending_[offset + sizeof(uint32_t)], sizeof(expectedTotalSize));
+            offset += sizeof(uint32_t) + CompressionFrameTrailerSize;
+            isFinished_ = true;
+            if (expectedTotalSize != totalSize_ || offset != pending_.size())
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            break;
+        }
+
+        size_t const blockSize = sizeWord & ~StoredBlockFlag;
+        if (blockSize > GetCompressedBlockBound(CompressionFrameWriter::MaximumBlockSize))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            break;
+        }
+        if (available() < sizeof(uint32_t) + blockSize)
+            break;
+
+        const_byte_array_ref blockData(&pending_[offset + sizeof(uint32_t)], blockSize);
+        offset += sizeof(uint32_t) + blockSize;
+
+        if (sizeWord & StoredBlockFlag)
+        {
+            if (blockSize > CompressionFrameWriter::MaximumBlockSize)
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            else
+                hr = outputSink_(blockData);
+            totalSize_ += blockSize;
+        }
+        else
+        {
+            size_t decompressedSize;
+            hr = DecompressBlock(blockData, block_, OUT decompressedSize);
+            if (SUCCEEDED(hr))
+                hr = outputSink_(const_byte_array_ref(block_.data(), decompressedSize));
+            totalSize_ += decompressedSize;
+        }
+    }
+
+    pending_.erase(pending_.begin(), pending_.begin() + std::min(offset, pending_.size()));
+    return hr;
+}
+
+
+HRESULT CompressionFrameReader::Finish()
+{
+    return isFinished_ ? S_OK : HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+}
+
+
+HRESULT CompressData(
+    const_byte_array_ref data,
+    uint32_t level,
+    OUT std::vector<uint8_t>& frame
+    )
+{
+    frame.clear();
+
+    auto appendToFrame = [&](const_byte_array_ref frameData) -> HRESULT
+    {
+        try
+        {
+            frame.insert(frame.end(), frameData.begin(), frameData.end());
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+        return S_OK;
+    };
+
+    CompressionFrameWriter writer;
+    IFR(writer.Begin(appendToFrame, level));
+    IFR(writer.Write(data));
+    IFR(writer.Finish());
+
+    return S_OK;
+}
+
+
+HRESULT DecompressData(
+    const_byte_array_ref frame,
+    OUT std::vector<uint8_t>& data
+    )
+{
+    data.clear();
+
+    auto appendToData = [&](const_byte_array_ref blockData) -> HRESULT
+    {
+        try
+        {
+            data.insert(data.end(), blockData.begin(), blockData.end());
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+        return S_OK;
+    };
+
+    CompressionFrameReader reader;
+    IFR(reader.Begin(appendToData));
+    IFR(reader.Write(frame));
+    IFR(reader.Finish());
+
+    return S_OK;
+}
@@ -0,0 +1,87 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Fast LZ block compression, with a streaming frame format.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// Blocks are encoded as LZ77 sequences of literals and matches, in the same
+// token layout as LZ4, without any entropy coding, so that decompression is
+// little more than memcpy. Higher levels search further for longer matches,
+// slowing compression but not decompression.
+enum CompressionLevel : uint32_t
+{
+    CompressionLevelFast = 1,       // One hash probe per position, skipping ahead through incompressible data.
+    CompressionLevelDefault = 4,
+    CompressionLevelMaximum = 9,    // Searches up to 256 earlier positions per match.
+};
+
+
+// Writes a compressed frame incrementally, passing it to the sink one block
+// at a time, so neither the input nor output need be held whole. Each block
+// is compressed independently, and stored as-is if it does not shrink.
+//
+// Frame layout (little endian):
+//      uint32 signature, uint8 version, uint8 log2 block size, uint16 reserved
+//      blocks: uint32 size (high bit set if stored uncompressed), bytes
+//      uint32 zero end mark, uint64 total uncompressed size
+class CompressionFrameWriter
+{
+public:
+    typedef std::function<HRESULT(const_byte_array_ref frameData)> OutputSink;
+
+    static const uint32_t MaximumBlockSize = 65536; // Also the match window, so offsets fit 16 bits.
+
+    HRESULT Begin(OutputSink const& outputSink, uint32_t level = CompressionLevelFast);
+    HRESULT Write(const_byte_array_ref data);
+    HRESULT Finish(); // Writes any partial block and the end mark.
+
+protected:
+    HRESULT WriteBlock();
+
+protected:
+    OutputSink outputSink_;
+    uint32_t level_ = CompressionLevelFast;
+    uint64_t totalSize_ = 0;
+    std::vector<uint8_t> block_;            // Uncompressed data awaiting a full block.
+    std::vector<uint8_t> compressedBlock_;  // Size word followed by the encoded block.
+    std::vector<uint16_t> hashTable_;
+    std::vector<uint16_t> chainTable_;      // Previous position with the same hash, for higher levels.
+};
+
+
+// Reads a frame written by CompressionFrameWriter, which may arrive in
+// pieces of any size, passing each decompressed block to the sink. Every
+// length and offset is checked, so corrupt data fails rather than reading
+// or writing out of bounds.
+class CompressionFrameReader
+{
+public:
+    typedef std::function<HRESULT(const_byte_array_ref data)> OutputSink;
+
+    HRESULT Begin(OutputSink const& outputSink);
+    HRESULT Write(const_byte_array_ref frameData);
+    HRESULT Finish(); // Fails if the frame was incomplete.
+
+protected:
+    OutputSink outputSink_;
+    uint64_t totalSize_ = 0;
+    bool hasHeader_ = false;
+    bool isFinished_ = false;
+    std::vector<uint8_t> pending_;  // Frame bytes not yet forming a whole block.
+    std::vector<uint8_t> block_;
+};
+
+
+// Compress/decompress a whole buffer as a single frame.
+HRESULT CompressData(
+    const_byte_array_ref data,
+    uint32_t level,
+    OUT std::vector<uint8_t>& frame
+    );
+
+HRESULT DecompressData(
+    const_byte_array_ref frame,
+    OUT std::vector<uint8_t>& data
+    );
@@ -9,30 +9,11 @@
 
 #include <windows.h>
 #include <string>
+#include <deque>
 #include <Shlwapi.h>
 #include "FileHelpers.h"
 
 
-// Including ntdef.h directly can give redefinition errors depending on the
-// project structure. So include the minimum needed macros if it is not
-// included.
-
-#ifndef _NTDEF_
-typedef _Return_type_success_(return >= 0) LONG NTSTATUS;
-
-#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
-#define NT_INFORMATION(Status) ((((ULONG)(Status)) >> 30) == 1)
-#define NT_WARNING(Status) ((((ULONG)(Status)) >> 30) == 2)
-#define NT_ERROR(Status) ((((ULONG)(Status)) >> 30) == 3)
-
-#define APPLICATION_ERROR_MASK       0x20000000
-#define ERROR_SEVERITY_SUCCESS       0x00000000
-#define ERROR_SEVERITY_INFORMATIONAL 0x40000000
-#define ERROR_SEVERITY_WARNING       0x80000000
-#define ERROR_SEVERITY_ERROR         0xC0000000
-#endif
-
-
 enum PathPartType
 {
     PathPartTypeInvalid             = 0x80000000,
@@ -46,52 +27,28 @@ enum PathPartType
 
 HRESULT ReadTextFile(const wchar_t* filename, OUT std::wstring& text) throw()
 {
-    unsigned long bytesRead;
-    std::vector<char> fileData;
+    text.clear();
 
     ////////////////////
-    // Open the file handle, and read the contents.
-
-    HANDLE file = CreateFile(
-                    filename,
-                    GENERIC_READ,
-                    FILE_SHARE_READ,
-                    nullptr,
-                    OPEN_EXISTING,
-                    FILE_FLAG_SEQUENTIAL_SCAN,
-                    nullptr
-                    );
-    FileHandle scopedHandle(file);
+    // Map the file, copy it out of the view, and convert UTF-8 to UTF-16.
 
-    if (file == INVALID_HANDLE_VALUE)
-    {
-        return HRESULT_FROM_WIN32(GetLastError());
-    }
+    MappedFile mappedFile;
+    std::vector<uint8_t> fileData;
+    IFR(mappedFile.Open(filename));
+    IFR(mappedFile.ReadAllData(OUT fileData));
 
-    const unsigned long fileSize = GetFileSize(file, nullptr);
     try
     {
-        fileData.resize(fileSize);
-        text.resize(fileSize);
+        ConvertText(
+            array_ref<char const>(reinterpret_cast<char const*>(fileData.data()), fileData.size()),
+            OUT text
+            );
     }
     catch (...)
     {
         return E_OUTOFMEMORY;
     }
 
-    if (!ReadFile(file, OUT fileData.data(), fileSize, OUT &bytesRead, nullptr))
-    {
-        text.clear();
-        return HRESULT_FROM_WIN32(GetLastError());
-    }
-
-    scopedHandle.Clear();
-
-    ////////////////////
-    // Convert UTF-8 to UTF-16.
-
-    ConvertText(fileData, OUT text);
-
     return S_OK;
 }
 
@@ -116,19 +73,8 @@ HRESULT WriteTextFile(
 
     unsigned long fileSize = 0;
 
-    // Estimate the file size the first call.
-    int32_t charsConverted = WideCharToMultiByte(
-        CP_UTF8,
-        0, // no flags for UTF8 (we allow invalid characters for testing)
-        (LPCWSTR)&text[0],
-        int32_t(textLength),
-        nullptr, // multibyteString
-        0, // multibyteCount
-        nullptr, // defaultChar
-        nullptr  // usedDefaultChar
-        );
-
-    fileSize = charsConverted;
+    // Measure the file size first.
+    fileSize = static_cast<unsigned long>(GetUtf8Length(text, textLength));
 
     try
     {
@@ -139,16 +85,12 @@ HRESULT WriteTextFile(
         return E_OUTOFMEMORY;
     }
 
-    // Convert UTF-8 to UTF-16.
-    WideCharToMultiByte(
-        CP_UTF8,
-        0, // no flags for UTF8 (we allow invalid characters for testing)
-        (LPCWSTR)&text[0],
-        int32_t(textLength),
-        OUT (LPSTR)fileData.data(),
-        int32_t(fileData.size()),
-        nullptr, // defaultChar
-        nullptr  // usedDefaultChar
+    // Convert UTF-16 to UTF-8.
+    ConvertUtf16ToUtf8(
+        text,
+        textLength,
+        OUT reinterpret_cast<char*>(fileData.data()),
+        fileData.size()
         );
 
     ////////////////////
@@ -260,6 +202,113 @@ HRESULT WriteBinaryFile(const wchar_t* filename, const std::vector<uint8_t>& fil
 }
 
 
+HRESULT MappedFile::Open(_In_z_ const wchar_t* filename)
+{
+    Close();
+
+    // Hold each resource locally until all succeed, so a failure leaves
+    // this closed.
+    FileHandle file(
+        CreateFile(
+            filename,
+            GENERIC_READ,
+            FILE_SHARE_DELETE | FILE_SHARE_READ,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+            )
+        );
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        file.Abandon();
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, OUT &fileSize))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (uint64_t(fileSize.QuadPart) > SIZE_MAX)
+    {
+        return HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+    }
+
+    MemorySectionResource section;
+    MemoryViewResource view;
+    if (fileSize.QuadPart > 0)
+    {
+        section = CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (section == nullptr)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        view = MapViewOfFile(section, FILE_MAP_READ, 0, 0, 0);
+        if (view == nullptr)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+
+    data_ = const_byte_array_ref(static_cast<uint8_t const*>(view.Get()), static_cast<size_t>(fileSize.QuadPart));
+    file_.Steal(file);
+    section_.Steal(section);
+    view_.Steal(view);
+
+    return S_OK;
+}
+
+
+HRESULT MappedFile::ReadData(size_t offset, OUT byte_array_ref buffer) const
+{
+    if (offset > data_.size() || buffer.size() > data_.size() - offset)
+    {
+        return E_BOUNDS;
+    }
+
+    // Only a raw copy runs under the handler, since __try cannot share a
+    // function with C++ unwinding. Only in-page errors are caught, so other
+    // faults pass through as usual.
+    __try
+    {
+        memcpy(buffer.data(), data_.data() + offset, buffer.size());
+    }
+    __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+    {
+        return HRESULT_FROM_WIN32(ERROR_READ_FAULT);
+    }
+
+    return S_OK;
+}
+
+
+HRESULT MappedFile::ReadAllData(OUT std::vector<uint8_t>& data) const
+{
+    try
+    {
+        data.resize(data_.size());
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return ReadData(0, OUT byte_array_ref(data.data(), data.size()));
+}
+
+
+void MappedFile::Close()
+{
+    // Unmap before closing the handles the view depends on.
+    data_ = const_byte_array_ref();
+    view_.Clear();
+    section_.Clear();
+    file_.Clear();
+}
+
+
 std::wstring GetFullFileName(array_ref<const wchar_t> fileName)
 {
     std::wstring fullFileName;
@@ -428,408 +477,1161 @@ PathPartType GetNextPathPart(
 }
 
 
-// Single entry for the enumeration queue.
-struct EnumerateMatchingFilesEntry
+FileMaskMatcher::FileMaskMatcher(array_ref<const wchar_t> mask)
 {
-    size_t filePathSize;        // Size in code units of the file path being enumerated.
-    size_t fileMaskOffset;      // Offset into the filemask.
-    size_t queueNamesOffset;    // Current offset into the queue names (incremented each time).
-    size_t queueNamesStart;     // Beginning offset into the queue names (to free the buffer later).
-};
+    Compile(mask);
+}
 
 
-void EnumerateAndAddToQueue(
-    PathPartType type,
-    size_t filePathFileNameBegin,
-    size_t fileMaskOffset,
-    IN OUT std::wstring& filePath,      // full path plus mask on input, but arbitrarily modified on output
-    IN OUT std::wstring& fileNames,     // accumulated list of nul-terminated filenames
-    IN OUT std::wstring& queueNames,    // accumulated list of nul-terminated subdirectories remaining to process
-    IN OUT std::vector<EnumerateMatchingFilesEntry>& queue // List of queued directory entries to add to
-    )
+void FileMaskMatcher::Compile(array_ref<const wchar_t> mask)
 {
-    // Read all the files in from the given filePath, and appending to the
-    // fileNames and queueNames.
-    //
-    // Exactly one file with full path.
-    //
-    //      "c:\windows\fonts\arial.ttf"
-    //
-    // All font files (TrueType or OpenType) starting with 'a' in all
-    // subfolders.
-    //
-    //      "d:\fonts\micro*\**\a*.ttf;a*.otf"
-
-    //-wprintf(L"enumerating %ls, '%ls' ----------------\r\n", (type & PathPartTypeDirectory) ? L"dirs" : L"files", filePath.c_str());
-
-    std::wstring mask;
-    if (type & PathPartTypeMultipleMasks)
-    {
-        // If the string contains multiple wildcards separated by
-        // semicolons ("*.ttf;*.otf"), which FindFirstFile doesn't
-        // understand, then set the FindFirstFile file mask to a
-        // wildcard, and explicitly match each filename.
-        mask = filePath.substr(filePathFileNameBegin);
-        filePath.resize(filePathFileNameBegin);
-        filePath.push_back('*');
-    }
+    patterns_.clear();
+    text_.clear();
+    matchesAll_ = false;
 
-    WIN32_FIND_DATA findData;
-    HANDLE findHandle = FindFirstFile(filePath.c_str(), OUT &findData);
-    if (findHandle != INVALID_HANDLE_VALUE)
+    const wchar_t* maskEnd = mask.end();
+    for (const wchar_t* patternBegin = mask.begin(); patternBegin < maskEnd; )
     {
-        bool isEntryAlreadyStoredInQueue = false;
-        do
+        // Read up to the next semicolon, skipping leading spaces as
+        // PathMatchSpecEx does.
+        while (patternBegin < maskEnd && *patternBegin == ' ')
+            ++patternBegin;
+
+        const wchar_t* patternEnd = std::find(patternBegin, maskEnd, ';');
+        const wchar_t* nextPatternBegin = (patternEnd < maskEnd) ? patternEnd + 1 : patternEnd;
+
+        // Store the folded text, collapsing runs of '*' since they match
+        // the same as one.
+        Pattern pattern = { PatternTypeExact, static_cast<uint32_t>(text_.size()), 0 };
+        uint32_t wildcardCount = 0;
+        uint32_t questionCount = 0;
+        for (const wchar_t* p = patternBegin; p < patternEnd; ++p)
         {
-            if (type & PathPartTypeMultipleMasks)
+            wchar_t ch = *p;
+            if (ch == '*')
             {
-                // FindFirstFile returns all filenames, so match explicitly.
-                HRESULT hr = PathMatchSpecEx(findData.cFileName, mask.c_str(), PMSF_MULTIPLE);
-                if (hr != S_OK)
-                {
-                    continue; // Skip this one, error or S_FALSE
-                }
+                if (text_.size() > pattern.textOffset && text_.back() == '*')
+                    continue;
+                ++wildcardCount;
             }
-
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            else if (ch == '?')
             {
-                if (type & PathPartTypeDirectory)
-                {
-                    // Skip the unnecessary self-referential entries.
-                    if (findData.cFileName[0] == '.'
-                        && (findData.cFileName[1] == '.' || findData.cFileName[1] == '\0'))
-                    {
-                        continue;
-                    }
+                ++wildcardCount;
+                ++questionCount;
+            }
+            text_.push_back(FoldCase(ch));
+        }
+        pattern.textLength = static_cast<uint32_t>(text_.size()) - pattern.textOffset;
+        patternBegin = nextPatternBegin;
 
-                    // Add an entry to the queue.
-                    if (!isEntryAlreadyStoredInQueue)
-                    {
-                        // Store the full directory path into the queue for
-                        // the following subdirectory names.
-                        filePath.resize(filePathFileNameBegin);
-                        auto queueNamesOffset = queueNames.size();
-                        queueNames.push_back('\\');
-                        queueNames.append(filePath);
-                        queueNames.push_back('\0');
+        const wchar_t* patternText = text_.data() + pattern.textOffset;
+        const uint32_t patternLength = pattern.textLength;
+        if (patternLength == 0)
+        {
+            continue; // Empty patterns match nothing.
+        }
+        if ((patternLength == 1 && patternText[0] == '*')
+        ||  (patternLength == 3 && patternText[0] == '*' && patternText[1] == '.' && patternText[2] == '*'))
+        {
+            matchesAll_ = true; // No need to keep any others.
+            break;
+        }
 
-                        // EnumerateMatchingFilesEntry
-                        queue.push_back({ filePathFileNameBegin, fileMaskOffset, queueNamesOffset, queueNamesOffset });
+        // Classify the shape, trimming the lone '*' from prefix and suffix
+        // patterns so only the literal part remains.
+        if (wildcardCount == 0)
+        {
+            pattern.type = PatternTypeExact;
+        }
+        else if (wildcardCount == 1 && questionCount == 0 && patternText[patternLength - 1] == '*')
+        {
+            pattern.type = PatternTypePrefix;
+            --pattern.textLength;
+        }
+        else if (wildcardCount == 1 && questionCount == 0 && patternText[0] == '*')
+        {
+            pattern.type = PatternTypeSuffix;
+            ++pattern.textOffset;
+            --pattern.textLength;
+        }
+        else
+        {
+            pattern.type = PatternTypeGeneral;
+        }
+        patterns_.push_back(pattern);
+    }
+}
 
-                        isEntryAlreadyStoredInQueue = true;
-                    }
 
-                    // Append subdirectory name to queue.
-                    queueNames.append(findData.cFileName);
-                    queueNames.push_back('\0');
-                    //-wprintf(L"push directory name=%ls\r\n", findData.cFileName);
-                }
-            }
-            else
-            {
-                if (!(type & PathPartTypeDirectory))
-                {
-                    // Record filename.
-                    filePath.resize(filePathFileNameBegin);
-                    filePath.append(findData.cFileName);
-                    fileNames.append(filePath);
-                    fileNames.push_back('\0');
-                    //-wprintf(L"push file name=%ls\r\n", filePath.c_str());
-                }
-            }
-        } while (FindNextFile(findHandle, OUT &findData));
+bool FileMaskMatcher::Matches(array_ref<const wchar_t> fileName) const throw()
+{
+    if (matchesAll_)
+        return true;
 
-        FindClose(findHandle);
+    const size_t fileNameLength = fileName.size();
+    const wchar_t* text = text_.data();
+
+    for (auto const& pattern : patterns_)
+    {
+        const wchar_t* patternText = text + pattern.textOffset;
+        const size_t patternLength = pattern.textLength;
+
+        switch (pattern.type)
+        {
+        case PatternTypeExact:
+            if (fileNameLength == patternLength && EqualsFolded(patternText, fileName.data(), patternLength))
+                return true;
+            break;
+
+        case PatternTypePrefix:
+            if (fileNameLength >= patternLength && EqualsFolded(patternText, fileName.data(), patternLength))
+                return true;
+            break;
+
+        case PatternTypeSuffix:
+            if (fileNameLength >= patternLength && EqualsFolded(patternText, fileName.data() + fileNameLength - patternLength, patternLength))
+                return true;
+            break;
+
+        case PatternTypeGeneral:
+            if (MatchesGeneral(array_ref<const wchar_t>(patternText, patternLength), fileName))
+                return true;
+            break;
+        }
     }
+
+    return false;
 }
 
 
-HRESULT EnumerateMatchingFiles(
-    __in_z_opt const wchar_t* fileDirectory,
-    __in_z_opt wchar_t const* originalFileMask,
-    IN OUT std::wstring& fileNames // Append list of nul-delimited fileNames.
-    )
+wchar_t FileMaskMatcher::FoldCase(wchar_t ch) throw()
 {
-    if (fileDirectory == nullptr)
-        fileDirectory = L"";
-
-    if (originalFileMask == nullptr)
-        originalFileMask = L"*";
+    // File names compare by uppercase. Most are ASCII, so avoid the call for
+    // those.
+    if (ch < 0x80)
+    {
+        return (ch >= 'a' && ch <= 'z') ? wchar_t(ch - ('a' - 'A')) : ch;
+    }
 
-    std::wstring fileMask;      // input file mask, combined with the file directory
-    std::wstring filePath;      // current file path being enumerated
-    std::wstring queueNames;// list of nul-terminated filenames
-    std::vector<EnumerateMatchingFilesEntry> queue;
+    // Passing a single character in the low word converts just it.
+    return wchar_t(reinterpret_cast<uintptr_t>(CharUpperW(reinterpret_cast<wchar_t*>(uintptr_t(ch)))));
+}
 
-    size_t fileMaskOffset = 0;
 
-    // Combine the mask with file directory.
-    fileMask.resize(MAX_PATH);
-    PathCombine(OUT &fileMask[0], fileDirectory, originalFileMask);
-    fileMask.resize(wcslen(fileMask.data()));
+bool FileMaskMatcher::EqualsFolded(const wchar_t* foldedText, const wchar_t* text, size_t textLength) throw()
+{
+    for (size_t i = 0; i < textLength; ++i)
+    {
+        if (foldedText[i] != FoldCase(text[i]))
+            return false;
+    }
+    return true;
+}
 
-    // Pop an entry from the queue and read all the matching files/directories,
-    // pushing any directories onto the queue.
-    //
-    // The queue stores a series of nul-terminated strings consisting of
-    // file paths and subsequent subdirectory names. A file path starts
-    // with a '\' and stores a 16-bit index value of where in the mask it
-    // should continue matching from.
-    //
-    for (;;)
+
+bool FileMaskMatcher::MatchesGeneral(array_ref<const wchar_t> foldedPattern, array_ref<const wchar_t> fileName) throw()
+{
+    // Match greedily, and on a mismatch, resume just after the most recent
+    // '*' with it absorbing one more character. Earlier stars never need
+    // revisiting, so this needs no stack and is linear for typical masks.
+    const size_t patternLength = foldedPattern.size();
+    const size_t fileNameLength = fileName.size();
+    size_t patternIndex = 0;
+    size_t fileNameIndex = 0;
+    size_t starPatternIndex = SIZE_MAX;
+    size_t starFileNameIndex = 0;
+
+    while (fileNameIndex < fileNameLength)
     {
-        size_t fileMaskPartBegin = 0;
-        size_t fileMaskPartEnd = 0;
+        wchar_t patternCh = (patternIndex < patternLength) ? foldedPattern[patternIndex] : '\0';
+        if (patternCh == '*')
+        {
+            starPatternIndex = ++patternIndex;
+            starFileNameIndex = fileNameIndex;
+        }
+        else if (patternIndex < patternLength && (patternCh == '?' || patternCh == FoldCase(fileName[fileNameIndex])))
+        {
+            ++patternIndex;
+            ++fileNameIndex;
+        }
+        else if (starPatternIndex != SIZE_MAX)
+        {
+            patternIndex = starPatternIndex;
+            fileNameIndex = ++starFileNameIndex;
+        }
+        else
+        {
+            return false;
+        }
+    }
 
-        PathPartType type = GetNextPathPart(fileMask.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
-        while (type == PathPartTypeDirectory)
+    // Only trailing stars may remain.
+    while (patternIndex < patternLength && foldedPattern[patternIndex] == '*')
+        ++patternIndex;
+
+    return patternIndex == patternLength;
+}
+
+
+// Single entry read from a directory listing.
+struct DirectoryEntry
+{
+    std::wstring name;
+    bool isDirectory;
+};
+
+
+// Reads all the entries of a directory matching the FindFirstFile search
+// path (a directory plus mask). This is the only place the enumeration
+// touches the file system, so everything above it is independent of how the
+// listing is obtained.
+void ReadDirectoryEntries(
+    std::wstring const& searchPath,
+    OUT std::vector<DirectoryEntry>& entries
+    )
+{
+    entries.clear();
+
+    // The basic information level skips generating short names, and the large
+    // fetch asks for bigger batches per round trip, which matters most for
+    // network shares.
+    WIN32_FIND_DATA findData;
+    HANDLE findHandle = FindFirstFileEx(
+        searchPath.c_str(),
+        FindExInfoBasic,
+        OUT &findData,
+        FindExSearchNameMatch,
+        nullptr,
+        FIND_FIRST_EX_LARGE_FETCH
+        );
+    if (findHandle == INVALID_HANDLE_VALUE)
+        return;
+
+    do
+    {
+        // Skip the unnecessary self-referential entries.
+        if (findData.cFileName[0] == '.'
+            && (findData.cFileName[1] == '\0' || (findData.cFileName[1] == '.' && findData.cFileName[2] == '\0')))
         {
-            filePath.append(&fileMask[fileMaskPartBegin], fileMaskPartEnd - fileMaskPartBegin);
-            filePath.push_back('\\');
-            fileMaskOffset = fileMaskPartEnd;
-            type = GetNextPathPart(fileMask.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
+            continue;
         }
 
-        const size_t filePathFileNameBegin = filePath.size();
+        entries.push_back({ findData.cFileName, !!(findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) });
+    } while (FindNextFile(findHandle, OUT &findData));
 
-        if (type & PathPartTypeDirectoryRecursion)
+    FindClose(findHandle);
+}
+
+
+// Walks the directories matched by a file mask on several threads. Each
+// worker owns a deque of directories, taking new work from the back of its
+// own (depth first, staying near what it just listed) and stealing from the
+// front of others' when it runs dry (taking the oldest and typically largest
+// subtrees).
+//
+// Results stream to the caller's thread as they become deliverable. Every
+// directory is a node in a tree mirroring the walk, and files are delivered
+// by a depth first cursor over that tree which stops at the first directory
+// not yet listed, so the order is the same as a single threaded walk however
+// the work was scheduled. The calling thread is also a worker, so masks
+// without subdirectories never start any threads, and helpers pause once
+// enough results are waiting on the caller.
+class ParallelFileEnumerator
+{
+public:
+    ParallelFileEnumerator(std::wstring const& fileMask)
+    :   fileMask_(fileMask)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(OUT &systemInfo);
+
+        // Listing is mostly waiting on the disk or network rather than the
+        // processor, so use a few more workers than processors.
+        uint32_t workerCount = systemInfo.dwNumberOfProcessors * 2;
+        if (workerCount > maximumWorkerCount)
+            workerCount = maximumWorkerCount;
+        if (workerCount == 0)
+            workerCount = 1;
+
+        workers_.resize(workerCount);
+        for (auto& worker : workers_)
         {
-            // Read all subdirectories in the current path.
-            filePath.push_back(L'*');
-            EnumerateAndAddToQueue(
-                type,
-                filePathFileNameBegin,
-                fileMaskPartBegin,
-                IN OUT filePath,
-                IN OUT fileNames,
-                IN OUT queueNames,
-                IN OUT queue
-                );
-            filePath.resize(filePathFileNameBegin);
+            worker.enumerator = this;
+            worker.workerIndex = static_cast<uint32_t>(&worker - workers_.data());
+        }
 
-            // Exhaust any additional recursive segments in case the caller passed c:\fog\**\**\bat.ext.
-            while (type & PathPartTypeDirectoryRecursion)
+        // Compile any multiple mask parts once for all directories.
+        size_t fileMaskOffset = 0;
+        for (;;)
+        {
+            size_t fileMaskPartBegin, fileMaskPartEnd;
+            PathPartType type = GetNextPathPart(fileMask_.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
+            if (type == PathPartTypeInvalid)
+                break;
+
+            if (type & PathPartTypeMultipleMasks)
             {
-                fileMaskOffset = fileMaskPartEnd;
-                type = GetNextPathPart(fileMask.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
+                fileMaskMatchers_[fileMaskPartBegin].Compile({ &fileMask_[fileMaskPartBegin], fileMaskPartEnd - fileMaskPartBegin });
             }
+            fileMaskOffset = fileMaskPartEnd;
         }
+    }
 
-        // Append the file or folder mask to complete the search path.
-        filePath.append(&fileMask[fileMaskPartBegin], fileMaskPartEnd - fileMaskPartBegin);
-
-        EnumerateAndAddToQueue(
-            type,
-            filePathFileNameBegin,
-            fileMaskPartEnd,
-            IN OUT filePath,
-            IN OUT fileNames,
-            IN OUT queueNames,
-            IN OUT queue
-            );
 
-        if (queue.empty())
-            break;
+    HRESULT Enumerate(EnumerateMatchingFilesCallback const& callback)
+    {
+        nodes_.emplace_back();
+        deliveryStack_.push_back(&nodes_.back());
+        PushTask(0, { std::wstring(), 0, &nodes_.back() });
 
-        // Read the next name.
-        auto& entry = queue.back();
-        wchar_t* entryName = &queueNames[entry.queueNamesOffset];
-        size_t entryLength = wcslen(entryName);
+        HRESULT hr = S_OK;
+        std::wstring fileNames;
+        Task task;
 
-        // If the name is a full path, set the current file path.
-        if (entryName[0] == '\\')
+        for (;;)
         {
-            ++entryName; // Skip the slash.
-            filePath.assign(entryName);
-            assert(entry.filePathSize == filePath.size());
-            entry.queueNamesOffset += entry.filePathSize + 1 + 1; // Skip null and slash.
-            entryName += entry.filePathSize + 1;
-            entryLength = wcslen(entryName);
-        }
+            // Hand over whatever is deliverable first, so the caller's work
+            // overlaps with the helpers listing further directories.
+            TakeDeliverableFileNames(OUT fileNames);
+            if (!fileNames.empty() && SUCCEEDED(hr))
+            {
+                hr = callback(fileNames);
+                if (FAILED(hr))
+                {
+                    ExclusiveLockScope lockScope(lock_);
+                    isCanceled_ = true;
+                }
+            }
+
+            uint32_t pushedTaskCount;
+            {
+                ExclusiveLockScope lockScope(lock_);
+                pushedTaskCount = pushedTaskCount_;
+            }
+
+            if (TryTakeTask(0, OUT task))
+            {
+                RunTask(0, task);
+                continue;
+            }
+
+            ExclusiveLockScope lockScope(lock_);
+            if (pendingTaskCount_ == 0 && deliveryStack_.empty())
+                break;
 
-        // Append the next subdirectory.
-        entry.queueNamesOffset += entryLength + 1;
-        filePath.resize(entry.filePathSize);
-        filePath.append(entryName, entryLength);
-        filePath.push_back('\\');
-        fileMaskOffset = entry.fileMaskOffset;
+            if (pushedTaskCount == pushedTaskCount_ && !IsDeliveryReady())
+                SleepConditionVariableSRW(&condition_, &lock_, INFINITE, 0);
+        }
 
-        // Pop the entry and all names if it was the last one.
-        if (entry.queueNamesOffset >= queueNames.size())
+        // Wait for any helpers to leave before the workers go away.
         {
-            queueNames.resize(entry.queueNamesStart);
-            queue.pop_back();
+            ExclusiveLockScope lockScope(lock_);
+            while (runningHelperCount_ > 0)
+            {
+                SleepConditionVariableSRW(&condition_, &lock_, INFINITE, 0);
+            }
         }
+
+        if (FAILED(hr))
+            return hr;
+
+        return hasFailed_ ? E_OUTOFMEMORY : S_OK;
     }
 
-    return S_OK;
-}
+protected:
+    static const uint32_t maximumWorkerCount = 16;
 
+    // Helpers pause while more than this many characters of file names are
+    // deliverable but not yet taken by the caller.
+    static const size_t maximumDeliverableLength = 256 * 1024;
 
-typedef DWORD  (__stdcall RtlCompressBuffer ) (
-                IN ULONG    compressionFormat,
-                IN void*    sourceBuffer,
-                IN ULONG    sourceBufferLength,
-                OUT void*   destinationBuffer,
-                IN ULONG    destinationBufferLength,
-                IN ULONG    unknown,
-                OUT ULONG*  destinationSize,
-                IN void*    workspaceBuffer
-                );
- 
-typedef DWORD  (__stdcall RtlDecompressBuffer )(
-                IN ULONG    compressionFormat,
-                OUT void*   destinationBuffer,
-                IN ULONG    destinationBufferLength,
-                IN void*    sourceBuffer,
-                IN ULONG    sourceBufferLength,
-                OUT ULONG*  actualDestinationSize
-                );
- 
-typedef DWORD  (__stdcall RtlDecompressBufferEx )(
-                IN ULONG    compressionFormat,
-                OUT void*   destinationBuffer,
-                IN ULONG    destinationBufferLength,
-                IN void*    sourceBuffer,
-                IN ULONG    sourceBufferLength,
-                OUT ULONG*  actualDestinationSize,
-                IN void*    workspaceBuffer
-                );
- 
-typedef DWORD  (__stdcall RtlGetCompressionWorkSpaceSize )(
-                IN ULONG    compressionFormat,
-                OUT ULONG*  neededBufferSize,
-                OUT ULONG*  unknown
-                );
+    // Directory in the walk. Its files and children are filled in once it is
+    // listed, and the files are released once delivered.
+    struct Node
+    {
+        std::wstring fileNames;         // Nul-delimited.
+        std::vector<Node*> children;    // In walk order.
+        bool isListed = false;
+    };
 
+    // Directory to enumerate, and where in the mask to continue matching.
+    struct Task
+    {
+        std::wstring filePath;          // Ends with a slash, or empty for the current directory.
+        size_t fileMaskOffset;
+        Node* node;
+    };
 
-uint8_t* ReturnRecompressionDestinationBuffer(
-    NTSTATUS status,
-    _In_reads_bytes_(destinationBufferByteSize) uint8_t* destinationBuffer,
-    _Inout_ DWORD& destinationBufferByteSize
-    )
-{
-    // Free the buffer if any failured occurred.
-    if (NT_SUCCESS(status))
+    struct Worker
     {
-        uint8_t* newDestinationBuffer = (uint8_t*)realloc(destinationBuffer, destinationBufferByteSize);
-        if (newDestinationBuffer != nullptr)
-            destinationBuffer = newDestinationBuffer;
-    }
-    else
+        ParallelFileEnumerator* enumerator;
+        uint32_t workerIndex;
+        SRWLOCK lock = SRWLOCK_INIT;
+        std::deque<Task> tasks;
+    };
+
+    std::wstring fileMask_;
+    std::map<size_t, FileMaskMatcher> fileMaskMatchers_; // Keyed by mask part offset. Read only once enumerating.
+    std::vector<Worker> workers_;
+
+    // Guards everything below, and lets idle workers sleep until there is
+    // more work, something to deliver, or nothing left at all.
+    SRWLOCK lock_ = SRWLOCK_INIT;
+    CONDITION_VARIABLE condition_ = CONDITION_VARIABLE_INIT;
+    std::deque<Node> nodes_;            // Deque so nodes never move.
+    std::vector<Node*> deliveryStack_;  // Nodes not yet delivered, the next on top.
+    size_t deliverableLength_ = 0;      // Listed but undelivered file names, in characters.
+    uint32_t pendingTaskCount_ = 0;     // Queued or running.
+    uint32_t pushedTaskCount_ = 0;      // Ever queued, to detect a push racing with going idle.
+    uint32_t runningHelperCount_ = 0;
+    bool haveStartedHelpers_ = false;
+    bool isCanceled_ = false;
+    bool volatile hasFailed_ = false;
+
+protected:
+    void StartHelpers()
     {
-        free(destinationBuffer);
-        destinationBuffer = nullptr;
-        destinationBufferByteSize = 0;
+        // Only the first worker pushes before the helpers exist, so no lock
+        // is needed for the flag.
+        haveStartedHelpers_ = true;
+
+        for (uint32_t i = 1, ci = static_cast<uint32_t>(workers_.size()); i < ci; ++i)
+        {
+            {
+                ExclusiveLockScope lockScope(lock_);
+                ++runningHelperCount_;
+            }
+            if (!TrySubmitThreadpoolCallback(&HelperCallback, &workers_[i], nullptr))
+            {
+                // Fewer workers is fine, since the first one does everything
+                // left over anyway.
+                ExclusiveLockScope lockScope(lock_);
+                --runningHelperCount_;
+                break;
+            }
+        }
     }
 
-    return destinationBuffer;
-}
 
- 
-uint8_t* NtosCompressData(uint8_t* sourceBuffer, uint32_t sourceBufferSize, DWORD* dwSizeOut)
-{
-    *dwSizeOut = 0;
-    NTSTATUS status = ERROR_SEVERITY_ERROR;
-    
-    const uint32_t destinationBufferSize = 16 * sourceBufferSize;
-    uint8_t* destinationBuffer = (uint8_t*) malloc(destinationBufferSize);
+    static void CALLBACK HelperCallback(PTP_CALLBACK_INSTANCE instance, void* context)
+    {
+        auto& worker = *reinterpret_cast<Worker*>(context);
+        auto& enumerator = *worker.enumerator;
+        {
+            TraceSpan traceSpan(L"ParallelFileEnumerator::RunHelper");
+            enumerator.RunHelper(worker.workerIndex);
+        }
 
-    if (destinationBuffer != nullptr)
+        ExclusiveLockScope lockScope(enumerator.lock_);
+        --enumerator.runningHelperCount_;
+        WakeAllConditionVariable(&enumerator.condition_);
+    }
+
+
+    void RunHelper(uint32_t workerIndex)
     {
-        HANDLE hDll = LoadLibrary(L"ntdll.dll");
-        if (hDll != nullptr)
+        Task task;
+        for (;;)
         {
-            RtlCompressBuffer* fRtlCompressBuffer = (RtlCompressBuffer*) GetProcAddress((HINSTANCE)hDll, "RtlCompressBuffer");
-            RtlGetCompressionWorkSpaceSize* fRtlGetCompressionWorkSpaceSize = (RtlGetCompressionWorkSpaceSize*) GetProcAddress((HINSTANCE)hDll, "RtlGetCompressionWorkSpaceSize");
- 
-            if (fRtlCompressBuffer != nullptr && fRtlGetCompressionWorkSpaceSize != nullptr)
+            uint32_t pushedTaskCount;
             {
-                // We get compression workspace size
-                DWORD dwRet, dwSize;
-                status = (*fRtlGetCompressionWorkSpaceSize) (COMPRESSION_FORMAT_XPRESS_HUFF|COMPRESSION_ENGINE_MAXIMUM, OUT &dwSize, OUT &dwRet);
-    
-                if (NT_SUCCESS(status))
+                // Let the caller catch up if plenty is already waiting on it.
+                // Only when the cursor can move though, since the directory
+                // it waits on may still be sitting in a queue.
+                ExclusiveLockScope lockScope(lock_);
+                while (!isCanceled_ && deliverableLength_ > maximumDeliverableLength && IsDeliveryReady())
                 {
-                    void* workspace = LocalAlloc(LMEM_FIXED, dwSize);
-                    if (workspace != nullptr)
-                    {
-                        // COMPRESS FUNCTION
-                        status = (*fRtlCompressBuffer)(
-                            COMPRESSION_FORMAT_XPRESS_HUFF|COMPRESSION_ENGINE_MAXIMUM, // compression format
-                            sourceBuffer,
-                            sourceBufferSize,
-                            destinationBuffer,
-                            destinationBufferSize,
-                            0, // unknown chunk size?
-                            OUT dwSizeOut, // new destination size 
-                            IN OUT workspace
-                            );
-                    }
-                    LocalFree(workspace);
+                    SleepConditionVariableSRW(&condition_, &lock_, INFINITE, 0);
                 }
+                pushedTaskCount = pushedTaskCount_;
+            }
+
+            if (TryTakeTask(workerIndex, OUT task))
+            {
+                RunTask(workerIndex, task);
+                continue;
             }
+
+            // Nothing to take. Either everything is done, or others are still
+            // listing directories that may yield more work. Only sleep if
+            // nothing was pushed since looking, else the wake was missed.
+            ExclusiveLockScope lockScope(lock_);
+            if (pendingTaskCount_ == 0)
+                break;
+
+            if (pushedTaskCount == pushedTaskCount_)
+                SleepConditionVariableSRW(&condition_, &lock_, INFINITE, 0);
         }
-        FreeLibrary((HINSTANCE)hDll);
     }
 
-    return ReturnRecompressionDestinationBuffer(status, destinationBuffer, IN OUT *dwSizeOut);
-}
+
+    void PushTask(uint32_t workerIndex, Task&& task)
+    {
+        // Count it before it becomes visible, so the pending count cannot
+        // reach zero while a task is still queued.
+        {
+            ExclusiveLockScope lockScope(lock_);
+            ++pendingTaskCount_;
+            ++pushedTaskCount_;
+        }
+        {
+            auto& worker = workers_[workerIndex];
+            ExclusiveLockScope lockScope(worker.lock);
+            worker.tasks.push_back(std::move(task));
+        }
+        WakeConditionVariable(&condition_);
+    }
 
 
-uint8_t* NtosDecompressData(_In_reads_bytes_(sourceBufferSize) uint8_t* sourceBuffer, uint32_t sourceBufferSize, DWORD* dwSizeOut)
-{
-    *dwSizeOut = 0;
+    bool TryTakeTask(uint32_t workerIndex, OUT Task& task)
+    {
+        // Prefer the newest task of our own.
+        {
+            auto& worker = workers_[workerIndex];
+            ExclusiveLockScope lockScope(worker.lock);
+            if (!worker.tasks.empty())
+            {
+                task = std::move(worker.tasks.back());
+                worker.tasks.pop_back();
+                return true;
+            }
+        }
 
-    DWORD dwRet, dwSize;
-    NTSTATUS status = ERROR_SEVERITY_ERROR;
-    
-    const uint32_t destinationBufferSize = 16 * sourceBufferSize;
-    uint8_t* destinationBuffer = (uint8_t*) malloc(destinationBufferSize);
+        // Otherwise steal the oldest from another worker.
+        uint32_t const workerCount = static_cast<uint32_t>(workers_.size());
+        for (uint32_t i = 1; i < workerCount; ++i)
+        {
+            auto& victim = workers_[(workerIndex + i) % workerCount];
+            ExclusiveLockScope lockScope(victim.lock);
+            if (!victim.tasks.empty())
+            {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
 
-    if (destinationBuffer != nullptr)
+        return false;
+    }
+
+
+    void RunTask(uint32_t workerIndex, Task& task)
     {
-        HANDLE hDll = LoadLibrary(L"ntdll.dll");
-        if (hDll != nullptr)
+        std::wstring fileNames;
+        std::vector<Task> childTasks;
+
+        bool isCanceled;
         {
-            RtlDecompressBufferEx* fRtlDecompressBuffer = (RtlDecompressBufferEx*) GetProcAddress((HINSTANCE)hDll, "RtlDecompressBufferEx");
-            RtlGetCompressionWorkSpaceSize* fRtlGetCompressionWorkSpaceSize = (RtlGetCompressionWorkSpaceSize*) GetProcAddress( (HINSTANCE)hDll, "RtlGetCompressionWorkSpaceSize");
- 
-            if (fRtlDecompressBuffer != nullptr && fRtlGetCompressionWorkSpaceSize != nullptr)
+            ExclusiveLockScope lockScope(lock_);
+            isCanceled = isCanceled_;
+        }
+
+        // A failure only loses that directory, but the node is still marked
+        // listed so delivery and the other workers can finish.
+        if (!isCanceled)
+        {
+            try
             {
-                // We get compression workspace size
-                status = (*fRtlGetCompressionWorkSpaceSize)(
-                    COMPRESSION_FORMAT_LZNT1,
-                    OUT &dwSize,
-                    OUT &dwRet
-                    );
- 
-                if (NT_SUCCESS(status))
-                {
-                    void* workspace = LocalAlloc(LMEM_FIXED, dwSize);
-                    if (workspace != nullptr)
-                    {
-                        // DECOMPRESS FUNCTION
-                        status = (*fRtlDecompressBuffer)(
-                                    COMPRESSION_FORMAT_LZNT1 , // compression format
-                                    destinationBuffer,
-                                    destinationBufferSize,
-                                    sourceBuffer,
-                                    sourceBufferSize,
-                                    OUT dwSizeOut,
-                                    IN OUT workspace
-                                    );
-                    }
-                    LocalFree(workspace);
-                }
+                ListTask(task, OUT fileNames, OUT childTasks);
+            }
+            catch (...)
+            {
+                hasFailed_ = true;
+                fileNames.clear();
+                childTasks.clear();
             }
         }
-        FreeLibrary((HINSTANCE)hDll);
+
+        {
+            ExclusiveLockScope lockScope(lock_);
+            for (auto& childTask : childTasks)
+            {
+                nodes_.emplace_back();
+                childTask.node = &nodes_.back();
+                task.node->children.push_back(childTask.node);
+            }
+            deliverableLength_ += fileNames.size();
+            task.node->fileNames = std::move(fileNames);
+            task.node->isListed = true;
+        }
+
+        if (!childTasks.empty() && !haveStartedHelpers_)
+            StartHelpers();
+
+        for (auto& childTask : childTasks)
+        {
+            PushTask(workerIndex, std::move(childTask));
+        }
+
+        ExclusiveLockScope lockScope(lock_);
+        --pendingTaskCount_;
+        WakeAllConditionVariable(&condition_);
+    }
+
+
+    // Lock must be held.
+    bool IsDeliveryReady() const throw()
+    {
+        return !deliveryStack_.empty() && deliveryStack_.back()->isListed;
+    }
+
+
+    // Moves out the file names of all nodes the cursor can pass so far.
+    void TakeDeliverableFileNames(OUT std::wstring& fileNames)
+    {
+        fileNames.clear();
+
+        ExclusiveLockScope lockScope(lock_);
+        while (IsDeliveryReady())
+        {
+            Node* node = deliveryStack_.back();
+            deliveryStack_.pop_back();
+
+            if (!isCanceled_)
+                fileNames.append(node->fileNames);
+
+            deliverableLength_ -= node->fileNames.size();
+            node->fileNames = std::wstring();
+            deliveryStack_.insert(deliveryStack_.end(), node->children.rbegin(), node->children.rend());
+        }
+        WakeAllConditionVariable(&condition_);
+    }
+
+
+    void ListTask(Task& task, OUT std::wstring& fileNames, OUT std::vector<Task>& childTasks)
+    {
+        // Read all the files in the task's directory matching the next part
+        // of the mask, returning any matching subdirectories as new tasks.
+        //
+        // Exactly one file with full path.
+        //
+        //      "c:\windows\fonts\arial.ttf"
+        //
+        // All font files (TrueType or OpenType) starting with 'a' in all
+        // subfolders.
+        //
+        //      "d:\fonts\micro*\**\a*.ttf;a*.otf"
+
+        std::wstring& filePath = task.filePath;
+        size_t fileMaskOffset = task.fileMaskOffset;
+        size_t fileMaskPartBegin = 0;
+        size_t fileMaskPartEnd = 0;
+
+        PathPartType type = GetNextPathPart(fileMask_.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
+        while (type == PathPartTypeDirectory)
+        {
+            filePath.append(&fileMask_[fileMaskPartBegin], fileMaskPartEnd - fileMaskPartBegin);
+            filePath.push_back('\\');
+            fileMaskOffset = fileMaskPartEnd;
+            type = GetNextPathPart(fileMask_.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
+        }
+
+        if (type == PathPartTypeInvalid)
+            return; // Nothing left to match.
+
+        const size_t filePathFileNameBegin = filePath.size();
+        std::vector<DirectoryEntry> entries;
+        std::vector<std::wstring> recursionDirectoryNames;
+        size_t recursionMaskOffset = fileMaskPartBegin;
+
+        if (type & PathPartTypeDirectoryRecursion)
+        {
+            // Read all subdirectories in the current path, which continue
+            // matching from this same recursive part.
+            filePath.push_back(L'*');
+            ReadDirectoryEntries(filePath, OUT entries);
+            filePath.resize(filePathFileNameBegin);
+
+            for (auto& entry : entries)
+            {
+                if (entry.isDirectory)
+                    recursionDirectoryNames.push_back(std::move(entry.name));
+            }
+
+            // Exhaust any additional recursive segments in case the caller passed c:\fog\**\**\bat.ext.
+            while (type & PathPartTypeDirectoryRecursion)
+            {
+                fileMaskOffset = fileMaskPartEnd;
+                type = GetNextPathPart(fileMask_.data(), fileMaskOffset, OUT fileMaskPartBegin, OUT fileMaskPartEnd);
+            }
+        }
+
+        // Read the files or folders matching the last part.
+        FileMaskMatcher const* fileMaskMatcher = nullptr;
+        if (type & PathPartTypeMultipleMasks)
+        {
+            // If the string contains multiple wildcards separated by
+            // semicolons ("*.ttf;*.otf"), which FindFirstFile doesn't
+            // understand, then set the FindFirstFile file mask to a
+            // wildcard, and explicitly match each filename.
+            fileMaskMatcher = &fileMaskMatchers_.find(fileMaskPartBegin)->second;
+            filePath.push_back('*');
+        }
+        else
+        {
+            filePath.append(&fileMask_[fileMaskPartBegin], fileMaskPartEnd - fileMaskPartBegin);
+        }
+        ReadDirectoryEntries(filePath, OUT entries);
+        filePath.resize(filePathFileNameBegin);
+
+        std::vector<std::wstring> maskDirectoryNames;
+        for (auto& entry : entries)
+        {
+            // FindFirstFile returns all filenames, so match explicitly.
+            if (fileMaskMatcher != nullptr && !fileMaskMatcher->Matches(entry.name))
+                continue;
+
+            if (entry.isDirectory)
+            {
+                if (type & PathPartTypeDirectory)
+                    maskDirectoryNames.push_back(std::move(entry.name));
+            }
+            else if (!(type & PathPartTypeDirectory))
+            {
+                // Record filename.
+                fileNames.append(filePath);
+                fileNames.append(entry.name);
+                fileNames.push_back('\0');
+            }
+        }
+
+        // Return the subdirectories in walk order, after this directory's own
+        // files. Directories matching the mask come before the recursive ones.
+        auto appendChildTasks = [&](std::vector<std::wstring> const& directoryNames, size_t childMaskOffset)
+        {
+            for (auto const& directoryName : directoryNames)
+            {
+                Task childTask = { filePath, childMaskOffset, nullptr };
+                childTask.filePath.append(directoryName);
+                childTask.filePath.push_back('\\');
+                childTasks.push_back(std::move(childTask));
+            }
+        };
+        appendChildTasks(maskDirectoryNames, fileMaskPartEnd);
+        appendChildTasks(recursionDirectoryNames, recursionMaskOffset);
+    }
+};
+
+
+HRESULT EnumerateMatchingFiles(
+    __in_z_opt const wchar_t* fileDirectory,
+    __in_z_opt wchar_t const* originalFileMask,
+    EnumerateMatchingFilesCallback const& callback
+    )
+{
+    TraceSpan traceSpan(L"EnumerateMatchingFiles");
+
+    if (fileDirectory == nullptr)
+        fileDirectory = L"";
+
+    if (originalFileMask == nullptr)
+        originalFileMask = L"*";
+
+    std::wstring fileMask;      // input file mask, combined with the file directory
+
+    // Combine the mask with file directory.
+    fileMask.resize(MAX_PATH);
+    PathCombine(OUT &fileMask[0], fileDirectory, originalFileMask);
+    fileMask.resize(wcslen(fileMask.data()));
+
+    try
+    {
+        ParallelFileEnumerator enumerator(fileMask);
+        return enumerator.Enumerate(callback);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
     }
- 
-    return ReturnRecompressionDestinationBuffer(status, destinationBuffer, IN OUT *dwSizeOut);
 }
 
+
+HRESULT EnumerateMatchingFiles(
+    __in_z_opt const wchar_t* fileDirectory,
+    __in_z_opt wchar_t const* originalFileMask,
+    IN OUT std::wstring& fileNames // Append list of nul-delimited fileNames.
+    )
+{
+    // Copy the directory first, since it may point into the names being
+    // appended to.
+    std::wstring fileDirectoryCopy(fileDirectory != nullptr ? fileDirectory : L"");
+
+    return EnumerateMatchingFiles(
+        fileDirectoryCopy.c_str(),
+        originalFileMask,
+        [&](array_ref<wchar_t const> newFileNames) -> HRESULT
+        {
+            try
+            {
+                fileNames.append(newFileNames.data(), newFileNames.size());
+            }
+            catch (...)
+            {
+                return E_OUTOFMEMORY;
+            }
+            return S_OK;
+        }
+        );
+}
+
+
+bool IsPathWithinDirectory(array_ref<const wchar_t> filePath, array_ref<const wchar_t> directoryPath)
+{
+    size_t directoryPathLength = directoryPath.size();
+    while (directoryPathLength > 0 && (directoryPath[directoryPathLength - 1] == '\\' || directoryPath[directoryPathLength - 1] == '/'))
+    {
+        --directoryPathLength;
+    }
+
+    if (filePath.size() < directoryPathLength)
+        return false;
+
+    if (filePath.size() > directoryPathLength && filePath[directoryPathLength] != '\\' && filePath[directoryPathLength] != '/')
+        return false;
+
+    return CompareStringOrdinal(
+        filePath.data(),
+        static_cast<int>(directoryPathLength),
+        directoryPath.data(),
+        static_cast<int>(directoryPathLength),
+        /*ignoreCase*/ true
+        ) == CSTR_EQUAL;
+}
+
+
+void RemoveNestedPaths(IN OUT std::vector<std::wstring>& paths)
+{
+    // A path is dropped if a shorter one contains it, or an equal one (which
+    // differs only by case) comes before it, so exactly one of those stays.
+    std::vector<std::wstring> outermostPaths;
+    for (size_t i = 0, ci = paths.size(); i < ci; ++i)
+    {
+        bool isWithinOther = false;
+        for (size_t j = 0; j < ci && !isWithinOther; ++j)
+        {
+            isWithinOther = (i != j)
+                         && (paths[j].size() < paths[i].size() || (paths[j].size() == paths[i].size() && j < i))
+                         && IsPathWithinDirectory(paths[i], paths[j]);
+        }
+        if (!isWithinOther)
+            outermostPaths.push_back(paths[i]);
+    }
+    paths.swap(outermostPaths);
+}
+
+
+void ParseDirectoryChanges(
+    array_ref<const wchar_t> directoryPath,
+    const_byte_array_ref notifications,
+    OUT std::vector<DirectoryChange>& changes
+    )
+{
+    changes.clear();
+
+    size_t const fileNameOffset = offsetof(FILE_NOTIFY_INFORMATION, FileName);
+    for (size_t offset = 0; offset + fileNameOffset <= notifications.size(); )
+    {
+        FILE_NOTIFY_INFORMATION information;
+        memcpy(&information, &notifications[offset], fileNameOffset);
+        if (information.FileNameLength > notifications.size() - offset - fileNameOffset)
+            break;
+
+        DirectoryChange change;
+        change.action = information.Action;
+        change.filePath.assign(directoryPath.data(), directoryPath.size());
+        change.filePath.push_back('\\');
+        change.filePath.append(
+            reinterpret_cast<wchar_t const UNALIGNED*>(&notifications[offset + fileNameOffset]),
+            information.FileNameLength / sizeof(wchar_t)
+            );
+        changes.push_back(std::move(change));
+
+        if (information.NextEntryOffset == 0)
+            break;
+
+        offset += information.NextEntryOffset;
+    }
+}
+
+
+void ChangedPathSet::Add(array_ref<std::wstring const> paths, uint64_t currentTime)
+{
+    paths_.insert(paths.begin(), paths.end());
+    lastChangeTime_ = currentTime;
+}
+
+
+uint32_t ChangedPathSet::GetTimeUntilSettled(uint64_t currentTime) const throw()
+{
+    uint64_t const settleTime = lastChangeTime_ + debounceMilliseconds_;
+    return (currentTime >= settleTime) ? 0 : static_cast<uint32_t>(settleTime - currentTime);
+}
+
+
+void ChangedPathSet::Take(OUT std::vector<std::wstring>& paths)
+{
+    paths.assign(paths_.begin(), paths_.end());
+    paths_.clear();
+    RemoveNestedPaths(IN OUT paths);
+}
+
+
+struct DirectoryWatcher::WatchedDirectory
+{
+    DirectoryWatcher* watcher;
+    std::wstring directoryPath;         // Without a trailing slash.
+    FileHandle directoryHandle;
+    PTP_IO io = nullptr;
+    OVERLAPPED overlapped;
+    bool isClosing = false;             // Guarded by the watcher's lock.
+
+    // ReadDirectoryChangesW wants DWORD alignment, and fails for network
+    // shares with buffers over 64KB.
+    DWORD buffer[65536 / sizeof(DWORD)];
+};
+
+
+DirectoryWatcher::~DirectoryWatcher()
+{
+    Clear();
+
+    if (timer_ != nullptr)
+    {
+        SetThreadpoolTimer(timer_, nullptr, 0, 0);
+        WaitForThreadpoolTimerCallbacks(timer_, /*cancelPendingCallbacks*/ true);
+        CloseThreadpoolTimer(timer_);
+    }
+}
+
+
+void DirectoryWatcher::Initialize(HWND hwnd, UINT message, uint32_t debounceMilliseconds)
+{
+    hwnd_ = hwnd;
+    message_ = message;
+    debounceMilliseconds_ = debounceMilliseconds;
+    changedPaths_.SetDebounceInterval(debounceMilliseconds);
+}
+
+
+HRESULT DirectoryWatcher::AddDirectory(_In_z_ wchar_t const* directoryPath)
+{
+    if (timer_ == nullptr)
+    {
+        timer_ = CreateThreadpoolTimer(&TimerCallback, this, nullptr);
+        if (timer_ == nullptr)
+            return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    // A tree already watched reports this one too.
+    array_ref<const wchar_t> directoryPathRef(directoryPath, wcslen(directoryPath));
+    for (auto* watchedDirectory : watchedDirectories_)
+    {
+        if (IsPathWithinDirectory(directoryPathRef, watchedDirectory->directoryPath))
+            return S_OK;
+    }
+
+    try
+    {
+        watchedDirectories_.reserve(watchedDirectories_.size() + 1);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    auto* watchedDirectory = new(std::nothrow) WatchedDirectory;
+    if (watchedDirectory == nullptr)
+        return E_OUTOFMEMORY;
+
+    auto deferredCleanup = DeferCleanup([&]() { delete watchedDirectory; });
+
+    watchedDirectory->watcher = this;
+    watchedDirectory->directoryPath = directoryPath;
+    while (!watchedDirectory->directoryPath.empty() && watchedDirectory->directoryPath.back() == '\\')
+    {
+        watchedDirectory->directoryPath.pop_back();
+    }
+
+    HANDLE directoryHandle = CreateFile(
+        directoryPath,
+        FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, // Backup semantics needed to open a directory.
+        nullptr
+        );
+    if (directoryHandle == INVALID_HANDLE_VALUE)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    watchedDirectory->directoryHandle = directoryHandle;
+
+    watchedDirectory->io = CreateThreadpoolIo(watchedDirectory->directoryHandle, &IoCompletionCallback, watchedDirectory, nullptr);
+    if (watchedDirectory->io == nullptr)
+        return HRESULT_FROM_WIN32(GetLastError());
+
+    HRESULT hr = ReadChanges(*watchedDirectory);
+    if (FAILED(hr))
+    {
+        CloseThreadpoolIo(watchedDirectory->io);
+        return hr;
+    }
+
+    watchedDirectories_.push_back(watchedDirectory); // Reserved above, so cannot throw.
+    watchedDirectory = nullptr; // Owned by the list now.
+
+    return S_OK;
+}
+
+
+void DirectoryWatcher::Clear()
+{
+    for (auto* watchedDirectory : watchedDirectories_)
+    {
+        // Cancel under the lock, so the completion callback cannot issue
+        // another read after this one was cancelled.
+        {
+            ExclusiveLockScope lockScope(lock_);
+            watchedDirectory->isClosing = true;
+            CancelIoEx(watchedDirectory->directoryHandle, nullptr);
+        }
+        WaitForThreadpoolIoCallbacks(watchedDirectory->io, /*cancelPendingCallbacks*/ false);
+        CloseThreadpoolIo(watchedDirectory->io);
+        delete watchedDirectory;
+    }
+    watchedDirectories_.clear();
+
+    ExclusiveLockScope lockScope(lock_);
+    changedPaths_.clear();
+}
+
+
+void DirectoryWatcher::TakeChangedPaths(OUT std::vector<std::wstring>& changedPaths)
+{
+    ExclusiveLockScope lockScope(lock_);
+    changedPaths_.Take(OUT changedPaths);
+}
+
+
+HRESULT DirectoryWatcher::ReadChanges(WatchedDirectory& watchedDirectory)
+{
+    ZeroStructure(watchedDirectory.overlapped);
+    StartThreadpoolIo(watchedDirectory.io);
+
+    if (!ReadDirectoryChangesW(
+        watchedDirectory.directoryHandle,
+        OUT watchedDirectory.buffer,
+        sizeof(watchedDirectory.buffer),
+        /*watchSubtree*/ true,
+        FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+        nullptr,
+        &watchedDirectory.overlapped,
+        nullptr
+        ))
+    {
+        DWORD error = GetLastError();
+        CancelThreadpoolIo(watchedDirectory.io);
+        return HRESULT_FROM_WIN32(error);
+    }
+
+    return S_OK;
+}
+
+
+void CALLBACK DirectoryWatcher::IoCompletionCallback(
+    PTP_CALLBACK_INSTANCE instance,
+    void* context,
+    void* overlapped,
+    ULONG ioResult,
+    ULONG_PTR bytesTransferred,
+    PTP_IO io
+    )
+{
+    auto& watchedDirectory = *reinterpret_cast<WatchedDirectory*>(context);
+    auto& watcher = *watchedDirectory.watcher;
+
+    if (ioResult == ERROR_OPERATION_ABORTED)
+        return; // Closing.
+
+    // Any other failure (like the list overflowing, or the directory being
+    // deleted) is recorded as the whole directory having changed.
+    watcher.RecordChanges(watchedDirectory, (ioResult == NO_ERROR) ? static_cast<uint32_t>(bytesTransferred) : 0);
+
+    ExclusiveLockScope lockScope(watcher.lock_);
+    if (!watchedDirectory.isClosing)
+    {
+        watcher.ReadChanges(watchedDirectory);
+    }
+}
+
+
+void DirectoryWatcher::RecordChanges(WatchedDirectory& watchedDirectory, uint32_t bytesTransferred)
+{
+    std::vector<std::wstring> changedPaths;
+    std::vector<DirectoryChange> changes;
+
+    // Zero bytes means the changes did not fit, so just the whole tree.
+    if (bytesTransferred == 0)
+    {
+        changedPaths.push_back(watchedDirectory.directoryPath);
+    }
+
+    ParseDirectoryChanges(
+        watchedDirectory.directoryPath,
+        const_byte_array_ref(reinterpret_cast<uint8_t const*>(watchedDirectory.buffer), bytesTransferred),
+        OUT changes
+        );
+
+    for (auto& change : changes)
+    {
+        // A directory's own timestamp changes along with its contents, which
+        // are reported separately, so skip those.
+        DWORD fileAttributes = (change.action == FILE_ACTION_MODIFIED) ? GetFileAttributes(change.filePath.c_str()) : INVALID_FILE_ATTRIBUTES;
+        if (fileAttributes == INVALID_FILE_ATTRIBUTES || !(fileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        {
+            changedPaths.push_back(std::move(change.filePath));
+        }
+    }
+
+    if (changedPaths.empty())
+        return;
+
+    {
+        ExclusiveLockScope lockScope(lock_);
+        changedPaths_.Add(changedPaths, GetTickCount64());
+    }
+
+    // Restart the countdown, so a burst of changes (like copying a folder of
+    // fonts) yields one update once it settles.
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -int64_t(debounceMilliseconds_) * 10000; // Negative is relative, in 100ns units.
+    SetThreadpoolTimer(timer_, reinterpret_cast<FILETIME*>(&dueTime), 0, 0);
+}
+
+
+void CALLBACK DirectoryWatcher::TimerCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_TIMER timer)
+{
+    auto& watcher = *reinterpret_cast<DirectoryWatcher*>(context);
+
+    // Another batch may have arrived after this countdown started but before
+    // it restarted the timer, so wait out whatever remains of its interval.
+    uint32_t timeUntilSettled;
+    {
+        ExclusiveLockScope lockScope(watcher.lock_);
+        timeUntilSettled = watcher.changedPaths_.GetTimeUntilSettled(GetTickCount64());
+    }
+    if (timeUntilSettled > 0)
+    {
+        LARGE_INTEGER dueTime;
+        dueTime.QuadPart = -int64_t(timeUntilSettled) * 10000; // Negative is relative, in 100ns units.
+        SetThreadpoolTimer(timer, reinterpret_cast<FILETIME*>(&dueTime), 0, 0);
+        return;
+    }
+
+    PostMessage(watcher.hwnd_, watcher.message_, 0, 0);
+}
+
+
 #if 0
 //+---------------------------------------------------------------------------
 //
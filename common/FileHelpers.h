@@ -14,6 +14,38 @@ HRESULT ReadBinaryFile(const wchar_t* filename, OUT std::vector<uint8_t>& fileBy
 HRESULT WriteBinaryFile(const wchar_t* filename, const std::vector<uint8_t>& fileData);
 HRESULT WriteBinaryFile(_In_z_ const wchar_t* filename, _In_reads_bytes_(fileDataSize) const void* fileData, uint32_t fileDataSize);
 
+// Maps a whole file read-only, so it is paged in on demand. The data stays
+// valid until closed, and other writers are shut out meanwhile. Empty files
+// give an empty view, since they cannot be mapped.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+
+    HRESULT Open(_In_z_ const wchar_t* filename);
+    void Close();
+
+    // A read error on removable or network media surfaces as an in-page
+    // exception when the view is touched, rather than a failed HRESULT. So
+    // copy out of the view only through ReadData, which returns
+    // ERROR_READ_FAULT instead, and parse the copy.
+    HRESULT ReadData(size_t offset, OUT byte_array_ref buffer) const;
+    HRESULT ReadAllData(OUT std::vector<uint8_t>& data) const;
+
+    const_byte_array_ref GetData() const throw() { return data_; }
+
+protected:
+    FileHandle file_;
+    MemorySectionResource section_;
+    MemoryViewResource view_;
+    const_byte_array_ref data_;
+
+private:
+    // No copy construction allowed.
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+};
+
 std::wstring GetActualFileName(array_ref<const wchar_t> fileName);
 std::wstring GetFullFileName(array_ref<const wchar_t> fileName);
 
@@ -24,14 +56,154 @@ HRESULT EnumerateMatchingFiles(
     IN OUT std::wstring& fileNames // Appended onto any existing names. It's safe for this to alias fileDirectory.
     );
 
-uint8_t* NtosCompressData(uint8_t* sourceBuffer, uint32_t sourceBufferSize, DWORD* dwSizeOut);
+// Receives a batch of nul-delimited file names, in the same order as the
+// whole list. Returning a failure stops the enumeration with that error.
+typedef std::function<HRESULT(array_ref<wchar_t const> fileNames)> EnumerateMatchingFilesCallback;
 
-uint8_t* NtosDecompressData(_In_reads_bytes_(sourceBufferSize) uint8_t* sourceBuffer, uint32_t sourceBufferSize, DWORD* dwSizeOut);
+// Expand the given path and mask, passing the names to the callback on the
+// calling thread as they are found, rather than after the whole walk.
+HRESULT EnumerateMatchingFiles(
+    __in_z_opt const wchar_t* fileDirectory,
+    __in_z_opt wchar_t const* originalFileMask,
+    EnumerateMatchingFilesCallback const& callback
+    );
 
 const wchar_t* FindFileNameStart(array_ref<const wchar_t> fileName);
 
 bool FileContainsWildcard(array_ref<const wchar_t> fileName);
 
+// Whether the path is the directory itself or anything beneath it, ignoring case.
+bool IsPathWithinDirectory(array_ref<const wchar_t> filePath, array_ref<const wchar_t> directoryPath);
+
+// Removes the paths beneath another path of the list, and repeats of one that
+// differ only by case, keeping the rest in order.
+void RemoveNestedPaths(IN OUT std::vector<std::wstring>& paths);
+
+// Matches file names against one or more wildcard patterns separated by
+// semicolons ("*.ttf;*.ttc;*.otf"), case insensitively, like PathMatchSpecEx
+// with PMSF_MULTIPLE. The mask is parsed once, and the common shapes (exact
+// names, "abc*", "*.ext") are recognized up front, so matching a name is a
+// single pass without allocation.
+class FileMaskMatcher
+{
+public:
+    FileMaskMatcher() = default;
+    explicit FileMaskMatcher(array_ref<const wchar_t> mask);
+
+    void Compile(array_ref<const wchar_t> mask);
+    bool Matches(array_ref<const wchar_t> fileName) const throw();
+
+protected:
+    enum PatternType
+    {
+        PatternTypeExact,       // "arial.ttf"
+        PatternTypePrefix,      // "arial*"
+        PatternTypeSuffix,      // "*.ttf"
+        PatternTypeGeneral,     // "a*b?.ttf"
+    };
+
+    struct Pattern
+    {
+        PatternType type;
+        uint32_t textOffset;    // Into text_, excluding the leading or trailing '*' of prefix and suffix patterns.
+        uint32_t textLength;
+    };
+
+    static wchar_t FoldCase(wchar_t ch) throw();
+    static bool EqualsFolded(const wchar_t* foldedText, const wchar_t* text, size_t textLength) throw();
+    static bool MatchesGeneral(array_ref<const wchar_t> foldedPattern, array_ref<const wchar_t> fileName) throw();
+
+    std::vector<Pattern> patterns_;
+    std::wstring text_;         // Case folded text of all patterns.
+    bool matchesAll_ = false;   // Any pattern was just "*" or "*.*".
+};
+
+// One record from ReadDirectoryChangesW, with the full path.
+struct DirectoryChange
+{
+    std::wstring filePath;
+    uint32_t action;                    // FILE_ACTION_*
+};
+
+// Reads the FILE_NOTIFY_INFORMATION records of the directory, joining each
+// name to the directory path. A record that does not fit within the data
+// ends the list.
+void ParseDirectoryChanges(
+    array_ref<const wchar_t> directoryPath,
+    const_byte_array_ref notifications,
+    OUT std::vector<DirectoryChange>& changes
+    );
+
+// Changed paths collected until they settle. Each batch added restarts the
+// debounce interval, so a burst of changes (like copying a folder of fonts)
+// is taken as one. Times are in milliseconds, as from GetTickCount64. It is
+// not safe for concurrent use by itself.
+class ChangedPathSet
+{
+public:
+    void SetDebounceInterval(uint32_t debounceMilliseconds) throw() { debounceMilliseconds_ = debounceMilliseconds; }
+
+    void Add(array_ref<std::wstring const> paths, uint64_t currentTime);
+
+    // Milliseconds left until no change has arrived for the debounce
+    // interval, or zero once settled.
+    uint32_t GetTimeUntilSettled(uint64_t currentTime) const throw();
+
+    // Returns the outermost changed paths, sorted, and empties the set.
+    void Take(OUT std::vector<std::wstring>& paths);
+
+    void clear() throw() { paths_.clear(); }
+    bool empty() const throw() { return paths_.empty(); }
+
+protected:
+    std::set<std::wstring> paths_;
+    uint64_t lastChangeTime_ = 0;
+    uint32_t debounceMilliseconds_ = 0;
+};
+
+// Watches directory trees for added, removed, renamed, or rewritten files.
+// Changes are collected on thread pool threads, and once they settle for the
+// debounce interval, the message is posted to the window, which then takes
+// the changed paths on its own thread. A path may be a directory (for one
+// created, renamed, or if the change list overflowed), meaning everything
+// beneath it should be considered changed.
+class DirectoryWatcher
+{
+public:
+    DirectoryWatcher() = default;
+    ~DirectoryWatcher();
+
+    void Initialize(HWND hwnd, UINT message, uint32_t debounceMilliseconds);
+    HRESULT AddDirectory(_In_z_ wchar_t const* directoryPath);
+    void Clear(); // Stops watching all directories.
+
+    // Returns the outermost paths changed since last called, sorted.
+    void TakeChangedPaths(OUT std::vector<std::wstring>& changedPaths);
+
+protected:
+    struct WatchedDirectory;
+
+    static void CALLBACK IoCompletionCallback(PTP_CALLBACK_INSTANCE instance, void* context, void* overlapped, ULONG ioResult, ULONG_PTR bytesTransferred, PTP_IO io);
+    static void CALLBACK TimerCallback(PTP_CALLBACK_INSTANCE instance, void* context, PTP_TIMER timer);
+
+    HRESULT ReadChanges(WatchedDirectory& watchedDirectory);
+    void RecordChanges(WatchedDirectory& watchedDirectory, uint32_t bytesTransferred);
+
+    HWND hwnd_ = nullptr;
+    UINT message_ = 0;
+    uint32_t debounceMilliseconds_ = 0;
+    PTP_TIMER timer_ = nullptr;
+    std::vector<WatchedDirectory*> watchedDirectories_;
+
+    SRWLOCK lock_ = SRWLOCK_INIT;
+    ChangedPathSet changedPaths_; // Guarded by the lock.
+
+private:
+    // No copy construction allowed.
+    DirectoryWatcher(const DirectoryWatcher&);
+    DirectoryWatcher& operator=(const DirectoryWatcher&);
+};
+
 #if 0
 //+---------------------------------------------------------------------------
 //
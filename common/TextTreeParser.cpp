@@ -278,6 +278,8 @@ TextTree::iterator TextTree::BeginFirstChild()
 void TextTree::Clear()
 {
     // Reset the tree and release all memory.
+    InvalidateIndices();
+    CancelBatchEdits();
     nodes_.clear();
     nodes_.shrink_to_fit();
     nodesText_.clear();
@@ -346,6 +348,7 @@ void TextTree::SetText(__inout Node& node, const std::wstring& text)
 void TextTree::SetText(__inout Node& node, __in_ecount(textLength) const wchar_t* text, uint32_t textLength)
 {
     assert(size_t(&node - nodes_.data()) < nodes_.size());
+    InvalidateIndices();
     const uint32_t start  = static_cast<uint32_t>(nodesText_.size());
     nodesText_.append(text, textLength);
     node.start = start;
@@ -548,6 +551,39 @@ bool TextTree::Find(
     const auto nodesCount = nodes_.size();
     auto nodeIndex = firstNodeIndex;
 
+    // Use the hashed index of the children if the parent is wide enough.
+    // Entries with equal hashes are ordered by node index, so the first
+    // match is still the first one in the tree.
+    auto const* keyIndex = firstNodeIndexIsParent ? GetKeyIndex(firstNodeIndex) : nullptr;
+    if (keyIndex != nullptr)
+    {
+        KeyIndexEntry const searchEntry = { GetCaseFoldedHash(text, textLength), 0 };
+        auto entry = std::lower_bound(
+            keyIndex->begin(),
+            keyIndex->end(),
+            searchEntry,
+            [](KeyIndexEntry const& a, KeyIndexEntry const& b) -> bool { return a.hash < b.hash; }
+            );
+
+        for (; entry != keyIndex->end() && entry->hash == searchEntry.hash; ++entry)
+        {
+            uint32_t currentTextLength = 0;
+            auto& node = nodes_[entry->nodeIndex];
+            auto currentText = GetText(node, OUT currentTextLength);
+
+            if (currentTextLength == textLength
+            &&  AreKeysEqual(text, currentText, currentTextLength)
+            &&  (expectedType == TextTree::Node::TypeNone
+                ||  node.type == expectedType
+                ||  node.GetGenericType() == expectedType))
+            {
+                matchingNodeIndex = entry->nodeIndex;
+                return true;
+            }
+        }
+        return false;
+    }
+
     if (firstNodeIndexIsParent && !AdvanceChildNode(IN OUT nodeIndex))
     {
         return false;
@@ -561,7 +597,7 @@ bool TextTree::Find(
         auto& node = nodes_[nodeIndex];
         auto currentText = GetText(node, OUT currentTextLength);
 
-        if (currentTextLength == textLength && _wcsnicmp(text, currentText, currentTextLength) == 0)
+        if (currentTextLength == textLength && AreKeysEqual(text, currentText, currentTextLength))
         {
             // Return true if the text matches and it is the expected type (or the type is irrelevant).
             if (expectedType == TextTree::Node::TypeNone
@@ -581,6 +617,110 @@ bool TextTree::Find(
 }
 
 
+wchar_t TextTree::FoldKeyCase(wchar_t ch) throw()
+{
+    if (ch < 0x80)
+    {
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        return ch;
+    }
+    return towlower(ch);
+}
+
+
+bool TextTree::AreKeysEqual(
+    __in_ecount(textLength) wchar_t const* text1,
+    __in_ecount(textLength) wchar_t const* text2,
+    uint32_t textLength
+    ) throw()
+{
+    for (uint32_t i = 0; i < textLength; ++i)
+    {
+        if (text1[i] != text2[i] && FoldKeyCase(text1[i]) != FoldKeyCase(text2[i]))
+            return false;
+    }
+    return true;
+}
+
+
+uint32_t TextTree::GetCaseFoldedHash(
+    __in_ecount(textLength) wchar_t const* text,
+    uint32_t textLength
+    ) throw()
+{
+    // FNV-1a over the folded code units.
+    uint32_t hash = 2166136261;
+    for (uint32_t i = 0; i < textLength; ++i)
+    {
+        hash = (hash ^ FoldKeyCase(text[i])) * 16777619;
+    }
+    return hash;
+}
+
+
+const std::vector<TextTree::KeyIndexEntry>* TextTree::GetKeyIndex(uint32_t parentNodeIndex) const
+{
+    // Discard the cache if the tree changed behind our back.
+    if (keyIndexNodesCount_ != nodes_.size() || keyIndexTextLength_ != nodesText_.size())
+    {
+        keyIndices_.clear();
+        keyIndexNodesCount_ = nodes_.size();
+        keyIndexTextLength_ = nodesText_.size();
+    }
+
+    auto match = keyIndices_.find(parentNodeIndex);
+    if (match == keyIndices_.end())
+    {
+        if (keyIndices_.size() >= keyIndexMaximumParentCount)
+        {
+            keyIndices_.clear();
+        }
+
+        // Build the index from the immediate children. Small objects get an
+        // empty entry so that they are not recounted on every lookup.
+        std::vector<KeyIndexEntry> keyIndex;
+        uint32_t nodeIndex = parentNodeIndex;
+        if (parentNodeIndex < nodes_.size() && AdvanceChildNode(IN OUT nodeIndex))
+        {
+            do
+            {
+                auto& node = nodes_[nodeIndex];
+                KeyIndexEntry entry = { GetCaseFoldedHash(&nodesText_[node.start], node.length), nodeIndex };
+                keyIndex.push_back(entry);
+            } while (AdvanceNextNode(IN OUT nodeIndex));
+        }
+
+        if (keyIndex.size() < keyIndexMinimumChildCount)
+        {
+            keyIndex.clear();
+        }
+        else
+        {
+            std::sort(
+                keyIndex.begin(),
+                keyIndex.end(),
+                [](KeyIndexEntry const& a, KeyIndexEntry const& b) -> bool
+                {
+                    return a.hash < b.hash || (a.hash == b.hash && a.nodeIndex < b.nodeIndex);
+                }
+                );
+        }
+
+        match = keyIndices_.insert(std::make_pair(parentNodeIndex, std::move(keyIndex))).first;
+    }
+
+    return match->second.empty() ? nullptr : &match->second;
+}
+
+
+void TextTree::InvalidateIndices() throw()
+{
+    keyIndices_.clear();
+    buildPath_.clear();
+}
+
+
 bool TextTree::FindKey(
     uint32_t parentNodeIndex,
     __in_z wchar_t const* keyName,
@@ -686,6 +826,13 @@ bool TextTree::SetKey(
 
     auto nodeIndex = parentNodeIndex;
 
+    // When building, trust the caller that the key is new.
+    if (isBuilding_
+    &&  AppendBuiltNode(parentNodeIndex, type, keyName, static_cast<uint32_t>(wcslen(keyName)), OUT keyNodeIndex))
+    {
+        return true;
+    }
+
     // If key already exists, just return it.
     if (FindKey(parentNodeIndex, keyName, OUT nodeIndex))
     {
@@ -723,8 +870,18 @@ bool TextTree::SetSubvalue(
     // value underneath something like a comment or another value.
     assert(keyNode.GetGenericType() == Node::TypeKey);
 
+    // A key just appended by the builder has no values yet.
+    uint32_t valueNodeIndex;
+    if (isBuilding_
+    &&  keyNodeIndex + 1 == nodesCount
+    &&  AppendBuiltNode(keyNodeIndex, type, valueText, valueTextLength, OUT valueNodeIndex))
+    {
+        return true;
+    }
+
     // Delete existing subvalues.
 
+    InvalidateIndices();
     const auto firstChildNodeIndex = keyNodeIndex + 1;
     const auto keyNodeLevel = keyNode.level;
     const auto childNodeLevel = keyNodeLevel + 1;
@@ -823,6 +980,8 @@ bool TextTree::SetKeyValue(
 
 void TextTree::Append(TextTree::Node::Type type, uint32_t level, __in_ecount(textLength) wchar_t const* text, uint32_t textLength)
 {
+    InvalidateIndices();
+
     TextTree::Node node = {};
     node.start = static_cast<uint32_t>(nodesText_.size());
     node.length = textLength;
@@ -838,11 +997,13 @@ bool TextTree::Delete(uint32_t nodeIndex, bool shouldRemove)
     if (nodeIndex >= nodes_.size())
         return false;
 
+    InvalidateIndices();
+
     // Children are also deleted, so determine how many to erase.
     auto endIndex = nodeIndex + 1;
     const auto& node = nodes_[nodeIndex];
     const auto keyLevel = node.level;
-    while (endIndex < nodes_.size() && nodes_[endIndex].level < keyLevel)
+    while (endIndex < nodes_.size() && nodes_[endIndex].level > keyLevel)
     {
         ++endIndex;
     }
@@ -899,6 +1060,14 @@ bool TextTree::Insert(
 {
     newNodeIndex = nodeIndex;
 
+    if (isBuilding_
+    &&  insertAfter
+    &&  nodeIndexIsParent
+    &&  AppendBuiltNode(nodeIndex, type, text, textLength, OUT newNodeIndex))
+    {
+        return true;
+    }
+
     uint32_t newNodeLevel = 0;
     if (nodeIndex < nodes_.size())
     {
@@ -921,6 +1090,8 @@ bool TextTree::Insert(
             return false; // todo: debate whether the call should be false if count not reached
     }
 
+    InvalidateIndices();
+
     TextTree::Node node = {};
     node.start = static_cast<uint32_t>(nodesText_.size());
     node.length = textLength;
@@ -934,6 +1105,225 @@ bool TextTree::Insert(
 }
 
 
+bool TextTree::BatchInsert(
+    uint32_t nodeIndex,
+    TextTree::Node::Type type,
+    uint32_t level,
+    __in_ecount(textLength) wchar_t const* text,
+    uint32_t textLength
+    )
+{
+    if (pendingInserts_.empty() && pendingDeletes_.empty())
+        pendingNodesCount_ = nodes_.size();
+
+    if (nodeIndex > pendingNodesCount_)
+        return false;
+
+    // The level is checked by ApplyBatchEdits, since the neighbours it must
+    // fit between are not known until all the edits are merged.
+
+    // The text pool is append-only, so the text can be stored immediately
+    // without affecting any existing node.
+    PendingInsert pendingInsert = {};
+    pendingInsert.nodeIndex = nodeIndex;
+    pendingInsert.node.start = static_cast<uint32_t>(nodesText_.size());
+    pendingInsert.node.length = textLength;
+    pendingInsert.node.type = type;
+    pendingInsert.node.level = level;
+    nodesText_.append(text, textLength);
+    pendingInserts_.push_back(pendingInsert);
+
+    return true;
+}
+
+
+bool TextTree::BatchDelete(uint32_t nodeIndex)
+{
+    if (pendingInserts_.empty() && pendingDeletes_.empty())
+        pendingNodesCount_ = nodes_.size();
+
+    if (nodeIndex >= pendingNodesCount_)
+        return false;
+
+    pendingDeletes_.push_back(nodeIndex);
+    return true;
+}
+
+
+bool TextTree::ApplyBatchEdits()
+{
+    if (pendingInserts_.empty() && pendingDeletes_.empty())
+        return true;
+
+    if (pendingNodesCount_ != nodes_.size())
+    {
+        CancelBatchEdits();
+        return false;
+    }
+
+    // Stable, so inserts at the same index keep their recorded order.
+    std::stable_sort(
+        pendingInserts_.begin(),
+        pendingInserts_.end(),
+        [](PendingInsert const& a, PendingInsert const& b) -> bool { return a.nodeIndex < b.nodeIndex; }
+        );
+    std::sort(pendingDeletes_.begin(), pendingDeletes_.end());
+
+    // Merge the existing nodes with the pending edits into a new array,
+    // checking at each original index whether a removed subtree has ended,
+    // then emitting the inserts before it, then the node itself. Inserts
+    // recorded right after a removed subtree that are deeper than its root
+    // would have been its last children, so they are removed with it.
+    //
+    // Each inserted node may be at most one level deeper than the node before
+    // it in the merged result (a child), and likewise the node after it.
+    // Otherwise the batch is discarded, leaving the tree unchanged.
+    std::vector<Node> newNodes;
+    newNodes.reserve(nodes_.size() + pendingInserts_.size());
+
+    const uint32_t nodesCount = static_cast<uint32_t>(nodes_.size());
+    size_t insertIndex = 0;
+    size_t deleteIndex = 0;
+    bool isRemoving = false;
+    uint32_t removalLevel = 0;
+    bool isPreviousInserted = false;
+
+    auto emitNode = [&](Node const& node, bool isInserted) -> bool
+    {
+        if (isInserted || isPreviousInserted)
+        {
+            const uint32_t maximumLevel = newNodes.empty() ? 0 : newNodes.back().level + 1;
+            if (node.level > maximumLevel)
+                return false;
+        }
+        newNodes.push_back(node);
+        isPreviousInserted = isInserted;
+        return true;
+    };
+
+    for (uint32_t nodeIndex = 0; ; ++nodeIndex)
+    {
+        const bool isEnd = (nodeIndex >= nodesCount);
+        bool isAfterRemoval = false;
+        if (isRemoving && (isEnd || nodes_[nodeIndex].level <= removalLevel))
+        {
+            isRemoving = false;
+            isAfterRemoval = true;
+        }
+
+        for (; insertIndex < pendingInserts_.size() && pendingInserts_[insertIndex].nodeIndex == nodeIndex; ++insertIndex)
+        {
+            auto const& insertedNode = pendingInserts_[insertIndex].node;
+            if (isRemoving)
+                continue;
+
+            if (isAfterRemoval)
+            {
+                if (insertedNode.level > removalLevel)
+                    continue;
+
+                isAfterRemoval = false;
+            }
+
+            if (!emitNode(insertedNode, /*isInserted*/ true))
+            {
+                CancelBatchEdits();
+                return false;
+            }
+        }
+
+        if (isEnd)
+            break;
+
+        // Skip any deletes nested inside an already removed subtree.
+        while (deleteIndex < pendingDeletes_.size() && pendingDeletes_[deleteIndex] < nodeIndex)
+        {
+            ++deleteIndex;
+        }
+
+        if (!isRemoving && deleteIndex < pendingDeletes_.size() && pendingDeletes_[deleteIndex] == nodeIndex)
+        {
+            isRemoving = true;
+            removalLevel = nodes_[nodeIndex].level;
+        }
+
+        if (!isRemoving && !emitNode(nodes_[nodeIndex], /*isInserted*/ false))
+        {
+            CancelBatchEdits();
+            return false;
+        }
+    }
+
+    InvalidateIndices();
+    nodes_.swap(newNodes);
+    CancelBatchEdits();
+
+    return true;
+}
+
+
+void TextTree::CancelBatchEdits()
+{
+    pendingInserts_.clear();
+    pendingDeletes_.clear();
+    pendingNodesCount_ = 0;
+}
+
+
+void TextTree::SetBuilderMode(bool isBuilding)
+{
+    isBuilding_ = isBuilding;
+    buildPath_.clear();
+    buildPath_.shrink_to_fit();
+}
+
+
+bool TextTree::AppendBuiltNode(
+    uint32_t parentNodeIndex,
+    TextTree::Node::Type type,
+    __in_ecount(textLength) wchar_t const* text,
+    uint32_t textLength,
+    __out uint32_t& newNodeIndex
+    )
+{
+    if (parentNodeIndex >= nodes_.size())
+        return false;
+
+    // Recompute the rightmost path after any other kind of edit. Levels
+    // are not necessarily contiguous, so gaps are filled with an invalid
+    // index that never matches a parent.
+    if (buildPath_.empty())
+    {
+        for (uint32_t nodeIndex = 0, nodesCount = static_cast<uint32_t>(nodes_.size()); nodeIndex < nodesCount; ++nodeIndex)
+        {
+            buildPath_.resize(nodes_[nodeIndex].level, UINT32_MAX);
+            buildPath_.push_back(nodeIndex);
+        }
+    }
+
+    const uint32_t parentLevel = nodes_[parentNodeIndex].level;
+    if (parentLevel >= buildPath_.size() || buildPath_[parentLevel] != parentNodeIndex)
+        return false;
+
+    // Drop the key index, but keep the path since it is updated below.
+    keyIndices_.clear();
+
+    TextTree::Node node = {};
+    node.start = static_cast<uint32_t>(nodesText_.size());
+    node.length = textLength;
+    node.type = type;
+    node.level = parentLevel + 1;
+    nodesText_.append(text, textLength);
+    nodes_.push_back(node);
+
+    newNodeIndex = static_cast<uint32_t>(nodes_.size() - 1);
+    buildPath_.resize(node.level);
+    buildPath_.push_back(newNodeIndex);
+
+    return true;
+}
+
+
 bool TextTree::SkipEmptyNodes(__inout uint32_t& nodeIndex) const
 {
     // Check the first node to see if it is an empty key.
@@ -970,6 +1360,246 @@ bool TextTree::SkipRootNode(__inout uint32_t& nodeIndex) const
 }
 
 
+namespace
+{
+    // Binary layout written by TextTree::WriteBinary:
+    //
+    //      TextTreeBinaryHeader
+    //      TextTree::Node[nodeCount]
+    //      wchar_t[textLength]         // nodesText_, including any embedded nuls
+    //
+    // In the compressed version, the nodes and text after the header are
+    // instead a single CompressionFrameWriter frame. The checksum covers the
+    // uncompressed nodes and text either way. All fields are little endian,
+    // matching the in-memory layout on Windows.
+    struct TextTreeBinaryHeader
+    {
+        enum : uint32_t
+        {
+            CurrentSignature = 'BTTT', // Reads as "TTTB" in a hex dump.
+            UncompressedVersion = 1,
+            CompressedVersion = 2,
+        };
+
+        uint32_t signature;
+        uint16_t version;
+        uint16_t headerSize;
+        uint32_t nodeSize;              // sizeof(TextTree::Node), to catch layout changes.
+        uint32_t nodeCount;
+        uint32_t textLength;            // Code units, not bytes.
+        uint32_t checksum;
+    };
+    static_assert(sizeof(TextTreeBinaryHeader) == 24, "Binary header layout should be stable.");
+
+
+    // Fletcher-style checksum over 32-bit words, cheap enough to run on every
+    // load. Trailing bytes that do not fill a word are folded in individually.
+    uint32_t GetTextTreeBinaryChecksum(const_byte_array_ref data) throw()
+    {
+        uint64_t sum1 = 0, sum2 = 0;
+        const size_t wordCount = data.size() / sizeof(uint32_t);
+        auto words = reinterpret_cast<uint32_t const UNALIGNED*>(data.data());
+
+        for (size_t i = 0; i < wordCount; ++i)
+        {
+            sum1 = (sum1 + words[i]) % 0xFFFFFFFF;
+            sum2 = (sum2 + sum1) % 0xFFFFFFFF;
+        }
+        for (size_t i = wordCount * sizeof(uint32_t); i < data.size(); ++i)
+        {
+            sum1 = (sum1 + data[i]) % 0xFFFFFFFF;
+            sum2 = (sum2 + sum1) % 0xFFFFFFFF;
+        }
+
+        return static_cast<uint32_t>(sum1 ^ (sum2 << 16) ^ (sum2 >> 16));
+    }
+
+
+    // Whether the type is one of the declared node types, since readers
+    // switch over them and a snapshot could hold any value.
+    bool IsKnownNodeType(TextTree::Node::Type type) throw()
+    {
+        switch (type)
+        {
+        case TextTree::Node::TypeNone:
+        case TextTree::Node::TypeValue:
+        case TextTree::Node::TypeText:
+        case TextTree::Node::TypeString:
+        case TextTree::Node::TypeNumber:
+        case TextTree::Node::TypeData:
+        case TextTree::Node::TypeIdentifier:
+        case TextTree::Node::TypeKey:
+        case TextTree::Node::TypeRoot:
+        case TextTree::Node::TypeElement:
+        case TextTree::Node::TypeAttribute:
+        case TextTree::Node::TypeFunction:
+        case TextTree::Node::TypeArray:
+        case TextTree::Node::TypeObject:
+        case TextTree::Node::TypeSection:
+        case TextTree::Node::TypeComment:
+        case TextTree::Node::TypeIgnorable:
+        case TextTree::Node::TypeDirective:
+        case TextTree::Node::TypeDeclaration:
+            return true;
+        default:
+            return false;
+        }
+    }
+}
+
+
+bool TextTree::IsBinary(const_byte_array_ref data) throw()
+{
+    uint32_t signature;
+    if (data.size() < sizeof(TextTreeBinaryHeader))
+        return false;
+
+    memcpy(&signature, data.data(), sizeof(signature));
+    return signature == TextTreeBinaryHeader::CurrentSignature;
+}
+
+
+HRESULT TextTree::WriteBinary(OUT std::vector<uint8_t>& data, uint32_t compressionLevel) const
+{
+    TraceSpan traceSpan(L"TextTree::WriteBinary");
+
+    data.clear();
+
+    const size_t nodesByteSize = nodes_.size() * sizeof(nodes_[0]);
+    const size_t textByteSize = nodesText_.size() * sizeof(nodesText_[0]);
+    const size_t totalByteSize = sizeof(TextTreeBinaryHeader) + nodesByteSize + textByteSize;
+    if (nodes_.size() > UINT32_MAX || nodesText_.size() > UINT32_MAX || totalByteSize > UINT32_MAX)
+        return E_BOUNDS;
+
+    try
+    {
+        data.resize(totalByteSize);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // Copy both arrays as-is after the header. No per-node encoding is needed
+    // since the nodes only hold offsets into the text pool.
+    uint8_t* payload = data.data() + sizeof(TextTreeBinaryHeader);
+    if (nodesByteSize > 0)
+        memcpy(payload, nodes_.data(), nodesByteSize);
+    if (textByteSize > 0)
+        memcpy(payload + nodesByteSize, nodesText_.data(), textByteSize);
+
+    TextTreeBinaryHeader header = {};
+    header.signature = TextTreeBinaryHeader::CurrentSignature;
+    header.version = TextTreeBinaryHeader::UncompressedVersion;
+    header.headerSize = sizeof(TextTreeBinaryHeader);
+    header.nodeSize = sizeof(Node);
+    header.nodeCount = static_cast<uint32_t>(nodes_.size());
+    header.textLength = static_cast<uint32_t>(nodesText_.size());
+    header.checksum = GetTextTreeBinaryChecksum(const_byte_array_ref(payload, nodesByteSize + textByteSize));
+
+    if (compressionLevel > 0)
+    {
+        std::vector<uint8_t> frame;
+        IFR(CompressData(const_byte_array_ref(payload, nodesByteSize + textByteSize), compressionLevel, OUT frame));
+
+        try
+        {
+            data.resize(sizeof(TextTreeBinaryHeader));
+            data.insert(data.end(), frame.begin(), frame.end());
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+        header.version = TextTreeBinaryHeader::CompressedVersion;
+    }
+
+    memcpy(data.data(), &header, sizeof(header));
+
+    return S_OK;
+}
+
+
+HRESULT TextTree::ReadBinary(const_byte_array_ref data)
+{
+    TraceSpan traceSpan(L"TextTree::ReadBinary");
+
+    // Validate the header first.
+    TextTreeBinaryHeader header;
+    if (data.size() < sizeof(header))
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+    memcpy(&header, data.data(), sizeof(header));
+    if (header.signature != TextTreeBinaryHeader::CurrentSignature
+    ||  header.headerSize < sizeof(header)
+    ||  header.headerSize > data.size()
+    ||  header.nodeSize != sizeof(Node))
+    {
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    if (header.version != TextTreeBinaryHeader::UncompressedVersion
+    &&  header.version != TextTreeBinaryHeader::CompressedVersion)
+    {
+        return HRESULT_FROM_WIN32(ERROR_UNSUPPORTED_TYPE);
+    }
+
+    // Expand a compressed payload first, so the rest validates the same.
+    const_byte_array_ref storedPayload(data.data() + header.headerSize, data.size() - header.headerSize);
+    std::vector<uint8_t> decompressedPayload;
+    if (header.version == TextTreeBinaryHeader::CompressedVersion)
+    {
+        IFR(DecompressData(storedPayload, OUT decompressedPayload));
+        storedPayload = decompressedPayload;
+    }
+
+    const uint64_t nodesByteSize = uint64_t(header.nodeCount) * sizeof(Node);
+    const uint64_t textByteSize = uint64_t(header.textLength) * sizeof(wchar_t);
+    if (nodesByteSize + textByteSize != storedPayload.size())
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+    const uint8_t* payload = storedPayload.data();
+    const size_t payloadByteSize = storedPayload.size();
+    if (GetTextTreeBinaryChecksum(const_byte_array_ref(payload, payloadByteSize)) != header.checksum)
+        return HRESULT_FROM_WIN32(ERROR_CRC);
+
+    // Check every node has a known type and refers only to text inside the
+    // pool, and that levels never skip more than one deeper than the previous
+    // node, so that the Advance* functions can trust the tree the same as a
+    // parsed one.
+    auto nodes = reinterpret_cast<Node const UNALIGNED*>(payload);
+    for (uint32_t i = 0; i < header.nodeCount; ++i)
+    {
+        auto const& node = nodes[i];
+        if (!IsKnownNodeType(node.type)
+        ||  node.start > header.textLength
+        ||  node.length > header.textLength - node.start
+        ||  (i == 0 ? node.level != 0 : node.level > nodes[i - 1].level + 1))
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+    }
+
+    // Everything is valid, so replace the existing contents.
+    try
+    {
+        auto text = reinterpret_cast<wchar_t const UNALIGNED*>(payload + nodesByteSize);
+        nodes_.assign(nodes, nodes + header.nodeCount);
+        nodesText_.assign(text, text + header.textLength);
+    }
+    catch (...)
+    {
+        Clear();
+        return E_OUTOFMEMORY;
+    }
+    InvalidateIndices();
+
+    // Batch edits recorded against the old tree no longer apply.
+    CancelBatchEdits();
+
+    return S_OK;
+}
+
+
 namespace
 {
     // Parse a character of the form \x1234.
@@ -1129,6 +1759,10 @@ char32_t TextTreeParser::ReadCStyleEscapeCharacter()
 
 bool TextTreeParser::ReadNodes(__inout TextTree& textTree)
 {
+    TraceSpan traceSpan(L"TextTreeParser::ReadNodes");
+
+    textTree.InvalidateIndices();
+
     // Always allocate at least one node for the root.
     TextTree::Node node = {};
     if (textTree.empty())
@@ -1960,6 +2594,92 @@ TextTreeWriter::TextTreeWriter(Options options)
 }
 
 
+void TextTreeWriter::SetOutputSink(OutputSink const& outputSink, uint32_t bufferLength)
+{
+    outputSink_ = outputSink;
+    outputBufferLength_ = std::max(bufferLength, 1u);
+    text_.reserve(outputBufferLength_);
+}
+
+
+void TextTreeWriter::SetOutputFile(HANDLE fileHandle, uint32_t bufferLength)
+{
+    auto writeToFile = [fileHandle](const_byte_array_ref utf8Text) -> HRESULT
+    {
+        // The buffer is bounded well under 4GB, so a single write suffices.
+        DWORD bytesWritten = 0;
+        if (!WriteFile(fileHandle, utf8Text.data(), static_cast<DWORD>(utf8Text.size()), OUT &bytesWritten, nullptr))
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        if (bytesWritten != utf8Text.size())
+            return HRESULT_FROM_WIN32(ERROR_WRITE_FAULT);
+
+        return S_OK;
+    };
+    SetOutputSink(writeToFile, bufferLength);
+}
+
+
+HRESULT TextTreeWriter::Flush()
+{
+    return FlushInternal(/*isFinalFlush*/ true);
+}
+
+
+HRESULT TextTreeWriter::FlushIfNeeded()
+{
+    if (!outputSink_ || text_.size() < outputBufferLength_)
+        return S_OK;
+
+    return FlushInternal(/*isFinalFlush*/ false);
+}
+
+
+HRESULT TextTreeWriter::FlushInternal(bool isFinalFlush)
+{
+    if (!outputSink_)
+        return S_OK;
+
+    // Hold back a dangling leading surrogate until its trailing half arrives,
+    // unless nothing more will be written.
+    size_t textLength = text_.size();
+    if (!isFinalFlush && textLength > 0 && IsLeadingSurrogate(text_[textLength - 1]))
+        --textLength;
+
+    if (textLength == 0)
+        return S_OK;
+
+    try
+    {
+        utf8Buffer_.resize(textLength * 3);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    const size_t utf8Length = ConvertUtf16ToUtf8(
+        text_.data(),
+        textLength,
+        OUT reinterpret_cast<char*>(utf8Buffer_.data()),
+        utf8Buffer_.size()
+        );
+    IFR(outputSink_(const_byte_array_ref(utf8Buffer_.data(), utf8Length)));
+
+    // Keep the capacity for the next round.
+    text_.erase(0, textLength);
+    flushedTextLength_ += textLength;
+
+    return S_OK;
+}
+
+
+bool TextTreeWriter::HasWrittenText() const throw()
+{
+    return !text_.empty() || flushedTextLength_ > 0;
+}
+
+
 HRESULT TextTreeWriter::WriteNode(
     TextTree::Node::Type type,
     __in_ecount(textLength) const wchar_t* text,
@@ -2060,7 +2780,7 @@ HRESULT TextTreeWriter::WriteNodes(const TextTree& textTree)
         IFR(ExitNode());
     }
 
-    return S_OK;
+    return Flush();
 }
 
 
@@ -2157,7 +2877,7 @@ HRESULT JsonexWriter::WriteNode(
     }
     if (wantNewLine)
     {
-        if (!text_.empty()) // Write new line, but never start the text file with a leading return (would be a pointless blank line).
+        if (HasWrittenText()) // Write new line, but never start the text file with a leading return (would be a pointless blank line).
             text_.append(L"\r\n");
 
         WriteIndentation();
@@ -2220,7 +2940,7 @@ HRESULT JsonexWriter::WriteNode(
         break;
     }
 
-    return S_OK;
+    return FlushIfNeeded();
 }
 
 
@@ -2367,7 +3087,7 @@ HRESULT JsonexWriter::ExitNode()
         text_.push_back(closingPunctuation);
     }
 
-    return S_OK;
+    return FlushIfNeeded();
 }
 
 
@@ -2587,7 +3307,7 @@ HRESULT XmlWriter::WriteNode(
                 wantNewLine = (nodeStack_[nodeLevel_ - 1].type != TextTree::Node::TypeAttribute);
             }
         }
-        if (wantNewLine && !text_.empty()) // Never start with a leading return.
+        if (wantNewLine && HasWrittenText()) // Never start with a leading return.
         {
             text_.append(L"\r\n");
             const size_t spacesToIndent = nodeLevel_ * spacesPerIndent_;
@@ -2601,6 +3321,18 @@ HRESULT XmlWriter::WriteNode(
     nodeStack_.resize(nodeLevel_);
     nodeStack_.push_back(node);
 
+    // Drop the names of any elements no longer on the stack.
+    size_t elementNamesLength = 0;
+    for (auto it = nodeStack_.rbegin(); it != nodeStack_.rend(); ++it)
+    {
+        if (it->type == TextTree::Node::TypeElement && it->length > 0)
+        {
+            elementNamesLength = it->start + it->length;
+            break;
+        }
+    }
+    elementNames_.resize(elementNamesLength);
+
     switch (type)
     {
     case TextTree::Node::TypeValue:
@@ -2614,11 +3346,17 @@ HRESULT XmlWriter::WriteNode(
         break;
 
     case TextTree::Node::TypeElement:
-        text_.push_back('<');
-        nodeStack_.back().start = static_cast<uint32_t>(text_.size());
-        nodeStack_.back().length = textLength;
-        WriteStringInternal(text, textLength, type);
-        isInsideOpeningTag_ = true;
+        {
+            text_.push_back('<');
+            const size_t nameStart = text_.size();
+            WriteStringInternal(text, textLength, type);
+
+            // Keep a copy of the escaped name for the closing tag.
+            nodeStack_.back().start = static_cast<uint32_t>(elementNames_.size());
+            nodeStack_.back().length = static_cast<uint32_t>(text_.size() - nameStart);
+            elementNames_.append(text_, nameStart, std::wstring::npos);
+            isInsideOpeningTag_ = true;
+        }
         break;
 
     case TextTree::Node::TypeAttribute:
@@ -2635,7 +3373,7 @@ HRESULT XmlWriter::WriteNode(
 
     previousType_ = type;
 
-    return S_OK;
+    return FlushIfNeeded();
 }
 
 
@@ -2726,13 +3464,13 @@ HRESULT XmlWriter::ExitNode()
             spaceBuffer_.assign(spacesToIndent, ' ');
             text_.append(spaceBuffer_);
             text_.append(L"</");
-            text_.append(&text_[node.start], node.length);
+            text_.append(elementNames_, node.start, node.length);
             text_.append(L">");
         }
         break;
     }
 
-    return S_OK;
+    return FlushIfNeeded();
 }
 
 
@@ -227,11 +227,55 @@ public:
     // it in-place (TypeNone).
     bool Delete(uint32_t nodeIndex, bool shouldRemove);
 
+    // Batch editing, for many inserts or removals at once. Each edit is only
+    // recorded, using node indices as they were before the batch, and
+    // ApplyBatchEdits merges all of them in a single pass rather than
+    // shifting the remaining nodes once per edit.
+    //
+    // Nodes inserted at the same index keep the order they were recorded in,
+    // and are placed before the existing node at that index (or at the end if
+    // the index equals the node count), regardless of the order the indices
+    // were recorded in. Removing a node removes its children too, along with
+    // any inserts recorded inside the removed range or that would become its
+    // last children.
+    //
+    // BatchInsert returns false if the index is out of range. ApplyBatchEdits
+    // returns false and discards the edits if the tree was changed in between
+    // by anything other than batch calls, or if an inserted node would not fit
+    // between its neighbours in the edited tree (like Insert, at most one
+    // level deeper than the node before it, with the node after it at most
+    // one level deeper than it).
+    bool BatchInsert(
+        uint32_t nodeIndex,
+        TextTree::Node::Type type,
+        uint32_t level,
+        __in_ecount(textLength) wchar_t const* text,
+        uint32_t textLength
+        );
+    bool BatchDelete(uint32_t nodeIndex);
+    bool ApplyBatchEdits();
+    void CancelBatchEdits();
+
+    // Builder mode, for constructing a large tree top down in pre-order.
+    // While enabled, SetKey, SetKeyValue, and AppendChild append the new
+    // node directly at the end when the parent is the last node or one of
+    // its ancestors (always true when each object is completely filled in
+    // before its next sibling is started), instead of searching for the
+    // parent's last child and shifting everything after it. SetKey also
+    // skips the search for an existing key of the same name, so the caller
+    // is responsible for not adding duplicates. Other parents fall back to
+    // the normal insertion.
+    void SetBuilderMode(bool isBuilding);
+
     // Find the node matching the given text (case insensitive).
     // If more than one exists, the first match is returned.
     // The search is not recursive (only at siblings or immediate
     // children if firstNodeIndexIsParent) and stops at the last sibling.
-    // This is most efficient at leaf branches. 
+    // This is most efficient at leaf branches.
+    //
+    // When searching immediate children, a hashed index of the parent's
+    // children is built on first lookup and reused until the tree is
+    // modified, so repeated lookups in wide objects avoid the linear scan.
     //
     // Returns:
     //    - true if a match was found, with matchingNodeIndex updated.
@@ -348,9 +392,95 @@ public:
     bool SkipEmptyNodes(__inout uint32_t& nodeIndex) const;
     bool SkipRootNode(__inout uint32_t& nodeIndex) const;
 
+    // Serializes the nodes and text pool directly into a compact binary form
+    // (header, nodes, text) which ReadBinary can reload without tokenizing.
+    // The nodes and text are compressed unless the level is 0.
+    HRESULT WriteBinary(OUT std::vector<uint8_t>& data, uint32_t compressionLevel = CompressionLevelFast) const;
+
+    // Replaces the tree with one previously written by WriteBinary. The data
+    // can come from a single file read or a mapped view, and it is validated
+    // (signature, version, checksum, node types, bounds and levels) before
+    // anything is copied. Both compressed and uncompressed snapshots are
+    // accepted. Any pending batch edits are dropped.
+    HRESULT ReadBinary(const_byte_array_ref data);
+
+    // Whether the data starts with the WriteBinary signature, to tell a
+    // snapshot apart from text before choosing how to load it.
+    static bool IsBinary(const_byte_array_ref data) throw();
+
+private:
+    struct KeyIndexEntry
+    {
+        uint32_t hash;                  // Case-folded hash of the node text.
+        uint32_t nodeIndex;             // Index of the child node.
+    };
+
+    // Objects with fewer children than this are just scanned linearly.
+    const static uint32_t keyIndexMinimumChildCount = 4;
+
+    // The cache is dropped once it holds this many parents, so that walking
+    // a large tree does not keep an index of every object alive.
+    const static uint32_t keyIndexMaximumParentCount = 256;
+
+    // Key matching ignores case. The hash and the comparison share the same
+    // folding, so that equal keys always land in the same bucket.
+    static wchar_t FoldKeyCase(wchar_t ch) throw();
+
+    static bool AreKeysEqual(
+        __in_ecount(textLength) wchar_t const* text1,
+        __in_ecount(textLength) wchar_t const* text2,
+        uint32_t textLength
+        ) throw();
+
+    static uint32_t GetCaseFoldedHash(
+        __in_ecount(textLength) wchar_t const* text,
+        uint32_t textLength
+        ) throw();
+
+    // Returns the lazily built child index of the parent, or null if the
+    // parent has too few children to be worth indexing.
+    const std::vector<KeyIndexEntry>* GetKeyIndex(uint32_t parentNodeIndex) const;
+
+    void InvalidateIndices() throw();
+
+    // Appends a child directly to the end of the tree if the parent lies on
+    // the rightmost path, returning false otherwise.
+    bool AppendBuiltNode(
+        uint32_t parentNodeIndex,
+        TextTree::Node::Type type,
+        __in_ecount(textLength) wchar_t const* text,
+        uint32_t textLength,
+        __out uint32_t& newNodeIndex
+        );
+
+    struct PendingInsert
+    {
+        uint32_t nodeIndex;             // Original node index to insert before.
+        Node node;
+    };
+
 private:
     std::vector<Node> nodes_;
     std::wstring nodesText_;  // Holds decoded text for cases for numeric codes: \u03A3 or &#931; or &#x03A3.
+
+    // Cache of child indices per parent node, cleared whenever the tree is
+    // modified. The node and text sizes are recorded to also catch changes
+    // made directly through GetNode. Like the rest of the tree, it is
+    // not safe for concurrent use, even by const callers.
+    mutable std::map<uint32_t, std::vector<KeyIndexEntry> > keyIndices_;
+    mutable size_t keyIndexNodesCount_ = 0;
+    mutable size_t keyIndexTextLength_ = 0;
+
+    // Edits recorded by BatchInsert/BatchDelete, and the node count they
+    // were recorded against.
+    std::vector<PendingInsert> pendingInserts_;
+    std::vector<uint32_t> pendingDeletes_;
+    size_t pendingNodesCount_ = 0;
+
+    // The last node index at each level along the rightmost path of the
+    // tree, used by builder mode. Empty means it must be recomputed.
+    bool isBuilding_ = false;
+    std::vector<uint32_t> buildPath_;
 };
 
 
@@ -655,9 +785,29 @@ public:
         OptionsNoEscapeSequence     = TextTreeParser::OptionsNoEscapeSequence,
     };
 
+    // Receives UTF-8 encoded output each time the writer's buffer fills.
+    // A failing HRESULT stops the writer and is returned to the caller.
+    typedef std::function<HRESULT(const_byte_array_ref utf8Text)> OutputSink;
+
+    const static uint32_t DefaultOutputBufferLength = 65536; // Code units
+
 public:
     TextTreeWriter(Options options);
 
+    // Stream the output through a sink rather than accumulating the entire
+    // document in memory. Once the buffered text reaches bufferLength code
+    // units, it is encoded to UTF-8 and passed to the sink, so memory stays
+    // bounded by the buffer plus the largest single node. Call Flush after
+    // the last node to emit any remaining text. GetText then only returns
+    // the text not yet flushed.
+    void SetOutputSink(OutputSink const& outputSink, uint32_t bufferLength = DefaultOutputBufferLength);
+
+    // Convenience sink which writes to an open file handle (not owned).
+    void SetOutputFile(HANDLE fileHandle, uint32_t bufferLength = DefaultOutputBufferLength);
+
+    // Emit any buffered text to the sink. Does nothing without a sink.
+    HRESULT Flush();
+
     // Write an entire parse tree or parse tree fragment.
     HRESULT WriteNodes(const TextTree& textTree);
 
@@ -685,9 +835,24 @@ public:
         ) throw();
 
 protected:
-    std::wstring text_; // Starts empty and grows with each written node.
+    // Called by derived classes after writing each node, flushing to the
+    // sink once the buffer is full.
+    HRESULT FlushIfNeeded();
+
+    HRESULT FlushInternal(bool isFinalFlush);
+
+    // Whether anything was written yet, including text already flushed.
+    bool HasWrittenText() const throw();
+
+protected:
+    std::wstring text_; // Starts empty and grows with each written node (or until flushed to the sink).
     uint32_t nodeLevel_ = 0; // Current heirarchy level
     Options options_ = OptionsDefault;
+
+    OutputSink outputSink_;
+    uint32_t outputBufferLength_ = 0;
+    uint64_t flushedTextLength_ = 0; // Code units already passed to the sink.
+    std::vector<uint8_t> utf8Buffer_;
 };
 
 
@@ -823,6 +988,7 @@ protected:
     TextTree::Node::Type previousType_;
     std::wstring spaceBuffer_;
     std::vector<TextTree::Node> nodeStack_;
+    std::wstring elementNames_; // Escaped names of open elements, since text_ may be flushed before the closing tag.
 };
 
 #if 0
@@ -0,0 +1,316 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Lightweight timing spans, exported as a Chrome trace.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "Tracing.h"
+
+
+bool volatile Tracer::isEnabled_ = false;
+uint64_t Tracer::startTimestamp_ = 0;
+SRWLOCK Tracer::lock_ = SRWLOCK_INIT;
+Tracer::ThreadBuffer* Tracer::threadBuffers_[Tracer::MaximumThreadCount] = {};
+uint32_t Tracer::threadBufferCount_ = 0;
+LONG volatile Tracer::droppedEventCount_ = 0;
+LONG volatile Tracer::releasedThreadBufferCount_ = 0;
+
+
+namespace
+{
+    uint64_t GetTimestampFrequency() throw()
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(OUT &frequency); // Always succeeds on XP and later.
+        return frequency.QuadPart;
+    }
+
+
+    // Split the multiply so large tick counts do not overflow.
+    uint64_t ConvertTicksToNanoseconds(uint64_t ticks, uint64_t frequency) throw()
+    {
+        const uint64_t nanosecondsPerSecond = 1000000000;
+        return ticks / frequency * nanosecondsPerSecond
+             + ticks % frequency * nanosecondsPerSecond / frequency;
+    }
+
+
+    // Chrome traces count in microseconds, but accept fractions.
+    void FormatMicroseconds(uint64_t nanoseconds, OUT wchar_t (&buffer)[32]) throw()
+    {
+        swprintf_s(buffer, L"%llu.%03u", nanoseconds / 1000, static_cast<uint32_t>(nanoseconds % 1000));
+    }
+}
+
+
+void Tracer::Enable(bool isEnabled) throw()
+{
+    ExclusiveLockScope lockScope(lock_);
+    if (isEnabled && startTimestamp_ == 0)
+    {
+        startTimestamp_ = GetTimestamp();
+    }
+    isEnabled_ = isEnabled;
+}
+
+
+void Tracer::Clear() throw()
+{
+    ExclusiveLockScope lockScope(lock_);
+    startTimestamp_ = GetTimestamp();
+    droppedEventCount_ = 0;
+
+    // Exited threads' buffers have nothing left to record, so free them
+    // rather than keep their slots until another thread needs one.
+    uint32_t liveThreadBufferCount = 0;
+    for (uint32_t i = 0; i < threadBufferCount_; ++i)
+    {
+        ThreadBuffer* threadBuffer = threadBuffers_[i];
+        if (threadBuffer->isThreadExited)
+        {
+            delete threadBuffer;
+            continue;
+        }
+
+        {
+            ExclusiveLockScope threadLockScope(threadBuffer->lock);
+            threadBuffer->eventCount = 0;
+        }
+        threadBuffers_[liveThreadBufferCount++] = threadBuffer;
+    }
+    if (liveThreadBufferCount < threadBufferCount_)
+    {
+        std::fill(threadBuffers_ + liveThreadBufferCount, threadBuffers_ + threadBufferCount_, nullptr);
+        threadBufferCount_ = liveThreadBufferCount;
+        InterlockedIncrement(&releasedThreadBufferCount_);
+    }
+}
+
+
+uint64_t Tracer::GetTimestamp() throw()
+{
+    LARGE_INTEGER timestamp;
+    QueryPerformanceCounter(OUT &timestamp);
+    return timestamp.QuadPart;
+}
+
+
+Tracer::ThreadBuffer* Tracer::GetThreadBuffer() throw()
+{
+    // Each thread acquires a buffer on its first span, and releases it on
+    // exit, keeping its events for export until the slot is needed again.
+    // A thread past the limit only retries once another thread has exited,
+    // to keep later spans cheap.
+    struct ThreadBufferHolder
+    {
+        ThreadBuffer* threadBuffer = nullptr;
+        bool isThreadDropped = false;
+        LONG releasedThreadBufferCount = 0; // As of being dropped.
+
+        ~ThreadBufferHolder()
+        {
+            if (threadBuffer != nullptr)
+                ReleaseThreadBuffer(threadBuffer);
+        }
+    };
+    static thread_local ThreadBufferHolder holder;
+
+    if (holder.threadBuffer != nullptr)
+        return holder.threadBuffer;
+    if (holder.isThreadDropped && holder.releasedThreadBufferCount == releasedThreadBufferCount_)
+        return nullptr;
+
+    holder.releasedThreadBufferCount = releasedThreadBufferCount_;
+    holder.threadBuffer = AcquireThreadBuffer();
+    holder.isThreadDropped = (holder.threadBuffer == nullptr);
+
+    return holder.threadBuffer;
+}
+
+
+Tracer::ThreadBuffer* Tracer::AcquireThreadBuffer() throw()
+{
+    ExclusiveLockScope lockScope(lock_);
+    ThreadBuffer* threadBuffer = nullptr;
+
+    // Allocate new buffers while there is room, so exited threads' events
+    // last as long as possible, and then reuse exited threads' buffers,
+    // earliest acquired first.
+    if (threadBufferCount_ < MaximumThreadCount)
+    {
+        threadBuffer = new(std::nothrow) ThreadBuffer;
+        if (threadBuffer == nullptr)
+            return nullptr;
+
+        InitializeSRWLock(&threadBuffer->lock);
+        threadBuffers_[threadBufferCount_++] = threadBuffer;
+    }
+    else
+    {
+        auto exitedThreadBuffer = std::find_if(
+            threadBuffers_,
+            threadBuffers_ + threadBufferCount_,
+            [](ThreadBuffer const* threadBuffer) -> bool { return threadBuffer->isThreadExited; }
+            );
+        if (exitedThreadBuffer == threadBuffers_ + threadBufferCount_)
+            return nullptr;
+
+        // Move it to the end, so the next one found is the next oldest.
+        threadBuffer = *exitedThreadBuffer;
+        std::rotate(exitedThreadBuffer, exitedThreadBuffer + 1, threadBuffers_ + threadBufferCount_);
+    }
+
+    // Exporting also takes the tracer lock first, and the previous owner has
+    // exited, so nothing else can be looking at the buffer.
+    threadBuffer->threadId = GetCurrentThreadId();
+    threadBuffer->isThreadExited = false;
+    threadBuffer->eventCount = 0;
+
+    return threadBuffer;
+}
+
+
+void Tracer::ReleaseThreadBuffer(ThreadBuffer* threadBuffer) throw()
+{
+    ExclusiveLockScope lockScope(lock_);
+    threadBuffer->isThreadExited = true;
+    InterlockedIncrement(&releasedThreadBufferCount_);
+}
+
+
+void Tracer::RecordSpan(
+    _In_z_ wchar_t const* name,
+    uint64_t beginTimestamp,
+    uint64_t endTimestamp
+    ) throw()
+{
+    ThreadBuffer* threadBuffer = GetThreadBuffer();
+    if (threadBuffer == nullptr)
+    {
+        InterlockedIncrement(&droppedEventCount_);
+        return;
+    }
+
+    // Only the exporter ever contends for this lock.
+    ExclusiveLockScope lockScope(threadBuffer->lock);
+    auto& event = threadBuffer->events[threadBuffer->eventCount % EventsPerThread];
+    event.name = name;
+    event.beginTimestamp = beginTimestamp;
+    event.endTimestamp = endTimestamp;
+    ++threadBuffer->eventCount;
+}
+
+
+HRESULT Tracer::ExportChromeTrace(JsonexWriter& writer)
+{
+    struct ThreadEvent
+    {
+        uint32_t threadId;
+        TraceEvent event;
+    };
+
+    // Copy the events out under the locks, then write them without holding
+    // up the recording threads.
+    std::vector<ThreadEvent> threadEvents;
+    uint64_t startTimestamp;
+    uint64_t overwrittenEventCount = 0;
+    uint64_t droppedEventCount;
+
+    try
+    {
+        ExclusiveLockScope lockScope(lock_);
+        startTimestamp = startTimestamp_;
+        droppedEventCount = droppedEventCount_;
+
+        for (uint32_t i = 0; i < threadBufferCount_; ++i)
+        {
+            auto& threadBuffer = *threadBuffers_[i];
+            ExclusiveLockScope threadLockScope(threadBuffer.lock);
+
+            uint64_t const eventCount = threadBuffer.eventCount;
+            uint64_t const firstEventIndex = (eventCount > EventsPerThread) ? eventCount - EventsPerThread : 0;
+            overwrittenEventCount += firstEventIndex;
+
+            for (uint64_t eventIndex = firstEventIndex; eventIndex < eventCount; ++eventIndex)
+            {
+                ThreadEvent threadEvent = { threadBuffer.threadId, threadBuffer.events[eventIndex % EventsPerThread] };
+                threadEvents.push_back(threadEvent);
+            }
+        }
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    // Spans are recorded as they end, so children precede their parents.
+    // Order by start instead, outermost first, which viewers expect.
+    std::sort(
+        threadEvents.begin(),
+        threadEvents.end(),
+        [](ThreadEvent const& a, ThreadEvent const& b) -> bool
+        {
+            if (a.threadId != b.threadId)
+                return a.threadId < b.threadId;
+            if (a.event.beginTimestamp != b.event.beginTimestamp)
+                return a.event.beginTimestamp < b.event.beginTimestamp;
+            return a.event.endTimestamp > b.event.endTimestamp;
+        }
+        );
+
+    auto writeKeyValue = [&](_In_z_ wchar_t const* keyName, _In_z_ wchar_t const* value, bool isNumber) -> HRESULT
+    {
+        IFR(writer.BeginKey(keyName));
+        IFR(isNumber ? writer.WriteValueNumber(value) : writer.WriteValueString(value));
+        return writer.EndScope();
+    };
+
+    //  {
+    //    "displayTimeUnit": "ns",
+    //    "otherData": {"overwrittenEventCount": 0, "droppedEventCount": 0},
+    //    "traceEvents": [
+    //      {"name": "RebuildFontCollectionList", "ph": "X", "pid": 1234, "tid": 5678, "ts": 12.345, "dur": 6.789}, ...
+    //    ]
+    //  }
+
+    uint64_t const frequency = GetTimestampFrequency();
+    wchar_t processId[16];
+    wchar_t threadId[16];
+    wchar_t number[32];
+    swprintf_s(processId, L"%u", GetCurrentProcessId());
+
+    IFR(writer.BeginObject());
+    IFR(writeKeyValue(L"displayTimeUnit", L"ns", /*isNumber*/ false));
+
+    IFR(writer.BeginObject(L"otherData"));
+    swprintf_s(number, L"%llu", overwrittenEventCount);
+    IFR(writeKeyValue(L"overwrittenEventCount", number, /*isNumber*/ true));
+    swprintf_s(number, L"%llu", droppedEventCount);
+    IFR(writeKeyValue(L"droppedEventCount", number, /*isNumber*/ true));
+    IFR(writer.EndScope());
+
+    IFR(writer.BeginArray(L"traceEvents"));
+    for (auto const& threadEvent : threadEvents)
+    {
+        auto const& event = threadEvent.event;
+        uint64_t const beginTimestamp = std::max(event.beginTimestamp, startTimestamp);
+        uint64_t const endTimestamp = std::max(event.endTimestamp, beginTimestamp);
+
+        IFR(writer.BeginObject());
+        IFR(writeKeyValue(L"name", event.name, /*isNumber*/ false));
+        IFR(writeKeyValue(L"ph", L"X", /*isNumber*/ false)); // Complete event, with a duration.
+        IFR(writeKeyValue(L"pid", processId, /*isNumber*/ true));
+        swprintf_s(threadId, L"%u", threadEvent.threadId);
+        IFR(writeKeyValue(L"tid", threadId, /*isNumber*/ true));
+        FormatMicroseconds(ConvertTicksToNanoseconds(beginTimestamp - startTimestamp, frequency), OUT number);
+        IFR(writeKeyValue(L"ts", number, /*isNumber*/ true));
+        FormatMicroseconds(ConvertTicksToNanoseconds(endTimestamp - beginTimestamp, frequency), OUT number);
+        IFR(writeKeyValue(L"dur", number, /*isNumber*/ true));
+        IFR(writer.EndScope());
+    }
+    IFR(writer.EndScope());
+
+    IFR(writer.EndScope());
+
+    return S_OK;
+}
@@ -0,0 +1,112 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Lightweight timing spans, exported as a Chrome trace.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+class JsonexWriter;
+
+
+// Records timed spans from any thread into per-thread ring buffers, which
+// can be exported in the Chrome trace event format (chrome://tracing or
+// ui.perfetto.dev). Nesting is implied by containment on the same thread.
+// Recording is off by default, and then a span costs a single flag check.
+//
+// Span names must be string literals (or otherwise outlive the tracer),
+// since only the pointer is recorded.
+class Tracer
+{
+public:
+    static const uint32_t EventsPerThread = 8192;  // Older events are overwritten.
+    static const uint32_t MaximumThreadCount = 64; // Live threads beyond this are dropped.
+
+    static bool IsEnabled() throw()
+    {
+        return isEnabled_;
+    }
+
+    static void Enable(bool isEnabled) throw();
+    static void Clear() throw(); // Discards all recorded events, and frees exited threads' buffers.
+
+    static uint64_t GetTimestamp() throw(); // Ticks of QueryPerformanceCounter.
+
+    static void RecordSpan(
+        _In_z_ wchar_t const* name,
+        uint64_t beginTimestamp,
+        uint64_t endTimestamp
+        ) throw();
+
+    // Writes all recorded events, oldest first per thread, as a Chrome trace
+    // object with nanosecond precision timestamps.
+    static HRESULT ExportChromeTrace(JsonexWriter& writer);
+
+protected:
+    struct TraceEvent
+    {
+        wchar_t const* name;
+        uint64_t beginTimestamp;
+        uint64_t endTimestamp;
+    };
+
+    struct ThreadBuffer
+    {
+        uint32_t threadId;
+        bool isThreadExited;        // Guarded by the tracer lock. Exited buffers may be reused.
+        SRWLOCK lock;               // Uncontended except while exporting.
+        uint64_t eventCount;        // Total ever recorded. The ring holds the last EventsPerThread.
+        TraceEvent events[EventsPerThread];
+    };
+
+    static ThreadBuffer* GetThreadBuffer() throw();
+    static ThreadBuffer* AcquireThreadBuffer() throw();
+    static void ReleaseThreadBuffer(ThreadBuffer* threadBuffer) throw();
+
+    static bool volatile isEnabled_;
+    static uint64_t startTimestamp_; // Exported times are relative to this.
+    static SRWLOCK lock_;
+    static ThreadBuffer* threadBuffers_[MaximumThreadCount]; // Guarded by the lock.
+    static uint32_t threadBufferCount_;
+    static LONG volatile droppedEventCount_;
+    static LONG volatile releasedThreadBufferCount_; // Lets dropped threads know when to retry.
+};
+
+
+// Records the time from construction to destruction as a span, if tracing
+// was enabled when constructed.
+//
+//  TraceSpan traceSpan(L"RebuildFontCollectionList");
+//
+class TraceSpan
+{
+public:
+    explicit TraceSpan(_In_z_ wchar_t const* name) throw()
+    :   name_(name),
+        beginTimestamp_(Tracer::IsEnabled() ? Tracer::GetTimestamp() : 0)
+    { }
+
+    ~TraceSpan() throw()
+    {
+        End();
+    }
+
+    // Ends the span early, such as before a long tail that belongs elsewhere.
+    void End() throw()
+    {
+        if (beginTimestamp_ != 0)
+        {
+            Tracer::RecordSpan(name_, beginTimestamp_, Tracer::GetTimestamp());
+            beginTimestamp_ = 0;
+        }
+    }
+
+protected:
+    wchar_t const* name_;
+    uint64_t beginTimestamp_;
+
+private:
+    // No copy construction allowed.
+    TraceSpan(const TraceSpan&);
+    TraceSpan& operator=(const TraceSpan&);
+};
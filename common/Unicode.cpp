@@ -4,6 +4,99 @@
 #include "precomp.h"
 
 
+#if defined(_M_IX86) || defined(_M_X64)
+#include <emmintrin.h>
+#define UNICODE_CONVERSION_USE_SSE2 1
+#endif
+
+
+// Reads one code point, advancing the index. For unpaired surrogates, pass
+// the isolated surrogate through (rather than remap to U+FFFD).
+inline char32_t ReadUtf16CodePoint(
+    __in_ecount(sourceCount) const wchar_t* sourceChars,
+    size_t sourceCount,
+    IN OUT size_t& si
+    ) throw()
+{
+    char32_t ch = sourceChars[si++];
+    if (IsLeadingSurrogate(ch) && si < sourceCount)
+    {
+        char32_t leading  = ch;
+        char32_t trailing = sourceChars[si];
+        if (IsTrailingSurrogate(trailing))
+        {
+            ch = MakeUnicodeCodepoint(leading, trailing);
+            ++si;
+        }
+    }
+    return ch;
+}
+
+
+// Reads one code point from UTF-8, advancing the index. Each invalid
+// sequence (truncated, overlong, surrogate, or beyond U+10FFFF) is read as
+// U+FFFD, consuming only its valid prefix, the same as MultiByteToWideChar.
+inline char32_t ReadUtf8CodePoint(
+    __in_ecount(sourceCount) const uint8_t* sourceChars,
+    size_t sourceCount,
+    IN OUT size_t& si
+    ) throw()
+{
+    uint32_t lead = sourceChars[si++];
+    if (lead < 0x80)
+        return lead;
+
+    uint32_t ch;
+    uint32_t trailCount;
+    uint32_t lowerTrail = 0x80, upperTrail = 0xBF; // Second byte range, narrower for some leads.
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        ch = lead & 0x1F;
+        trailCount = 1;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF)
+    {
+        ch = lead & 0x0F;
+        trailCount = 2;
+        if (lead == 0xE0) lowerTrail = 0xA0;        // Overlong
+        else if (lead == 0xED) upperTrail = 0x9F;   // Surrogates
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        ch = lead & 0x07;
+        trailCount = 3;
+        if (lead == 0xF0) lowerTrail = 0x90;        // Overlong
+        else if (lead == 0xF4) upperTrail = 0x8F;   // Beyond U+10FFFF
+    }
+    else
+    {
+        return UnicodeReplacementCharacter;
+    }
+
+    for ( ; trailCount > 0; --trailCount)
+    {
+        if (si >= sourceCount)
+            return UnicodeReplacementCharacter;
+
+        uint32_t trail = sourceChars[si];
+        if (trail < lowerTrail || trail > upperTrail)
+            return UnicodeReplacementCharacter;
+
+        ch = (ch << 6) | (trail & 0x3F);
+        lowerTrail = 0x80;
+        upperTrail = 0xBF;
+        ++si;
+    }
+    return ch;
+}
+
+
+inline size_t GetUtf8CodePointLength(char32_t ch) throw()
+{
+    return (ch < 0x80) ? 1 : (ch < 0x800) ? 2 : (ch < 0x10000) ? 3 : 4;
+}
+
+
 __out_range(0, destMax)
 size_t ConvertUtf16ToUtf32(
     __in_ecount(sourceCount) const wchar_t* sourceChars,
@@ -16,27 +109,36 @@ size_t ConvertUtf16ToUtf32(
     // but never the other way around.
 
     size_t si = 0, di = 0;
-    for ( ; di < destMax; ++di)
+    while (si < sourceCount && di < destMax)
     {
-        if (si >= sourceCount)
-            break;
-
-        char32_t ch = sourceChars[si++];
-
-        // Just use the character if not a surrogate code point.
-        // For unpaired surrogates, pass the isolated surrogate
-        // through (rather than remap to U+FFFD).
-        if (IsLeadingSurrogate(ch) && si < sourceCount)
+        #if UNICODE_CONVERSION_USE_SSE2
+        // Widen whole blocks of 8 code units when none are surrogates.
+        if (sourceCount - si >= 8 && destMax - di >= 8)
         {
-            char32_t leading  = ch;
-            char32_t trailing = sourceChars[si];
-            if (IsTrailingSurrogate(trailing))
+            __m128i const zero = _mm_setzero_si128();
+            __m128i units = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceChars[si]));
+            __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(short(0xF800))), _mm_set1_epi16(short(0xD800)));
+            if (_mm_movemask_epi8(surrogates) == 0)
             {
-                ch = MakeUnicodeCodepoint(leading, trailing);
-                ++si;
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&destChars[di + 0]), _mm_unpacklo_epi16(units, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&destChars[di + 4]), _mm_unpackhi_epi16(units, zero));
+                si += 8;
+                di += 8;
+                continue;
+            }
+
+            // Otherwise decode the block one by one. A pair straddling the
+            // end of the block is read whole.
+            size_t blockEnd = si + 8;
+            while (si < blockEnd && di < destMax)
+            {
+                destChars[di++] = ReadUtf16CodePoint(sourceChars, sourceCount, IN OUT si);
             }
+            continue;
         }
-        destChars[di] = ch;
+        #endif
+
+        destChars[di++] = ReadUtf16CodePoint(sourceChars, sourceCount, IN OUT si);
     }
 
     return di;
@@ -61,6 +163,27 @@ size_t ConvertUtf32ToUtf16(
         if (di >= destMax)
             break;
 
+        #if UNICODE_CONVERSION_USE_SSE2
+        // Narrow whole blocks of 8 characters when all are in the BMP. Values
+        // are biased into signed range so the saturating pack is exact.
+        if (sourceCount - si >= 8 && destMax - di >= 8)
+        {
+            __m128i low  = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceChars[si + 0]));
+            __m128i high = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceChars[si + 4]));
+            __m128i beyondBmp = _mm_srli_epi32(_mm_or_si128(low, high), 16);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(beyondBmp, _mm_setzero_si128())) == 0xFFFF)
+            {
+                __m128i const bias32 = _mm_set1_epi32(0x8000);
+                __m128i units = _mm_packs_epi32(_mm_sub_epi32(low, bias32), _mm_sub_epi32(high, bias32));
+                units = _mm_add_epi16(units, _mm_set1_epi16(short(0x8000)));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&destChars[di]), units);
+                si += 7; // The loop increments the last.
+                di += 8;
+                continue;
+            }
+        }
+        #endif
+
         char32_t ch = sourceChars[si];
 
         if (ch > 0xFFFF && destMax - di >= 2)
@@ -83,6 +206,183 @@ size_t ConvertUtf32ToUtf16(
 }
 
 
+__out_range(0, destMax)
+size_t ConvertUtf8ToUtf16(
+    __in_ecount(sourceCount) const char* sourceChars,
+    __in size_t sourceCount,
+    __out_ecount_part(destMax,0) wchar_t* destChars,
+    __in size_t destMax
+    ) throw()
+{
+    // Each UTF-8 byte yields at most one UTF-16 code unit, so a destination
+    // as long as the source always suffices.
+
+    const uint8_t* sourceBytes = reinterpret_cast<const uint8_t*>(sourceChars);
+    size_t si = 0, di = 0;
+    while (si < sourceCount && di < destMax)
+    {
+        #if UNICODE_CONVERSION_USE_SSE2
+        // Widen whole blocks of 16 ASCII bytes.
+        if (sourceCount - si >= 16 && destMax - di >= 16)
+        {
+            __m128i const zero = _mm_setzero_si128();
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceBytes[si]));
+            if (_mm_movemask_epi8(bytes) == 0)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&destChars[di + 0]), _mm_unpacklo_epi8(bytes, zero));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&destChars[di + 8]), _mm_unpackhi_epi8(bytes, zero));
+                si += 16;
+                di += 16;
+                continue;
+            }
+        }
+        #endif
+
+        // Read one code point, but leave it unread if its surrogate pair
+        // would not fit.
+        size_t nextSi = si;
+        char32_t ch = ReadUtf8CodePoint(sourceBytes, sourceCount, IN OUT nextSi);
+        if (IsCharacterBeyondBmp(ch))
+        {
+            if (destMax - di < 2)
+                break;
+
+            destChars[di++] = GetLeadingSurrogate(ch);
+            destChars[di++] = GetTrailingSurrogate(ch);
+        }
+        else
+        {
+            destChars[di++] = wchar_t(ch);
+        }
+        si = nextSi;
+    }
+
+    return di;
+}
+
+
+__out_range(0, destMax)
+size_t ConvertUtf16ToUtf8(
+    __in_ecount(sourceCount) const wchar_t* sourceChars,
+    __in size_t sourceCount,
+    __out_ecount_part(destMax,0) char* destChars,
+    __in size_t destMax
+    ) throw()
+{
+    uint8_t* destBytes = reinterpret_cast<uint8_t*>(destChars);
+    size_t si = 0, di = 0;
+    while (si < sourceCount && di < destMax)
+    {
+        #if UNICODE_CONVERSION_USE_SSE2
+        // Narrow whole blocks of 16 ASCII code units.
+        if (sourceCount - si >= 16 && destMax - di >= 16)
+        {
+            __m128i low  = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceChars[si + 0]));
+            __m128i high = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceChars[si + 8]));
+            __m128i nonAscii = _mm_and_si128(_mm_or_si128(low, high), _mm_set1_epi16(short(0xFF80)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) == 0xFFFF)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(&destBytes[di]), _mm_packus_epi16(low, high));
+                si += 16;
+                di += 16;
+                continue;
+            }
+        }
+        #endif
+
+        // Unpaired surrogates become U+FFFD, as with WideCharToMultiByte,
+        // since UTF-8 cannot represent them.
+        size_t nextSi = si;
+        char32_t ch = ReadUtf16CodePoint(sourceChars, sourceCount, IN OUT nextSi);
+        if (IsSurrogate(ch))
+            ch = UnicodeReplacementCharacter;
+
+        size_t length = GetUtf8CodePointLength(ch);
+        if (destMax - di < length)
+            break;
+
+        switch (length)
+        {
+        case 1:
+            destBytes[di++] = uint8_t(ch);
+            break;
+        case 2:
+            destBytes[di++] = uint8_t(0xC0 | (ch >> 6));
+            destBytes[di++] = uint8_t(0x80 | (ch & 0x3F));
+            break;
+        case 3:
+            destBytes[di++] = uint8_t(0xE0 | (ch >> 12));
+            destBytes[di++] = uint8_t(0x80 | ((ch >> 6) & 0x3F));
+            destBytes[di++] = uint8_t(0x80 | (ch & 0x3F));
+            break;
+        default:
+            destBytes[di++] = uint8_t(0xF0 | (ch >> 18));
+            destBytes[di++] = uint8_t(0x80 | ((ch >> 12) & 0x3F));
+            destBytes[di++] = uint8_t(0x80 | ((ch >> 6) & 0x3F));
+            destBytes[di++] = uint8_t(0x80 | (ch & 0x3F));
+            break;
+        }
+        si = nextSi;
+    }
+
+    return di;
+}
+
+
+size_t GetUtf8Length(
+    __in_ecount(sourceCount) const wchar_t* sourceChars,
+    __in size_t sourceCount
+    ) throw()
+{
+    size_t si = 0, length = 0;
+    while (si < sourceCount)
+    {
+        #if UNICODE_CONVERSION_USE_SSE2
+        if (sourceCount - si >= 8)
+        {
+            __m128i units = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceChars[si]));
+            __m128i nonAscii = _mm_and_si128(units, _mm_set1_epi16(short(0xFF80)));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(nonAscii, _mm_setzero_si128())) == 0xFFFF)
+            {
+                si += 8;
+                length += 8;
+                continue;
+            }
+        }
+        #endif
+
+        char32_t ch = ReadUtf16CodePoint(sourceChars, sourceCount, IN OUT si);
+        length += IsSurrogate(ch) ? 3 : GetUtf8CodePointLength(ch);
+    }
+
+    return length;
+}
+
+
+void ConvertUtf16BigEndianToNative(
+    __in_bcount(sourceCount * 2) const uint8_t* sourceBytes,
+    __in size_t sourceCount,
+    __out_ecount(sourceCount) wchar_t* destChars
+    ) throw()
+{
+    size_t i = 0;
+
+    #if UNICODE_CONVERSION_USE_SSE2
+    for ( ; sourceCount - i >= 8; i += 8)
+    {
+        __m128i units = _mm_loadu_si128(reinterpret_cast<__m128i const*>(&sourceBytes[i * 2]));
+        units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&destChars[i]), units);
+    }
+    #endif
+
+    for ( ; i < sourceCount; ++i)
+    {
+        destChars[i] = wchar_t((sourceBytes[i * 2] << 8) | sourceBytes[i * 2 + 1]);
+    }
+}
+
+
 struct UnicodeCharacterReader
 {
     const wchar_t* current;
@@ -83,6 +83,42 @@ size_t ConvertUtf32ToUtf16(
     ) throw();
 
 
+// Invalid UTF-8 sequences become U+FFFD. The destination never needs more
+// code units than the source has bytes.
+__out_range(0, return)
+size_t ConvertUtf8ToUtf16(
+    __in_ecount(sourceCount) const char* sourceChars,
+    __in size_t sourceCount,
+    __out_ecount_part(destMax,return) wchar_t* destChars,
+    __in size_t destMax
+    ) throw();
+
+
+// Unpaired surrogates become U+FFFD. Size the destination with GetUtf8Length.
+__out_range(0, return)
+size_t ConvertUtf16ToUtf8(
+    __in_ecount(sourceCount) const wchar_t* sourceChars,
+    __in size_t sourceCount,
+    __out_ecount_part(destMax,return) char* destChars,
+    __in size_t destMax
+    ) throw();
+
+
+size_t GetUtf8Length(
+    __in_ecount(sourceCount) const wchar_t* sourceChars,
+    __in size_t sourceCount
+    ) throw();
+
+
+// Swaps big endian UTF-16 (as stored in OpenType tables) to native order.
+// The source need not be aligned.
+void ConvertUtf16BigEndianToNative(
+    __in_bcount(sourceCount * 2) const uint8_t* sourceBytes,
+    __in size_t sourceCount,
+    __out_ecount(sourceCount) wchar_t* destChars
+    ) throw();
+
+
 bool IsCharacterSimple(char32_t ch);
 bool IsStringSimple(
     __in_ecount(textLength) const wchar_t* text,
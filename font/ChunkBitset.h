@@ -0,0 +1,206 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Bitset of the downloaded chunks of a remote font file.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// One bit per chunk, in 64-bit words so that a whole word can be tested or
+// atomically updated at once. The words are not owned, so that the stream
+// can keep them in the mapped view of its chunk map file.
+class ChunkBitset
+{
+public:
+    static uint32_t GetWordCount(uint32_t chunkCount) throw()
+    {
+        return (chunkCount + 63) / 64;
+    }
+
+
+    void Attach(uint64_t volatile* words, uint32_t chunkCount) throw()
+    {
+        words_ = words;
+        chunkCount_ = chunkCount;
+    }
+
+
+    void Detach() throw()
+    {
+        words_ = nullptr;
+        chunkCount_ = 0;
+    }
+
+
+    uint32_t GetChunkCount() const throw()
+    {
+        return chunkCount_;
+    }
+
+
+    // Clears the bits, then sets those of the nonzero bytes of a map from
+    // before the bitset, which used one byte per chunk.
+    void ReadByteMap(array_ref<uint8_t const> byteMap) throw()
+    {
+        memset(const_cast<uint64_t*>(words_), 0, GetWordCount(chunkCount_) * sizeof(uint64_t));
+        for (uint32_t chunkIndex = 0, ci = static_cast<uint32_t>(std::min(byteMap.size(), size_t(chunkCount_))); chunkIndex < ci; ++chunkIndex)
+        {
+            if (byteMap[chunkIndex])
+                words_[chunkIndex / 64] |= uint64_t(1) << (chunkIndex % 64);
+        }
+    }
+
+
+    // Returns the mask of the chunks in [lowChunkIndex, highChunkIndex) that
+    // fall within the given word.
+    static uint64_t GetChunkWordMask(uint32_t wordIndex, uint32_t lowChunkIndex, uint32_t highChunkIndex) throw()
+    {
+        uint32_t const wordLowChunkIndex = wordIndex * 64;
+        uint32_t const lowBit = std::max(lowChunkIndex, wordLowChunkIndex) - wordLowChunkIndex;
+        uint32_t const highBit = std::min(highChunkIndex - wordLowChunkIndex, 64u);
+        uint64_t const highMask = (highBit >= 64) ? ~uint64_t(0) : (uint64_t(1) << highBit) - 1;
+        return highMask & ~((uint64_t(1) << lowBit) - 1);
+    }
+
+
+    bool IsChunkPresent(uint32_t chunkIndex) const throw()
+    {
+        return chunkIndex < chunkCount_ && (words_[chunkIndex / 64] & (uint64_t(1) << (chunkIndex % 64))) != 0;
+    }
+
+
+    // Finds the first chunk in [lowChunkIndex, highChunkIndex) that has not
+    // been downloaded yet.
+    bool FindFirstMissingChunk(
+        uint32_t lowChunkIndex,
+        uint32_t highChunkIndex,
+        _Out_ uint32_t& missingChunkIndex
+        ) const throw()
+    {
+        return FindFirstChunk(lowChunkIndex, highChunkIndex, /*isPresent*/ false, OUT missingChunkIndex);
+    }
+
+
+    bool FindFirstPresentChunk(
+        uint32_t lowChunkIndex,
+        uint32_t highChunkIndex,
+        _Out_ uint32_t& presentChunkIndex
+        ) const throw()
+    {
+        return FindFirstChunk(lowChunkIndex, highChunkIndex, /*isPresent*/ true, OUT presentChunkIndex);
+    }
+
+
+    // Finds the first chunk in [lowChunkIndex, highChunkIndex) that is present
+    // or missing, testing 64 chunks per word. Without one, the chunk index is
+    // set to highChunkIndex.
+    bool FindFirstChunk(
+        uint32_t lowChunkIndex,
+        uint32_t highChunkIndex,
+        bool isPresent,
+        _Out_ uint32_t& chunkIndex
+        ) const throw()
+    {
+        chunkIndex = highChunkIndex;
+        highChunkIndex = std::min(highChunkIndex, chunkCount_);
+        if (lowChunkIndex >= highChunkIndex)
+            return false;
+
+        for (uint32_t wordIndex = lowChunkIndex / 64, highWordIndex = GetWordCount(highChunkIndex); wordIndex < highWordIndex; ++wordIndex)
+        {
+            uint64_t const chunkWord = isPresent ? words_[wordIndex] : ~words_[wordIndex];
+            uint64_t const matchingChunks = chunkWord & GetChunkWordMask(wordIndex, lowChunkIndex, highChunkIndex);
+            unsigned long bitIndex;
+            if (GetLowestSetBit(matchingChunks, OUT bitIndex))
+            {
+                chunkIndex = wordIndex * 64 + bitIndex;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+
+    uint32_t CountPresentChunks() const throw()
+    {
+        uint32_t presentChunkCount = 0;
+        for (uint32_t wordIndex = 0, wordCount = GetWordCount(chunkCount_); wordIndex < wordCount; ++wordIndex)
+        {
+            presentChunkCount += GetSetBitCount(words_[wordIndex]);
+        }
+        return presentChunkCount;
+    }
+
+
+    // Bytes of the file held by the present chunks, where the last chunk may
+    // be short.
+    uint64_t GetPresentByteCount(uint32_t chunkSize, uint64_t fileSize) const throw()
+    {
+        uint64_t presentByteCount = uint64_t(CountPresentChunks()) * chunkSize;
+        if (chunkCount_ > 0 && IsChunkPresent(chunkCount_ - 1))
+        {
+            presentByteCount -= uint64_t(chunkCount_) * chunkSize - fileSize;
+        }
+        return presentByteCount;
+    }
+
+
+    // Sets the chunks' bits, one interlocked OR per word so that concurrent
+    // downloads of neighboring chunks do not lose each other's bits. Returns
+    // the range of words touched, for the caller to flush, which is empty
+    // when no chunk was in range.
+    void MarkChunksPresent(
+        uint32_t lowChunkIndex,
+        uint32_t highChunkIndex,
+        _Out_ uint32_t& lowWordIndex,
+        _Out_ uint32_t& highWordIndex
+        ) throw()
+    {
+        lowWordIndex = highWordIndex = 0;
+        highChunkIndex = std::min(highChunkIndex, chunkCount_);
+        if (lowChunkIndex >= highChunkIndex)
+            return;
+
+        lowWordIndex = lowChunkIndex / 64;
+        highWordIndex = GetWordCount(highChunkIndex);
+        for (uint32_t wordIndex = lowWordIndex; wordIndex < highWordIndex; ++wordIndex)
+        {
+            InterlockedOr64(
+                reinterpret_cast<LONG64 volatile*>(&words_[wordIndex]),
+                static_cast<LONG64>(GetChunkWordMask(wordIndex, lowChunkIndex, highChunkIndex))
+                );
+        }
+    }
+
+
+    // The 64-bit bit scan and population count intrinsics only exist on 64-bit
+    // targets, so 32-bit builds combine the two halves.
+    static bool GetLowestSetBit(uint64_t value, _Out_ unsigned long& bitIndex) throw()
+    {
+    #if defined(_M_X64) || defined(_M_ARM64)
+        return _BitScanForward64(OUT &bitIndex, value) != 0;
+    #else
+        if (_BitScanForward(OUT &bitIndex, static_cast<uint32_t>(value)))
+            return true;
+        if (!_BitScanForward(OUT &bitIndex, static_cast<uint32_t>(value >> 32)))
+            return false;
+        bitIndex += 32;
+        return true;
+    #endif
+    }
+
+
+    static uint32_t GetSetBitCount(uint64_t value) throw()
+    {
+    #if defined(_M_X64) || defined(_M_ARM64)
+        return static_cast<uint32_t>(__popcnt64(value));
+    #else
+        return __popcnt(static_cast<uint32_t>(value)) + __popcnt(static_cast<uint32_t>(value >> 32));
+    #endif
+    }
+
+protected:
+    uint64_t volatile* words_ = nullptr;
+    uint32_t chunkCount_ = 0;
+};
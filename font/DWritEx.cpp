@@ -686,13 +686,756 @@ HRESULT GetLocalizedString(
 }
 
 
-bool IsKnownFontFileExtension(_In_z_ const wchar_t* fileExtension) throw()
+namespace
 {
-    return (_wcsicmp(fileExtension, L".otf") == 0
-        ||  _wcsicmp(fileExtension, L".ttf") == 0
-        ||  _wcsicmp(fileExtension, L".ttc") == 0
-        ||  _wcsicmp(fileExtension, L".tte") == 0
-            );
+    const uint32_t sfntOffsetTableSize = 12;
+    const uint32_t sfntTableRecordSize = 16;
+    const uint32_t collectionHeaderSize = 12;
+    const uint32_t woffHeaderSize = 44;
+    const uint32_t woffTableRecordSize = 20;
+    const uint32_t woff2HeaderSize = 48;
+
+    inline uint32_t MakeFileTag(char a, char b, char c, char d) throw()
+    {
+        return (uint32_t(uint8_t(a)) << 24) | (uint32_t(uint8_t(b)) << 16) | (uint32_t(uint8_t(c)) << 8) | uint32_t(uint8_t(d));
+    }
+
+
+    // Big endian reads, returning zero past the end of the data.
+    inline uint16_t ReadFileUint16(array_ref<uint8_t const> data, uint64_t offset) throw()
+    {
+        if (offset > data.size() || data.size() - offset < 2)
+            return 0;
+
+        uint8_t const* p = &data[size_t(offset)];
+        return uint16_t((p[0] << 8) | p[1]);
+    }
+
+
+    inline uint32_t ReadFileUint32(array_ref<uint8_t const> data, uint64_t offset) throw()
+    {
+        if (offset > data.size() || data.size() - offset < 4)
+            return 0;
+
+        uint8_t const* p = &data[size_t(offset)];
+        return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+    }
+
+
+    FontFileFormat GetSfntFormat(uint32_t version) throw()
+    {
+        if (version == 0x00010000 || version == MakeFileTag('t','r','u','e'))
+            return FontFileFormatTrueType;
+        if (version == MakeFileTag('O','T','T','O'))
+            return FontFileFormatOpenTypeCff;
+        return FontFileFormatUnknown;
+    }
+
+
+    // Checks the sfnt table directory at the offset. The directory itself must
+    // fit in the file, and each table record that was read must point within
+    // it. Records past the end of the header are not checked.
+    bool IsValidSfntDirectory(
+        array_ref<uint8_t const> fileHeader,
+        uint64_t fileSize,
+        uint64_t directoryOffset,
+        _Out_ FontFileFormat& fileFormat
+        ) throw()
+    {
+        fileFormat = GetSfntFormat(ReadFileUint32(fileHeader, directoryOffset));
+        if (fileFormat == FontFileFormatUnknown)
+            return false;
+
+        uint32_t const tableCount = ReadFileUint16(fileHeader, directoryOffset + 4);
+        if (tableCount == 0 || directoryOffset + sfntOffsetTableSize + uint64_t(tableCount) * sfntTableRecordSize > fileSize)
+            return false;
+
+        for (uint32_t i = 0; i < tableCount; ++i)
+        {
+            uint64_t const recordOffset = directoryOffset + sfntOffsetTableSize + uint64_t(i) * sfntTableRecordSize;
+            if (recordOffset + sfntTableRecordSize > fileHeader.size())
+                break;
+
+            uint64_t const tableOffset = ReadFileUint32(fileHeader, recordOffset + 8);
+            uint64_t const tableLength = ReadFileUint32(fileHeader, recordOffset + 12);
+            if (tableOffset + tableLength > fileSize)
+                return false;
+        }
+        return true;
+    }
+}
+
+
+FontFileFormat GetFontFileFormat(
+    array_ref<uint8_t const> fileHeader,
+    uint64_t fileSize
+    ) throw()
+{
+    if (fileHeader.size() < sfntOffsetTableSize || fileHeader.size() > fileSize)
+        return FontFileFormatUnknown;
+
+    FontFileFormat fileFormat;
+    uint32_t const signature = ReadFileUint32(fileHeader, 0);
+
+    if (signature == MakeFileTag('t','t','c','f'))
+    {
+        // Each font offset must leave room for an offset table, and the first
+        // font (which normally directly follows the header) must be valid.
+        uint32_t const fontCount = ReadFileUint32(fileHeader, 8);
+        if (fontCount == 0 || collectionHeaderSize + uint64_t(fontCount) * sizeof(uint32_t) > fileSize)
+            return FontFileFormatUnknown;
+
+        for (uint32_t i = 0; i < fontCount; ++i)
+        {
+            uint64_t const entryOffset = collectionHeaderSize + uint64_t(i) * sizeof(uint32_t);
+            if (entryOffset + sizeof(uint32_t) > fileHeader.size())
+                break;
+
+            uint64_t const directoryOffset = ReadFileUint32(fileHeader, entryOffset);
+            if (directoryOffset + sfntOffsetTableSize > fileSize)
+                return FontFileFormatUnknown;
+
+            if (i == 0
+            &&  directoryOffset + sfntOffsetTableSize <= fileHeader.size()
+            &&  !IsValidSfntDirectory(fileHeader, fileSize, directoryOffset, OUT fileFormat))
+            {
+                return FontFileFormatUnknown;
+            }
+        }
+        return FontFileFormatCollection;
+    }
+
+    if (signature == MakeFileTag('w','O','F','F') || signature == MakeFileTag('w','O','F','2'))
+    {
+        // The flavor is the version of the wrapped font, and the length field
+        // is the total file size. WOFF2 table records are variable length and
+        // hold no offsets, so only WOFF's are checked.
+        bool const isWoff2 = (signature == MakeFileTag('w','O','F','2'));
+        uint32_t const flavor = ReadFileUint32(fileHeader, 4);
+        uint32_t const tableCount = ReadFileUint16(fileHeader, 12);
+        uint64_t const headerSize = isWoff2 ? woff2HeaderSize : woffHeaderSize;
+
+        if (GetSfntFormat(flavor) == FontFileFormatUnknown && flavor != MakeFileTag('t','t','c','f'))
+            return FontFileFormatUnknown;
+        if (ReadFileUint32(fileHeader, 8) != fileSize || tableCount == 0 || headerSize > fileHeader.size())
+            return FontFileFormatUnknown;
+        if (isWoff2)
+            return FontFileFormatWoff2;
+
+        if (woffHeaderSize + uint64_t(tableCount) * woffTableRecordSize > fileSize)
+            return FontFileFormatUnknown;
+
+        for (uint32_t i = 0; i < tableCount; ++i)
+        {
+            uint64_t const recordOffset = woffHeaderSize + uint64_t(i) * woffTableRecordSize;
+            if (recordOffset + woffTableRecordSize > fileHeader.size())
+                break;
+
+            uint64_t const tableOffset = ReadFileUint32(fileHeader, recordOffset + 4);
+            uint64_t const compressedLength = ReadFileUint32(fileHeader, recordOffset + 8);
+            if (tableOffset + compressedLength > fileSize)
+                return FontFileFormatUnknown;
+        }
+        return FontFileFormatWoff;
+    }
+
+    if (!IsValidSfntDirectory(fileHeader, fileSize, 0, OUT fileFormat))
+        return FontFileFormatUnknown;
+
+    return fileFormat;
+}
+
+
+HRESULT GetFontFileFormats(
+    array_ref<wchar_t const* const> filePaths,
+    OUT std::vector<FontFileFormat>& fileFormats
+    )
+{
+    TraceSpan traceSpan(L"GetFontFileFormats");
+
+    // Keep a bounded number of files open, since a directory can have many.
+    const size_t maximumPendingReadCount = 64;
+
+    struct PendingRead
+    {
+        FileHandle file;
+        OVERLAPPED overlapped;
+        uint64_t fileSize;
+        bool isPending;
+    };
+
+    try
+    {
+        fileFormats.assign(filePaths.size(), FontFileFormatUnknown);
+        std::vector<PendingRead> pendingReads(maximumPendingReadCount);
+        std::vector<uint8_t> buffers(maximumPendingReadCount * FontFileFormatHeaderSize);
+
+        for (size_t batchIndex = 0; batchIndex < filePaths.size(); batchIndex += maximumPendingReadCount)
+        {
+            size_t batchCount = filePaths.size() - batchIndex;
+            if (batchCount > maximumPendingReadCount)
+                batchCount = maximumPendingReadCount;
+
+            // Issue all the reads first, then wait on them.
+            for (size_t i = 0; i < batchCount; ++i)
+            {
+                auto& pendingRead = pendingReads[i];
+                pendingRead.isPending = false;
+
+                HANDLE file = CreateFile(
+                    filePaths[batchIndex + i],
+                    GENERIC_READ,
+                    FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                    nullptr,
+                    OPEN_EXISTING,
+                    FILE_FLAG_OVERLAPPED,
+                    nullptr
+                    );
+                if (file == INVALID_HANDLE_VALUE)
+                    continue;
+
+                pendingRead.file = file;
+
+                LARGE_INTEGER fileSize;
+                if (!GetFileSizeEx(file, OUT &fileSize))
+                    continue;
+
+                pendingRead.fileSize = fileSize.QuadPart;
+                ZeroStructure(pendingRead.overlapped);
+                if (ReadFile(file, &buffers[i * FontFileFormatHeaderSize], FontFileFormatHeaderSize, nullptr, &pendingRead.overlapped)
+                ||  GetLastError() == ERROR_IO_PENDING)
+                {
+                    pendingRead.isPending = true;
+                }
+            }
+
+            for (size_t i = 0; i < batchCount; ++i)
+            {
+                auto& pendingRead = pendingReads[i];
+                DWORD bytesRead = 0;
+                if (pendingRead.isPending
+                &&  GetOverlappedResult(pendingRead.file, &pendingRead.overlapped, OUT &bytesRead, true))
+                {
+                    array_ref<uint8_t const> fileHeader(&buffers[i * FontFileFormatHeaderSize], bytesRead);
+                    fileFormats[batchIndex + i] = GetFontFileFormat(fileHeader, pendingRead.fileSize);
+                }
+                pendingRead.file.clear();
+            }
+        }
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
+}
+
+
+HRESULT WriteFontSetManifestEntry(
+    JsonexWriter& writer,
+    FontSetManifestEntry const& entry
+    )
+{
+    auto writeKeyValue = [&](_In_z_ wchar_t const* keyName, std::wstring const& value, bool isNumber) -> HRESULT
+    {
+        IFR(writer.BeginKey(keyName));
+        IFR(isNumber
+            ? writer.WriteValueNumber(value.c_str(), static_cast<uint32_t>(value.size()))
+            : writer.WriteValueString(value.c_str(), static_cast<uint32_t>(value.size())));
+        return writer.EndScope();
+    };
+
+    auto writeLocalizedName = [&](_In_z_ wchar_t const* keyName, std::wstring const& value) -> HRESULT
+    {
+        IFR(writer.BeginObject(keyName));
+        IFR(writeKeyValue(L"en-us", value, /*isNumber*/ false));
+        return writer.EndScope();
+    };
+
+    wchar_t faceIndex[12];
+    swprintf_s(faceIndex, L"%u", entry.faceIndex);
+
+    IFR(writer.BeginObject());
+    IFR(writeKeyValue(L"Path", entry.filePath, /*isNumber*/ false));
+    IFR(writeKeyValue(L"FaceIndex", faceIndex, /*isNumber*/ true));
+    IFR(writeLocalizedName(L"FullName", entry.fullName));
+    IFR(writeLocalizedName(L"WssFamilyName", entry.wssFamilyName));
+    IFR(writeKeyValue(L"Weight", entry.weight, /*isNumber*/ !entry.weight.empty()));
+    IFR(writeKeyValue(L"Stretch", entry.stretch, /*isNumber*/ !entry.stretch.empty()));
+    IFR(writeKeyValue(L"Slope", entry.slope, /*isNumber*/ !entry.slope.empty()));
+    IFR(writer.EndScope());
+
+    return S_OK;
+}
+
+
+namespace
+{
+    HRESULT ParseFontSetManifest(
+        array_ref<wchar_t const> text,
+        OUT TextTree& nodes
+        )
+    {
+        // Escapes must be decoded, since the paths contain backslashes.
+        JsonexParser parser(text.data(), static_cast<uint32_t>(text.size()), TextTreeParser::OptionsDefault);
+        parser.ReadNodes(IN OUT nodes);
+        if (parser.GetErrorCount() > 0)
+            return E_INVALIDARG;
+
+        return S_OK;
+    }
+
+
+    HRESULT ReadFontSetManifestNodes(
+        TextTree const& nodes,
+        OUT std::vector<FontSetManifestEntry>& entries
+        )
+    {
+        uint32_t nodeIndex = 0;
+        if (!nodes.AdvanceChildNode(IN OUT nodeIndex) // Skip the root node.
+        ||  nodes.GetNode(nodeIndex).type != TextTree::Node::TypeArray)
+        {
+            return E_INVALIDARG;
+        }
+
+        if (!nodes.AdvanceChildNode(IN OUT nodeIndex))
+            return S_OK; // Empty array.
+
+        try
+        {
+            FontSetManifestEntry entry;
+            std::wstring value;
+            uint32_t subnodeIndex;
+
+            do
+            {
+                if (nodes.GetNode(nodeIndex).type != TextTree::Node::TypeObject
+                ||  !nodes.GetKeyValue(nodeIndex, L"Path", OUT entry.filePath)
+                ||  entry.filePath.empty())
+                {
+                    continue;
+                }
+
+                entry.faceIndex = 0;
+                if (nodes.GetKeyValue(nodeIndex, L"FaceIndex", OUT value))
+                {
+                    entry.faceIndex = static_cast<uint32_t>(wcstoul(value.c_str(), nullptr, 10));
+                }
+
+                entry.fullName.clear();
+                entry.wssFamilyName.clear();
+                if (nodes.FindKey(nodeIndex, L"FullName", OUT subnodeIndex))
+                {
+                    nodes.GetKeyValue(subnodeIndex, L"en-us", OUT entry.fullName);
+                }
+                if (nodes.FindKey(nodeIndex, L"WssFamilyName", OUT subnodeIndex))
+                {
+                    nodes.GetKeyValue(subnodeIndex, L"en-us", OUT entry.wssFamilyName);
+                }
+                nodes.GetKeyValue(nodeIndex, L"Weight", OUT entry.weight);
+                nodes.GetKeyValue(nodeIndex, L"Stretch", OUT entry.stretch);
+                nodes.GetKeyValue(nodeIndex, L"Slope", OUT entry.slope);
+
+                entries.push_back(entry);
+            } while (nodes.AdvanceNextNode(IN OUT nodeIndex));
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
+    }
+}
+
+
+HRESULT ReadFontSetManifest(
+    array_ref<wchar_t const> text,
+    OUT std::vector<FontSetManifestEntry>& entries
+    )
+{
+    TraceSpan traceSpan(L"ReadFontSetManifest");
+
+    entries.clear();
+
+    TextTree nodes;
+    IFR(ParseFontSetManifest(text, OUT nodes));
+
+    return ReadFontSetManifestNodes(nodes, OUT entries);
+}
+
+
+HRESULT ReadFontSetManifestData(
+    const_byte_array_ref fileData,
+    OUT std::vector<FontSetManifestEntry>& entries
+    )
+{
+    TraceSpan traceSpan(L"ReadFontSetManifestData");
+
+    entries.clear();
+
+    TextTree nodes;
+    if (TextTree::IsBinary(fileData))
+    {
+        IFR(nodes.ReadBinary(fileData));
+    }
+    else
+    {
+        std::wstring text;
+        try
+        {
+            ConvertText(array_ref<char const>(reinterpret_cast<char const*>(fileData.data()), fileData.size()), OUT text);
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+        IFR(ParseFontSetManifest(text, OUT nodes));
+    }
+
+    return ReadFontSetManifestNodes(nodes, OUT entries);
+}
+
+
+HRESULT ReadFontSetManifestFile(
+    _In_z_ wchar_t const* fileName,
+    OUT std::vector<FontSetManifestEntry>& entries
+    )
+{
+    entries.clear();
+
+    // Copy out of the view before parsing, so a read error on the media
+    // only fails the copy.
+    MappedFile mappedFile;
+    std::vector<uint8_t> fileData;
+    IFR(mappedFile.Open(fileName));
+    IFR(mappedFile.ReadAllData(OUT fileData));
+
+    return ReadFontSetManifestData(fileData, OUT entries);
+}
+
+
+HRESULT WriteFontSetManifestBinary(
+    array_ref<wchar_t const> text,
+    OUT std::vector<uint8_t>& data
+    )
+{
+    TraceSpan traceSpan(L"WriteFontSetManifestBinary");
+
+    data.clear();
+
+    TextTree nodes;
+    IFR(ParseFontSetManifest(text, OUT nodes));
+
+    return nodes.WriteBinary(OUT data);
+}
+
+
+void FontNameCatalog::clear()
+{
+    strings_.clear();
+    records_.clear();
+    fonts_.clear();
+    fontIndices_.clear();
+    stringOffsetsByHash_.clear();
+}
+
+
+void FontNameCatalog::SetPreferredLanguage(_In_opt_z_ wchar_t const* languageName)
+{
+    preferredLanguageId_ = 0;
+    if (languageName != nullptr)
+    {
+        preferredLanguageId_ = static_cast<uint16_t>(LocaleNameToLCID(languageName, 0));
+    }
+}
+
+
+HRESULT FontNameCatalog::AddFont(
+    IDWriteFont* font,
+    OUT uint32_t& fontIndex
+    )
+{
+    fontIndex = 0;
+
+    auto match = fontIndices_.find(font);
+    if (match != fontIndices_.end())
+    {
+        fontIndex = match->second;
+        return S_OK;
+    }
+
+    ComPtr<IDWriteFontFace> fontFace;
+    IFR(font->CreateFontFace(OUT &fontFace));
+
+    const void* tableData;
+    uint32_t tableSize;
+    void* tableContext;
+    BOOL exists = false;
+    IFR(fontFace->TryGetFontTable(DWRITE_MAKE_OPENTYPE_TAG('n','a','m','e'), OUT &tableData, OUT &tableSize, OUT &tableContext, OUT &exists));
+    if (!exists)
+        return DWRITE_E_FILEFORMAT;
+
+    HRESULT hr = AddNameTable({ reinterpret_cast<uint8_t const*>(tableData), tableSize }, OUT fontIndex);
+    fontFace->ReleaseFontTable(tableContext);
+    IFR(hr);
+
+    try
+    {
+        fonts_[fontIndex].font = font;
+        fontIndices_.insert(std::pair<IDWriteFont*, uint32_t>(font, fontIndex));
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
+}
+
+
+HRESULT FontNameCatalog::AddNameTable(
+    array_ref<uint8_t const> nameTable,
+    OUT uint32_t& fontIndex
+    )
+{
+    fontIndex = 0;
+
+    const uint32_t headerSize = 6;
+    const uint32_t recordSize = 12;
+    const uint16_t licenseNameId = 13; // Long, and never shown.
+
+    uint32_t const recordCount = ReadFileUint16(nameTable, 2);
+    uint32_t const storageOffset = ReadFileUint16(nameTable, 4);
+    if (nameTable.size() < headerSize + recordCount * recordSize || storageOffset > nameTable.size())
+        return DWRITE_E_FILEFORMAT;
+
+    try
+    {
+        FontEntry fontEntry = { nullptr, static_cast<uint32_t>(records_.size()), 0 };
+
+        for (uint32_t i = 0; i < recordCount; ++i)
+        {
+            uint32_t const recordOffset = headerSize + i * recordSize;
+            uint16_t const platformId = ReadFileUint16(nameTable, recordOffset + 0);
+            uint16_t const encodingId = ReadFileUint16(nameTable, recordOffset + 2);
+            uint16_t const languageId = ReadFileUint16(nameTable, recordOffset + 4);
+            uint16_t const nameId     = ReadFileUint16(nameTable, recordOffset + 6);
+            uint32_t const length     = ReadFileUint16(nameTable, recordOffset + 8);
+            uint32_t const offset     = ReadFileUint16(nameTable, recordOffset + 10);
+
+            if (nameId == licenseNameId || storageOffset + offset + length > nameTable.size())
+                continue;
+
+            // Skip strings in encodings that cannot be decoded.
+            if (!DecodeString(platformId, encodingId, { nameTable.data() + storageOffset + offset, length }))
+                continue;
+
+            NameRecord record = { nameId, platformId, languageId, 0, static_cast<uint32_t>(decodedString_.size()) };
+            record.stringOffset = InternDecodedString();
+            records_.push_back(record);
+            ++fontEntry.recordCount;
+        }
+
+        fontIndex = static_cast<uint32_t>(fonts_.size());
+        fonts_.push_back(fontEntry);
+    }
+    catch (...)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    return S_OK;
+}
+
+
+array_ref<wchar_t const> FontNameCatalog::GetName(
+    uint32_t fontIndex,
+    uint16_t nameId
+    ) const throw()
+{
+    if (fontIndex >= fonts_.size())
+        return {};
+
+    // Rank Windows records in the preferred language, then in US English,
+    // then Macintosh English, then anything.
+    const uint16_t windowsPlatformId = 3;
+    const uint16_t macintoshPlatformId = 1;
+    const uint16_t windowsEnglishLanguageId = 0x0409;
+    const uint16_t macintoshEnglishLanguageId = 0;
+
+    auto const& fontEntry = fonts_[fontIndex];
+    NameRecord const* bestRecord = nullptr;
+    uint32_t bestRank = 0;
+
+    for (uint32_t i = 0; i < fontEntry.recordCount; ++i)
+    {
+        auto const& record = records_[fontEntry.firstRecordIndex + i];
+        if (record.nameId != nameId)
+            continue;
+
+        uint32_t rank = 1;
+        if (record.platformId == windowsPlatformId)
+        {
+            if (record.languageId == preferredLanguageId_)
+                rank = 4;
+            else if (record.languageId == windowsEnglishLanguageId)
+                rank = 3;
+        }
+        else if (record.platformId == macintoshPlatformId && record.languageId == macintoshEnglishLanguageId)
+        {
+            rank = 2;
+        }
+
+        if (rank > bestRank)
+        {
+            bestRecord = &record;
+            bestRank = rank;
+        }
+    }
+
+    if (bestRecord == nullptr)
+        return {};
+
+    return { strings_.data() + bestRecord->stringOffset, bestRecord->stringLength };
+}
+
+
+uint16_t FontNameCatalog::GetNameId(DWRITE_INFORMATIONAL_STRING_ID stringId) throw()
+{
+    switch (stringId)
+    {
+    case DWRITE_INFORMATIONAL_STRING_WIN32_FAMILY_NAMES:        return NameIdFamily;
+    case DWRITE_INFORMATIONAL_STRING_WIN32_SUBFAMILY_NAMES:     return NameIdSubfamily;
+    case DWRITE_INFORMATIONAL_STRING_FULL_NAME:                 return NameIdFullName;
+    case DWRITE_INFORMATIONAL_STRING_POSTSCRIPT_NAME:           return NameIdPostscriptName;
+    case DWRITE_INFORMATIONAL_STRING_PREFERRED_FAMILY_NAMES:    return NameIdTypographicFamily;
+    case DWRITE_INFORMATIONAL_STRING_PREFERRED_SUBFAMILY_NAMES: return NameIdTypographicSubfamily;
+    default:                                                    return 0;
+    }
+}
+
+
+// Decodes the string into decodedString_, returning false if the encoding
+// is not supported.
+bool FontNameCatalog::DecodeString(
+    uint16_t platformId,
+    uint16_t encodingId,
+    array_ref<uint8_t const> stringBytes
+    )
+{
+    decodedString_.clear();
+
+    uint32_t codePage = 0;
+    switch (platformId)
+    {
+    case 0: // Unicode
+        break;
+
+    case 1: // Macintosh
+        switch (encodingId)
+        {
+        case 0:  codePage = 10000; break; // Roman
+        case 1:  codePage = 10001; break; // Japanese
+        case 2:  codePage = 10002; break; // Traditional Chinese
+        case 3:  codePage = 10003; break; // Korean
+        case 25: codePage = 10008; break; // Simplified Chinese
+        default: return false;
+        }
+        break;
+
+    case 3: // Windows
+        switch (encodingId)
+        {
+        case 0:  case 1: case 10: break;  // Symbol, Unicode BMP, Unicode full
+        case 2:  codePage = 932;  break;  // ShiftJIS
+        case 3:  codePage = 936;  break;  // PRC
+        case 4:  codePage = 950;  break;  // Big5
+        case 5:  codePage = 949;  break;  // Wansung
+        case 6:  codePage = 1361; break;  // Johab
+        default: return false;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    if (codePage == 0)
+    {
+        decodedString_.resize(stringBytes.size() / 2);
+        ConvertUtf16BigEndianToNative(stringBytes.data(), decodedString_.size(), OUT decodedString_.data());
+        return true;
+    }
+
+    // Legacy Windows encodings store each byte of the multibyte string in a
+    // big endian 16-bit unit, so drop the zero high bytes first.
+    std::string multibyteString;
+    if (platformId == 3)
+    {
+        for (size_t i = 0; i + 1 < stringBytes.size(); i += 2)
+        {
+            if (stringBytes[i] != 0)
+                multibyteString.push_back(char(stringBytes[i]));
+            multibyteString.push_back(char(stringBytes[i + 1]));
+        }
+    }
+    else
+    {
+        multibyteString.assign(stringBytes.begin(), stringBytes.end());
+    }
+
+    // Plain ASCII needs no code page.
+    if (std::all_of(multibyteString.begin(), multibyteString.end(), [](char ch) -> bool { return uint8_t(ch) < 0x80; }))
+    {
+        decodedString_.assign(multibyteString.begin(), multibyteString.end());
+        return true;
+    }
+
+    decodedString_.resize(multibyteString.size());
+    int32_t charsConverted = MultiByteToWideChar(
+        codePage,
+        0,
+        multibyteString.data(),
+        int32_t(multibyteString.size()),
+        OUT decodedString_.data(),
+        int32_t(decodedString_.size())
+        );
+    if (charsConverted <= 0)
+        return false;
+
+    decodedString_.resize(charsConverted);
+    return true;
+}
+
+
+// Returns the offset of decodedString_ in the arena, appending it only if
+// not already present.
+uint32_t FontNameCatalog::InternDecodedString()
+{
+    uint32_t hash = 2166136261; // FNV-1a
+    for (wchar_t ch : decodedString_)
+    {
+        hash = (hash ^ ch) * 16777619;
+    }
+
+    size_t const length = decodedString_.size();
+    auto range = stringOffsetsByHash_.equal_range(hash);
+    for (auto match = range.first; match != range.second; ++match)
+    {
+        uint32_t const stringOffset = match->second;
+        if (strings_.size() - stringOffset >= length
+        &&  std::equal(decodedString_.begin(), decodedString_.end(), strings_.begin() + stringOffset))
+        {
+            return stringOffset;
+        }
+    }
+
+    uint32_t const stringOffset = static_cast<uint32_t>(strings_.size());
+    strings_.insert(strings_.end(), decodedString_.begin(), decodedString_.end());
+    stringOffsetsByHash_.insert(std::pair<uint32_t, uint32_t>(hash, stringOffset));
+    return stringOffset;
 }
 
 
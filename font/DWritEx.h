@@ -105,7 +105,182 @@ HRESULT GetLocalizedString(
     OUT std::wstring& value
     ) throw();
 
-bool IsKnownFontFileExtension(_In_z_ const wchar_t* fileExtension) throw();
+// Font file container formats, identified from the file contents.
+enum FontFileFormat
+{
+    FontFileFormatUnknown,          // Not a font, or truncated or corrupt.
+    FontFileFormatTrueType,         // sfnt with 0x00010000 or 'true' version.
+    FontFileFormatOpenTypeCff,      // sfnt with 'OTTO' version.
+    FontFileFormatCollection,       // 'ttcf'
+    FontFileFormatWoff,             // 'wOFF'
+    FontFileFormatWoff2,            // 'wOF2'
+};
+
+// Number of bytes from the start of the file read to identify it, enough to
+// cover the table directory of most fonts.
+const uint32_t FontFileFormatHeaderSize = 4096;
+
+// Identifies the format from the start of the file, checking that the table
+// directory (as much as is in the header) lies within the file size.
+FontFileFormat GetFontFileFormat(
+    array_ref<uint8_t const> fileHeader,
+    uint64_t fileSize
+    ) throw();
+
+// Reads the start of each file, with the reads of a batch of files issued
+// together so their latencies overlap, and identifies their formats. Files
+// that cannot be opened or read are reported as unknown.
+HRESULT GetFontFileFormats(
+    array_ref<wchar_t const* const> filePaths,
+    OUT std::vector<FontFileFormat>& fileFormats
+    );
+
+// Whether DirectWrite can load the format directly from a file reference.
+inline bool IsLoadableFontFileFormat(FontFileFormat fileFormat) throw()
+{
+    return fileFormat == FontFileFormatTrueType
+        || fileFormat == FontFileFormatOpenTypeCff
+        || fileFormat == FontFileFormatCollection;
+}
+
+// One font of a font set manifest, which lists local font files along with
+// the properties needed to build a font set without opening them:
+//
+//  [
+//    {
+//      "Path": "c:\\fonts\\arial.ttf",
+//      "FaceIndex": 0,
+//      "FullName": {"en-us": "Arial"},
+//      "WssFamilyName": {"en-us": "Arial"},
+//      "Weight": 400, "Stretch": 5, "Slope": 0
+//    }, ...
+//  ]
+//
+// Weight, stretch, and slope are kept as text, empty if unknown.
+struct FontSetManifestEntry
+{
+    std::wstring filePath;
+    uint32_t faceIndex;
+    std::wstring fullName;
+    std::wstring wssFamilyName;
+    std::wstring weight;
+    std::wstring stretch;
+    std::wstring slope;
+};
+
+// Writes one entry as an object, inside an array the caller has begun.
+HRESULT WriteFontSetManifestEntry(
+    JsonexWriter& writer,
+    FontSetManifestEntry const& entry
+    );
+
+// Reads all the entries of a manifest. Entries without a path are skipped.
+// Returns E_INVALIDARG if the text has syntax errors or is not an array.
+HRESULT ReadFontSetManifest(
+    array_ref<wchar_t const> text,
+    OUT std::vector<FontSetManifestEntry>& entries
+    );
+
+// Same, but from file contents which are either UTF-8 text or the parsed
+// tree snapshot from WriteFontSetManifestBinary. A snapshot is loaded
+// without tokenizing, which matters for catalogs of many thousands of fonts.
+HRESULT ReadFontSetManifestData(
+    const_byte_array_ref fileData,
+    OUT std::vector<FontSetManifestEntry>& entries
+    );
+
+// Reads a manifest file of either form through a mapped view.
+HRESULT ReadFontSetManifestFile(
+    _In_z_ wchar_t const* fileName,
+    OUT std::vector<FontSetManifestEntry>& entries
+    );
+
+// Parses the manifest text and writes the tree as a binary snapshot (see
+// TextTree::WriteBinary). Returns E_INVALIDARG if the text has syntax errors.
+HRESULT WriteFontSetManifestBinary(
+    array_ref<wchar_t const> text,
+    OUT std::vector<uint8_t>& data
+    );
+
+// Strings decoded directly from the OpenType 'name' tables of fonts. The
+// strings of all fonts added share one arena, with identical strings (such
+// as a family name repeated across faces and platforms) stored once. The
+// preferred language is resolved to a language id once, rather than matched
+// by name for every lookup.
+class FontNameCatalog
+{
+public:
+    enum NameId : uint16_t
+    {
+        NameIdFamily                = 1,
+        NameIdSubfamily             = 2,
+        NameIdFullName              = 4,
+        NameIdPostscriptName        = 6,
+        NameIdTypographicFamily     = 16,
+        NameIdTypographicSubfamily  = 17,
+    };
+
+    void clear();
+
+    void SetPreferredLanguage(_In_opt_z_ wchar_t const* languageName);
+
+    // Decodes the font's name table, or returns the existing index if the
+    // font was already added. Fails if the font has no name table.
+    HRESULT AddFont(
+        IDWriteFont* font,
+        OUT uint32_t& fontIndex
+        );
+
+    HRESULT AddNameTable(
+        array_ref<uint8_t const> nameTable,
+        OUT uint32_t& fontIndex
+        );
+
+    // Returns the name in the preferred language, else English, else the
+    // first one. Empty if the font has no such name.
+    array_ref<wchar_t const> GetName(
+        uint32_t fontIndex,
+        uint16_t nameId
+        ) const throw();
+
+    // Returns the name id for the informational string, or zero if it is
+    // not stored directly in the name table.
+    static uint16_t GetNameId(DWRITE_INFORMATIONAL_STRING_ID stringId) throw();
+
+protected:
+    struct NameRecord
+    {
+        uint16_t nameId;
+        uint16_t platformId;
+        uint16_t languageId;
+        uint32_t stringOffset;          // In strings_, not bytes.
+        uint32_t stringLength;
+    };
+
+    struct FontEntry
+    {
+        ComPtr<IDWriteFont> font;       // Null if added by table.
+        uint32_t firstRecordIndex;
+        uint32_t recordCount;
+    };
+
+    bool DecodeString(
+        uint16_t platformId,
+        uint16_t encodingId,
+        array_ref<uint8_t const> stringBytes
+        );
+
+    uint32_t InternDecodedString();
+
+protected:
+    std::vector<wchar_t> strings_;
+    std::vector<NameRecord> records_;
+    std::vector<FontEntry> fonts_;
+    std::map<IDWriteFont*, uint32_t> fontIndices_;
+    std::multimap<uint32_t, uint32_t> stringOffsetsByHash_; // For deduplication.
+    std::vector<wchar_t> decodedString_;                    // Scratch for the string being added.
+    uint16_t preferredLanguageId_ = 0;
+};
 
 // Draw a text layout to a bitmap render target.
 HRESULT DrawTextLayout(
@@ -0,0 +1,137 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Priority queue of pending font downloads.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// Orders queued downloads by priority, and by when they were first queued
+// within a priority. Each key is queued at most once, so enqueuing it again
+// merges with the waiting entry, and a waiting entry can be moved to another
+// priority (as rows scroll in and out of view) or cancelled. Only the keys
+// are tracked, leaving what they refer to up to the caller.
+class DownloadScheduler
+{
+public:
+    enum Priority
+    {
+        PriorityVisible,            // Shown right now.
+        PriorityNearVisible,        // Likely shown soon, such as rows just past the scroll position.
+        PriorityBackground,         // Prefetch, whenever nothing else is waiting.
+        PriorityTotal,
+    };
+
+    typedef std::vector<uint8_t> Key;
+
+protected:
+    struct Entry
+    {
+        Priority priority;
+        uint64_t sequence;          // Order first queued, kept across priority changes.
+    };
+
+    typedef std::pair<uint32_t, uint64_t> OrderKey; // (priority, sequence)
+
+    std::map<Key, Entry> entries_;
+    std::map<OrderKey, Key const*> order_;  // Points to the keys in entries_.
+    uint64_t nextSequence_ = 0;
+
+public:
+    // Queues the key, or raises the priority of the waiting entry if the new
+    // one is higher. Returns true if the key was not already waiting.
+    bool Enqueue(Key const& key, Priority priority)
+    {
+        auto match = entries_.find(key);
+        if (match != entries_.end())
+        {
+            if (priority < match->second.priority)
+                Reorder(match, priority);
+            return false;
+        }
+
+        Entry entry = { priority, nextSequence_++ };
+        auto newEntry = entries_.insert(std::make_pair(key, entry)).first;
+        order_[GetOrderKey(entry)] = &newEntry->first;
+        return true;
+    }
+
+
+    // Moves a waiting entry to another priority, up or down. Returns false
+    // if the key is not waiting.
+    bool SetPriority(Key const& key, Priority priority)
+    {
+        auto match = entries_.find(key);
+        if (match == entries_.end())
+            return false;
+
+        Reorder(match, priority);
+        return true;
+    }
+
+
+    // Removes a waiting entry. Returns false if the key is not waiting.
+    bool Cancel(Key const& key)
+    {
+        auto match = entries_.find(key);
+        if (match == entries_.end())
+            return false;
+
+        order_.erase(GetOrderKey(match->second));
+        entries_.erase(match);
+        return true;
+    }
+
+
+    // Removes and returns the highest priority, oldest entry.
+    bool Dequeue(_Out_ Key& key)
+    {
+        if (order_.empty())
+            return false;
+
+        auto next = order_.begin();
+        key = *next->second;
+        order_.erase(next);
+        entries_.erase(key);
+        return true;
+    }
+
+
+    bool IsQueued(Key const& key) const
+    {
+        return entries_.find(key) != entries_.end();
+    }
+
+
+    size_t size() const throw()
+    {
+        return entries_.size();
+    }
+
+
+    bool empty() const throw()
+    {
+        return entries_.empty();
+    }
+
+
+    void clear()
+    {
+        order_.clear();
+        entries_.clear();
+    }
+
+protected:
+    static OrderKey GetOrderKey(Entry const& entry) throw()
+    {
+        return OrderKey(entry.priority, entry.sequence);
+    }
+
+
+    void Reorder(std::map<Key, Entry>::iterator match, Priority priority)
+    {
+        order_.erase(GetOrderKey(match->second));
+        match->second.priority = priority;
+        order_[GetOrderKey(match->second)] = &match->first;
+    }
+};
@@ -1,24 +1,64 @@
-#include "../precomp.inc"
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Remote font files, downloaded in ranges over HTTP into a
+//              sparse file cache, and the queue that schedules them.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
 #include <WinHttp.h>
 #include <WinIoCtl.h>
+#include <bcrypt.h>
+#include <deque>
+#include <memory>
+#include "ChunkBitset.h"
+#include "DownloadScheduler.h"
+#include "FontDownloader.h"
+#include "LruCachePolicy.h"
+#include "OpenTypeFileReader.h"
+#include "RangeDownloadPlanner.h"
 
 using InternetHandle = AutoResource<HINTERNET, HandleResourceTypePolicy<HINTERNET, BOOL(WINAPI*)(HINTERNET), &WinHttpCloseHandle> >;
 
 
 class InternetDownloader
 {
+public:
+    // WinHttp's own limit on sockets per server, shared by every downloader.
+    static const uint32_t maximumConnectionsPerServer = 6;
+
 protected:
-    InternetHandle internetSession_;
+    HINTERNET internetSession_ = nullptr; // The shared session, not owned.
     InternetHandle internetConnection_;
     InternetHandle internetRequest_;
+    std::wstring connectedServerName_;
+    INTERNET_PORT connectedServerPort_ = 0;
+
+    static InternetHandle sharedInternetSession_;
+    static SRWLOCK sharedInternetSessionLock_;
 
 public:
+    // Where a URL's server is, as cracked from the URL. The port is the
+    // scheme's default unless the URL names one.
+    struct ServerAddress
+    {
+        std::wstring hostName;
+        INTERNET_PORT port;
+        bool isSecure;                  // https
+    };
+
+    // All downloaders share one session. WinHttp pools the sockets of a
+    // session by server and keeps them alive between requests, so each new
+    // downloader reuses an open connection instead of paying for TCP setup.
     HRESULT EnsureInternetSession()
     {
-        if (internetSession_ == nullptr)
+        if (internetSession_ != nullptr)
+            return S_OK;
+
+        ExclusiveLockScope lockScope(sharedInternetSessionLock_);
+        if (sharedInternetSession_ == nullptr)
         {
             // Use WinHttpOpen to obtain a session handle.
-            internetSession_ =
+            sharedInternetSession_ =
                 WinHttpOpen(L"FontSetViewer Test Application 1.0",
                     WINHTTP_ACCESS_TYPE_DEFAULT_PROXY,
                     WINHTTP_NO_PROXY_NAME,
@@ -26,20 +66,61 @@ public:
                     0       
                     );
 
-            if (internetSession_ == nullptr)
+            if (sharedInternetSession_ == nullptr)
                 return HRESULT_FROM_WIN32(GetLastError());
+
+            unsigned long maximumConnections = maximumConnectionsPerServer;
+            WinHttpSetOption(sharedInternetSession_, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &maximumConnections, sizeof(maximumConnections));
+            WinHttpSetOption(sharedInternetSession_, WINHTTP_OPTION_MAX_CONNS_PER_1_0_SERVER, &maximumConnections, sizeof(maximumConnections));
         }
+        internetSession_ = sharedInternetSession_;
+
+        return S_OK;
+    }
+
+
+    // Connects to the server, keeping the existing connection if it is to
+    // the same one. Whether requests are secure is chosen per request.
+    HRESULT EnsureInternetConnection(ServerAddress const& server)
+    {
+        IFR(EnsureInternetSession());
 
+        if (internetConnection_ != nullptr && connectedServerName_ == server.hostName && connectedServerPort_ == server.port)
+            return S_OK;
+
+        internetRequest_.clear();
+        connectedServerName_.clear();
+        connectedServerPort_ = 0;
+
+        // Specify an HTTP server.
+        internetConnection_ =
+            WinHttpConnect(
+                internetSession_,
+                server.hostName.c_str(),
+                server.port,
+                0 // reserved
+                );
+
+        if (internetConnection_ == nullptr)
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        connectedServerName_ = server.hostName;
+        connectedServerPort_ = server.port;
         return S_OK;
     }
 
 
     static HRESULT GetServerAndFilePathFromUrl(
         std::wstring const& url,
-        _Out_ std::wstring& serverName,
+        _Out_ ServerAddress& server,
         _Out_ std::wstring& filePath
         )
     {
+        server.hostName.clear();
+        server.port = 0;
+        server.isSecure = false;
+        filePath.clear();
+
         URL_COMPONENTS urlComponents = {};
         urlComponents.dwStructSize = sizeof(urlComponents);
         urlComponents.dwHostNameLength = (unsigned long)-1;
@@ -48,27 +129,56 @@ public:
         if (!WinHttpCrackUrl(url.c_str(), static_cast<unsigned long>(url.size()), 0, OUT &urlComponents))
             return HRESULT_FROM_WIN32(GetLastError());
 
-        serverName.reserve(urlComponents.dwHostNameLength);
+        if (urlComponents.nScheme != INTERNET_SCHEME_HTTP && urlComponents.nScheme != INTERNET_SCHEME_HTTPS)
+            return HRESULT_FROM_WIN32(ERROR_WINHTTP_UNRECOGNIZED_SCHEME);
+
+        server.hostName.reserve(urlComponents.dwHostNameLength);
         filePath.reserve(urlComponents.dwUrlPathLength);
 
-        serverName.assign(urlComponents.lpszHostName, urlComponents.lpszHostName + urlComponents.dwHostNameLength);
+        server.hostName.assign(urlComponents.lpszHostName, urlComponents.lpszHostName + urlComponents.dwHostNameLength);
+        server.port = urlComponents.nPort;
+        server.isSecure = (urlComponents.nScheme == INTERNET_SCHEME_HTTPS);
         filePath.assign(urlComponents.lpszUrlPath, urlComponents.lpszUrlPath + urlComponents.dwUrlPathLength);
 
         return S_OK;
     }
 
 
+    // Names the server for pooling its connections, "https://host:443". The
+    // scheme and port are part of it, since a plain connection cannot serve
+    // a secure request, nor one port's connection another port's.
+    static HRESULT GetServerKeyFromUrl(
+        std::wstring const& url,
+        _Out_ std::wstring& serverKey
+        )
+    {
+        serverKey.clear();
+
+        ServerAddress server;
+        std::wstring filePath;
+        IFR(GetServerAndFilePathFromUrl(url, OUT server, OUT filePath));
+
+        serverKey.assign(server.isSecure ? L"https://" : L"http://");
+        serverKey.append(server.hostName);
+        AppendFormattedString(IN OUT serverKey, L":%u", server.port);
+
+        return S_OK;
+    }
+
+
     void clear()
     {
         internetRequest_.clear();
         internetConnection_.clear();
-        internetSession_.clear();
+        connectedServerName_.clear();
+        connectedServerPort_ = 0;
+        internetSession_ = nullptr; // Shared, so left open for the others.
     }
 
 
-    HRESULT VerifySuccessStatusCode()
+    HRESULT GetStatusCode(_Out_ uint32_t& statusCode)
     {
-        uint32_t statusCode = 0;
+        statusCode = 0;
         unsigned long bufferByteLength = sizeof(statusCode);
         if (!WinHttpQueryHeaders(
             internetRequest_,
@@ -82,6 +192,85 @@ public:
             return HRESULT_FROM_WIN32(GetLastError());
         }
 
+        return S_OK;
+    }
+
+
+    HRESULT QueryHeaderString(
+        uint32_t infoLevel, // WINHTTP_QUERY_*
+        _Out_ std::wstring& value
+        )
+    {
+        value.clear();
+
+        // Ask for the size first, which is returned in bytes.
+        unsigned long bufferByteLength = 0;
+        WinHttpQueryHeaders(internetRequest_, infoLevel, WINHTTP_HEADER_NAME_BY_INDEX, WINHTTP_NO_OUTPUT_BUFFER, IN OUT &bufferByteLength, WINHTTP_NO_HEADER_INDEX);
+        auto lastError = GetLastError();
+        if (lastError != ERROR_INSUFFICIENT_BUFFER)
+            return HRESULT_FROM_WIN32(lastError);
+
+        value.resize(bufferByteLength / sizeof(wchar_t));
+        if (!WinHttpQueryHeaders(internetRequest_, infoLevel, WINHTTP_HEADER_NAME_BY_INDEX, OUT &value[0], IN OUT &bufferByteLength, WINHTTP_NO_HEADER_INDEX))
+        {
+            value.clear();
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        value.resize(bufferByteLength / sizeof(wchar_t));
+
+        return S_OK;
+    }
+
+
+    // Parses the value of a Content-Range header, "bytes 0-50/1270", into
+    // the half-open range [0, 51).
+    template <typename CharType>
+    static bool ParseContentRange(
+        _In_reads_(textLength) CharType const* text,
+        size_t textLength,
+        _Out_ uint64_t& begin,
+        _Out_ uint64_t& end
+        )
+    {
+        begin = 0;
+        end = 0;
+
+        CharType const* textEnd = text + textLength;
+        auto skipSpaces = [&]() { while (text < textEnd && *text == ' ') ++text; };
+        auto readNumber = [&](_Out_ uint64_t& value) -> bool
+        {
+            value = 0;
+            CharType const* numberStart = text;
+            for (; text < textEnd && *text >= '0' && *text <= '9'; ++text)
+            {
+                value = value * 10 + (*text - '0');
+            }
+            return text > numberStart;
+        };
+
+        skipSpaces();
+        const char unitName[] = "bytes";
+        for (size_t i = 0; i < ARRAYSIZE(unitName) - 1; ++i, ++text)
+        {
+            if (text >= textEnd || (*text | 0x20) != unitName[i])
+                return false;
+        }
+        skipSpaces();
+
+        uint64_t last;
+        if (!readNumber(OUT begin) || text >= textEnd || *text++ != '-' || !readNumber(OUT last) || last < begin)
+            return false;
+
+        end = last + 1;
+        return true;
+    }
+
+
+    HRESULT VerifySuccessStatusCode()
+    {
+        uint32_t statusCode = 0;
+        IFR(GetStatusCode(OUT statusCode));
+
         // Accept any informational or successful status codes, but not errors or redirects.
         if (statusCode < 100 || statusCode >= 300)
             return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
@@ -94,26 +283,10 @@ public:
         std::wstring const& url
         )
     {
-        std::wstring serverName;
+        ServerAddress server;
         std::wstring filePath;
-        IFR(GetServerAndFilePathFromUrl(url, OUT serverName, OUT filePath));
-
-        IFR(EnsureInternetSession());
-
-        // Specify an HTTP server.
-        if (internetConnection_ == nullptr)
-        {
-            internetConnection_ =
-                WinHttpConnect(
-                    internetSession_,
-                    serverName.c_str(),
-                    INTERNET_DEFAULT_HTTP_PORT, // INTERNET_DEFAULT_HTTPS_PORT
-                    0 // reserved
-                    );
-
-            if (internetConnection_ == nullptr)
-                return HRESULT_FROM_WIN32(GetLastError());
-        }
+        IFR(GetServerAndFilePathFromUrl(url, OUT server, OUT filePath));
+        IFR(EnsureInternetConnection(server));
 
         // Create an HTTP request handle.
         internetRequest_ =
@@ -124,7 +297,7 @@ public:
                 NULL, // Version, use HTTP 1.1
                 WINHTTP_NO_REFERER, 
                 WINHTTP_DEFAULT_ACCEPT_TYPES, 
-                0 // WINHTTP_FLAG_SECURE
+                server.isSecure ? WINHTTP_FLAG_SECURE : 0
                 );
         if (internetRequest_ == nullptr)
             return HRESULT_FROM_WIN32(GetLastError());
@@ -138,13 +311,36 @@ public:
         uint64_t fragmentSize
         )
     {
-        // Send a request.
+        // If the range is anything except the entire file, request a specific range.
+        if (fileOffset != 0 || fragmentSize != UINT64_MAX)
+        {
+            Range range = { fileOffset, fileOffset + fragmentSize };
+            return SendDownloadRequest({ &range, 1 });
+        }
+
+        return SendDownloadRequest(array_ref<Range const>());
+    }
+
+
+    HRESULT SendDownloadRequest(array_ref<Range const> ranges)
+    {
+        // Send a request, for the entire file if no ranges are given. More
+        // than one range makes a multi-range request.
         // Range: bytes=1073152-64313343
+        // Range: bytes=0-1023,8192-12287
         std::wstring additionalHeader;
-        if (fileOffset != 0 || fragmentSize != UINT64_MAX)
+        if (!ranges.empty())
         {
-            // If the range is anything except the entire file, request a specific range.
-            GetFormattedString(OUT additionalHeader, L"Range: bytes=%lld-%lld", fileOffset, fileOffset + fragmentSize - 1);
+            additionalHeader.assign(L"Range: bytes=");
+            for (auto const& range : ranges)
+            {
+                if (&range != ranges.data())
+                    additionalHeader.push_back(',');
+
+                additionalHeader.append(std::to_wstring(range.begin));
+                additionalHeader.push_back('-');
+                additionalHeader.append(std::to_wstring(range.end - 1));
+            }
         }
 
         if (!WinHttpSendRequest(
@@ -173,6 +369,8 @@ public:
         _Out_ std::vector<uint8_t>& buffer
         )
     {
+        TraceSpan traceSpan(L"InternetDownloader::DownloadFile");
+
         // This function only works with small enough files that fit into memory.
 
         IFR(PrepareDownloadRequest(url));
@@ -242,6 +440,47 @@ public:
     }
 
 
+    // Reads the response body into the vector, stopping after at most
+    // maximumSize bytes.
+    HRESULT DownloadRequestIntoVector(
+        uint64_t maximumSize,
+        _Out_ std::vector<uint8_t>& buffer
+        )
+    {
+        buffer.clear();
+
+        try
+        {
+            unsigned long bytesAvailable = 0;
+            do
+            {
+                bytesAvailable = 0;
+                if (!WinHttpQueryDataAvailable(internetRequest_, OUT &bytesAvailable))
+                    return HRESULT_FROM_WIN32(GetLastError());
+
+                if (bytesAvailable > maximumSize - buffer.size())
+                    bytesAvailable = static_cast<unsigned long>(maximumSize - buffer.size());
+
+                size_t const oldSize = buffer.size();
+                buffer.resize(oldSize + bytesAvailable);
+
+                unsigned long bytesRead = 0;
+                if (bytesAvailable > 0 && !WinHttpReadData(internetRequest_, OUT &buffer[oldSize], bytesAvailable, OUT &bytesRead))
+                    return HRESULT_FROM_WIN32(GetLastError());
+
+                buffer.resize(oldSize + bytesRead);
+
+            } while (bytesAvailable > 0 && buffer.size() < maximumSize);
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
+    }
+
+
     HRESULT GetFileSizeAndDate(
         std::wstring const& url,
         _Out_ uint64_t& fileSize,
@@ -251,23 +490,10 @@ public:
         fileSize = 0;
         fileTime = {0};
 
-        IFR(EnsureInternetSession());
-
-        std::wstring serverName;
+        ServerAddress server;
         std::wstring filePath;
-        IFR(GetServerAndFilePathFromUrl(url, OUT serverName, OUT filePath));
-
-        // Specify an HTTP server.
-        internetConnection_ =
-            WinHttpConnect(
-                internetSession_,
-                serverName.c_str(),
-                INTERNET_DEFAULT_HTTP_PORT, // INTERNET_DEFAULT_HTTPS_PORT
-                0 // reserved
-                );
-
-        if (internetConnection_ == nullptr)
-            return HRESULT_FROM_WIN32(GetLastError());
+        IFR(GetServerAndFilePathFromUrl(url, OUT server, OUT filePath));
+        IFR(EnsureInternetConnection(server));
 
         // Create an HTTP request handle.
         internetRequest_ =
@@ -278,7 +504,7 @@ public:
                 nullptr, // Version, use HTTP 1.1
                 WINHTTP_NO_REFERER,
                 WINHTTP_DEFAULT_ACCEPT_TYPES,
-                0 // WINHTTP_FLAG_SECURE
+                server.isSecure ? WINHTTP_FLAG_SECURE : 0
                 );
 
         if (internetRequest_ == nullptr)
@@ -289,7 +515,7 @@ public:
                 WINHTTP_NO_ADDITIONAL_HEADERS, 0,
                 WINHTTP_NO_REQUEST_DATA, 0,
                 0, // totalLength
-                NULL // context
+                0 // context
                 ))
         {
             return HRESULT_FROM_WIN32(GetLastError());
@@ -336,181 +562,1716 @@ public:
     }
 };
 
+InternetHandle InternetDownloader::sharedInternetSession_;
+SRWLOCK InternetDownloader::sharedInternetSessionLock_ = SRWLOCK_INIT;
 
-interface RemoteFontFileStreamInterfaceBinding : public IDWriteRemoteFontFileStream
+
+// Byte range of a file to read into memory.
+struct RangeRequest
 {
+    uint64_t fileOffset;
+    uint64_t fragmentSize;
+    uint8_t* buffer;            // Receives the bytes, and must stay valid until completion.
 };
 
-class RemoteFontFileStream : public ComBase<RemoteFontFileStreamInterfaceBinding>
+
+// A single persistent connection to one server, able to read byte ranges of
+// files on it, one request at a time.
+class RangeConnection
 {
 public:
-    static const uint64_t chunkSize_ = 16384;
+    virtual ~RangeConnection()
+    { }
+
+    // Reads one or more ranges of the file in a single request. The bytes
+    // read count, per range, how much of the start of it arrived.
+    virtual HRESULT DownloadRanges(
+        std::wstring const& url,
+        array_ref<RangeRequest const> ranges,
+        _Out_writes_(ranges.size()) uint64_t* bytesActuallyRead
+        ) = 0;
 
+    // Reads the file's size and last modified date.
+    virtual HRESULT GetFileInformation(
+        std::wstring const& url,
+        _Out_ uint64_t& fileSize,
+        _Out_ FILETIME& fileTime
+        ) = 0;
+};
+
+
+// Creates connections for the download engine. The HTTP transport sits
+// behind this so that the engine can be driven by something other than
+// WinHttp, such as a canned local server.
+class RangeTransport
+{
+public:
+    virtual ~RangeTransport()
+    { }
+
+    virtual HRESULT CreateConnection(
+        std::wstring const& serverName,
+        _Out_ std::unique_ptr<RangeConnection>& connection
+        ) = 0;
+};
+
+
+class InternetRangeConnection : public RangeConnection
+{
 protected:
-    std::wstring url_;
-    std::wstring fileName_;
-    std::vector<uint8_t> chunkMap_;
-    ComPtr<IDWriteFontDownloadQueue> downloadManager_; // optionally null
-    ComPtr<IDWriteFontFileLoader> fontFileLoader_;
-    uint64_t fileSize_ = 0;
-    uint8_t* streamMemory_ = nullptr;
-    FileHandle fileHandle_;
-    FileHandle chunkMapFileHandle_;
+    // The downloader keeps its connection handle across requests, and
+    // WinHttp keeps the socket alive underneath it.
     InternetDownloader internetDownloader_;
 
-protected:
-    IFACEMETHODIMP QueryInterface(IID const& iid, __out void** object) OVERRIDE
+    // Allowance for the part headers and boundaries of a multipart response.
+    static const uint64_t multipartOverheadPerRange = 512;
+
+public:
+    HRESULT GetFileInformation(
+        std::wstring const& url,
+        _Out_ uint64_t& fileSize,
+        _Out_ FILETIME& fileTime
+        ) override
     {
-        COM_BASE_RETURN_INTERFACE(iid, IDWriteRemoteFontFileStream, object);
-        COM_BASE_RETURN_INTERFACE(iid, IDWriteFontFileStream, object);
-        COM_BASE_RETURN_INTERFACE_AMBIGUOUS(iid, IUnknown, object, static_cast<IDWriteRemoteFontFileStream*>(this));
-        COM_BASE_RETURN_NO_INTERFACE(object);
+        return internetDownloader_.GetFileSizeAndDate(url, OUT fileSize, OUT fileTime);
     }
 
-public:
-    RemoteFontFileStream()
-    { }
 
-    HRESULT Initialize(
-        const wchar_t* url,
-        IDWriteFontDownloadQueue* downloadManager,
-        IDWriteFontFileLoader* fontFileLoader
-        )
+    HRESULT DownloadRanges(
+        std::wstring const& url,
+        array_ref<RangeRequest const> ranges,
+        _Out_writes_(ranges.size()) uint64_t* bytesActuallyRead
+        ) override
     {
-        if (url == nullptr)
-            return E_INVALIDARG;
-
-        downloadManager_ = downloadManager;
-        fontFileLoader_ = fontFileLoader;
-        streamMemory_ = nullptr;
-        url_ = url;
+        std::fill(bytesActuallyRead, bytesActuallyRead + ranges.size(), 0);
+        if (ranges.empty())
+            return S_OK;
 
-        // Create the file name from the URL.
-        // Just use a simple munging to underscores for invalid characters.
-        GetFileNameFromUrl(url_, OUT fileName_);
+        TraceSpan traceSpan(L"InternetRangeConnection::DownloadRanges");
 
-        fileHandle_ = CreateFile(
-            fileName_.c_str(),
-            GENERIC_READ | GENERIC_WRITE,
-            FILE_SHARE_READ | FILE_SHARE_WRITE,
-            nullptr,
-            OPEN_EXISTING,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr
-            );
+        IFR(internetDownloader_.PrepareDownloadRequest(url));
 
-        if (fileHandle_ == INVALID_HANDLE_VALUE)
+        // A single range is read straight into its buffer.
+        if (ranges.size() == 1)
         {
-            auto lastError = GetLastError();
-            if (lastError == ERROR_FILE_NOT_FOUND || lastError == ERROR_PATH_NOT_FOUND)
-            {
-                if (downloadManager_ != nullptr)
-                {
-                    // downloadManager_->EnqueueFileFragmentDownload(
-                    //     fontFileLoader_,
-                    //     url_.c_str(),
-                    //     (url_.size() + 1) * sizeof(url_[0]),
-                    //     0, // fileOffset,
-                    //     0 // fragmentSize
-                    //     );
-                }
-
-                return DWRITE_E_REMOTEFONT;
-            }
-            return HRESULT_FROM_WIN32(GetLastError());
+            auto const& range = ranges.front();
+            IFR(internetDownloader_.SendDownloadRequest(range.fileOffset, range.fragmentSize));
+            IFR(internetDownloader_.DownloadRequestIntoBuffer(range.buffer, range.fragmentSize, OUT bytesActuallyRead[0]));
+            return S_OK;
         }
 
-        // Do not change the file time upon writes, leaving it the same as the
-        // original server time, since later writes are just partial hydration
-        // rather than actual meaningful content changes.
-        FILETIME fileTime = { 0xFFFFFFFF, 0xFFFFFFFF };
-        SetFileTime(fileHandle_, nullptr, &fileTime, &fileTime);
-
-        LARGE_INTEGER fileSize;
-        ::GetFileSizeEx(fileHandle_, OUT &fileSize);
-        fileSize_ = fileSize.QuadPart;
-        auto numberOfChunks = static_cast<uint32_t>((fileSize_ + chunkSize_ - 1) / chunkSize_);
-        chunkMap_.resize(numberOfChunks);
+        // Otherwise send a multi-range request. The server may answer with a
+        // multipart body, a single part covering everything, or just the
+        // whole file, so read the body and then distribute it.
+        std::vector<Range> httpRanges;
+        uint64_t totalRangeSize = 0;
+        uint64_t lastRangeEnd = 0;
+        for (auto const& range : ranges)
+        {
+            Range httpRange = { range.fileOffset, range.fileOffset + range.fragmentSize };
+            httpRanges.push_back(httpRange);
+            totalRangeSize += range.fragmentSize;
+            lastRangeEnd = std::max(lastRangeEnd, httpRange.end);
+        }
+        IFR(internetDownloader_.SendDownloadRequest(httpRanges));
 
-        // Allocate space for later file reads, equal to the file size.
-        streamMemory_ = reinterpret_cast<uint8_t*>(malloc(size_t(fileSize_)));
-        if (streamMemory_ == nullptr)
-            return HRESULT_FROM_WIN32(E_OUTOFMEMORY); // This is the only exception type we need to worry about.
+        uint32_t statusCode = 0;
+        IFR(internetDownloader_.GetStatusCode(OUT statusCode));
 
-        // Read the initial file contents into memory.
-        ReadFile(fileHandle_, OUT &streamMemory_[0], static_cast<uint32_t>(fileSize_), nullptr, nullptr);
+        std::wstring contentType;
+        internetDownloader_.QueryHeaderString(WINHTTP_QUERY_CONTENT_TYPE, OUT contentType);
+        std::string boundary;
+        bool const isMultipart = (statusCode == 206) && GetMultipartBoundary(contentType, OUT boundary);
 
-        // Read the chunk map in too.
-        std::wstring chunkMapFileName = fileName_;
-        chunkMapFileName.append(L"_ChunkMap");
-        chunkMapFileHandle_ = CreateFile(
-            chunkMapFileName.c_str(),
-            GENERIC_READ | GENERIC_WRITE,
-            FILE_SHARE_READ | FILE_SHARE_WRITE,
-            nullptr,
-            OPEN_ALWAYS,
-            FILE_ATTRIBUTE_NORMAL,
-            nullptr
-            );
-        if (chunkMapFileHandle_ == INVALID_HANDLE_VALUE)
+        std::vector<uint8_t> body;
+        if (isMultipart)
         {
-            return HRESULT_FROM_WIN32(GetLastError());
+            IFR(internetDownloader_.DownloadRequestIntoVector(totalRangeSize + multipartOverheadPerRange * (ranges.size() + 1), OUT body));
+            DistributeMultipartBody(body, boundary, ranges, bytesActuallyRead);
+        }
+        else if (statusCode == 206)
+        {
+            uint64_t contentBegin, contentEnd;
+            std::wstring contentRange;
+            IFR(internetDownloader_.QueryHeaderString(WINHTTP_QUERY_CONTENT_RANGE, OUT contentRange));
+            if (!InternetDownloader::ParseContentRange(contentRange.data(), contentRange.size(), OUT contentBegin, OUT contentEnd))
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+
+            IFR(internetDownloader_.DownloadRequestIntoVector(contentEnd - contentBegin, OUT body));
+            DistributeResponseSpan(contentBegin, body, ranges, bytesActuallyRead);
+        }
+        else
+        {
+            // The whole file came back. Only read as far as needed.
+            IFR(internetDownloader_.DownloadRequestIntoVector(lastRangeEnd, OUT body));
+            DistributeResponseSpan(0, body, ranges, bytesActuallyRead);
         }
-        ReadFile(chunkMapFileHandle_, OUT chunkMap_.data(), static_cast<uint32_t>(chunkMap_.size()), nullptr, nullptr);
 
         return S_OK;
     }
 
 
-    ~RemoteFontFileStream()
+    static bool GetMultipartBoundary(
+        std::wstring const& contentType,
+        _Out_ std::string& boundary
+        )
     {
-        free(streamMemory_);
-    }
+        // Content-Type: multipart/byteranges; boundary=3d6b6a416f9b5
+        boundary.clear();
+        const wchar_t multipartType[] = L"multipart/byteranges";
+        const wchar_t boundaryName[] = L"boundary=";
+        if (_wcsnicmp(contentType.c_str(), multipartType, ARRAYSIZE(multipartType) - 1) != 0)
+            return false;
+
+        auto boundaryStart = contentType.find(boundaryName);
+        if (boundaryStart == std::wstring::npos)
+            return false;
+
+        boundaryStart += ARRAYSIZE(boundaryName) - 1;
+        bool const isQuoted = (boundaryStart < contentType.size() && contentType[boundaryStart] == '"');
+        boundaryStart += isQuoted;
+
+        for (size_t i = boundaryStart, ci = contentType.size(); i < ci; ++i)
+        {
+            wchar_t ch = contentType[i];
+            if (isQuoted ? (ch == '"') : (ch == ';' || ch == ' '))
+                break;
 
+            boundary.push_back(char(ch)); // Boundaries are restricted to ASCII.
+        }
 
-    static void GetCachedFontFilesPath(_Out_ std::wstring& cachePath)
-    {
-        cachePath.resize(MAX_PATH + 1);
-        auto fileNameStartingIndex = GetTempPath(MAX_PATH + 1, OUT &cachePath[0]);
-        cachePath.resize(fileNameStartingIndex);
+        return !boundary.empty();
     }
 
 
-    static void GetFileNameFromUrl(std::wstring const& url, _Inout_ std::wstring& fileName)
+    static void DistributeMultipartBody(
+        std::vector<uint8_t> const& body,
+        std::string const& boundary,
+        array_ref<RangeRequest const> ranges,
+        _Inout_updates_(ranges.size()) uint64_t* bytesActuallyRead
+        )
     {
-        GetCachedFontFilesPath(OUT fileName);
+        // Each part is a delimiter line, headers, a blank line, and then the
+        // bytes named by its Content-Range header:
+        //
+        //      --3d6b6a416f9b5
+        //      Content-Type: application/octet-stream
+        //      Content-Range: bytes 0-50/1270
+        //
+        //      <51 bytes>
+        //      --3d6b6a416f9b5--
+        //
+        std::string delimiter("--");
+        delimiter.append(boundary);
+        const char headerEnd[] = "\r\n\r\n";
+        const char contentRangeName[] = "content-range:";
+
+        auto bodyEnd = body.end();
+        auto position = body.begin();
+        for (;;)
+        {
+            position = std::search(position, bodyEnd, delimiter.begin(), delimiter.end());
+            if (position == bodyEnd)
+                break;
+
+            position += delimiter.size();
+            if (bodyEnd - position >= 2 && position[0] == '-' && position[1] == '-')
+                break; // Closing delimiter.
+
+            auto partHeadersEnd = std::search(position, bodyEnd, headerEnd, headerEnd + ARRAYSIZE(headerEnd) - 1);
+            if (partHeadersEnd == bodyEnd)
+                break;
 
-        // Grab the file name from the URL.
-        // Just use a simple munging to underscores for invalid characters.
-        const size_t filePrefixLength = 11; // 'CachedFont_'
-        auto fileNameStartingIndex = fileName.size();
-        fileNameStartingIndex += filePrefixLength;
-        fileName.append(L"CachedFont_", filePrefixLength);
-        fileName.append(FindFileNameStart(url.c_str(), url.c_str() + url.size()));
-        for (size_t i = fileNameStartingIndex, ci = fileName.size(); i < ci; ++i)
-        {
-            auto c = fileName[i];
-            switch (c)
+            // Find the Content-Range among the part headers.
+            uint64_t contentBegin = 0, contentEnd = 0;
+            bool haveContentRange = false;
+            for (auto line = position; line < partHeadersEnd; )
             {
-            case '/':
-            case '\\':
-            case '?':
-            case '*':
-            case ':':
-                fileName[i] = '_';
+                auto lineEnd = std::find(line, partHeadersEnd, '\n');
+                size_t const lineLength = lineEnd - line;
+                size_t const nameLength = ARRAYSIZE(contentRangeName) - 1;
+                if (lineLength > nameLength && _strnicmp(reinterpret_cast<char const*>(&*line), contentRangeName, nameLength) == 0)
+                {
+                    haveContentRange = InternetDownloader::ParseContentRange(
+                        reinterpret_cast<char const*>(&*line) + nameLength,
+                        lineLength - nameLength,
+                        OUT contentBegin,
+                        OUT contentEnd
+                        );
+                }
+                line = (lineEnd == partHeadersEnd) ? lineEnd : lineEnd + 1;
+            }
+
+            position = partHeadersEnd + ARRAYSIZE(headerEnd) - 1;
+            if (!haveContentRange)
+                continue;
+
+            // Clip the data to whatever arrived.
+            uint64_t const partLength = std::min(contentEnd - contentBegin, uint64_t(bodyEnd - position));
+            if (partLength > 0)
+            {
+                DistributeResponseSpan(contentBegin, { &*position, size_t(partLength) }, ranges, bytesActuallyRead);
+                position += size_t(partLength);
+            }
+        }
+    }
+
+
+    // Copies the bytes of the file at spanBegin into every requested range
+    // overlapping it, extending each range's count of contiguous bytes read.
+    static void DistributeResponseSpan(
+        uint64_t spanBegin,
+        const_byte_array_ref span,
+        array_ref<RangeRequest const> ranges,
+        _Inout_updates_(ranges.size()) uint64_t* bytesActuallyRead
+        )
+    {
+        if (span.empty())
+            return;
+
+        uint64_t const spanEnd = spanBegin + span.size();
+        for (size_t i = 0, ci = ranges.size(); i < ci; ++i)
+        {
+            auto const& range = ranges[i];
+            uint64_t const rangeEnd = range.fileOffset + range.fragmentSize;
+            uint64_t const overlapBegin = std::max(spanBegin, range.fileOffset);
+            uint64_t const overlapEnd = std::min(spanEnd, rangeEnd);
+            if (overlapBegin >= overlapEnd)
+                continue;
+
+            memcpy(
+                range.buffer + (overlapBegin - range.fileOffset),
+                span.data() + (overlapBegin - spanBegin),
+                size_t(overlapEnd - overlapBegin)
+                );
+
+            if (overlapBegin <= range.fileOffset + bytesActuallyRead[i])
+            {
+                bytesActuallyRead[i] = std::max(bytesActuallyRead[i], overlapEnd - range.fileOffset);
+            }
+        }
+    }
+};
+
+
+class InternetRangeTransport : public RangeTransport
+{
+public:
+    HRESULT CreateConnection(
+        std::wstring const& serverName,
+        _Out_ std::unique_ptr<RangeConnection>& connection
+        ) override
+    {
+        try
+        {
+            connection.reset(new InternetRangeConnection());
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+        return S_OK;
+    }
+};
+
+
+// Downloads byte ranges concurrently on the system thread pool, using a
+// bounded set of persistent connections per server. Requests for the same
+// server are queued and picked up by whichever connection frees up first,
+// so several ranges are in flight at once while connections are reused
+// rather than reopened per request.
+class RangeDownloadEngine
+{
+public:
+    // Called on a thread pool thread once the request is read or has failed,
+    // with the bytes read for each of its ranges.
+    typedef std::function<void(HRESULT hr, array_ref<uint64_t const> bytesActuallyRead)> CompletionCallback;
+
+    static const uint32_t defaultConnectionsPerServer = InternetDownloader::maximumConnectionsPerServer;
+
+    // Idle connections older than this are closed rather than reused, since
+    // the server has likely dropped its end by then.
+    static const uint64_t idleConnectionTimeout = 30000000; // Microseconds
+
+    struct Statistics
+    {
+        uint64_t completedRequestCount;
+        uint64_t failedRequestCount;
+        uint64_t bytesDownloaded;
+        uint64_t totalLatency;      // Sum of enqueue to completion times, in microseconds.
+        uint64_t maximumLatency;    // In microseconds.
+        uint64_t busyTime;          // Wall time with at least one request outstanding, in microseconds.
+    };
+
+protected:
+    struct FileInformation
+    {
+        uint64_t fileSize;
+        FILETIME fileTime;
+    };
+
+    struct PendingRequest
+    {
+        std::wstring url;
+        std::vector<RangeRequest> ranges;
+        CompletionCallback callback;
+        uint64_t enqueueTime;
+        FileInformation* fileInformation; // If set, reads this instead of ranges.
+    };
+
+    struct IdleConnection
+    {
+        std::unique_ptr<RangeConnection> connection;
+        uint64_t idleStartTime;
+    };
+
+    struct Server
+    {
+        std::deque<PendingRequest> pendingRequests;
+        std::vector<IdleConnection> idleConnections; // Most recently used last.
+        uint32_t activeWorkerCount = 0;
+
+        // Smoothed estimates for the cost model, updated from each request's
+        // service time (excluding time spent queued).
+        uint64_t roundTripTime = RangeDownloadPlanner::defaultRoundTripTime;
+        uint64_t bytesPerSecond = RangeDownloadPlanner::defaultBytesPerSecond;
+    };
+
+    struct WorkerContext
+    {
+        RangeDownloadEngine* engine;
+        std::wstring serverName;
+    };
+
+    // Requests up to this size are dominated by the round trip, and larger
+    // ones by the bandwidth.
+    static const uint64_t roundTripSampleMaximumSize = 16384;
+    static const uint64_t bandwidthSampleMinimumSize = 65536;
+
+    SRWLOCK lock_ = SRWLOCK_INIT;
+    CONDITION_VARIABLE idleCondition_ = CONDITION_VARIABLE_INIT;
+    InternetRangeTransport defaultTransport_;
+    RangeTransport* transport_ = &defaultTransport_;
+    uint32_t maximumConnectionsPerServer_ = defaultConnectionsPerServer;
+    std::map<std::wstring, Server> servers_; // By InternetDownloader::GetServerKeyFromUrl.
+    uint32_t outstandingRequestCount_ = 0;
+    uint32_t activeWorkerCount_ = 0; // Across all servers. Each worker holds a pointer into servers_.
+    uint64_t busyStartTime_ = 0;
+    Statistics statistics_ = {};
+
+    static RangeDownloadEngine singleton_;
+
+public:
+    RangeDownloadEngine()
+    { }
+
+    ~RangeDownloadEngine()
+    {
+        ExclusiveLockScope lockScope(lock_);
+        WaitForWorkers();
+    }
+
+    static RangeDownloadEngine& GetInstance()
+    {
+        return singleton_;
+    }
+
+    // Replaces the transport and connection limit. Only call this while
+    // nothing is outstanding. Passing null restores the WinHttp transport.
+    void SetTransport(_In_opt_ RangeTransport* transport, uint32_t maximumConnectionsPerServer)
+    {
+        ExclusiveLockScope lockScope(lock_);
+        WaitForWorkers();
+        servers_.clear(); // Drop idle connections from the old transport.
+        transport_ = (transport != nullptr) ? transport : &defaultTransport_;
+        maximumConnectionsPerServer_ = std::max(maximumConnectionsPerServer, 1u);
+    }
+
+
+    // Returns the current cost model estimates for the server of the URL.
+    void GetCostModel(
+        std::wstring const& url,
+        _Out_ uint64_t& roundTripTime,
+        _Out_ uint64_t& bytesPerSecond
+        )
+    {
+        roundTripTime = RangeDownloadPlanner::defaultRoundTripTime;
+        bytesPerSecond = RangeDownloadPlanner::defaultBytesPerSecond;
+
+        std::wstring serverName;
+        if (FAILED(InternetDownloader::GetServerKeyFromUrl(url, OUT serverName)))
+            return;
+
+        ExclusiveLockScope lockScope(lock_);
+        auto match = servers_.find(serverName);
+        if (match != servers_.end())
+        {
+            roundTripTime = match->second.roundTripTime;
+            bytesPerSecond = match->second.bytesPerSecond;
+        }
+    }
+
+
+    // Enqueues a request for one or more ranges of the same file. Multiple
+    // ranges are sent as a single multi-range request.
+    HRESULT EnqueueRanges(
+        std::wstring const& url,
+        array_ref<RangeRequest const> ranges,
+        CompletionCallback const& callback
+        )
+    {
+        return EnqueueRequest(url, ranges, nullptr, callback);
+    }
+
+
+    // Reads the size and date of a file, sharing the pooled connections and
+    // per server limit with the range downloads, and waits for it.
+    HRESULT GetFileInformationAndWait(
+        std::wstring const& url,
+        _Out_ uint64_t& fileSize,
+        _Out_ FILETIME& fileTime
+        )
+    {
+        struct Waiter
+        {
+            SRWLOCK lock = SRWLOCK_INIT;
+            CONDITION_VARIABLE condition = CONDITION_VARIABLE_INIT;
+            bool isComplete = false;
+            HRESULT hr = S_OK;
+        } waiter;
+
+        FileInformation fileInformation = {};
+        auto callback = [&waiter](HRESULT hr, array_ref<uint64_t const> bytesRead) -> void
+        {
+            ExclusiveLockScope lockScope(waiter.lock);
+            waiter.hr = hr;
+            waiter.isComplete = true;
+            WakeAllConditionVariable(&waiter.condition);
+        };
+        IFR(EnqueueRequest(url, array_ref<RangeRequest const>(), &fileInformation, callback));
+
+        ExclusiveLockScope lockScope(waiter.lock);
+        while (!waiter.isComplete)
+        {
+            SleepConditionVariableSRW(&waiter.condition, &waiter.lock, INFINITE, 0);
+        }
+
+        fileSize = fileInformation.fileSize;
+        fileTime = fileInformation.fileTime;
+        return waiter.hr;
+    }
+
+protected:
+    HRESULT EnqueueRequest(
+        std::wstring const& url,
+        array_ref<RangeRequest const> ranges,
+        _In_opt_ FileInformation* fileInformation,
+        CompletionCallback const& callback
+        )
+    {
+        std::wstring serverName;
+        IFR(InternetDownloader::GetServerKeyFromUrl(url, OUT serverName));
+
+        bool shouldStartWorker = false;
+        try
+        {
+            ExclusiveLockScope lockScope(lock_);
+
+            const uint64_t enqueueTime = GetTimeInMicroseconds();
+            PendingRequest pendingRequest = { url, std::vector<RangeRequest>(ranges.begin(), ranges.end()), callback, enqueueTime, fileInformation };
+            auto& server = servers_[serverName];
+            server.pendingRequests.push_back(std::move(pendingRequest));
+
+            if (outstandingRequestCount_++ == 0)
+                busyStartTime_ = enqueueTime;
+
+            // Start another worker if the server is below its connection
+            // limit. Otherwise an existing worker will get to it.
+            if (server.activeWorkerCount < maximumConnectionsPerServer_)
+            {
+                ++server.activeWorkerCount;
+                ++activeWorkerCount_;
+                shouldStartWorker = true;
+            }
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        if (shouldStartWorker)
+        {
+            auto* workerContext = new(std::nothrow) WorkerContext{ this, serverName };
+            if (workerContext == nullptr || !TrySubmitThreadpoolCallback(&WorkerCallback, workerContext, nullptr))
+            {
+                // The request stays queued. If no other worker is serving the
+                // server, it is failed by the worker loop below on this thread.
+                delete workerContext;
+                RunWorker(serverName, /*shouldFailAll*/ true);
+            }
+        }
+
+        return S_OK;
+    }
+
+public:
+    // Downloads all the ranges concurrently and waits for all of them,
+    // returning the first failure if any. The ranges are partitioned into
+    // requests by requestRangeCounts (one request per range if empty). The
+    // bytes read for each range are returned in the same order.
+    HRESULT DownloadRangesAndWait(
+        std::wstring const& url,
+        array_ref<RangeRequest const> ranges,
+        array_ref<uint32_t const> requestRangeCounts,
+        _Out_ std::vector<uint64_t>& bytesActuallyRead
+        )
+    {
+        bytesActuallyRead.assign(ranges.size(), 0);
+        if (ranges.empty())
+            return S_OK;
+
+        struct WaitGroup
+        {
+            SRWLOCK lock = SRWLOCK_INIT;
+            CONDITION_VARIABLE condition = CONDITION_VARIABLE_INIT;
+            size_t remainingCount = 0;
+            HRESULT hr = S_OK;
+        } waitGroup;
+
+        for (size_t rangeIndex = 0, requestIndex = 0; rangeIndex < ranges.size(); ++requestIndex)
+        {
+            size_t rangeCount = (requestIndex < requestRangeCounts.size()) ? requestRangeCounts[requestIndex] : 1;
+            rangeCount = std::min(std::max(rangeCount, size_t(1)), ranges.size() - rangeIndex);
+
+            uint64_t* requestBytesRead = &bytesActuallyRead[rangeIndex];
+            auto callback = [&waitGroup, requestBytesRead](HRESULT hr, array_ref<uint64_t const> bytesRead) -> void
+            {
+                ExclusiveLockScope lockScope(waitGroup.lock);
+                std::copy(bytesRead.begin(), bytesRead.end(), requestBytesRead);
+                if (FAILED(hr) && SUCCEEDED(waitGroup.hr))
+                    waitGroup.hr = hr;
+                if (--waitGroup.remainingCount == 0)
+                    WakeAllConditionVariable(&waitGroup.condition);
+            };
+
+            {
+                ExclusiveLockScope lockScope(waitGroup.lock);
+                ++waitGroup.remainingCount;
+            }
+
+            HRESULT hr = EnqueueRanges(url, { &ranges[rangeIndex], rangeCount }, callback);
+            if (FAILED(hr))
+            {
+                ExclusiveLockScope lockScope(waitGroup.lock);
+                --waitGroup.remainingCount;
+                if (SUCCEEDED(waitGroup.hr))
+                    waitGroup.hr = hr;
+                break; // Still wait for whatever was already enqueued.
+            }
+            rangeIndex += rangeCount;
+        }
+
+        ExclusiveLockScope lockScope(waitGroup.lock);
+        while (waitGroup.remainingCount > 0)
+        {
+            SleepConditionVariableSRW(&waitGroup.condition, &waitGroup.lock, INFINITE, 0);
+        }
+
+        return waitGroup.hr;
+    }
+
+
+    // Waits until every enqueued request has completed.
+    void WaitForAll()
+    {
+        ExclusiveLockScope lockScope(lock_);
+        while (outstandingRequestCount_ > 0)
+        {
+            SleepConditionVariableSRW(&idleCondition_, &lock_, INFINITE, 0);
+        }
+    }
+
+
+    // Returns the totals since the last reset, from which throughput
+    // (bytesDownloaded / busyTime) and mean latency can be derived.
+    void GetStatistics(_Out_ Statistics& statistics, bool shouldReset = false)
+    {
+        ExclusiveLockScope lockScope(lock_);
+        statistics = statistics_;
+        if (outstandingRequestCount_ > 0)
+        {
+            statistics.busyTime += GetTimeInMicroseconds() - busyStartTime_;
+        }
+        if (shouldReset)
+        {
+            statistics_ = {};
+            busyStartTime_ = GetTimeInMicroseconds();
+        }
+    }
+
+
+    void clear()
+    {
+        ExclusiveLockScope lockScope(lock_);
+        WaitForWorkers();
+        servers_.clear();
+    }
+
+protected:
+    // Lock must be held. Waits for the requests and then for the workers
+    // themselves, since a worker still touches its server after the last
+    // request completes, so the servers can be safely cleared.
+    void WaitForWorkers()
+    {
+        while (outstandingRequestCount_ > 0 || activeWorkerCount_ > 0)
+        {
+            SleepConditionVariableSRW(&idleCondition_, &lock_, INFINITE, 0);
+        }
+    }
+
+
+    static uint64_t GetTimeInMicroseconds()
+    {
+        static LARGE_INTEGER frequency = {};
+        if (frequency.QuadPart == 0)
+            QueryPerformanceFrequency(OUT &frequency);
+
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(OUT &counter);
+        return uint64_t(counter.QuadPart / frequency.QuadPart) * 1000000
+             + uint64_t(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+    }
+
+
+    static void CALLBACK WorkerCallback(PTP_CALLBACK_INSTANCE instance, void* context)
+    {
+        std::unique_ptr<WorkerContext> workerContext(reinterpret_cast<WorkerContext*>(context));
+        workerContext->engine->RunWorker(workerContext->serverName, /*shouldFailAll*/ false);
+    }
+
+
+    static void UpdateCostModel(_Inout_ Server& server, uint64_t totalBytesRead, uint64_t serviceTime)
+    {
+        // Exponentially weighted like TCP's smoothed round trip time, each
+        // sample contributing an eighth.
+        if (totalBytesRead <= roundTripSampleMaximumSize)
+        {
+            server.roundTripTime = (server.roundTripTime * 7 + serviceTime) / 8;
+        }
+        else if (totalBytesRead >= bandwidthSampleMinimumSize && serviceTime > server.roundTripTime)
+        {
+            uint64_t const bytesPerSecond = totalBytesRead * 1000000 / (serviceTime - server.roundTripTime);
+            server.bytesPerSecond = (server.bytesPerSecond * 7 + bytesPerSecond) / 8;
+        }
+    }
+
+
+    // Lock must be held. Idle connections are in order of when they became
+    // idle, so the expired ones are at the front.
+    static void CloseExpiredConnections(_Inout_ Server& server)
+    {
+        uint64_t const currentTime = GetTimeInMicroseconds();
+        auto firstUnexpired = std::find_if(
+            server.idleConnections.begin(),
+            server.idleConnections.end(),
+            [=](IdleConnection const& idleConnection) -> bool
+            {
+                return currentTime - idleConnection.idleStartTime < idleConnectionTimeout;
+            }
+            );
+        server.idleConnections.erase(server.idleConnections.begin(), firstUnexpired);
+    }
+
+
+    // Serves queued requests for a server until there are none left,
+    // keeping one connection for the whole run.
+    void RunWorker(std::wstring const& serverName, bool shouldFailAll)
+    {
+        // The server and transport stay valid until this worker is counted
+        // out, since clearing them waits for every worker.
+        std::unique_ptr<RangeConnection> connection;
+        RangeTransport* transport;
+        Server* server;
+        {
+            ExclusiveLockScope lockScope(lock_);
+            transport = transport_;
+            server = &servers_[serverName];
+            CloseExpiredConnections(*server);
+            if (!shouldFailAll && !server->idleConnections.empty())
+            {
+                connection = std::move(server->idleConnections.back().connection);
+                server->idleConnections.pop_back();
+            }
+        }
+
+        std::vector<uint64_t> bytesActuallyRead;
+        for (;;)
+        {
+            PendingRequest request;
+            {
+                ExclusiveLockScope lockScope(lock_);
+
+                // A worker that could not be started only fails the backlog
+                // when it is the last one serving this server.
+                if (server->pendingRequests.empty() || (shouldFailAll && server->activeWorkerCount > 1))
+                {
+                    if (connection != nullptr)
+                    {
+                        IdleConnection idleConnection = { std::move(connection), GetTimeInMicroseconds() };
+                        server->idleConnections.push_back(std::move(idleConnection));
+                    }
+                    --server->activeWorkerCount;
+                    if (--activeWorkerCount_ == 0)
+                        WakeAllConditionVariable(&idleCondition_);
+                    return;
+                }
+                request = std::move(server->pendingRequests.front());
+                server->pendingRequests.pop_front();
+            }
+
+            bytesActuallyRead.assign(request.ranges.size(), 0);
+            const uint64_t startTime = GetTimeInMicroseconds();
+            HRESULT hr = shouldFailAll ? E_OUTOFMEMORY : S_OK;
+            if (SUCCEEDED(hr) && connection == nullptr)
+            {
+                hr = transport->CreateConnection(serverName, OUT connection);
+            }
+            if (SUCCEEDED(hr))
+            {
+                hr = (request.fileInformation != nullptr)
+                   ? connection->GetFileInformation(request.url, OUT request.fileInformation->fileSize, OUT request.fileInformation->fileTime)
+                   : connection->DownloadRanges(request.url, request.ranges, OUT bytesActuallyRead.data());
+            }
+            if (FAILED(hr))
+            {
+                connection.reset(); // The connection may be in an unknown state, so start afresh.
+            }
+            const uint64_t serviceTime = GetTimeInMicroseconds() - startTime;
+
+            if (request.callback)
+            {
+                request.callback(hr, bytesActuallyRead);
+            }
+
+            ExclusiveLockScope lockScope(lock_);
+            const uint64_t completionTime = GetTimeInMicroseconds();
+            const uint64_t latency = completionTime - request.enqueueTime;
+            const uint64_t totalBytesRead = std::accumulate(bytesActuallyRead.begin(), bytesActuallyRead.end(), uint64_t(0));
+            if (SUCCEEDED(hr))
+            {
+                ++statistics_.completedRequestCount;
+                UpdateCostModel(*server, totalBytesRead, serviceTime);
+            }
+            else
+            {
+                ++statistics_.failedRequestCount;
+            }
+            statistics_.bytesDownloaded += totalBytesRead;
+            statistics_.totalLatency += latency;
+            statistics_.maximumLatency = std::max(statistics_.maximumLatency, latency);
+
+            if (--outstandingRequestCount_ == 0)
+            {
+                statistics_.busyTime += completionTime - busyStartTime_;
+                WakeAllConditionVariable(&idleCondition_);
+            }
+        }
+    }
+};
+
+RangeDownloadEngine RangeDownloadEngine::singleton_;
+
+
+// Keeps the CachedFont_ files in the temp folder within a byte quota,
+// evicting the least recently used ones (along with their chunk maps) on a
+// thread pool thread once the quota is exceeded. Files held open by a stream
+// are pinned, with their last access recorded when the stream closes. The
+// existing files are picked up on first use, aged by their chunk map's last
+// write, which is when they last received data.
+class FontCacheManager
+{
+public:
+    static const uint64_t defaultQuota = 256 * 1024 * 1024;
+
+    struct Statistics
+    {
+        uint64_t hitCount;              // Fragment reads satisfied locally.
+        uint64_t missCount;             // Fragment reads needing a download.
+        uint64_t cachedBytes;           // Bytes on disk, counting only downloaded chunks of sparse files.
+        uint64_t cachedFileCount;
+        uint64_t evictedFileCount;
+        uint64_t evictedBytes;
+    };
+
+protected:
+    // Evict down to this fraction of the quota, so that each pass frees a
+    // useful amount rather than running again on the next download.
+    static const uint32_t evictionTargetNumerator = 7;
+    static const uint32_t evictionTargetDenominator = 8;
+
+    SRWLOCK lock_ = SRWLOCK_INIT;
+    LruCachePolicy policy_;
+    uint64_t quota_ = defaultQuota;
+    bool haveScannedFiles_ = false;
+    bool isEvictionScheduled_ = false;
+    Statistics statistics_ = {};
+    LONG64 volatile hitCount_ = 0;
+    LONG64 volatile missCount_ = 0;
+
+    static FontCacheManager singleton_;
+
+public:
+    static FontCacheManager& GetInstance()
+    {
+        return singleton_;
+    }
+
+
+    void SetQuota(uint64_t quota)
+    {
+        {
+            ExclusiveLockScope lockScope(lock_);
+            quota_ = quota;
+        }
+        ScheduleEvictionIfNeeded();
+    }
+
+
+    void OnFileOpened(std::wstring const& fileName)
+    {
+        ExclusiveLockScope lockScope(lock_);
+        ScanCachedFilesIfNeeded();
+        policy_.Pin(fileName);
+        policy_.Touch(fileName, GetCurrentFileTime());
+    }
+
+
+    void OnFileClosed(std::wstring const& fileName, uint64_t localSize)
+    {
+        {
+            ExclusiveLockScope lockScope(lock_);
+            policy_.Unpin(fileName);
+            policy_.Touch(fileName, GetCurrentFileTime());
+            policy_.SetSize(fileName, localSize);
+        }
+        ScheduleEvictionIfNeeded();
+    }
+
+
+    void OnFileSizeChanged(std::wstring const& fileName, uint64_t localSize)
+    {
+        {
+            ExclusiveLockScope lockScope(lock_);
+            ScanCachedFilesIfNeeded();
+            policy_.Touch(fileName, GetCurrentFileTime());
+            policy_.SetSize(fileName, localSize);
+        }
+        ScheduleEvictionIfNeeded();
+    }
+
+
+    // The file moved along with its chunk map.
+    void OnFileRenamed(std::wstring const& oldFileName, std::wstring const& newFileName)
+    {
+        std::wstring chunkMapFileName;
+        GetChunkMapFileName(newFileName, OUT chunkMapFileName);
+        uint64_t const localSize = GetFileAllocatedSize(newFileName) + GetFileAllocatedSize(chunkMapFileName);
+
+        ExclusiveLockScope lockScope(lock_);
+        ScanCachedFilesIfNeeded();
+        policy_.Remove(oldFileName);
+        policy_.Touch(newFileName, GetCurrentFileTime());
+        policy_.SetSize(newFileName, localSize);
+    }
+
+
+    void OnFileDeleted(std::wstring const& fileName)
+    {
+        ExclusiveLockScope lockScope(lock_);
+        policy_.Remove(fileName);
+    }
+
+
+    // Called for every fragment read, so just count without locking.
+    void OnFragmentRead(bool wasLocal) throw()
+    {
+        InterlockedIncrement64(wasLocal ? &hitCount_ : &missCount_);
+    }
+
+
+    void GetStatistics(_Out_ Statistics& statistics)
+    {
+        ExclusiveLockScope lockScope(lock_);
+        statistics = statistics_;
+        statistics.hitCount = hitCount_;
+        statistics.missCount = missCount_;
+        statistics.cachedBytes = policy_.GetTotalSize();
+        statistics.cachedFileCount = policy_.GetEntryCount();
+    }
+
+
+    // Forgets all entries, such as after the files were deleted wholesale.
+    void clear()
+    {
+        ExclusiveLockScope lockScope(lock_);
+        policy_.clear();
+        haveScannedFiles_ = false;
+    }
+
+
+    static void GetChunkMapFileName(std::wstring const& fileName, _Out_ std::wstring& chunkMapFileName)
+    {
+        chunkMapFileName = fileName;
+        chunkMapFileName.append(L"_ChunkMap");
+    }
+
+protected:
+    static uint64_t GetCurrentFileTime() throw()
+    {
+        ULARGE_INTEGER fileTime;
+        GetSystemTimeAsFileTime(OUT reinterpret_cast<FILETIME*>(&fileTime));
+        return fileTime.QuadPart;
+    }
+
+
+    // Returns the bytes a file actually occupies, which for a sparse file is
+    // only what has been written.
+    static uint64_t GetFileAllocatedSize(std::wstring const& fileName) throw()
+    {
+        ULARGE_INTEGER fileSize;
+        fileSize.LowPart = GetCompressedFileSize(fileName.c_str(), OUT &fileSize.HighPart);
+        if (fileSize.LowPart == INVALID_FILE_SIZE && GetLastError() != NO_ERROR)
+            return 0;
+
+        return fileSize.QuadPart;
+    }
+
+
+    // Lock must be held.
+    void ScanCachedFilesIfNeeded()
+    {
+        if (haveScannedFiles_)
+            return;
+
+        haveScannedFiles_ = true;
+
+        wchar_t filePath[MAX_PATH + 1];
+        auto fileNameStartingIndex = GetTempPath(ARRAYSIZE(filePath), OUT &filePath[0]);
+        if (fileNameStartingIndex == 0 || fileNameStartingIndex >= ARRAYSIZE(filePath))
+            return;
+
+        wcsncat_s(IN OUT filePath, L"CachedFont_*", ARRAYSIZE(filePath));
+
+        WIN32_FIND_DATA findData;
+        HANDLE findHandle = FindFirstFile(filePath, OUT &findData);
+        if (findHandle == INVALID_HANDLE_VALUE)
+            return;
+
+        const wchar_t chunkMapSuffix[] = L"_ChunkMap";
+        const size_t chunkMapSuffixLength = ARRAYSIZE(chunkMapSuffix) - 1;
+        do
+        {
+            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+                continue; // Skip directories.
+
+            std::wstring fileName(filePath, fileNameStartingIndex);
+            fileName.append(findData.cFileName);
+
+            // Account a chunk map to its data file, and date the entry by it.
+            ULARGE_INTEGER lastAccessTime;
+            lastAccessTime.LowPart = findData.ftLastWriteTime.dwLowDateTime;
+            lastAccessTime.HighPart = findData.ftLastWriteTime.dwHighDateTime;
+            uint64_t fileSize = GetFileAllocatedSize(fileName);
+
+            if (fileName.size() > chunkMapSuffixLength
+            &&  fileName.compare(fileName.size() - chunkMapSuffixLength, chunkMapSuffixLength, chunkMapSuffix) == 0)
+            {
+                fileName.resize(fileName.size() - chunkMapSuffixLength);
+                policy_.Touch(fileName, lastAccessTime.QuadPart);
+                policy_.SetSize(fileName, GetFileAllocatedSize(fileName) + fileSize);
+            }
+            else
+            {
+                std::wstring chunkMapFileName;
+                GetChunkMapFileName(fileName, OUT chunkMapFileName);
+                policy_.SetSize(fileName, GetFileAllocatedSize(chunkMapFileName) + fileSize);
+            }
+
+        } while (FindNextFile(findHandle, OUT &findData));
+
+        FindClose(findHandle);
+    }
+
+
+    void ScheduleEvictionIfNeeded()
+    {
+        {
+            ExclusiveLockScope lockScope(lock_);
+            if (isEvictionScheduled_ || policy_.GetTotalSize() <= quota_)
+                return;
+
+            isEvictionScheduled_ = true;
+        }
+
+        if (!TrySubmitThreadpoolCallback(&EvictionCallback, this, nullptr))
+        {
+            EvictFiles(); // Do it now instead.
+        }
+    }
+
+
+    static void CALLBACK EvictionCallback(PTP_CALLBACK_INSTANCE instance, void* context)
+    {
+        reinterpret_cast<FontCacheManager*>(context)->EvictFiles();
+    }
+
+
+    void EvictFiles()
+    {
+        std::vector<std::wstring> victims;
+        {
+            ExclusiveLockScope lockScope(lock_);
+            isEvictionScheduled_ = false;
+            uint64_t const targetSize = quota_ / evictionTargetDenominator * evictionTargetNumerator;
+            policy_.SelectVictims(targetSize, OUT victims);
+        }
+
+        // Delete outside the lock, since it touches the disk.
+        std::wstring chunkMapFileName;
+        for (auto const& fileName : victims)
+        {
+            uint64_t const fileSize = GetFileAllocatedSize(fileName);
+            GetChunkMapFileName(fileName, OUT chunkMapFileName);
+            uint64_t const chunkMapFileSize = GetFileAllocatedSize(chunkMapFileName);
+
+            // Delete the chunk map first, so a data file left behind by a
+            // failed delete is just treated as not downloaded.
+            bool const wasDeleted = (DeleteFile(chunkMapFileName.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND)
+                                 && (DeleteFile(fileName.c_str()) || GetLastError() == ERROR_FILE_NOT_FOUND);
+
+            ExclusiveLockScope lockScope(lock_);
+            if (wasDeleted)
+            {
+                policy_.Remove(fileName);
+                ++statistics_.evictedFileCount;
+                statistics_.evictedBytes += fileSize + chunkMapFileSize;
+            }
+            else
+            {
+                // Probably open in another process. Try others first next time.
+                policy_.Touch(fileName, GetCurrentFileTime());
+            }
+        }
+    }
+};
+
+FontCacheManager FontCacheManager::singleton_;
+
+
+// Names cached font files by a SHA-256 hash rather than by the URL's file
+// name, so that different fonts with the same file name no longer collide,
+// and mirrors of the same font end up sharing one file. Each URL gets a small
+// manifest naming its content file.
+//
+// While downloading, a URL's content file is its own, named by a hash of the
+// URL, since nothing short of the whole file proves two servers hold the same
+// bytes; a mirror copying a popular font's table directory could otherwise
+// write its own chunks into the file every other URL reads. Once every chunk
+// has arrived, the whole file is hashed, and when the stream closes the file
+// moves to the name of that hash (or is dropped if another URL already put the
+// same bytes there), and the manifest is marked verified. Verified files are
+// complete, so nothing is ever downloaded into them again.
+class FontContentStore
+{
+public:
+    static const uint64_t hashOffsetBasis = 0xCBF29CE484222325;
+
+    struct ContentHash
+    {
+        uint8_t bytes[32]; // SHA-256
+    };
+
+protected:
+    static const uint64_t hashPrime = 0x00000100000001B3;
+
+    // The manifest file is this header followed by the URL, which is checked
+    // on reading in case two URLs hash to the same manifest name.
+    struct ManifestHeader
+    {
+        uint32_t signature;             // 'CURL'
+        uint32_t version;
+        uint64_t fileSize;
+        ContentHash contentHash;
+        uint32_t urlLength;             // In code units, excluding the nul.
+        uint32_t flags;                 // ManifestFlags
+    };
+    static const uint32_t manifestSignature = 0x4C525543; // 'CURL' little endian
+    static const uint32_t manifestVersion = 3; // Version 2 shared files by a hash of just the first chunk.
+
+    enum ManifestFlags : uint32_t
+    {
+        ManifestFlagNone = 0,
+        ManifestFlagVerified = 1,       // The content hash covers the whole file, which is shared.
+    };
+
+public:
+    // 64-bit FNV-1a, chained through the initial hash. Only for names that
+    // are verified after lookup, like the manifest's URL.
+    static uint64_t HashBytes(const_byte_array_ref data, uint64_t hash = hashOffsetBasis) throw()
+    {
+        for (auto byte : data)
+        {
+            hash = (hash ^ byte) * hashPrime;
+        }
+        return hash;
+    }
+
+
+    // Hashes the complete file content, naming the file shared by every URL
+    // that served the same bytes.
+    static HRESULT GetContentHash(
+        const_byte_array_ref fileData,
+        _Out_ ContentHash& contentHash
+        )
+    {
+        return GetSha256({}, fileData, OUT contentHash);
+    }
+
+
+    // Hashes the URL, naming the file only it downloads into until verified.
+    // The prefix keeps it from ever matching the hash of some file content.
+    static HRESULT GetUrlContentHash(
+        std::wstring const& url,
+        _Out_ ContentHash& contentHash
+        )
+    {
+        static const uint8_t prefix[] = { 'U', 'R', 'L', ':' };
+        const_byte_array_ref urlData(reinterpret_cast<uint8_t const*>(url.data()), url.size() * sizeof(url[0]));
+        return GetSha256(prefix, urlData, OUT contentHash);
+    }
+
+
+    static void GetCachedFontFilesPath(_Out_ std::wstring& cachePath)
+    {
+        cachePath.resize(MAX_PATH + 1);
+        auto fileNameStartingIndex = GetTempPath(MAX_PATH + 1, OUT &cachePath[0]);
+        cachePath.resize(fileNameStartingIndex);
+    }
+
+
+    static void GetContentFileName(ContentHash const& contentHash, _Out_ std::wstring& fileName)
+    {
+        GetCachedFontFilesPath(OUT fileName);
+        fileName.append(L"CachedFont_");
+        for (auto byte : contentHash.bytes)
+        {
+            AppendFormattedString(IN OUT fileName, L"%02X", byte);
+        }
+    }
+
+
+    static void GetManifestFileName(std::wstring const& url, _Out_ std::wstring& fileName)
+    {
+        uint64_t const urlHash = HashBytes(const_byte_array_ref(reinterpret_cast<uint8_t const*>(url.data()), url.size() * sizeof(url[0])));
+        GetCachedFontFilesPath(OUT fileName);
+        AppendHashedFileName(L"CachedFontUrl_", urlHash, IN OUT fileName);
+    }
+
+
+    // Returns false if the URL has no manifest yet.
+    static bool ReadManifest(
+        std::wstring const& url,
+        _Out_ ContentHash& contentHash,
+        _Out_ uint64_t& fileSize,
+        _Out_ bool& isVerified
+        )
+    {
+        contentHash = {};
+        fileSize = 0;
+        isVerified = false;
+
+        std::wstring manifestFileName;
+        GetManifestFileName(url, OUT manifestFileName);
+        FileHandle manifestFileHandle = CreateFile(
+            manifestFileName.c_str(),
+            GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_DELETE,
+            nullptr,
+            OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+            );
+        if (manifestFileHandle == INVALID_HANDLE_VALUE)
+            return false;
+
+        ManifestHeader header;
+        unsigned long bytesRead;
+        if (!ReadFile(manifestFileHandle, OUT &header, sizeof(header), OUT &bytesRead, nullptr)
+        ||  bytesRead != sizeof(header)
+        ||  header.signature != manifestSignature
+        ||  header.version != manifestVersion
+        ||  header.urlLength != url.size())
+        {
+            return false;
+        }
+
+        std::wstring manifestUrl(url.size(), '\0');
+        unsigned long const urlByteCount = static_cast<unsigned long>(url.size() * sizeof(url[0]));
+        if (!ReadFile(manifestFileHandle, OUT &manifestUrl[0], urlByteCount, OUT &bytesRead, nullptr)
+        ||  bytesRead != urlByteCount
+        ||  manifestUrl != url)
+        {
+            return false;
+        }
+
+        contentHash = header.contentHash;
+        fileSize = header.fileSize;
+        isVerified = (header.flags & ManifestFlagVerified) != 0;
+        return true;
+    }
+
+
+    static HRESULT WriteManifest(
+        std::wstring const& url,
+        ContentHash const& contentHash,
+        uint64_t fileSize,
+        bool isVerified
+        )
+    {
+        std::vector<uint8_t> buffer(sizeof(ManifestHeader) + url.size() * sizeof(url[0]));
+        auto& header = *reinterpret_cast<ManifestHeader*>(buffer.data());
+        header.signature = manifestSignature;
+        header.version = manifestVersion;
+        header.fileSize = fileSize;
+        header.contentHash = contentHash;
+        header.urlLength = static_cast<uint32_t>(url.size());
+        header.flags = isVerified ? ManifestFlagVerified : ManifestFlagNone;
+        memcpy(&buffer[sizeof(header)], url.data(), url.size() * sizeof(url[0]));
+
+        std::wstring manifestFileName;
+        GetManifestFileName(url, OUT manifestFileName);
+        FileHandle manifestFileHandle = CreateFile(
+            manifestFileName.c_str(),
+            GENERIC_WRITE,
+            0,
+            nullptr,
+            CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+            );
+        if (manifestFileHandle == INVALID_HANDLE_VALUE)
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        unsigned long bytesWritten;
+        if (!WriteFile(manifestFileHandle, buffer.data(), static_cast<unsigned long>(buffer.size()), OUT &bytesWritten, nullptr))
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        return S_OK;
+    }
+
+
+    // Moves a completely downloaded URL's content file, closed by now, to the
+    // name of its whole content hash, or drops it if another URL already put
+    // the same bytes there, and then points the URL's manifest at the shared
+    // file. This fails while any other stream has the file open, and is tried
+    // again after the next stream of the URL closes.
+    static HRESULT ShareVerifiedContent(
+        std::wstring const& url,
+        std::wstring const& fileName,
+        ContentHash const& contentHash,
+        uint64_t fileSize
+        )
+    {
+        std::wstring sharedFileName, chunkMapFileName, sharedChunkMapFileName;
+        GetContentFileName(contentHash, OUT sharedFileName);
+        FontCacheManager::GetChunkMapFileName(fileName, OUT chunkMapFileName);
+        FontCacheManager::GetChunkMapFileName(sharedFileName, OUT sharedChunkMapFileName);
+        auto& cacheManager = FontCacheManager::GetInstance();
+
+        if (!MoveFileEx(fileName.c_str(), sharedFileName.c_str(), 0))
+        {
+            auto lastError = GetLastError();
+            if (lastError != ERROR_ALREADY_EXISTS && lastError != ERROR_FILE_EXISTS)
+                return HRESULT_FROM_WIN32(lastError);
+
+            // Another URL served the same bytes first.
+            IFR(WriteManifest(url, contentHash, fileSize, /*isVerified*/ true));
+            DeleteFile(fileName.c_str());
+            DeleteFile(chunkMapFileName.c_str());
+            cacheManager.OnFileDeleted(fileName);
+            return S_OK;
+        }
+
+        // Streams of shared files ignore the chunk map, since the file is
+        // complete, so losing it here does no harm.
+        if (!MoveFileEx(chunkMapFileName.c_str(), sharedChunkMapFileName.c_str(), MOVEFILE_REPLACE_EXISTING))
+            DeleteFile(chunkMapFileName.c_str());
+
+        cacheManager.OnFileRenamed(fileName, sharedFileName);
+        return WriteManifest(url, contentHash, fileSize, /*isVerified*/ true);
+    }
+
+protected:
+    static HRESULT GetSha256(
+        const_byte_array_ref prefix,
+        const_byte_array_ref data,
+        _Out_ ContentHash& contentHash
+        )
+    {
+        contentHash = {};
+
+        BCRYPT_ALG_HANDLE algorithm = nullptr;
+        BCRYPT_HASH_HANDLE hash = nullptr;
+        NTSTATUS status = BCryptOpenAlgorithmProvider(OUT &algorithm, BCRYPT_SHA256_ALGORITHM, nullptr, 0);
+        if (BCRYPT_SUCCESS(status))
+            status = BCryptCreateHash(algorithm, OUT &hash, nullptr, 0, nullptr, 0, 0);
+        if (BCRYPT_SUCCESS(status) && !prefix.empty())
+            status = BCryptHashData(hash, const_cast<PUCHAR>(prefix.data()), static_cast<ULONG>(prefix.size()), 0);
+
+        // BCryptHashData takes a 32-bit length, so feed large files in pieces.
+        for (size_t offset = 0, pieceSize; BCRYPT_SUCCESS(status) && offset < data.size(); offset += pieceSize)
+        {
+            pieceSize = std::min(data.size() - offset, size_t(0x40000000));
+            status = BCryptHashData(hash, const_cast<PUCHAR>(data.data() + offset), static_cast<ULONG>(pieceSize), 0);
+        }
+
+        if (BCRYPT_SUCCESS(status))
+            status = BCryptFinishHash(hash, OUT contentHash.bytes, sizeof(contentHash.bytes), 0);
+
+        if (hash != nullptr)
+            BCryptDestroyHash(hash);
+        if (algorithm != nullptr)
+            BCryptCloseAlgorithmProvider(algorithm, 0);
+
+        return BCRYPT_SUCCESS(status) ? S_OK : HRESULT_FROM_NT(status);
+    }
+
+
+    static void AppendHashedFileName(
+        _In_z_ wchar_t const* prefix,
+        uint64_t hash,
+        _Inout_ std::wstring& fileName
+        )
+    {
+        wchar_t hashText[17];
+        swprintf_s(hashText, L"%016llX", hash);
+        fileName.append(prefix);
+        fileName.append(hashText);
+    }
+};
+
+
+class RemoteFontDownloadManager;
+
+
+interface RemoteFontFileStreamInterfaceBinding : public IDWriteRemoteFontFileStream
+{
+};
+
+class RemoteFontFileStream : public ComBase<RemoteFontFileStreamInterfaceBinding>
+{
+public:
+    static const uint64_t chunkSize_ = 16384;
+
+protected:
+    enum ContentHashState : LONG
+    {
+        ContentHashStateNone,
+        ContentHashStateHashing,
+        ContentHashStateHashed,
+    };
+
+    std::wstring url_;
+    std::wstring fileName_;
+    RemoteFontDownloadManager* downloadManager_ = nullptr; // The static singleton, optionally null.
+    ComPtr<IDWriteFontFileLoader> fontFileLoader_;
+    uint64_t fileSize_ = 0;
+    uint8_t* streamMemory_ = nullptr;           // The mapped view of the cached file.
+    FileHandle fileHandle_;
+    FileHandle streamMappingHandle_;
+    MemoryViewResource streamView_;
+    FileHandle chunkMapFileHandle_;
+    FileHandle chunkMapMappingHandle_;
+    MemoryViewResource chunkMapView_;
+    uint64_t volatile* chunkWords_ = nullptr;   // The bitset words, within the mapped view.
+    ChunkBitset chunkMap_;
+    uint32_t chunkCount_ = 0;
+    bool isCacheEntryPinned_ = false;
+    bool isContentShared_ = false;              // Opened through a verified manifest, so complete.
+    LONG volatile hasPrefetchedMetadata_ = 0;
+    LONG volatile contentHashState_ = ContentHashStateNone;
+    FontContentStore::ContentHash contentHash_ = {}; // Of the whole file, once ContentHashStateHashed.
+
+    // The chunk map file is this header followed by the bitset, in 64-bit
+    // words so that a whole word can be tested or atomically updated at once.
+    struct ChunkMapHeader
+    {
+        uint32_t signature;             // 'CMAP'
+        uint32_t version;
+        uint32_t chunkSize;
+        uint32_t chunkCount;
+    };
+    static const uint32_t chunkMapSignature = 0x50414D43; // 'CMAP' little endian
+    static const uint32_t chunkMapVersion = 1;
+
+protected:
+    IFACEMETHODIMP QueryInterface(IID const& iid, __out void** object) OVERRIDE
+    {
+        COM_BASE_RETURN_INTERFACE(iid, IDWriteRemoteFontFileStream, object);
+        COM_BASE_RETURN_INTERFACE(iid, IDWriteFontFileStream, object);
+        COM_BASE_RETURN_INTERFACE_AMBIGUOUS(iid, IUnknown, object, static_cast<IDWriteRemoteFontFileStream*>(this));
+        COM_BASE_RETURN_NO_INTERFACE(object);
+    }
+
+public:
+    RemoteFontFileStream()
+    { }
+
+    HRESULT Initialize(
+        const wchar_t* url,
+        RemoteFontDownloadManager* downloadManager,
+        IDWriteFontFileLoader* fontFileLoader
+        )
+    {
+        if (url == nullptr)
+            return E_INVALIDARG;
+
+        downloadManager_ = downloadManager;
+        fontFileLoader_ = fontFileLoader;
+        streamMemory_ = nullptr;
+        url_ = url;
+
+        // Find the content file through the URL's manifest. Neither exists
+        // until the stream information is downloaded.
+        FontContentStore::ContentHash contentHash;
+        uint64_t manifestFileSize;
+        auto lastError = ERROR_FILE_NOT_FOUND;
+        if (FontContentStore::ReadManifest(url_, OUT contentHash, OUT manifestFileSize, OUT isContentShared_))
+        {
+            FontContentStore::GetContentFileName(contentHash, OUT fileName_);
+            fileHandle_ = CreateFile(
+                fileName_.c_str(),
+                GENERIC_READ | GENERIC_WRITE,
+                FILE_SHARE_READ | FILE_SHARE_WRITE,
+                nullptr,
+                OPEN_EXISTING,
+                FILE_ATTRIBUTE_NORMAL,
+                nullptr
+                );
+            lastError = GetLastError();
+        }
+
+        if (fileHandle_ == nullptr || fileHandle_ == INVALID_HANDLE_VALUE)
+        {
+            if (lastError == ERROR_FILE_NOT_FOUND || lastError == ERROR_PATH_NOT_FOUND)
+            {
+                // An empty fragment asks for just the file information.
+                EnqueueFileFragmentDownload(0, 0);
+                return DWRITE_E_REMOTEFONT;
             }
+            return HRESULT_FROM_WIN32(lastError);
+        }
+
+        // Do not change the file time upon writes, leaving it the same as the
+        // original server time, since later writes are just partial hydration
+        // rather than actual meaningful content changes.
+        FILETIME fileTime = { 0xFFFFFFFF, 0xFFFFFFFF };
+        SetFileTime(fileHandle_, nullptr, &fileTime, &fileTime);
+
+        LARGE_INTEGER fileSize;
+        ::GetFileSizeEx(fileHandle_, OUT &fileSize);
+        fileSize_ = fileSize.QuadPart;
+        chunkCount_ = static_cast<uint32_t>((fileSize_ + chunkSize_ - 1) / chunkSize_);
+
+        // Map the cached file rather than reading it all into memory. It is
+        // sparse, so pages that were never downloaded are neither on disk nor
+        // resident, and memory use follows what was actually fetched. Fragment
+        // reads return pointers into the view, and downloads write through it.
+        if (fileSize_ > SIZE_MAX)
+            return E_OUTOFMEMORY;
+
+        if (fileSize_ > 0)
+        {
+            streamMappingHandle_ = CreateFileMapping(fileHandle_, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+            if (streamMappingHandle_ == nullptr)
+                return HRESULT_FROM_WIN32(GetLastError());
+
+            streamView_ = MapViewOfFile(streamMappingHandle_, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0);
+            if (streamView_ == nullptr)
+                return HRESULT_FROM_WIN32(GetLastError());
+
+            streamMemory_ = reinterpret_cast<uint8_t*>(streamView_.Get());
+        }
+
+        IFR(OpenChunkMap());
+
+        // A shared file was complete when verified. Never download into it,
+        // whatever its chunk map says, since this URL's server may not have
+        // the same bytes anymore.
+        if (isContentShared_)
+        {
+            if (chunkMap_.CountPresentChunks() < chunkCount_)
+                MarkChunksPresent(0, chunkCount_);
+        }
+        else
+        {
+            HashContentIfComplete();
+        }
+
+        // Keep the cache manager from evicting the file while it is open.
+        FontCacheManager::GetInstance().OnFileOpened(fileName_);
+        isCacheEntryPinned_ = true;
+
+        return S_OK;
+    }
+
+
+    ~RemoteFontFileStream()
+    {
+        if (isCacheEntryPinned_)
+        {
+            FontCacheManager::GetInstance().OnFileClosed(fileName_, GetLocalByteCount());
+        }
+        streamMemory_ = nullptr; // Unmapped along with streamView_.
+
+        // Share the completed file now that this stream no longer holds it.
+        if (contentHashState_ == ContentHashStateHashed)
+        {
+            chunkMap_.Detach();
+            chunkWords_ = nullptr;
+            chunkMapView_.clear();
+            chunkMapMappingHandle_.clear();
+            chunkMapFileHandle_.clear();
+            streamView_.clear();
+            streamMappingHandle_.clear();
+            fileHandle_.clear();
+            FontContentStore::ShareVerifiedContent(url_, fileName_, contentHash_, fileSize_);
+        }
+    }
+
+
+    // Hashes the URL's own file once every chunk has arrived, so it can be
+    // shared when the stream closes.
+    void HashContentIfComplete()
+    {
+        if (isContentShared_ || chunkMap_.CountPresentChunks() < chunkCount_)
+            return;
+
+        if (InterlockedCompareExchange(&contentHashState_, ContentHashStateHashing, ContentHashStateNone) != ContentHashStateNone)
+            return;
+
+        FontContentStore::ContentHash contentHash;
+        if (FAILED(FontContentStore::GetContentHash({ streamMemory_, size_t(fileSize_) }, OUT contentHash)))
+        {
+            InterlockedExchange(&contentHashState_, ContentHashStateNone);
+            return;
+        }
+
+        contentHash_ = contentHash;
+        InterlockedExchange(&contentHashState_, ContentHashStateHashed);
+    }
+
+
+    // Opens or creates the chunk map beside the cached file, and maps it.
+    HRESULT OpenChunkMap()
+    {
+        std::wstring chunkMapFileName;
+        FontCacheManager::GetChunkMapFileName(fileName_, OUT chunkMapFileName);
+        chunkMapFileHandle_ = CreateFile(
+            chunkMapFileName.c_str(),
+            GENERIC_READ | GENERIC_WRITE,
+            FILE_SHARE_READ | FILE_SHARE_WRITE,
+            nullptr,
+            OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL,
+            nullptr
+            );
+        if (chunkMapFileHandle_ == INVALID_HANDLE_VALUE)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        LARGE_INTEGER existingFileSize;
+        if (!::GetFileSizeEx(chunkMapFileHandle_, OUT &existingFileSize))
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        // Files from before the bitset used one byte per chunk. Read those
+        // before mapping so the chunks need not be downloaded again.
+        std::vector<uint8_t> oldChunkMap;
+        if (existingFileSize.QuadPart == chunkCount_ && chunkCount_ > 0)
+        {
+            unsigned long bytesRead = 0;
+            oldChunkMap.resize(chunkCount_);
+            if (!ReadFile(chunkMapFileHandle_, OUT oldChunkMap.data(), chunkCount_, OUT &bytesRead, nullptr))
+                oldChunkMap.clear();
+        }
+
+        uint32_t const wordCount = ChunkBitset::GetWordCount(chunkCount_);
+        uint32_t const mappingSize = sizeof(ChunkMapHeader) + wordCount * sizeof(uint64_t);
+        chunkMapMappingHandle_ = CreateFileMapping(chunkMapFileHandle_, nullptr, PAGE_READWRITE, 0, mappingSize, nullptr);
+        if (chunkMapMappingHandle_ == nullptr)
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        chunkMapView_ = MapViewOfFile(chunkMapMappingHandle_, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, mappingSize);
+        if (chunkMapView_ == nullptr)
+            return HRESULT_FROM_WIN32(GetLastError());
+
+        auto* header = reinterpret_cast<ChunkMapHeader*>(chunkMapView_.Get());
+        chunkWords_ = reinterpret_cast<uint64_t volatile*>(header + 1);
+        chunkMap_.Attach(chunkWords_, chunkCount_);
+
+        // Reset the map if it is not ours or describes a different file, since
+        // a wrong bit would hand back bytes that were never downloaded.
+        if (header->signature != chunkMapSignature
+        ||  header->version != chunkMapVersion
+        ||  header->chunkSize != chunkSize_
+        ||  header->chunkCount != chunkCount_
+        ||  existingFileSize.QuadPart != mappingSize)
+        {
+            chunkMap_.ReadByteMap(oldChunkMap);
+
+            header->signature = chunkMapSignature;
+            header->version = chunkMapVersion;
+            header->chunkSize = chunkSize_;
+            header->chunkCount = chunkCount_;
+            FlushViewOfFile(header, mappingSize);
+        }
+
+        return S_OK;
+    }
+
+
+    // Sets the chunks' bits, and then flushes the touched words back to the
+    // file.
+    void MarkChunksPresent(uint32_t lowChunkIndex, uint32_t highChunkIndex) throw()
+    {
+        uint32_t lowWordIndex, highWordIndex;
+        chunkMap_.MarkChunksPresent(lowChunkIndex, highChunkIndex, OUT lowWordIndex, OUT highWordIndex);
+        if (highWordIndex > lowWordIndex)
+        {
+            FlushViewOfFile(const_cast<uint64_t*>(&chunkWords_[lowWordIndex]), (highWordIndex - lowWordIndex) * sizeof(uint64_t));
         }
     }
 
 
-    static HRESULT DeleteCachedFontFiles()
+    static HRESULT DeleteCachedFontFiles()
+    {
+        // Delete the URL manifests along with the content files and maps.
+        IFR(DeleteCachedFontFiles(L"CachedFontUrl_*"));
+        IFR(DeleteCachedFontFiles(L"CachedFont_*"));
+        FontCacheManager::GetInstance().clear();
+        return S_OK;
+    }
+
+
+    static HRESULT DeleteCachedFontFiles(_In_z_ wchar_t const* fileMask)
     {
         WIN32_FIND_DATA findData;
 
         // Get the first file matching the mask.
         wchar_t filePath[MAX_PATH + 1];
         auto fileNameStartingIndex = GetTempPath(ARRAYSIZE(filePath), OUT &filePath[0]);
-        wcsncat_s(IN OUT filePath, L"CachedFont_*", ARRAYSIZE(filePath));
+        wcsncat_s(IN OUT filePath, fileMask, ARRAYSIZE(filePath));
 
         HANDLE findHandle = FindFirstFile(filePath, OUT &findData);
         if (findHandle == INVALID_HANDLE_VALUE)
@@ -538,12 +2299,6 @@ public:
     }
 
 
-    IFACEMETHODIMP DownloadFileInformation()
-    {
-        return E_NOTIMPL;
-    }
-
-
     HRESULT CheckFileFragment(
         uint64_t fileOffset,
         uint64_t fragmentSize,
@@ -556,46 +2311,61 @@ public:
             return E_INVALIDARG;
 
         static_assert(((chunkSize_ - 1) & chunkSize_) == 0, "Chunk size must be a power of two.");
-        uint32_t const lowFilePosition = fileOffset & ~(chunkSize_ - 1);
-        uint32_t const highFilePosition = (fileOffset + fragmentSize + chunkSize_ - 1) & ~(chunkSize_ - 1);
-        uint32_t const lowChunkMapIndex = uint32_t(lowFilePosition / chunkSize_);
-        uint32_t const highChunkMapIndex = std::min(uint32_t(highFilePosition / chunkSize_), static_cast<uint32_t>(chunkMap_.size()));
+        uint32_t const lowChunkMapIndex = uint32_t(fileOffset / chunkSize_);
+        uint32_t const highChunkMapIndex = uint32_t((fileOffset + fragmentSize + chunkSize_ - 1) / chunkSize_);
 
-        bool allChunksArePresent = true;
-        for (auto chunkMapIndex = lowChunkMapIndex; chunkMapIndex < highChunkMapIndex; ++chunkMapIndex)
-        {
-            if (!chunkMap_[chunkMapIndex])
-            {
-                allChunksArePresent = false;
-                break;
-            }
-        }
+        uint32_t missingChunkIndex;
+        bool const allChunksArePresent = !chunkMap_.FindFirstMissingChunk(lowChunkMapIndex, highChunkMapIndex, OUT missingChunkIndex);
 
         if (allChunksArePresent)
         {
             *fragmentIsReady = true;
         }
-        else if (downloadManager_ != nullptr)
+        else
         {
-            // downloadManager_->EnqueueFileFragmentDownload(
-            //     fontFileLoader_,
-            //     url_.c_str(),
-            //     (url_.size() + 1) * sizeof(url_[0]),
-            //     fileOffset,
-            //     fragmentSize
-            //     );
+            EnqueueFileFragmentDownload(fileOffset, fragmentSize);
         }
 
         return S_OK;
     }
 
 
-    IFACEMETHODIMP DownloadFileFragments(
+    // Queues the fragment with the download manager, if there is one, for the
+    // next BeginDownload. Defined after the manager.
+    void EnqueueFileFragmentDownload(uint64_t fileOffset, uint64_t fragmentSize);
+
+
+    HRESULT DownloadFileFragments(
         _In_reads_(fragmentCount) DWRITE_FILE_FRAGMENT const* fileFragments,
         uint32_t fragmentCount
         )
     {
-        return E_NOTIMPL;
+        // Issue all the fragments at once so they download in parallel.
+        std::vector<Range> ranges;
+        try
+        {
+            ranges.reserve(fragmentCount);
+            for (uint32_t i = 0; i < fragmentCount; ++i)
+            {
+                auto const& fileFragment = fileFragments[i];
+                if (fileFragment.fragmentSize == 0)
+                    continue;
+
+                if (fileFragment.fileOffset + fileFragment.fragmentSize < fileFragment.fileOffset
+                ||  fileFragment.fileOffset + fileFragment.fragmentSize > fileSize_)
+                {
+                    return E_INVALIDARG;
+                }
+
+                ranges.push_back(GetChunkAlignedRange(fileFragment.fileOffset, fileFragment.fragmentSize));
+            }
+
+            return DownloadChunkAlignedRanges(IN OUT ranges);
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
     }
 
 
@@ -611,6 +2381,7 @@ public:
 
         BOOL fileFragmentIsReady = false;
         IFR(CheckFileFragment(fileOffset, fragmentSize, OUT &fileFragmentIsReady));
+        FontCacheManager::GetInstance().OnFragmentRead(!!fileFragmentIsReady);
         if (!fileFragmentIsReady)
             return DWRITE_E_REMOTEFONT;
 
@@ -618,62 +2389,535 @@ public:
     }
 
 
-    IFACEMETHODIMP DownloadFileFragment(
+    // Expands the fragment outward to whole chunks (the last chunk clipped
+    // to the file size).
+    Range GetChunkAlignedRange(
         uint64_t fileOffset,
         uint64_t fragmentSize
         )
     {
-        if (fragmentSize == 0)
-            return S_OK;
+        static_assert(((chunkSize_ - 1) & chunkSize_) == 0, "Chunk size must be a power of two.");
+        Range range;
+        range.begin = fileOffset & ~(chunkSize_ - 1);
+        range.end = std::min((fileOffset + fragmentSize + chunkSize_ - 1) & ~(chunkSize_ - 1), fileSize_);
+        return range;
+    }
 
-        if (fileOffset + fragmentSize < fileOffset || fileOffset + fragmentSize > fileSize_)
-            return E_INVALIDARG;
 
-        static_assert(((chunkSize_ - 1) & chunkSize_) == 0, "Chunk size must be a power of two.");
-        uint32_t const lowFilePosition = fileOffset & ~(chunkSize_ - 1);
-        uint32_t const highFilePosition = (fileOffset + fragmentSize + chunkSize_ - 1) & ~(chunkSize_ - 1);
-        uint32_t const totalBytesToRead = highFilePosition - lowFilePosition;
-        uint32_t const lowChunkMapIndex  = uint32_t(lowFilePosition / chunkSize_);
-        uint32_t const highChunkMapIndex = std::min(uint32_t(highFilePosition / chunkSize_), static_cast<uint32_t>(chunkMap_.size()));
+    HRESULT DownloadChunkAlignedRanges(_Inout_ std::vector<Range>& ranges)
+    {
+        auto& downloadEngine = RangeDownloadEngine::GetInstance();
+
+        // Merge gaps that are cheaper to download than another request,
+        // rounding the gap down to whole chunks so the merged ranges stay
+        // chunk aligned, and then bundle the rest into multi-range requests.
+        uint64_t roundTripTime, bytesPerSecond;
+        downloadEngine.GetCostModel(url_, OUT roundTripTime, OUT bytesPerSecond);
+        uint64_t const maximumGapSize = RangeDownloadPlanner::GetMaximumGapSize(roundTripTime, bytesPerSecond) & ~(chunkSize_ - 1);
+        RangeDownloadPlanner::CoalesceRanges(IN OUT ranges, maximumGapSize);
+
+        std::vector<uint32_t> requestRangeCounts;
+        RangeDownloadPlanner::GroupRanges(ranges, RangeDownloadEngine::defaultConnectionsPerServer, RangeDownloadPlanner::maximumMergedRangeSize, OUT requestRangeCounts);
+
+        std::vector<RangeRequest> rangeRequests;
+        rangeRequests.reserve(ranges.size());
+        for (auto const& range : ranges)
+        {
+            RangeRequest rangeRequest = { range.begin, range.end - range.begin, &streamMemory_[range.begin] };
+            rangeRequests.push_back(rangeRequest);
+        }
+
+        // Read the ranges from the server concurrently.
+        std::vector<uint64_t> bytesActuallyRead;
+        HRESULT hr = downloadEngine.DownloadRangesAndWait(url_, rangeRequests, requestRangeCounts, OUT bytesActuallyRead);
+
+        // Persist whatever did arrive, even if some ranges failed.
+        for (size_t i = 0, ci = bytesActuallyRead.size(); i < ci; ++i)
+        {
+            if (bytesActuallyRead[i] > 0)
+            {
+                CommitDownloadedRange(rangeRequests[i].fileOffset, bytesActuallyRead[i]);
+            }
+        }
+
+        // With the first chunk in, the rest of the metadata can be requested.
+        PrefetchMetadataTables();
+
+        return hr;
+    }
+
+
+    // Once the first chunk is present, reads the table directory and fetches
+    // every table needed to catalog the font (names, metrics, character map,
+    // variations) in one batch, rather than letting DirectWrite discover them
+    // one round trip at a time. Only runs once per stream.
+    HRESULT PrefetchMetadataTables()
+    {
+        if (hasPrefetchedMetadata_ || chunkCount_ == 0 || IsChunkMissing(0))
+            return S_OK; // Done already, or nothing to parse yet.
+
+        if (InterlockedCompareExchange(&hasPrefetchedMetadata_, 1, 0) != 0)
+            return S_OK; // Another thread got here first.
+
+        TraceSpan traceSpan(L"RemoteFontFileStream::PrefetchMetadataTables");
+
+        const uint32_t metadataTableTags[] = {
+            OpenTypeFileReader::MakeTag('h','e','a','d'),
+            OpenTypeFileReader::MakeTag('h','h','e','a'),
+            OpenTypeFileReader::MakeTag('m','a','x','p'),
+            OpenTypeFileReader::MakeTag('O','S','/','2'),
+            OpenTypeFileReader::MakeTag('n','a','m','e'),
+            OpenTypeFileReader::MakeTag('c','m','a','p'),
+            OpenTypeFileReader::MakeTag('p','o','s','t'),
+            OpenTypeFileReader::MakeTag('f','v','a','r'),
+            OpenTypeFileReader::MakeTag('a','v','a','r'),
+            OpenTypeFileReader::MakeTag('S','T','A','T'),
+            OpenTypeFileReader::MakeTag('m','e','t','a'),
+        };
+
+        std::vector<Range> ranges;
+        std::vector<uint32_t> directoryOffsets;
+        std::vector<OpenTypeFileReader::TableRecord> tableRecords;
+        uint64_t requiredSize;
+
+        // The directories are normally within the first chunk, but a large
+        // collection may need more. Fetch it and read again.
+        if (!OpenTypeFileReader::ReadFontDirectoryOffsets(GetLocalPrefix(), OUT directoryOffsets, OUT requiredSize))
+        {
+            if (!EnsureLocalPrefix(requiredSize)
+            ||  !OpenTypeFileReader::ReadFontDirectoryOffsets(GetLocalPrefix(), OUT directoryOffsets, OUT requiredSize))
+            {
+                return S_OK; // Not an OpenType file. Nothing to prefetch.
+            }
+        }
+
+        for (auto directoryOffset : directoryOffsets)
+        {
+            if (directoryOffset >= fileSize_)
+                continue;
+
+            if (!OpenTypeFileReader::ReadTableRecords(GetLocalFragment(directoryOffset), 0, OUT tableRecords, OUT requiredSize))
+            {
+                std::vector<Range> directoryRanges(1, GetChunkAlignedRange(directoryOffset, std::min(requiredSize, fileSize_ - directoryOffset)));
+                DownloadMissingChunkAlignedRanges(IN OUT directoryRanges);
+                if (!OpenTypeFileReader::ReadTableRecords(GetLocalFragment(directoryOffset), 0, OUT tableRecords, OUT requiredSize))
+                    continue;
+            }
 
-        // Read the file from the server.
-        uint64_t totalBytesActuallyRead;
-        IFR(internetDownloader_.PrepareDownloadRequest(url_));
-        IFR(internetDownloader_.SendDownloadRequest(lowFilePosition, totalBytesToRead));
-        IFR(internetDownloader_.DownloadRequestIntoBuffer(&streamMemory_[lowFilePosition], totalBytesToRead, OUT totalBytesActuallyRead));
+            for (auto tag : metadataTableTags)
+            {
+                AppendTableRange(OpenTypeFileReader::FindTable(tableRecords, tag), IN OUT ranges);
+            }
+        }
+
+        return DownloadMissingChunkAlignedRanges(IN OUT ranges);
+    }
+
+
+    // Downloads just what is needed to draw the given characters and glyphs
+    // of one face in the file: the tables mapping characters to glyphs and
+    // glyphs to outlines, then only those outlines, including the components
+    // of composite glyphs. TrueType and CFF outlines are understood. Other
+    // formats (bitmap only fonts) are left to be read on demand.
+    HRESULT DownloadGlyphs(
+        uint32_t faceIndex,
+        array_ref<char32_t const> characters,
+        array_ref<uint16_t const> glyphIds
+        )
+    {
+        TraceSpan traceSpan(L"RemoteFontFileStream::DownloadGlyphs");
+
+        std::vector<OpenTypeFileReader::TableRecord> tableRecords;
+        IFR(DownloadTableRecords(faceIndex, OUT tableRecords));
+
+        auto* headRecord = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('h','e','a','d'));
+        auto* maxpRecord = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('m','a','x','p'));
+        auto* cmapRecord = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('c','m','a','p'));
+        auto* locaRecord = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('l','o','c','a'));
+        auto* glyfRecord = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('g','l','y','f'));
+        auto* cffRecord  = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('C','F','F',' '));
+        bool const isCff2 = (cffRecord == nullptr);
+        if (isCff2)
+            cffRecord = OpenTypeFileReader::FindTable(tableRecords, OpenTypeFileReader::MakeTag('C','F','F','2'));
+
+        if (maxpRecord == nullptr)
+            return DWRITE_E_FILEFORMAT;
+
+        // Get the mapping tables in one batch, along with the first chunk of
+        // the CFF table, which usually holds everything before the outlines.
+        std::vector<Range> ranges;
+        AppendTableRange(headRecord, IN OUT ranges);
+        AppendTableRange(maxpRecord, IN OUT ranges);
+        AppendTableRange(locaRecord, IN OUT ranges);
+        if (!characters.empty())
+            AppendTableRange(cmapRecord, IN OUT ranges);
+        if (cffRecord != nullptr)
+            ranges.push_back(GetChunkAlignedRange(cffRecord->offset, std::min(uint64_t(cffRecord->length), chunkSize_)));
+        IFR(DownloadMissingChunkAlignedRanges(IN OUT ranges));
+
+        uint32_t const glyphCount = OpenTypeFileReader::ReadGlyphCount(GetLocalTable(*maxpRecord));
+
+        std::vector<uint16_t> pendingGlyphIds(glyphIds.begin(), glyphIds.end());
+        if (!characters.empty() && cmapRecord != nullptr)
+        {
+            auto cmapTable = GetLocalTable(*cmapRecord);
+            uint32_t const subtableOffset = OpenTypeFileReader::FindUnicodeCmapSubtable(cmapTable);
+            if (subtableOffset != 0)
+            {
+                for (auto ch : characters)
+                {
+                    pendingGlyphIds.push_back(OpenTypeFileReader::MapCharacter(cmapTable, subtableOffset, ch));
+                }
+            }
+        }
+
+        // Keep each valid glyph once. Glyph 0 is always wanted, to draw any
+        // characters missing from the font.
+        std::vector<bool> isGlyphRequested(glyphCount);
+        pendingGlyphIds.push_back(0);
+        pendingGlyphIds.erase(
+            std::remove_if(
+                pendingGlyphIds.begin(),
+                pendingGlyphIds.end(),
+                [&](uint16_t glyphId) -> bool
+                {
+                    if (glyphId >= glyphCount || isGlyphRequested[glyphId])
+                        return true;
+                    isGlyphRequested[glyphId] = true;
+                    return false;
+                }
+                ),
+            pendingGlyphIds.end()
+            );
+
+        if (glyfRecord != nullptr && locaRecord != nullptr && headRecord != nullptr)
+        {
+            auto locaTable = GetLocalTable(*locaRecord);
+            bool const isLongFormat = OpenTypeFileReader::IsLongGlyphLocationFormat(GetLocalTable(*headRecord));
+
+            // Download the outlines a level at a time, since the components
+            // of composite glyphs are only known once their outlines arrive.
+            std::vector<uint16_t> componentGlyphIds;
+            while (!pendingGlyphIds.empty())
+            {
+                ranges.clear();
+                for (auto glyphId : pendingGlyphIds)
+                {
+                    Range glyphRange;
+                    if (OpenTypeFileReader::ReadGlyphDataRange(locaTable, isLongFormat, glyphId, OUT glyphRange)
+                    &&  glyphRange.end > glyphRange.begin
+                    &&  glyphRange.end <= glyfRecord->length)
+                    {
+                        ranges.push_back(GetChunkAlignedRange(glyfRecord->offset + glyphRange.begin, glyphRange.end - glyphRange.begin));
+                    }
+                }
+                IFR(DownloadMissingChunkAlignedRanges(IN OUT ranges));
+
+                OpenTypeFileReader::ReadComponentGlyphs(
+                    locaTable,
+                    isLongFormat,
+                    GetLocalTable(*glyfRecord),
+                    pendingGlyphIds,
+                    IN OUT isGlyphRequested,
+                    OUT componentGlyphIds
+                    );
+                pendingGlyphIds.swap(componentGlyphIds);
+            }
+        }
+        else if (cffRecord != nullptr)
+        {
+            // Find the outlines, fetching more of the table if the parts
+            // before them run past the first chunk.
+            OpenTypeFileReader::CffIndex charStringsIndex;
+            uint64_t requiredSize;
+            while (!OpenTypeFileReader::ReadCffCharStringsIndex(GetLocalTable(*cffRecord), isCff2, OUT charStringsIndex, OUT requiredSize))
+            {
+                if (requiredSize > cffRecord->length || GetLocalTable(*cffRecord).size() >= requiredSize)
+                    return DWRITE_E_FILEFORMAT;
+
+                ranges.assign(1, GetChunkAlignedRange(cffRecord->offset, requiredSize));
+                IFR(DownloadMissingChunkAlignedRanges(IN OUT ranges));
+                if (GetLocalTable(*cffRecord).size() < requiredSize)
+                    return E_FAIL; // The download failed without saying why.
+            }
+
+            // Outlines call into shared subroutines, which are only found by
+            // interpreting them. So take everything in the table except the
+            // other glyphs' outlines, which are normally the bulk of it.
+            auto cffTable = GetLocalTable(*cffRecord);
+            uint64_t const charStringsBegin = charStringsIndex.dataOffset + 1;
+            uint64_t const charStringsEnd = std::min(charStringsIndex.endOffset, uint64_t(cffRecord->length));
+            ranges.clear();
+            ranges.push_back(GetChunkAlignedRange(cffRecord->offset, std::min(charStringsBegin, charStringsEnd)));
+            if (charStringsEnd < cffRecord->length)
+                ranges.push_back(GetChunkAlignedRange(cffRecord->offset + charStringsEnd, cffRecord->length - charStringsEnd));
+
+            for (auto glyphId : pendingGlyphIds)
+            {
+                Range glyphRange = OpenTypeFileReader::GetCffIndexItem(cffTable, charStringsIndex, glyphId);
+                if (glyphRange.end > glyphRange.begin && glyphRange.end <= cffRecord->length)
+                {
+                    ranges.push_back(GetChunkAlignedRange(cffRecord->offset + glyphRange.begin, glyphRange.end - glyphRange.begin));
+                }
+            }
+            IFR(DownloadMissingChunkAlignedRanges(IN OUT ranges));
+        }
+
+        return S_OK;
+    }
+
+
+    // Reads the table directory of a face, downloading it first if needed.
+    HRESULT DownloadTableRecords(
+        uint32_t faceIndex,
+        _Out_ std::vector<OpenTypeFileReader::TableRecord>& tableRecords
+        )
+    {
+        tableRecords.clear();
 
-        LARGE_INTEGER filePosition; filePosition.QuadPart = lowFilePosition;
-        SetFilePointerEx(fileHandle_, filePosition, nullptr, FILE_BEGIN);
-        WriteFile(fileHandle_, &streamMemory_[lowFilePosition], static_cast<uint32_t>(totalBytesActuallyRead), nullptr, nullptr);
+        std::vector<uint32_t> directoryOffsets;
+        uint64_t requiredSize;
+        if (!EnsureLocalPrefix(std::min(chunkSize_, fileSize_)))
+            return E_FAIL; // The download failed without saying why.
 
-        // Update the chunk map.
-        for (auto chunkMapIndex = lowChunkMapIndex; chunkMapIndex < highChunkMapIndex; ++chunkMapIndex)
+        if (!OpenTypeFileReader::ReadFontDirectoryOffsets(GetLocalPrefix(), OUT directoryOffsets, OUT requiredSize))
         {
-            chunkMap_[chunkMapIndex] = true;
+            if (!EnsureLocalPrefix(requiredSize)
+            ||  !OpenTypeFileReader::ReadFontDirectoryOffsets(GetLocalPrefix(), OUT directoryOffsets, OUT requiredSize))
+            {
+                return DWRITE_E_FILEFORMAT;
+            }
         }
 
-        // Updated the chunkmap file contents.
-        SetFilePointer(chunkMapFileHandle_, lowChunkMapIndex, nullptr, FILE_BEGIN);
-        WriteFile(chunkMapFileHandle_, chunkMap_.data() + lowChunkMapIndex, static_cast<uint32_t>(highChunkMapIndex - lowChunkMapIndex), nullptr, nullptr);
+        if (faceIndex >= directoryOffsets.size() || directoryOffsets[faceIndex] >= fileSize_)
+            return DWRITE_E_FILEFORMAT;
+
+        uint32_t const directoryOffset = directoryOffsets[faceIndex];
+        if (!OpenTypeFileReader::ReadTableRecords(GetLocalFragment(directoryOffset), 0, OUT tableRecords, OUT requiredSize))
+        {
+            std::vector<Range> ranges(1, GetChunkAlignedRange(directoryOffset, std::min(requiredSize, fileSize_ - directoryOffset)));
+            IFR(DownloadMissingChunkAlignedRanges(IN OUT ranges));
+            if (!OpenTypeFileReader::ReadTableRecords(GetLocalFragment(directoryOffset), 0, OUT tableRecords, OUT requiredSize))
+                return DWRITE_E_FILEFORMAT;
+        }
 
         return S_OK;
     }
 
 
-    IFACEMETHODIMP IsFileFragmentLocal(
-        uint64_t fileOffset,
-        uint64_t fragmentSize,
-        _Out_ BOOL* isLocal
+    void AppendTableRange(
+        _In_opt_ OpenTypeFileReader::TableRecord const* tableRecord,
+        _Inout_ std::vector<Range>& ranges
+        )
+    {
+        if (tableRecord == nullptr
+        ||  tableRecord->length == 0
+        ||  tableRecord->offset >= fileSize_
+        ||  tableRecord->length > fileSize_ - tableRecord->offset)
+        {
+            return; // Absent or bogus. DirectWrite will validate it anyway.
+        }
+        ranges.push_back(GetChunkAlignedRange(tableRecord->offset, tableRecord->length));
+    }
+
+
+    // Returns the present part of a table, from its start up to its end or
+    // the first missing chunk.
+    const_byte_array_ref GetLocalTable(OpenTypeFileReader::TableRecord const& tableRecord) const throw()
+    {
+        auto data = GetLocalFragment(tableRecord.offset);
+        return const_byte_array_ref(data.data(), std::min(data.size(), size_t(tableRecord.length)));
+    }
+
+
+    // Drops the ranges (or their leading and trailing chunks) already
+    // present, so a prefetch of a mostly cached file costs nothing, then
+    // downloads the rest as one batch.
+    HRESULT DownloadMissingChunkAlignedRanges(_Inout_ std::vector<Range>& ranges)
+    {
+        size_t keptCount = 0;
+        for (auto range : ranges)
+        {
+            uint32_t lowChunkIndex = uint32_t(range.begin / chunkSize_);
+            uint32_t highChunkIndex = uint32_t((range.end + chunkSize_ - 1) / chunkSize_);
+            if (!chunkMap_.FindFirstMissingChunk(lowChunkIndex, highChunkIndex, OUT lowChunkIndex))
+                continue;
+
+            while (highChunkIndex > lowChunkIndex + 1 && !IsChunkMissing(highChunkIndex - 1))
+                --highChunkIndex;
+
+            range.begin = lowChunkIndex * chunkSize_;
+            range.end = std::min(highChunkIndex * chunkSize_, fileSize_);
+            ranges[keptCount++] = range;
+        }
+        ranges.resize(keptCount);
+
+        if (ranges.empty())
+            return S_OK;
+
+        return DownloadChunkAlignedRanges(IN OUT ranges);
+    }
+
+
+    bool IsChunkMissing(uint32_t chunkIndex) const throw()
+    {
+        uint32_t missingChunkIndex;
+        return chunkMap_.FindFirstMissingChunk(chunkIndex, chunkIndex + 1, OUT missingChunkIndex);
+    }
+
+
+    // Returns the longest run of present bytes at the start of the file.
+    const_byte_array_ref GetLocalPrefix() const throw()
+    {
+        return GetLocalFragment(0);
+    }
+
+
+    // Returns the run of present bytes starting at the offset, clipped to
+    // the first missing chunk.
+    const_byte_array_ref GetLocalFragment(uint64_t fileOffset) const throw()
+    {
+        if (fileOffset >= fileSize_)
+            return const_byte_array_ref();
+
+        uint32_t missingChunkIndex;
+        chunkMap_.FindFirstMissingChunk(uint32_t(fileOffset / chunkSize_), chunkCount_, OUT missingChunkIndex);
+        uint64_t const endOffset = std::min(uint64_t(missingChunkIndex) * chunkSize_, fileSize_);
+        if (endOffset <= fileOffset)
+            return const_byte_array_ref();
+
+        return const_byte_array_ref(&streamMemory_[fileOffset], size_t(endOffset - fileOffset));
+    }
+
+
+    bool EnsureLocalPrefix(uint64_t requiredSize)
+    {
+        if (requiredSize > fileSize_)
+            return false;
+
+        std::vector<Range> ranges(1, GetChunkAlignedRange(0, requiredSize));
+        DownloadMissingChunkAlignedRanges(IN OUT ranges);
+        return GetLocalPrefix().size() >= requiredSize;
+    }
+
+
+    // Stores bytes downloaded elsewhere, such as the first chunk read along
+    // with the file information before the file existed.
+    HRESULT WriteDownloadedRange(
+        uint64_t lowFilePosition, // chunk aligned
+        const_byte_array_ref data
+        )
+    {
+        if (lowFilePosition > fileSize_ || data.size() > fileSize_ - lowFilePosition)
+            return E_INVALIDARG;
+
+        if (data.empty())
+            return S_OK;
+
+        memcpy(&streamMemory_[lowFilePosition], data.data(), data.size());
+        CommitDownloadedRange(lowFilePosition, data.size());
+        return PrefetchMetadataTables();
+    }
+
+
+    void CommitDownloadedRange(
+        uint64_t lowFilePosition, // chunk aligned
+        uint64_t totalBytesActuallyRead
+        )
+    {
+        uint64_t const highFilePosition = lowFilePosition + totalBytesActuallyRead;
+
+        // The bytes were downloaded straight into the mapped view. They must
+        // reach the disk before the chunk map claims them, so that a crash in
+        // between only loses chunks rather than leaving ones marked present
+        // with garbage in them.
+        if (!FlushViewOfFile(&streamMemory_[lowFilePosition], size_t(totalBytesActuallyRead)))
+            return; // Leave the chunks marked missing so they are fetched again.
+
+        FlushFileBuffers(fileHandle_);
+
+        // Update the chunk map, only marking chunks that were completely
+        // read (or that end at the end of the file).
+        uint32_t const lowChunkMapIndex = uint32_t(lowFilePosition / chunkSize_);
+        uint32_t const highChunkMapIndex = (highFilePosition >= fileSize_)
+                                         ? chunkCount_
+                                         : uint32_t(highFilePosition / chunkSize_);
+        MarkChunksPresent(lowChunkMapIndex, highChunkMapIndex);
+
+        FontCacheManager::GetInstance().OnFileSizeChanged(fileName_, GetLocalByteCount());
+        HashContentIfComplete();
+    }
+
+
+    // Bytes the cached file and its chunk map occupy on disk.
+    uint64_t GetLocalByteCount()
+    {
+        UINT64 localFileSize = 0;
+        GetLocalFileSize(OUT &localFileSize);
+        return localFileSize + sizeof(ChunkMapHeader) + ChunkBitset::GetWordCount(chunkCount_) * sizeof(uint64_t);
+    }
+
+
+    // Reports whether the fragment's first byte is local, and how far from
+    // there the bytes stay that way, up to the first chunk that differs.
+    IFACEMETHODIMP GetFileFragmentLocality(
+        UINT64 fileOffset,
+        UINT64 fragmentSize,
+        _Out_ BOOL* isLocal,
+        _Out_range_(0, fragmentSize) UINT64* partialSize
         ) override
     {
         *isLocal = false;
-        return E_NOTIMPL;
+        *partialSize = 0;
+
+        if (fileOffset + fragmentSize < fileOffset || fileOffset + fragmentSize > fileSize_)
+            return E_INVALIDARG;
+
+        if (fragmentSize == 0)
+        {
+            *isLocal = true;
+            return S_OK;
+        }
+
+        uint32_t const lowChunkIndex = uint32_t(fileOffset / chunkSize_);
+        uint32_t const highChunkIndex = uint32_t((fileOffset + fragmentSize + chunkSize_ - 1) / chunkSize_);
+        bool const isFirstChunkLocal = !IsChunkMissing(lowChunkIndex);
+
+        uint32_t differingChunkIndex;
+        if (isFirstChunkLocal)
+            chunkMap_.FindFirstMissingChunk(lowChunkIndex, highChunkIndex, OUT differingChunkIndex);
+        else
+            chunkMap_.FindFirstPresentChunk(lowChunkIndex, highChunkIndex, OUT differingChunkIndex);
+
+        *isLocal = isFirstChunkLocal;
+        *partialSize = std::min(uint64_t(differingChunkIndex) * chunkSize_, uint64_t(fileOffset + fragmentSize)) - fileOffset;
+        return S_OK;
     }
 
 
     IFACEMETHODIMP_(DWRITE_LOCALITY) GetLocality() override
     {
-        return DWRITE_LOCALITY_REMOTE;
+        uint32_t const presentChunkCount = chunkMap_.CountPresentChunks();
+        if (presentChunkCount == chunkCount_)
+            return DWRITE_LOCALITY_LOCAL;
+
+        return (presentChunkCount == 0) ? DWRITE_LOCALITY_REMOTE : DWRITE_LOCALITY_PARTIAL;
+    }
+
+
+    // Downloads the fragments before returning, so there is never an async
+    // result to wait on. Callers are download threads, like the download
+    // manager's, which may block. Without fragments, it only needs the file
+    // information, which the stream already has by existing.
+    IFACEMETHODIMP BeginDownload(
+        _In_ UUID const* downloadOperationID,
+        _In_reads_(fragmentCount) DWRITE_FILE_FRAGMENT const* fileFragments,
+        UINT32 fragmentCount,
+        _COM_Outptr_result_maybenull_ IDWriteAsyncResult** asyncResult
+        ) override
+    {
+        *asyncResult = nullptr;
+        return DownloadFileFragments(fileFragments, fragmentCount);
     }
 
 
@@ -698,8 +2942,7 @@ public:
         _Out_ UINT64* localFileSize
         )
     {
-        // hack: should check chunkmap.
-        *localFileSize = fileSize_;
+        *localFileSize = chunkMap_.GetPresentByteCount(chunkSize_, fileSize_);
         return S_OK;
     }
 
@@ -716,28 +2959,13 @@ public:
     }
 
 
-    IFACEMETHODIMP PrefetchRemoteFileFragment(
-        uint64_t fileOffset,
-        uint64_t fragmentSize,
-        _Out_ BOOL* fileFragmentIsReady
-        )
-    {
-        IFR(CheckFileFragment(fileOffset, fragmentSize, OUT fileFragmentIsReady));
-        return S_OK;
-    }
-
-    IFACEMETHODIMP CancelDownload() throw() override
-    {
-        return E_NOTIMPL;
-    }
 };
 
 
 class RemoteStreamFontFileLoader : public ComBase<IDWriteRemoteFontFileLoader, RefCountBaseStatic>
 {
 protected:
-    ComPtr<IDWriteFontDownloadQueue> downloadManager_;
-    InternetDownloader internetDownloader_;
+    RemoteFontDownloadManager* downloadManager_ = nullptr; // The static singleton, optionally null.
 
 protected:
     IFACEMETHODIMP QueryInterface(IID const& iid, __out void** object) OVERRIDE
@@ -751,17 +2979,38 @@ protected:
 public:
     IFACEMETHODIMP CreateStreamFromKey(
         _In_reads_bytes_(fontFileReferenceKeySize) void const* fontFileReferenceKey,
-        uint32_t fontFileReferenceKeySize,
+        UINT32 fontFileReferenceKeySize,
         _COM_Outptr_ IDWriteFontFileStream** fontFileStream
         )
     {
-        if (fontFileReferenceKey == nullptr || fontFileReferenceKeySize < sizeof(wchar_t))
-            return E_INVALIDARG;
+        *fontFileStream = nullptr;
+        ComPtr<IDWriteRemoteFontFileStream> remoteFontFileStream;
+        IFR(CreateRemoteStreamFromKey(fontFileReferenceKey, fontFileReferenceKeySize, OUT &remoteFontFileStream));
+        *fontFileStream = remoteFontFileStream.Detach();
+        return S_OK;
+    }
+
+
+    // The key is the URL, nul terminated. Until the file information has been
+    // downloaded, this fails with DWRITE_E_REMOTEFONT, having queued it.
+    IFACEMETHODIMP CreateRemoteStreamFromKey(
+        _In_reads_bytes_(fontFileReferenceKeySize) void const* fontFileReferenceKey,
+        UINT32 fontFileReferenceKeySize,
+        _COM_Outptr_ IDWriteRemoteFontFileStream** fontFileStream
+        ) override
+    {
+        *fontFileStream = nullptr;
 
         const wchar_t* urlPointer = reinterpret_cast<const wchar_t*>(fontFileReferenceKey);
+        uint32_t const urlLength = fontFileReferenceKeySize / sizeof(wchar_t);
+        if (fontFileReferenceKey == nullptr || urlLength == 0 || wcsnlen(urlPointer, urlLength) >= urlLength)
+            return E_INVALIDARG;
+
+        auto* newFontFileStream = new(std::nothrow) RemoteFontFileStream();
+        if (newFontFileStream == nullptr)
+            return E_OUTOFMEMORY;
 
-        auto* newFontFileStream = new RemoteFontFileStream();
-        ComPtr<IDWriteFontFileStream> fontFileStreamScope(newFontFileStream);
+        ComPtr<IDWriteRemoteFontFileStream> fontFileStreamScope(newFontFileStream);
         IFR(newFontFileStream->Initialize(urlPointer, downloadManager_, this));
         *fontFileStream = fontFileStreamScope.Detach();
 
@@ -777,23 +3026,54 @@ public:
 
     IFACEMETHODIMP GetLocalityFromKey(
         _In_reads_bytes_(fontFileReferenceKeySize) void const* fontFileReferenceKey,
-        uint32_t fontFileReferenceKeySize,
+        UINT32 fontFileReferenceKeySize,
         _Out_ DWRITE_LOCALITY* fileLocality
         ) override
     {
-        // Hack - always return partial.
-        *fileLocality = DWRITE_LOCALITY_PARTIAL;
+        *fileLocality = DWRITE_LOCALITY_REMOTE;
+
+        ComPtr<IDWriteRemoteFontFileStream> fontFileStream;
+        HRESULT hr = CreateRemoteStreamFromKey(fontFileReferenceKey, fontFileReferenceKeySize, OUT &fontFileStream);
+        if (hr == DWRITE_E_REMOTEFONT)
+            return S_OK; // Nothing is cached yet.
+        IFR(hr);
+
+        *fileLocality = fontFileStream->GetLocality();
         return S_OK;
     }
 
 
-    IFACEMETHODIMP CreateRemoteStreamFromKey(
-        _In_reads_bytes_(fontFileReferenceKeySize) void const* fontFileReferenceKey,
-        UINT32 fontFileReferenceKeySize,
-        _COM_Outptr_ IDWriteRemoteFontFileStream** fontFileStream
+    // Makes a reference keyed by the URL. A relative URL is appended to the
+    // base, which should end with a slash.
+    IFACEMETHODIMP CreateFontFileReferenceFromUrl(
+        IDWriteFactory* factory,
+        _In_opt_z_ WCHAR const* baseUrl,
+        _In_z_ WCHAR const* fontFileUrl,
+        _COM_Outptr_ IDWriteFontFile** fontFile
         ) override
     {
-        return E_NOTIMPL;
+        *fontFile = nullptr;
+        if (factory == nullptr || fontFileUrl == nullptr)
+            return E_INVALIDARG;
+
+        try
+        {
+            std::wstring url;
+            if (baseUrl != nullptr && wcsstr(fontFileUrl, L"://") == nullptr)
+                url = baseUrl;
+            url += fontFileUrl;
+
+            return factory->CreateCustomFontFileReference(
+                url.c_str(),
+                static_cast<uint32_t>((url.size() + 1) * sizeof(wchar_t)),
+                this,
+                OUT fontFile
+                );
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
     }
 
 
@@ -805,18 +3085,36 @@ public:
         const wchar_t* urlPointer = reinterpret_cast<const wchar_t*>(fontFileReferenceKey);
         std::wstring url(urlPointer);
         std::wstring fileName;
-        RemoteFontFileStream::GetFileNameFromUrl(url, OUT fileName);
+        FontContentStore::ContentHash contentHash;
+        uint64_t fileSize;
+        bool isVerified;
 
-        auto fileAttributes = GetFileAttributes(fileName.c_str());
-        if (fileAttributes != INVALID_FILE_ATTRIBUTES && !(fileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+        if (FontContentStore::ReadManifest(url, OUT contentHash, OUT fileSize, OUT isVerified))
         {
-            return S_OK; // Already created.
+            FontContentStore::GetContentFileName(contentHash, OUT fileName);
+            if (DoesFileExist(fileName))
+                return S_OK; // Already created.
+
+            // Otherwise the content was evicted. Start over.
         }
 
-        // Read the date from the server.
-        uint64_t fileSize;
+        // Read the size and date from the server, and the first chunk, which
+        // holds the table directory that is read right away.
         FILETIME fileTime = { 0xFFFFFFFF, 0xFFFFFFFF };
-        internetDownloader_.GetFileSizeAndDate(url, OUT fileSize, OUT fileTime);
+        IFR(RangeDownloadEngine::GetInstance().GetFileInformationAndWait(url, OUT fileSize, OUT fileTime));
+
+        std::vector<uint8_t> firstChunk;
+        IFR(DownloadFirstChunk(url, fileSize, OUT firstChunk));
+
+        // Download into a file of this URL's own until all of it is verified.
+        IFR(FontContentStore::GetUrlContentHash(url, OUT contentHash));
+        FontContentStore::GetContentFileName(contentHash, OUT fileName);
+
+        // Any chunk map left from an earlier download describes bytes that
+        // are about to be truncated away.
+        std::wstring chunkMapFileName;
+        FontCacheManager::GetChunkMapFileName(fileName, OUT chunkMapFileName);
+        DeleteFile(chunkMapFileName.c_str());
 
         // Create the sparse file.
         FileHandle fileHandle = CreateFile(
@@ -824,7 +3122,7 @@ public:
             GENERIC_READ|GENERIC_WRITE,
             0, // No file sharing allowed until size and date or set, not even FILE_SHARE_READ.
             nullptr,
-            OPEN_ALWAYS,
+            CREATE_ALWAYS,
             FILE_ATTRIBUTE_NORMAL,
             nullptr
             );
@@ -851,21 +3149,66 @@ public:
         SetEndOfFile(fileHandle);
         SetFileTime(fileHandle, nullptr, &fileTime, &fileTime);
 
-        fileHandle.clear();
+        fileHandle.clear();
+
+        // Nothing is downloaded yet, but start tracking it.
+        FontCacheManager::GetInstance().OnFileSizeChanged(fileName, 0);
+
+        IFR(FontContentStore::WriteManifest(url, contentHash, fileSize, /*isVerified*/ false));
+
+        // Keep the first chunk rather than download it again.
+        ComPtr<IDWriteFontFileStream> fontFileStream;
+        IFR(CreateStreamFromKey(fontFileReferenceKey, fontFileReferenceKeySize, OUT &fontFileStream));
+        return static_cast<RemoteFontFileStream*>(fontFileStream.Get())->WriteDownloadedRange(0, firstChunk);
+    }
+
 
-        return S_OK;
+    static bool DoesFileExist(std::wstring const& fileName)
+    {
+        auto fileAttributes = GetFileAttributes(fileName.c_str());
+        return fileAttributes != INVALID_FILE_ATTRIBUTES && !(fileAttributes & FILE_ATTRIBUTE_DIRECTORY);
     }
 
 
-    void SetDownloadManager(IDWriteFontDownloadQueue* downloadManager)
+    static HRESULT DownloadFirstChunk(
+        std::wstring const& url,
+        uint64_t fileSize,
+        _Out_ std::vector<uint8_t>& firstChunk
+        )
     {
-        downloadManager_ = downloadManager;
+        firstChunk.clear();
+        if (fileSize == 0)
+            return S_OK;
+
+        try
+        {
+            firstChunk.resize(size_t(std::min(fileSize, RemoteFontFileStream::chunkSize_)));
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        RangeRequest rangeRequest = { 0, firstChunk.size(), firstChunk.data() };
+        uint32_t const requestRangeCount = 1;
+        std::vector<uint64_t> bytesActuallyRead;
+        IFR(RangeDownloadEngine::GetInstance().DownloadRangesAndWait(
+            url,
+            { &rangeRequest, 1 },
+            { &requestRangeCount, 1 },
+            OUT bytesActuallyRead
+            ));
+
+        if (bytesActuallyRead.empty() || bytesActuallyRead.front() != firstChunk.size())
+            return HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+
+        return S_OK;
     }
 
-    void Finalize() override
+
+    void SetDownloadManager(RemoteFontDownloadManager* downloadManager)
     {
-        downloadManager_.clear();
-        internetDownloader_.clear();
+        downloadManager_ = downloadManager;
     }
   
 private:  
@@ -878,25 +3221,43 @@ RemoteStreamFontFileLoader RemoteStreamFontFileLoader::singleton_;
 class RemoteFontDownloadManager : public ComBase<IDWriteFontDownloadQueue, RefCountBaseStatic>
 {
 private:
+    struct EnqueuedGlyphs
+    {
+        uint32_t faceIndex;
+        std::vector<char32_t> characters;
+        std::vector<uint16_t> glyphIds;
+    };
+
     struct EnqueuedRequest
     {
         ComPtr<IDWriteFontFileLoader> fontLoader;
         std::vector<uint8_t> fileKey;
         std::vector<Range> ranges;
+        std::vector<EnqueuedGlyphs> glyphs; // Mapped to ranges once the file's tables are read.
     };
 
-    struct RangeComparer
+    struct DownloadContext
     {
-        bool operator() (const Range& lhs, const Range& rhs) const throw()
-        {
-            if (lhs.begin < rhs.begin) return true;
-            if (lhs.begin > rhs.begin) return false;
-            return (lhs.end < rhs.end);
-        }
+        RemoteFontDownloadManager* manager;
+        ComPtr<IUnknown> context;
     };
 
     static RemoteFontDownloadManager singleton_;
-    std::vector<EnqueuedRequest> enqueuedRequests_;
+
+    // Requests are keyed by loader and file key, so repeated requests for
+    // the same file merge. The lock lets the UI thread reprioritize or
+    // cancel while a download works through the queue on a thread pool
+    // thread. Downloads run one at a time, in the order begun.
+    SRWLOCK lock_ = SRWLOCK_INIT;
+    CONDITION_VARIABLE idleCondition_ = CONDITION_VARIABLE_INIT;
+    DownloadScheduler scheduler_;
+    std::map<DownloadScheduler::Key, EnqueuedRequest> enqueuedRequests_;
+    std::vector<std::pair<uint32_t, ComPtr<IDWriteFontDownloadListener> > > listeners_;
+    uint32_t nextListenerToken_ = 1;
+    uint32_t pendingDownloadCount_ = 0; // Begun but not completed.
+    bool isDownloading_ = false;
+    uint64_t cancellationCount_ = 0;
+    LONG64 volatile generationCount_ = 0;
 
 protected:
     IFACEMETHODIMP QueryInterface(IID const& iid, __out void** object) OVERRIDE
@@ -912,38 +3273,102 @@ public:
         return &singleton_;
     }
 
-    STDMETHODIMP RegisterRemoteFontHandler(
-        IDWriteFontDownloadListener* remoteFontHandler
-        ) throw()
-    {
-        return E_NOTIMPL;
-    }
-
-    IFACEMETHODIMP UnregisterRemoteFontHandler(
-        IDWriteFontDownloadListener* remoteFontHandler
-        ) throw()
+    static RemoteFontDownloadManager* GetManagerInstance()
     {
-        return E_NOTIMPL;
+        return &singleton_;
     }
 
     IFACEMETHODIMP AddListener(
         IDWriteFontDownloadListener* listener,
-        _Out_ uint32_t* token
+        _Out_ UINT32* token
         ) throw() override
     {
-        return E_NOTIMPL;
+        *token = 0;
+        if (listener == nullptr)
+            return E_INVALIDARG;
+
+        try
+        {
+            ExclusiveLockScope lockScope(lock_);
+            listeners_.push_back(std::make_pair(nextListenerToken_, ComPtr<IDWriteFontDownloadListener>(listener)));
+            *token = nextListenerToken_++;
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
     }
 
     IFACEMETHODIMP RemoveListener(
-        uint32_t token
+        UINT32 token
         ) throw() override
     {
-        return E_NOTIMPL;
+        ExclusiveLockScope lockScope(lock_);
+        for (auto it = listeners_.begin(); it != listeners_.end(); ++it)
+        {
+            if (it->first == token)
+            {
+                listeners_.erase(it);
+                return S_OK;
+            }
+        }
+        return E_INVALIDARG;
+    }
+
+    IFACEMETHODIMP_(BOOL) IsEmpty() throw() override
+    {
+        ExclusiveLockScope lockScope(lock_);
+        return scheduler_.empty();
+    }
+
+    IFACEMETHODIMP_(UINT64) GetGenerationCount() throw() override
+    {
+        return static_cast<UINT64>(generationCount_);
+    }
+
+    // Moves the waiting requests for a font's file to another priority, such
+    // as when its row scrolls into or out of view.
+    HRESULT SetFontDownloadPriority(
+        IDWriteFontFaceReference* fontFaceReference,
+        DownloadScheduler::Priority priority
+        )
+    {
+        try
+        {
+            DownloadScheduler::Key schedulerKey;
+            IFR(GetSchedulerKey(fontFaceReference, OUT schedulerKey));
+
+            ExclusiveLockScope lockScope(lock_);
+            return scheduler_.SetPriority(schedulerKey, priority) ? S_OK : S_FALSE;
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
     }
 
-    IFACEMETHODIMP_(BOOL) IsQueueEmpty() throw() override
+    // Drops the waiting requests for a font's file. A download already
+    // under way for it finishes.
+    HRESULT CancelFontDownload(IDWriteFontFaceReference* fontFaceReference)
     {
-        return enqueuedRequests_.empty();
+        try
+        {
+            DownloadScheduler::Key schedulerKey;
+            IFR(GetSchedulerKey(fontFaceReference, OUT schedulerKey));
+
+            ExclusiveLockScope lockScope(lock_);
+            if (!scheduler_.Cancel(schedulerKey))
+                return S_FALSE;
+
+            enqueuedRequests_.erase(schedulerKey);
+            return S_OK;
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
     }
 
     IFACEMETHODIMP EnqueueFileFragmentDownload(
@@ -954,35 +3379,113 @@ public:
         UINT64 fragmentSize
         ) throw()
     {
-        EnqueuedRequest* newRequest = nullptr;
-        for (auto& existingRequest : enqueuedRequests_)
+        try
         {
-            if (existingRequest.fileKey.size() == fileKeySize
-            &&  memcmp(existingRequest.fileKey.data(), fileKey, fileKeySize) == 0)
-            {
-                // Found an existing request with the same file key.
-                newRequest = &existingRequest;
-            }
+            ExclusiveLockScope lockScope(lock_);
+            Range range = { fileOffset, fileOffset + fragmentSize };
+            GetEnqueuedRequest(fontLoader, fileKey, fileKeySize).ranges.push_back(range);
         }
-        if (newRequest == nullptr)
+        catch (...)
         {
-            enqueuedRequests_.resize(enqueuedRequests_.size() + 1);
-            newRequest = &enqueuedRequests_.back();
-            uint8_t const* byteKey = reinterpret_cast<uint8_t const*>(fileKey);
-            newRequest->fontLoader = fontLoader;
-            newRequest->fileKey.assign(byteKey, byteKey + fileKeySize);
+            return E_OUTOFMEMORY;
         }
-        Range range = { uint32_t(fileOffset), uint32_t(fileOffset + fragmentSize) };
-        newRequest->ranges.push_back(range);
 
         return S_OK;
     }
 
-    IFACEMETHODIMP EnqueueFontDownload(
-        IDWriteFontFaceReference* fontFaceReference
-        ) throw()
+
+    static void MakeSchedulerKey(
+        IDWriteFontFileLoader* fontLoader,
+        _In_reads_(fileKeySize) void const* fileKey,
+        UINT32 fileKeySize,
+        _Out_ DownloadScheduler::Key& schedulerKey
+        )
+    {
+        // The same key may mean different files to different loaders.
+        uint8_t const* loaderBytes = reinterpret_cast<uint8_t const*>(&fontLoader);
+        uint8_t const* byteKey = reinterpret_cast<uint8_t const*>(fileKey);
+        schedulerKey.assign(loaderBytes, loaderBytes + sizeof(fontLoader));
+        schedulerKey.insert(schedulerKey.end(), byteKey, byteKey + fileKeySize);
+    }
+
+
+    static HRESULT GetSchedulerKey(
+        IDWriteFontFaceReference* fontFaceReference,
+        _Out_ DownloadScheduler::Key& schedulerKey
+        )
+    {
+        schedulerKey.clear();
+        if (fontFaceReference == nullptr)
+            return E_INVALIDARG;
+
+        ComPtr<IDWriteFontFile> fontFile;
+        ComPtr<IDWriteFontFileLoader> fontLoader;
+        void const* fileKey;
+        uint32_t fileKeySize;
+        IFR(fontFaceReference->GetFontFile(OUT &fontFile));
+        IFR(fontFile->GetLoader(OUT &fontLoader));
+        IFR(fontFile->GetReferenceKey(OUT &fileKey, OUT &fileKeySize));
+        MakeSchedulerKey(fontLoader, fileKey, fileKeySize, OUT schedulerKey);
+        return S_OK;
+    }
+
+
+    // Lock must be held. Returns the waiting request for the file, creating
+    // it if needed. Files are queued as their text is drawn, so they start
+    // out visible, and the list lowers them as their rows scroll away.
+    EnqueuedRequest& GetEnqueuedRequest(
+        IDWriteFontFileLoader* fontLoader,
+        _In_reads_(fileKeySize) void const* fileKey,
+        UINT32 fileKeySize
+        )
+    {
+        DownloadScheduler::Key schedulerKey;
+        MakeSchedulerKey(fontLoader, fileKey, fileKeySize, OUT schedulerKey);
+
+        auto& request = enqueuedRequests_[schedulerKey];
+        if (scheduler_.Enqueue(schedulerKey, DownloadScheduler::PriorityVisible))
+        {
+            uint8_t const* byteKey = reinterpret_cast<uint8_t const*>(fileKey);
+            request.fontLoader = fontLoader;
+            request.fileKey.assign(byteKey, byteKey + fileKeySize);
+        }
+        return request;
+    }
+
+
+    // Lock must be held.
+    HRESULT GetEnqueuedGlyphs(
+        IDWriteFontFaceReference* fontFaceReference,
+        _Out_ EnqueuedGlyphs*& enqueuedGlyphs
+        )
     {
-        return E_NOTIMPL;
+        enqueuedGlyphs = nullptr;
+        if (fontFaceReference == nullptr)
+            return E_INVALIDARG;
+
+        ComPtr<IDWriteFontFile> fontFile;
+        ComPtr<IDWriteFontFileLoader> fontLoader;
+        void const* fileKey;
+        uint32_t fileKeySize;
+        IFR(fontFaceReference->GetFontFile(OUT &fontFile));
+        IFR(fontFile->GetLoader(OUT &fontLoader));
+        IFR(fontFile->GetReferenceKey(OUT &fileKey, OUT &fileKeySize));
+        uint32_t const faceIndex = fontFaceReference->GetFontFaceIndex();
+
+        auto& request = GetEnqueuedRequest(fontLoader, fileKey, fileKeySize);
+        for (auto& existingGlyphs : request.glyphs)
+        {
+            if (existingGlyphs.faceIndex == faceIndex)
+            {
+                enqueuedGlyphs = &existingGlyphs;
+                return S_OK;
+            }
+        }
+
+        request.glyphs.resize(request.glyphs.size() + 1);
+        enqueuedGlyphs = &request.glyphs.back();
+        enqueuedGlyphs->faceIndex = faceIndex;
+        return S_OK;
     }
 
     IFACEMETHODIMP EnqueueCharactersDownload(
@@ -991,7 +3494,24 @@ public:
         UINT32 characterCount
         ) throw()
     {
-        return E_NOTIMPL;
+        try
+        {
+            ExclusiveLockScope lockScope(lock_);
+            EnqueuedGlyphs* enqueuedGlyphs;
+            IFR(GetEnqueuedGlyphs(fontFaceReference, OUT enqueuedGlyphs));
+
+            auto& enqueuedCharacters = enqueuedGlyphs->characters;
+            size_t const previousCount = enqueuedCharacters.size();
+            enqueuedCharacters.resize(previousCount + characterCount);
+            size_t const convertedCount = ConvertUtf16ToUtf32(characters, characterCount, OUT enqueuedCharacters.data() + previousCount, characterCount);
+            enqueuedCharacters.resize(previousCount + convertedCount);
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
     }
 
     IFACEMETHODIMP EnqueueGlyphsDownload(
@@ -1000,252 +3520,378 @@ public:
         UINT32 glyphCount
         ) throw()
     {
-        return E_NOTIMPL;
+        try
+        {
+            ExclusiveLockScope lockScope(lock_);
+            EnqueuedGlyphs* enqueuedGlyphs;
+            IFR(GetEnqueuedGlyphs(fontFaceReference, OUT enqueuedGlyphs));
+            enqueuedGlyphs->glyphIds.insert(enqueuedGlyphs->glyphIds.end(), glyphs, glyphs + glyphCount);
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
     }
 
+    // Downloads the queue on a thread pool thread, since the requests block
+    // on the network, and then calls the listeners from there.
     IFACEMETHODIMP BeginDownload(_In_opt_ IUnknown* context) throw() override
     {
-        if (enqueuedRequests_.empty())
+        bool isIdle;
+        {
+            ExclusiveLockScope lockScope(lock_);
+            isIdle = scheduler_.empty() && pendingDownloadCount_ == 0;
+            if (!isIdle)
+                ++pendingDownloadCount_;
+        }
+
+        if (isIdle)
+        {
+            NotifyListeners(context, S_OK);
             return S_FALSE;
+        }
 
-        for (auto& request : enqueuedRequests_)
+        auto* downloadContext = new(std::nothrow) DownloadContext{ this, context };
+        if (downloadContext == nullptr || !TrySubmitThreadpoolCallback(&DownloadCallback, downloadContext, nullptr))
         {
-            if (request.fontLoader == nullptr || request.ranges.empty())
-                continue;
+            HRESULT hr = (downloadContext == nullptr) ? E_OUTOFMEMORY : HRESULT_FROM_WIN32(GetLastError());
+            delete downloadContext;
+            EndDownload();
+            return hr;
+        }
 
-            // Sort all the range requests into ascending order,
-            // coalescing adjacent ranges.
+        return S_OK;
+    }
+
+    // Waits for the downloads begun to complete, such as before exiting.
+    void WaitForDownloads()
+    {
+        ExclusiveLockScope lockScope(lock_);
+        while (pendingDownloadCount_ > 0)
+        {
+            SleepConditionVariableSRW(&idleCondition_, &lock_, INFINITE, 0);
+        }
+    }
 
-            auto& ranges = request.ranges;
-            std::sort(ranges.begin(), ranges.end(), RangeComparer());
-            size_t const oldRangesSize = ranges.size();
-            size_t currentRangeIndex = 1, newRangesSize = 1;
+protected:
+    static void CALLBACK DownloadCallback(PTP_CALLBACK_INSTANCE instance, void* context)
+    {
+        std::unique_ptr<DownloadContext> downloadContext(reinterpret_cast<DownloadContext*>(context));
+        auto* manager = downloadContext->manager;
 
-            for ( ; currentRangeIndex < oldRangesSize; ++currentRangeIndex)
+        // A later download completes after the earlier ones.
+        uint64_t cancellationCount;
+        {
+            ExclusiveLockScope lockScope(manager->lock_);
+            while (manager->isDownloading_)
             {
-                auto& previousRange = ranges[newRangesSize - 1];
-                auto& currentRange = ranges[currentRangeIndex];
-                if (currentRange.begin <= previousRange.end)
-                {
-                    previousRange.end = std::max(currentRange.end, previousRange.end); // Extend range.
-                }
-                else
-                {
-                    ranges[newRangesSize++] = currentRange; // Copy over a new range.
-                }
+                SleepConditionVariableSRW(&manager->idleCondition_, &manager->lock_, INFINITE, 0);
             }
-            ranges.resize(newRangesSize);
+            manager->isDownloading_ = true;
+            cancellationCount = manager->cancellationCount_;
+        }
 
-            // If there is an empty range, extend it to the granularity.
-            if (ranges.size() == 1 && ranges.front().end == 0)
-            {
-                ranges.front().end = RemoteFontFileStream::chunkSize_;
-            }
+        HRESULT hr = manager->DownloadEnqueuedRequests();
+
+        {
+            ExclusiveLockScope lockScope(manager->lock_);
+            manager->isDownloading_ = false;
+            if (manager->cancellationCount_ != cancellationCount)
+                hr = DWRITE_E_DOWNLOADCANCELLED;
+        }
+        InterlockedIncrement64(&manager->generationCount_);
 
-            ComPtr<IDWriteRemoteFontFileLoader> remoteFontFileLoader;
-            request.fontLoader->QueryInterface(OUT &remoteFontFileLoader);
-            if (remoteFontFileLoader != nullptr)
+        manager->NotifyListeners(downloadContext->context, hr);
+        downloadContext.reset();
+        manager->EndDownload();
+    }
+
+    void EndDownload()
+    {
+        ExclusiveLockScope lockScope(lock_);
+        --pendingDownloadCount_;
+        WakeAllConditionVariable(&idleCondition_);
+    }
+
+    // Calls the context, if it is a listener, and the registered listeners.
+    void NotifyListeners(_In_opt_ IUnknown* context, HRESULT downloadResult) throw()
+    {
+        ComPtr<IDWriteFontDownloadListener> contextListener;
+        if (context != nullptr)
+        {
+            context->QueryInterface(OUT &contextListener);
+            if (contextListener != nullptr)
+                contextListener->DownloadCompleted(this, context, downloadResult);
+        }
+
+        std::vector<std::pair<uint32_t, ComPtr<IDWriteFontDownloadListener> > > listeners;
+        try
+        {
+            ExclusiveLockScope lockScope(lock_);
+            listeners = listeners_;
+        }
+        catch (...)
+        {
+            return;
+        }
+
+        for (auto& listener : listeners)
+        {
+            listener.second->DownloadCompleted(this, context, downloadResult);
+        }
+    }
+
+    // Takes one request at a time, so that priority changes and
+    // cancellations made meanwhile apply to everything still waiting.
+    HRESULT DownloadEnqueuedRequests() throw()
+    {
+        // Keep going past a failed file, reporting the first failure.
+        HRESULT hr = S_OK;
+        try
+        {
+            for (;;)
             {
-                // remoteFontFileLoader->DownloadStreamInformationFromKey(
-                //     request.fileKey.data(),
-                //     uint32_t(request.fileKey.size())
-                //     );
+                EnqueuedRequest request;
+                {
+                    ExclusiveLockScope lockScope(lock_);
+                    DownloadScheduler::Key schedulerKey;
+                    if (!scheduler_.Dequeue(OUT schedulerKey))
+                        break;
+
+                    auto match = enqueuedRequests_.find(schedulerKey);
+                    request = std::move(match->second);
+                    enqueuedRequests_.erase(match);
+                }
+                HRESULT requestResult = DownloadRequest(IN OUT request);
+                if (SUCCEEDED(hr))
+                    hr = requestResult;
             }
+        }
+        catch (...)
+        {
+            return E_OUTOFMEMORY;
+        }
 
-            ComPtr<IDWriteFontFileStream> fontFileStream;
-            ComPtr<IDWriteRemoteFontFileStream> remoteFontFileStream;
-            request.fontLoader->CreateStreamFromKey(
-                request.fileKey.data(),
-                uint32_t(request.fileKey.size()),
-                OUT &fontFileStream
-                );
+        return hr;
+    }
+
+    // Downloads one file's request: the file information if needed, the
+    // fragment ranges coalesced, and for our own streams, the glyphs.
+    // Returns the first failure.
+    HRESULT DownloadRequest(_Inout_ EnqueuedRequest& request)
+    {
+        if (request.fontLoader == nullptr || (request.ranges.empty() && request.glyphs.empty()))
+            return S_OK;
+
+        ComPtr<IDWriteRemoteFontFileLoader> remoteFontFileLoader;
+        request.fontLoader->QueryInterface(OUT &remoteFontFileLoader);
+        if (remoteFontFileLoader == nullptr)
+            return S_OK; // A local loader, with nothing to download.
+
+        void const* fileKey = request.fileKey.data();
+        uint32_t const fileKeySize = static_cast<uint32_t>(request.fileKey.size());
+
+        // Our own loader's streams only exist once the file information is
+        // cached (which also brings the first chunk and the metadata tables),
+        // and its keys are URLs, whose server's measured costs apply.
+        auto* ownFontFileLoader = RemoteStreamFontFileLoader::GetInstance();
+        bool const isOwnFontFileLoader = (request.fontLoader.Get() == static_cast<IDWriteFontFileLoader*>(ownFontFileLoader));
+        uint64_t roundTripTime = RangeDownloadPlanner::defaultRoundTripTime;
+        uint64_t bytesPerSecond = RangeDownloadPlanner::defaultBytesPerSecond;
+        if (isOwnFontFileLoader)
+        {
+            IFR(ownFontFileLoader->DownloadStreamInformationFromKey(fileKey, fileKeySize));
+
+            std::wstring url(reinterpret_cast<wchar_t const*>(fileKey), fileKeySize / sizeof(wchar_t));
+            url.resize(wcsnlen(url.c_str(), url.size()));
+            RangeDownloadEngine::GetInstance().GetCostModel(url, OUT roundTripTime, OUT bytesPerSecond);
+        }
+
+        ComPtr<IDWriteRemoteFontFileStream> remoteFontFileStream;
+        IFR(remoteFontFileLoader->CreateRemoteStreamFromKey(fileKey, fileKeySize, OUT &remoteFontFileStream));
+
+        // Clip the ranges to the file, dropping the empty ones that only
+        // asked for the file information. Then sort them into ascending
+        // order, coalescing overlapping ranges and any separated by a gap
+        // cheaper to download than another request.
+        UINT64 fileSize;
+        IFR(remoteFontFileStream->GetFileSize(OUT &fileSize));
+
+        auto& ranges = request.ranges;
+        size_t keptCount = 0;
+        for (auto range : ranges)
+        {
+            range.end = std::min(range.end, uint64_t(fileSize));
+            if (range.begin < range.end)
+                ranges[keptCount++] = range;
+        }
+        ranges.resize(keptCount);
+        RangeDownloadPlanner::CoalesceRanges(IN OUT ranges, RangeDownloadPlanner::GetMaximumGapSize(roundTripTime, bytesPerSecond));
 
-            if (fontFileStream != nullptr)
+        std::vector<DWRITE_FILE_FRAGMENT> fileFragments;
+        fileFragments.reserve(ranges.size());
+        for (auto const& range : ranges)
+        {
+            DWRITE_FILE_FRAGMENT fileFragment = { range.begin, range.end - range.begin };
+            fileFragments.push_back(fileFragment);
+        }
+
+        // Other loaders' streams may download asynchronously, so wait.
+        HRESULT hr = S_OK;
+        if (!fileFragments.empty() || !isOwnFontFileLoader)
+        {
+            UUID const downloadOperationId = {};
+            ComPtr<IDWriteAsyncResult> asyncResult;
+            hr = remoteFontFileStream->BeginDownload(
+                &downloadOperationId,
+                fileFragments.data(),
+                static_cast<uint32_t>(fileFragments.size()),
+                OUT &asyncResult
+                );
+            if (SUCCEEDED(hr) && asyncResult != nullptr)
             {
-                fontFileStream->QueryInterface(OUT &remoteFontFileStream);
+                WaitForSingleObject(asyncResult->GetWaitHandle(), INFINITE);
+                hr = asyncResult->GetResult();
             }
-            if (remoteFontFileStream != nullptr)
+        }
+
+        // Our own streams can read the font's tables to map glyphs to just
+        // the bytes holding their outlines.
+        if (isOwnFontFileLoader)
+        {
+            auto* ownFontFileStream = static_cast<RemoteFontFileStream*>(remoteFontFileStream.Get());
+            for (auto const& glyphs : request.glyphs)
             {
-                for (auto const& range : ranges)
-                {
-                    // remoteFontFileStream->DownloadFileFragment(range.begin, range.end - range.begin);
-                }
+                HRESULT glyphsResult = ownFontFileStream->DownloadGlyphs(glyphs.faceIndex, glyphs.characters, glyphs.glyphIds);
+                if (SUCCEEDED(hr))
+                    hr = glyphsResult;
             }
-
-            request.fontLoader.Clear();
         }
 
-        CancelDownload();
-        return S_OK;
+        return hr;
     }
 
+public:
+    // Drops everything still waiting. A request already under way finishes,
+    // but the download then finds nothing more to do, and completes as
+    // cancelled.
     IFACEMETHODIMP CancelDownload() throw() override
     {
+        ExclusiveLockScope lockScope(lock_);
+        scheduler_.clear();
         enqueuedRequests_.clear();
-        return E_NOTIMPL;
-    }
-
-    void Finalize() override
-    {
-        //downloadManager_.clear();
+        ++cancellationCount_;
+        return S_OK;
     }
 };
 
 RemoteFontDownloadManager RemoteFontDownloadManager::singleton_;
 
 
-#if 0
-auto fontFileLoader = RemoteStreamFontFileLoader::GetInstance();
-IFR(dwriteFactory3p->RegisterFontFileLoader(fontFileLoader));
-fontFileLoader->SetDownloadManager(RemoteFontDownloadManager::GetInstance());
+void RemoteFontFileStream::EnqueueFileFragmentDownload(uint64_t fileOffset, uint64_t fragmentSize)
+{
+    if (downloadManager_ == nullptr)
+        return;
+
+    downloadManager_->EnqueueFileFragmentDownload(
+        fontFileLoader_,
+        url_.c_str(),
+        static_cast<uint32_t>((url_.size() + 1) * sizeof(url_[0])),
+        fileOffset,
+        fragmentSize
+        );
+}
+
 
-const wchar_t* urlList[] = {
-    L"http://dwayner-test/fonts/GoogleFontDirectory/alice/Alice-Regular.ttf",
-    L"http://dwayner-test/fonts/AdobeOpenType_fonts/ACaslonPro-Bold.otf",
-    L"http://dwayner-test/fonts/www.dafont.com/15x5.ttf",
-    L"http://dwayner-test/fonts/www.dafont.com/HVD_Peace.ttf",
-    L"http://dwayner-test/Fonts/AdobeOpenType_fonts/KozGoPr6N-Bold.otf",
-    L"http://dwayner-test/Fonts/www.dafont.com/catcrypt.ttf",
-};
-DWRITE_FONT_PROPERTY properties[][2] = {
-    { { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"Alice", L"en-us" },{ DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"Alice", L"en-us" }, },
-    { { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"Adobe Carlson Pro", L"en-us" },{ DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"Adobe Carlson Pro", L"en-us" }, },
-    { { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"15x5", L"en-us" },{ DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"15x5", L"en-us" }, },
-    { { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"HVD Peace", L"en-us" },{ DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"HVD Peace", L"en-us" }, },
-    { { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"Kozuka Gothic Pro", L"en-us" },{ DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"Kozuka Gothic Pro", L"en-us" }, },
-    { { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"Cat Crypt", L"en-us" },{ DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"Cat Crypt", L"en-us" }, },
-};
-static_assert(ARRAYSIZE(urlList) == ARRAYSIZE(properties), "Array sizes must match");
+bool IsRemoteFontUrl(_In_z_ wchar_t const* path) throw()
+{
+    return _wcsnicmp(path, L"http://", 7) == 0
+        || _wcsnicmp(path, L"https://", 8) == 0;
+}
 
-auto fontFileLoader = RemoteStreamFontFileLoader::GetInstance();
-dwriteFactory3p->RegisterFontFileLoader(fontFileLoader);
-fontFileLoader->SetDownloadManager(RemoteFontDownloadManager::GetInstance());
 
-for (uint32_t i = 0; i < ARRAYSIZE(urlList); ++i)
+HRESULT RegisterRemoteFontFileLoader(IDWriteFactory* factory)
 {
-    ComPtr<IDWriteFontFile> fontFile;
-    ComPtr<IDWriteFontFaceReference> fontFaceReference;
-
-    wchar_t const* fontFileReferenceKey = urlList[i];
-    uint32_t fontFileReferenceKeySize = (wcslen(fontFileReferenceKey) + 1) * sizeof(wchar_t);
-    IFR(dwriteFactory3p->CreateCustomFontFileReference(
-        fontFileReferenceKey,
-        fontFileReferenceKeySize,
-        fontFileLoader,
-        OUT &fontFile
-    ));
-
-    IFR(dwriteFactory3p->CreateFontFaceReference(
-        fontFile,
-        0, // faceIndex
-        DWRITE_FONT_SIMULATIONS_NONE,
-        OUT &fontFaceReference
-    ));
-
-    fontSetBuilder->AddFontFaceReference(
-        fontFaceReference,
-        &properties[i][0],
-        2 // propertiesCount
-    );
+    auto* fontFileLoader = RemoteStreamFontFileLoader::GetInstance();
+    fontFileLoader->SetDownloadManager(RemoteFontDownloadManager::GetManagerInstance());
+    return factory->RegisterFontFileLoader(fontFileLoader);
 }
 
-////////////////////////////////////////
-// Download the font set from the server.
-
-std::vector<uint8_t> rawJsonFile;
-InternetDownloader internetDownloader;
-IFR(internetDownloader.DownloadFile(g_fontSetUrl, OUT rawJsonFile));
-internetDownloader.clear();
-
-// Read all commands into a text tree.
-std::wstring fontSetText;
-ConvertText(rawJsonFile, OUT fontSetText);
-TextTree nodes;
-uint32_t textLength = static_cast<uint32_t>(fontSetText.size());
-JsonexParser parser(fontSetText.data(), textLength, TextTreeParser::OptionsNoEscapeSequence);
-parser.ReadNodes(IN OUT nodes);
-
-uint32_t nodeIndex = 0;
-if (!nodes.AdvanceChildNode(IN OUT nodeIndex) // skip the root node.
-    || nodes.GetNode(nodeIndex).type != TextTree::Node::TypeArray
-    || !nodes.AdvanceChildNode(IN OUT nodeIndex))
+
+HRESULT UnregisterRemoteFontFileLoader(IDWriteFactory* factory)
 {
-    return S_FALSE;
+    // Let any download under way finish with the loader before it goes.
+    auto* downloadManager = RemoteFontDownloadManager::GetManagerInstance();
+    downloadManager->CancelDownload();
+    downloadManager->WaitForDownloads();
+    return factory->UnregisterFontFileLoader(RemoteStreamFontFileLoader::GetInstance());
 }
 
-std::wstring filePath;
-std::wstring familyName;
-std::wstring fullName;
-std::wstring weight;
-std::wstring stretch;
-std::wstring slope;
-std::wstring value;
-uint32_t faceIndex = 0;
-
-DWRITE_FONT_PROPERTY properties[5] = {
-    { DWRITE_FONT_PROPERTY_ID_FULL_NAME, L"FullName", L"en-us" },
-    { DWRITE_FONT_PROPERTY_ID_WEIGHT_STRETCH_STYLE_FAMILY_NAME, L"WssFamilyName", L"en-us" },
-    { DWRITE_FONT_PROPERTY_ID_WEIGHT, L"Weight", L"" },
-    { DWRITE_FONT_PROPERTY_ID_STRETCH, L"Stretch", L"" },
-    { DWRITE_FONT_PROPERTY_ID_STYLE, L"Slope", L"" },
-};
 
-while (nodeIndex < nodes.GetNodeCount())
+HRESULT CreateRemoteFontFileReference(
+    IDWriteFactory* factory,
+    _In_z_ wchar_t const* url,
+    _COM_Outptr_ IDWriteFontFile** fontFile
+    )
 {
-    if (nodes.GetNode(nodeIndex).type == TextTree::Node::TypeObject)
-    {
-        uint32_t subnodeIndex;
-        nodes.GetKeyValue(nodeIndex, L"Path", OUT filePath);
+    return RemoteStreamFontFileLoader::GetInstance()->CreateFontFileReferenceFromUrl(factory, nullptr, url, OUT fontFile);
+}
 
-        if (nodes.FindKey(nodeIndex, L"FullName", OUT subnodeIndex))
-        {
-            nodes.GetKeyValue(subnodeIndex, L"en-us", OUT fullName);
-        }
-        if (nodes.FindKey(nodeIndex, L"WssFamilyName", OUT subnodeIndex))
-        {
-            nodes.GetKeyValue(subnodeIndex, L"en-us", OUT familyName);
-        }
-        if (nodes.GetKeyValue(nodeIndex, L"FaceIndex", OUT value))
-        {
-            faceIndex = _wtoi(value.c_str());
-        }
-        nodes.GetKeyValue(nodeIndex, L"Weight", OUT weight);
-        nodes.GetKeyValue(nodeIndex, L"Stretch", OUT stretch);
-        nodes.GetKeyValue(nodeIndex, L"Slope", OUT slope);
 
-        ComPtr<IDWriteFontFile> fontFile;
-        ComPtr<IDWriteFontFaceReference> fontFaceReference;
-
-        wchar_t const* fontFileReferenceKey = filePath.data();
-        uint32_t fontFileReferenceKeySize = (static_cast<uint32_t>(filePath.size()) + 1) * sizeof(wchar_t);
-        IFR(dwriteFactory3p->CreateCustomFontFileReference(
-            fontFileReferenceKey,
-            fontFileReferenceKeySize,
-            fontFileLoader,
-            OUT &fontFile
-        ));
-
-        IFR(dwriteFactory3p->CreateFontFaceReference(
-            fontFile,
-            faceIndex,
-            DWRITE_FONT_SIMULATIONS_NONE,
-            OUT &fontFaceReference
-        ));
-
-        static_assert(ARRAYSIZE(properties) == 5, "Update this code to match the size");
-        properties[0].propertyValue = fullName.c_str();
-        properties[1].propertyValue = familyName.c_str();
-        properties[2].propertyValue = weight.c_str();
-        properties[3].propertyValue = stretch.c_str();
-        properties[4].propertyValue = slope.c_str();
-        fontSetBuilder->AddFontFaceReference(
-            fontFaceReference,
-            &properties[0],
-            ARRAYSIZE(properties) // propertiesCount
+IDWriteFontDownloadQueue* GetRemoteFontDownloadQueue() throw()
+{
+    return RemoteFontDownloadManager::GetInstance();
+}
+
+
+HRESULT SetRemoteFontDownloadPriority(
+    IDWriteFontFaceReference* fontFaceReference,
+    DownloadScheduler::Priority priority
+    )
+{
+    return RemoteFontDownloadManager::GetManagerInstance()->SetFontDownloadPriority(fontFaceReference, priority);
+}
+
+
+HRESULT CancelRemoteFontDownload(IDWriteFontFaceReference* fontFaceReference)
+{
+    return RemoteFontDownloadManager::GetManagerInstance()->CancelFontDownload(fontFaceReference);
+}
+
+
+HRESULT ClearRemoteFontCache()
+{
+    return RemoteFontFileStream::DeleteCachedFontFiles();
+}
+
+
+void GetRemoteFontCacheSummary(OUT std::wstring& text)
+{
+    FontCacheManager::Statistics cacheStatistics;
+    RangeDownloadEngine::Statistics downloadStatistics;
+    FontCacheManager::GetInstance().GetStatistics(OUT cacheStatistics);
+    RangeDownloadEngine::GetInstance().GetStatistics(OUT downloadStatistics);
+
+    text.clear();
+    AppendFormattedString(IN OUT text, L"Cached files: %llu (%llu bytes)\r\n", cacheStatistics.cachedFileCount, cacheStatistics.cachedBytes);
+    AppendFormattedString(IN OUT text, L"Evicted files: %llu (%llu bytes)\r\n", cacheStatistics.evictedFileCount, cacheStatistics.evictedBytes);
+    AppendFormattedString(IN OUT text, L"Fragment reads: %llu local, %llu missing\r\n", cacheStatistics.hitCount, cacheStatistics.missCount);
+    AppendFormattedString(
+        IN OUT text,
+        L"Requests: %llu completed, %llu failed, %llu bytes downloaded\r\n",
+        downloadStatistics.completedRequestCount,
+        downloadStatistics.failedRequestCount,
+        downloadStatistics.bytesDownloaded
         );
+    if (downloadStatistics.completedRequestCount > 0)
+    {
+        AppendFormattedString(
+            IN OUT text,
+            L"Request latency: %llu ms average, %llu ms maximum\r\n",
+            downloadStatistics.totalLatency / downloadStatistics.completedRequestCount / 1000,
+            downloadStatistics.maximumLatency / 1000
+            );
     }
-
-    if (!nodes.AdvanceNextNode(IN OUT nodeIndex))
-        break;
 }
-#endif
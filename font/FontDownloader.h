@@ -0,0 +1,43 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Remote fonts, read by URL through a cache in the temp folder.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// Whether a manifest path names a remote font rather than a local file.
+bool IsRemoteFontUrl(_In_z_ wchar_t const* path) throw();
+
+// Registers the remote font file loader with the factory, which must be
+// unregistered before the factory is released.
+HRESULT RegisterRemoteFontFileLoader(IDWriteFactory* factory);
+HRESULT UnregisterRemoteFontFileLoader(IDWriteFactory* factory);
+
+// Makes a reference to a font file by URL. Nothing is downloaded until the
+// file is read, which fails with DWRITE_E_REMOTEFONT for any part not yet
+// cached, having queued that part for the next download.
+HRESULT CreateRemoteFontFileReference(
+    IDWriteFactory* factory,
+    _In_z_ wchar_t const* url,
+    _COM_Outptr_ IDWriteFontFile** fontFile
+    );
+
+// The queue of parts found missing. BeginDownload fetches them on a thread
+// pool thread, calling the listeners there when done.
+IDWriteFontDownloadQueue* GetRemoteFontDownloadQueue() throw();
+
+// Moves the waiting downloads of a font's file to another priority, such as
+// when its row scrolls into or out of view, or drops them. Returns S_FALSE
+// if none are waiting. A download already under way finishes either way.
+HRESULT SetRemoteFontDownloadPriority(
+    IDWriteFontFaceReference* fontFaceReference,
+    DownloadScheduler::Priority priority
+    );
+HRESULT CancelRemoteFontDownload(IDWriteFontFaceReference* fontFaceReference);
+
+// Deletes the cached files of all remote fonts.
+HRESULT ClearRemoteFontCache();
+
+// Describes the cache contents and download statistics, one item per line.
+void GetRemoteFontCacheSummary(OUT std::wstring& text);
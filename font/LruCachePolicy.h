@@ -0,0 +1,129 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Least recently used eviction for the font download cache.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// Least recently used eviction policy over named entries of known size. It
+// knows nothing about files, so FontCacheManager decides what an entry is
+// and how it is removed.
+class LruCachePolicy
+{
+public:
+    struct Entry
+    {
+        uint64_t size;
+        uint64_t lastAccessTime;
+        uint32_t pinCount;              // Pinned entries are in use and never chosen.
+    };
+
+    void Touch(std::wstring const& name, uint64_t accessTime)
+    {
+        auto& entry = GetEntry(name);
+        entry.lastAccessTime = std::max(entry.lastAccessTime, accessTime);
+    }
+
+
+    void SetSize(std::wstring const& name, uint64_t size)
+    {
+        auto& entry = GetEntry(name);
+        totalSize_ += size - entry.size;
+        entry.size = size;
+    }
+
+
+    void Pin(std::wstring const& name)
+    {
+        ++GetEntry(name).pinCount;
+    }
+
+
+    void Unpin(std::wstring const& name)
+    {
+        auto match = entries_.find(name);
+        if (match != entries_.end() && match->second.pinCount > 0)
+            --match->second.pinCount;
+    }
+
+
+    void Remove(std::wstring const& name)
+    {
+        auto match = entries_.find(name);
+        if (match != entries_.end())
+        {
+            totalSize_ -= match->second.size;
+            entries_.erase(match);
+        }
+    }
+
+
+    void clear()
+    {
+        entries_.clear();
+        totalSize_ = 0;
+    }
+
+
+    uint64_t GetTotalSize() const throw()
+    {
+        return totalSize_;
+    }
+
+
+    size_t GetEntryCount() const throw()
+    {
+        return entries_.size();
+    }
+
+
+    // Chooses the least recently used unpinned entries whose removal brings
+    // the total size down to the target, oldest first. If pinned entries
+    // alone exceed the target, everything unpinned is chosen.
+    void SelectVictims(
+        uint64_t targetSize,
+        _Out_ std::vector<std::wstring>& victims
+        ) const
+    {
+        victims.clear();
+        if (totalSize_ <= targetSize)
+            return;
+
+        std::vector<std::pair<uint64_t, std::wstring const*> > candidates;
+        for (auto const& entry : entries_)
+        {
+            if (entry.second.pinCount == 0)
+                candidates.push_back(std::make_pair(entry.second.lastAccessTime, &entry.first));
+        }
+        std::sort(
+            candidates.begin(),
+            candidates.end(),
+            [](std::pair<uint64_t, std::wstring const*> const& a, std::pair<uint64_t, std::wstring const*> const& b) -> bool
+            {
+                return a.first < b.first;
+            }
+            );
+
+        uint64_t remainingSize = totalSize_;
+        for (auto const& candidate : candidates)
+        {
+            if (remainingSize <= targetSize)
+                break;
+
+            remainingSize -= entries_.find(*candidate.second)->second.size;
+            victims.push_back(*candidate.second);
+        }
+    }
+
+protected:
+    Entry& GetEntry(std::wstring const& name)
+    {
+        auto& entry = entries_[name]; // New entries start zeroed.
+        return entry;
+    }
+
+protected:
+    std::map<std::wstring, Entry> entries_;
+    uint64_t totalSize_ = 0;
+};
@@ -0,0 +1,678 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Reading the table structure of partially downloaded fonts.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+#include "RangeDownloadPlanner.h" // Range
+
+
+// Minimal reader of the OpenType (sfnt) file structure, enough to locate
+// tables in a partially downloaded file. It only reads from the byte array
+// given, and every read is bounds checked, so it works on whatever prefix
+// or ranges have arrived so far. All values in the file are big endian.
+class OpenTypeFileReader
+{
+public:
+    struct TableRecord
+    {
+        uint32_t tag;                   // Big endian order, as in MakeTag.
+        uint32_t offset;
+        uint32_t length;
+    };
+
+    static const uint32_t offsetTableSize = 12;
+    static const uint32_t tableRecordSize = 16;
+    static const uint32_t collectionHeaderSize = 12;
+
+    static uint32_t MakeTag(char a, char b, char c, char d) throw()
+    {
+        return (uint32_t(uint8_t(a)) << 24) | (uint32_t(uint8_t(b)) << 16) | (uint32_t(uint8_t(c)) << 8) | uint32_t(uint8_t(d));
+    }
+
+
+    static bool ReadUint16(const_byte_array_ref data, uint64_t offset, _Out_ uint16_t& value) throw()
+    {
+        value = 0;
+        if (offset > data.size() || data.size() - offset < 2)
+            return false;
+
+        value = (uint16_t(data[size_t(offset)]) << 8) | data[size_t(offset) + 1];
+        return true;
+    }
+
+
+    static bool ReadUint32(const_byte_array_ref data, uint64_t offset, _Out_ uint32_t& value) throw()
+    {
+        value = 0;
+        if (offset > data.size() || data.size() - offset < 4)
+            return false;
+
+        uint8_t const* p = &data[size_t(offset)];
+        value = (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+        return true;
+    }
+
+
+    // Returns the offsets of the table directories, one per font, reading
+    // the collection header if it is a collection. The data must reach at
+    // least the end of the header, which for a collection can run past the
+    // first 12 bytes. The required size is returned either way, so the
+    // caller can fetch more and retry.
+    static bool ReadFontDirectoryOffsets(
+        const_byte_array_ref data,
+        _Out_ std::vector<uint32_t>& directoryOffsets,
+        _Out_ uint64_t& requiredSize
+        )
+    {
+        directoryOffsets.clear();
+        requiredSize = offsetTableSize;
+
+        uint32_t signature;
+        if (!ReadUint32(data, 0, OUT signature))
+            return false;
+
+        if (signature != MakeTag('t','t','c','f'))
+        {
+            if (!IsFontSignature(signature))
+                return false;
+
+            directoryOffsets.push_back(0);
+            return true;
+        }
+
+        uint32_t fontCount;
+        if (!ReadUint32(data, 8, OUT fontCount))
+            return false;
+
+        requiredSize = collectionHeaderSize + uint64_t(fontCount) * sizeof(uint32_t);
+        if (requiredSize > data.size())
+            return false;
+
+        directoryOffsets.resize(fontCount);
+        for (uint32_t i = 0; i < fontCount; ++i)
+        {
+            ReadUint32(data, collectionHeaderSize + i * sizeof(uint32_t), OUT directoryOffsets[i]);
+        }
+        return true;
+    }
+
+
+    static bool IsFontSignature(uint32_t signature) throw()
+    {
+        return signature == 0x00010000
+            || signature == MakeTag('O','T','T','O')
+            || signature == MakeTag('t','r','u','e');
+    }
+
+
+    // Reads the table records of the font whose directory is at the offset.
+    // The data must reach the end of the directory, as with the offsets.
+    static bool ReadTableRecords(
+        const_byte_array_ref data,
+        uint32_t directoryOffset,
+        _Out_ std::vector<TableRecord>& tableRecords,
+        _Out_ uint64_t& requiredSize
+        )
+    {
+        tableRecords.clear();
+        requiredSize = uint64_t(directoryOffset) + offsetTableSize;
+
+        uint32_t signature;
+        uint16_t tableCount;
+        if (!ReadUint32(data, directoryOffset, OUT signature)
+        ||  !ReadUint16(data, uint64_t(directoryOffset) + 4, OUT tableCount))
+        {
+            return false;
+        }
+        if (!IsFontSignature(signature))
+            return false;
+
+        requiredSize += uint64_t(tableCount) * tableRecordSize;
+        if (requiredSize > data.size())
+            return false;
+
+        tableRecords.resize(tableCount);
+        for (uint32_t i = 0; i < tableCount; ++i)
+        {
+            uint64_t const recordOffset = uint64_t(directoryOffset) + offsetTableSize + i * tableRecordSize;
+            auto& tableRecord = tableRecords[i];
+            ReadUint32(data, recordOffset + 0,  OUT tableRecord.tag);
+            ReadUint32(data, recordOffset + 8,  OUT tableRecord.offset);
+            ReadUint32(data, recordOffset + 12, OUT tableRecord.length);
+        }
+        return true;
+    }
+
+
+    static TableRecord const* FindTable(array_ref<TableRecord const> tableRecords, uint32_t tag) throw()
+    {
+        for (auto const& tableRecord : tableRecords)
+        {
+            if (tableRecord.tag == tag)
+                return &tableRecord;
+        }
+        return nullptr;
+    }
+
+
+    // Reads the glyph count from a 'maxp' table.
+    static uint16_t ReadGlyphCount(const_byte_array_ref maxpTable) throw()
+    {
+        uint16_t glyphCount;
+        ReadUint16(maxpTable, 4, OUT glyphCount);
+        return glyphCount;
+    }
+
+
+    // Reads indexToLocFormat from a 'head' table, returning whether the
+    // 'loca' table has 32-bit offsets.
+    static bool IsLongGlyphLocationFormat(const_byte_array_ref headTable) throw()
+    {
+        uint16_t indexToLocFormat;
+        ReadUint16(headTable, 50, OUT indexToLocFormat);
+        return indexToLocFormat != 0;
+    }
+
+
+    // Picks the Unicode subtable to map characters with, preferring the full
+    // repertoire (format 12) over the BMP only one (format 4). Returns the
+    // subtable's offset within the 'cmap' table, or 0 if none is usable.
+    static uint32_t FindUnicodeCmapSubtable(const_byte_array_ref cmapTable) throw()
+    {
+        uint16_t subtableCount;
+        if (!ReadUint16(cmapTable, 2, OUT subtableCount))
+            return 0;
+
+        uint32_t bestSubtableOffset = 0;
+        uint32_t bestRank = 0;
+        for (uint32_t i = 0; i < subtableCount; ++i)
+        {
+            uint64_t const recordOffset = 4 + i * 8;
+            uint16_t platformId, encodingId, format;
+            uint32_t subtableOffset;
+            if (!ReadUint16(cmapTable, recordOffset + 0, OUT platformId)
+            ||  !ReadUint16(cmapTable, recordOffset + 2, OUT encodingId)
+            ||  !ReadUint32(cmapTable, recordOffset + 4, OUT subtableOffset)
+            ||  !ReadUint16(cmapTable, subtableOffset, OUT format))
+            {
+                continue;
+            }
+
+            bool const isUnicode = (platformId == 0)
+                                || (platformId == 3 && (encodingId == 0 || encodingId == 1 || encodingId == 10));
+            uint32_t const rank = !isUnicode ? 0
+                                : (format == 12) ? 2
+                                : (format == 4) ? 1
+                                : 0;
+            if (rank > bestRank)
+            {
+                bestRank = rank;
+                bestSubtableOffset = subtableOffset;
+            }
+        }
+
+        return bestSubtableOffset;
+    }
+
+
+    // Maps a character to its nominal glyph through a format 4 or 12 'cmap'
+    // subtable, returning glyph 0 (.notdef) if it is unmapped.
+    static uint16_t MapCharacter(
+        const_byte_array_ref cmapTable,
+        uint32_t subtableOffset,
+        char32_t ch
+        ) throw()
+    {
+        uint16_t format;
+        if (!ReadUint16(cmapTable, subtableOffset, OUT format))
+            return 0;
+
+        if (format == 4)
+        {
+            // Segments of consecutive characters, sorted by end character.
+            uint16_t segmentCountX2;
+            if (ch > 0xFFFF || !ReadUint16(cmapTable, subtableOffset + 6, OUT segmentCountX2))
+                return 0;
+
+            uint64_t const endCodesOffset = subtableOffset + 14;
+            uint64_t const startCodesOffset = endCodesOffset + segmentCountX2 + 2;
+            uint64_t const idDeltasOffset = startCodesOffset + segmentCountX2;
+            uint64_t const idRangeOffsetsOffset = idDeltasOffset + segmentCountX2;
+
+            uint32_t low = 0, high = segmentCountX2 / 2;
+            while (low < high)
+            {
+                uint32_t const middle = (low + high) / 2;
+                uint16_t endCode;
+                if (!ReadUint16(cmapTable, endCodesOffset + middle * 2, OUT endCode))
+                    return 0;
+
+                if (endCode < ch)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+
+            uint16_t startCode, idDelta, idRangeOffset;
+            if (low >= segmentCountX2 / 2u
+            ||  !ReadUint16(cmapTable, startCodesOffset + low * 2, OUT startCode)
+            ||  !ReadUint16(cmapTable, idDeltasOffset + low * 2, OUT idDelta)
+            ||  !ReadUint16(cmapTable, idRangeOffsetsOffset + low * 2, OUT idRangeOffset)
+            ||  ch < startCode)
+            {
+                return 0;
+            }
+
+            if (idRangeOffset == 0)
+                return uint16_t(ch + idDelta);
+
+            // The range offset is relative to its own position in the array.
+            uint16_t glyphId;
+            if (!ReadUint16(cmapTable, idRangeOffsetsOffset + low * 2 + idRangeOffset + (ch - startCode) * 2, OUT glyphId)
+            ||  glyphId == 0)
+            {
+                return 0;
+            }
+            return uint16_t(glyphId + idDelta);
+        }
+        else if (format == 12)
+        {
+            // Groups of consecutive characters and glyphs, sorted by character.
+            uint32_t groupCount;
+            if (!ReadUint32(cmapTable, subtableOffset + 12, OUT groupCount))
+                return 0;
+
+            uint64_t const groupsOffset = subtableOffset + 16;
+            uint32_t low = 0, high = groupCount;
+            while (low < high)
+            {
+                uint32_t const middle = low + (high - low) / 2;
+                uint32_t startCharCode, endCharCode, startGlyphId;
+                if (!ReadUint32(cmapTable, groupsOffset + middle * 12ull + 0, OUT startCharCode)
+                ||  !ReadUint32(cmapTable, groupsOffset + middle * 12ull + 4, OUT endCharCode)
+                ||  !ReadUint32(cmapTable, groupsOffset + middle * 12ull + 8, OUT startGlyphId))
+                {
+                    return 0;
+                }
+
+                if (ch < startCharCode)
+                    high = middle;
+                else if (ch > endCharCode)
+                    low = middle + 1;
+                else
+                    return uint16_t(startGlyphId + (ch - startCharCode));
+            }
+        }
+
+        return 0;
+    }
+
+
+    // Reads the range of a glyph's outline within the 'glyf' table, from the
+    // 'loca' table. Empty glyphs (like the space) have an empty range.
+    static bool ReadGlyphDataRange(
+        const_byte_array_ref locaTable,
+        bool isLongFormat,
+        uint32_t glyphId,
+        _Out_ Range& range
+        ) throw()
+    {
+        range.begin = range.end = 0;
+        if (isLongFormat)
+        {
+            uint32_t begin, end;
+            if (!ReadUint32(locaTable, glyphId * 4ull, OUT begin)
+            ||  !ReadUint32(locaTable, glyphId * 4ull + 4, OUT end))
+            {
+                return false;
+            }
+            range.begin = begin;
+            range.end = end;
+        }
+        else
+        {
+            // Short offsets are stored halved.
+            uint16_t begin, end;
+            if (!ReadUint16(locaTable, glyphId * 2ull, OUT begin)
+            ||  !ReadUint16(locaTable, glyphId * 2ull + 2, OUT end))
+            {
+                return false;
+            }
+            range.begin = begin * 2ull;
+            range.end = end * 2ull;
+        }
+
+        return range.begin <= range.end;
+    }
+
+
+    // Appends the glyphs a composite 'glyf' outline refers to, which must be
+    // downloaded too for it to be drawn. Simple outlines have none.
+    static bool ReadCompositeGlyphComponents(
+        const_byte_array_ref glyphData,
+        _Inout_ std::vector<uint16_t>& componentGlyphIds
+        )
+    {
+        enum
+        {
+            ArgumentsAreWords   = 0x0001,
+            HaveScale           = 0x0008,
+            MoreComponents      = 0x0020,
+            HaveXYScale         = 0x0040,
+            HaveTwoByTwo        = 0x0080,
+        };
+
+        uint16_t contourCount;
+        if (!ReadUint16(glyphData, 0, OUT contourCount))
+            return glyphData.empty();
+
+        if (int16_t(contourCount) >= 0)
+            return true; // Simple glyph.
+
+        uint64_t offset = 10; // Skip the contour count and bounding box.
+        uint16_t flags;
+        do
+        {
+            uint16_t glyphId;
+            if (!ReadUint16(glyphData, offset, OUT flags)
+            ||  !ReadUint16(glyphData, offset + 2, OUT glyphId))
+            {
+                return false;
+            }
+            componentGlyphIds.push_back(glyphId);
+
+            offset += 4;
+            offset += (flags & ArgumentsAreWords) ? 4 : 2;
+            offset += (flags & HaveScale) ? 2
+                    : (flags & HaveXYScale) ? 4
+                    : (flags & HaveTwoByTwo) ? 8
+                    : 0;
+        } while (flags & MoreComponents);
+
+        return true;
+    }
+
+
+    // Reads one level of a glyph's closure: the components of the given
+    // glyphs' outlines that are not yet requested, which are then marked as
+    // requested. Repeating this with the components until none remain gives
+    // every outline needed to draw the original glyphs. Glyphs whose outline
+    // is not yet in the 'glyf' data contribute nothing.
+    static void ReadComponentGlyphs(
+        const_byte_array_ref locaTable,
+        bool isLongFormat,
+        const_byte_array_ref glyfTable,
+        array_ref<uint16_t const> glyphIds,
+        _Inout_ std::vector<bool>& isGlyphRequested,
+        _Out_ std::vector<uint16_t>& componentGlyphIds
+        )
+    {
+        componentGlyphIds.clear();
+        for (auto glyphId : glyphIds)
+        {
+            Range glyphRange;
+            if (ReadGlyphDataRange(locaTable, isLongFormat, glyphId, OUT glyphRange)
+            &&  glyphRange.end <= glyfTable.size())
+            {
+                const_byte_array_ref glyphData(&glyfTable[size_t(glyphRange.begin)], size_t(glyphRange.end - glyphRange.begin));
+                ReadCompositeGlyphComponents(glyphData, IN OUT componentGlyphIds);
+            }
+        }
+
+        componentGlyphIds.erase(
+            std::remove_if(
+                componentGlyphIds.begin(),
+                componentGlyphIds.end(),
+                [&](uint16_t glyphId) -> bool
+                {
+                    if (glyphId >= isGlyphRequested.size() || isGlyphRequested[glyphId])
+                        return true;
+                    isGlyphRequested[glyphId] = true;
+                    return false;
+                }
+                ),
+            componentGlyphIds.end()
+            );
+    }
+
+
+    // Layout of a CFF INDEX, an array of variable length items. Item i spans
+    // [dataOffset + offset[i], dataOffset + offset[i + 1]), where the offsets
+    // are one based, so dataOffset is one byte before the actual data.
+    struct CffIndex
+    {
+        uint32_t count;
+        uint8_t offsetSize;
+        uint64_t offsetsOffset;
+        uint64_t dataOffset;
+        uint64_t endOffset;
+    };
+
+
+    // Reads the header and offset array of a CFF INDEX (CFF2 counts are 32
+    // bits). The item data is not needed, but the data must otherwise reach
+    // the required size, or else it is malformed.
+    static bool ReadCffIndex(
+        const_byte_array_ref data,
+        uint64_t indexOffset,
+        bool isCff2,
+        _Out_ CffIndex& index,
+        _Out_ uint64_t& requiredSize
+        )
+    {
+        index = {};
+        uint32_t const countSize = isCff2 ? 4 : 2;
+        requiredSize = indexOffset + countSize + 1;
+        if (isCff2)
+        {
+            if (!ReadUint32(data, indexOffset, OUT index.count))
+                return false;
+        }
+        else
+        {
+            uint16_t count;
+            if (!ReadUint16(data, indexOffset, OUT count))
+                return false;
+            index.count = count;
+        }
+
+        if (index.count == 0)
+        {
+            requiredSize = index.endOffset = indexOffset + countSize; // No offset array follows.
+            return true;
+        }
+
+        if (indexOffset + countSize >= data.size())
+            return false;
+
+        index.offsetSize = data[size_t(indexOffset + countSize)];
+        if (index.offsetSize < 1 || index.offsetSize > 4)
+            return false;
+
+        index.offsetsOffset = indexOffset + countSize + 1;
+        requiredSize = index.offsetsOffset + (uint64_t(index.count) + 1) * index.offsetSize;
+        if (requiredSize > data.size())
+            return false;
+
+        index.dataOffset = requiredSize - 1;
+        index.endOffset = index.dataOffset + ReadCffOffset(data, index, index.count);
+        return true;
+    }
+
+
+    static uint32_t ReadCffOffset(
+        const_byte_array_ref data,
+        CffIndex const& index,
+        uint32_t itemIndex
+        ) throw()
+    {
+        uint64_t const offset = index.offsetsOffset + uint64_t(itemIndex) * index.offsetSize;
+        if (offset + index.offsetSize > data.size())
+            return 0;
+
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < index.offsetSize; ++i)
+        {
+            value = (value << 8) | data[size_t(offset + i)];
+        }
+        return value;
+    }
+
+
+    // Returns the range of an item, relative to the start of the data.
+    static Range GetCffIndexItem(
+        const_byte_array_ref data,
+        CffIndex const& index,
+        uint32_t itemIndex
+        ) throw()
+    {
+        Range range = {};
+        if (itemIndex < index.count)
+        {
+            range.begin = index.dataOffset + ReadCffOffset(data, index, itemIndex);
+            range.end = index.dataOffset + ReadCffOffset(data, index, itemIndex + 1);
+            if (range.end < range.begin)
+                range.end = range.begin;
+        }
+        return range;
+    }
+
+
+    // Finds the integer operand of an operator in a CFF DICT. Two byte
+    // operators are given as 0x0C00 | second byte.
+    static bool ReadCffDictInteger(
+        const_byte_array_ref data,
+        Range dict,
+        uint16_t targetOperator,
+        _Out_ int32_t& value
+        ) throw()
+    {
+        value = 0;
+        dict.end = std::min(dict.end, uint64_t(data.size()));
+
+        int32_t lastOperand = 0;
+        for (uint64_t offset = dict.begin; offset < dict.end; )
+        {
+            uint8_t const b0 = data[size_t(offset++)];
+            uint8_t const b1 = (offset < dict.end) ? data[size_t(offset)] : 0;
+
+            if (b0 <= 21)
+            {
+                // Operator, applying to the operands before it.
+                uint16_t op = b0;
+                if (b0 == 12)
+                {
+                    op = 0x0C00 | b1;
+                    ++offset;
+                }
+                if (op == targetOperator)
+                {
+                    value = lastOperand;
+                    return true;
+                }
+            }
+            else if (b0 == 28)
+            {
+                uint16_t operand;
+                if (!ReadUint16(data, offset, OUT operand))
+                    return false;
+                lastOperand = int16_t(operand);
+                offset += 2;
+            }
+            else if (b0 == 29)
+            {
+                uint32_t operand;
+                if (!ReadUint32(data, offset, OUT operand))
+                    return false;
+                lastOperand = int32_t(operand);
+                offset += 4;
+            }
+            else if (b0 == 30)
+            {
+                // Real number, in nibbles up to an 0xF terminator. Only
+                // integers are wanted, so skip it.
+                while (offset < dict.end)
+                {
+                    uint8_t const nibbles = data[size_t(offset++)];
+                    if ((nibbles & 0x0F) == 0x0F || (nibbles & 0xF0) == 0xF0)
+                        break;
+                }
+                lastOperand = 0;
+            }
+            else if (b0 >= 32 && b0 <= 246)
+            {
+                lastOperand = int32_t(b0) - 139;
+            }
+            else if (b0 >= 247 && b0 <= 250)
+            {
+                lastOperand = (int32_t(b0) - 247) * 256 + b1 + 108;
+                ++offset;
+            }
+            else if (b0 >= 251 && b0 <= 254)
+            {
+                lastOperand = -(int32_t(b0) - 251) * 256 - b1 - 108;
+                ++offset;
+            }
+            else
+            {
+                return false; // Reserved.
+            }
+        }
+
+        return false;
+    }
+
+
+    // Finds the CharStrings INDEX (the glyph outlines) of a 'CFF ' or 'CFF2'
+    // table, following the header and Top DICT to it. As with the other
+    // reads, returns the size needed when the table data is short.
+    static bool ReadCffCharStringsIndex(
+        const_byte_array_ref cffTable,
+        bool isCff2,
+        _Out_ CffIndex& charStringsIndex,
+        _Out_ uint64_t& requiredSize
+        )
+    {
+        enum { CharStringsOperator = 17 };
+
+        charStringsIndex = {};
+        requiredSize = 5;
+        if (cffTable.size() < requiredSize)
+            return false;
+
+        uint8_t const headerSize = cffTable[2];
+        Range topDict;
+        if (isCff2)
+        {
+            // The Top DICT follows the header directly.
+            uint16_t topDictSize;
+            ReadUint16(cffTable, 3, OUT topDictSize);
+            topDict.begin = headerSize;
+            topDict.end = topDict.begin + topDictSize;
+        }
+        else
+        {
+            // The Top DICT is the first item of the INDEX after the names.
+            CffIndex nameIndex, topDictIndex;
+            if (!ReadCffIndex(cffTable, headerSize, false, OUT nameIndex, OUT requiredSize)
+            ||  !ReadCffIndex(cffTable, nameIndex.endOffset, false, OUT topDictIndex, OUT requiredSize))
+            {
+                return false;
+            }
+            topDict = GetCffIndexItem(cffTable, topDictIndex, 0);
+        }
+
+        requiredSize = topDict.end;
+        int32_t charStringsOffset;
+        if (topDict.end > cffTable.size()
+        ||  !ReadCffDictInteger(cffTable, topDict, CharStringsOperator, OUT charStringsOffset)
+        ||  charStringsOffset <= 0)
+        {
+            return false;
+        }
+
+        return ReadCffIndex(cffTable, uint32_t(charStringsOffset), isCff2, OUT charStringsIndex, OUT requiredSize);
+    }
+};
@@ -0,0 +1,114 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Planning of the byte range requests for remote font files.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// Half-open byte range [begin, end) of a file.
+struct Range
+{
+    uint64_t begin;
+    uint64_t end;
+};
+
+
+// Plans how a set of wanted byte ranges of a file is fetched.
+//
+// Two ranges separated by a gap are merged when downloading the gap costs
+// less than issuing another request, which is when the gap is smaller than
+// the bandwidth-delay product (round trip time * bandwidth). Merged spans are
+// capped so one huge request does not hold up everything behind it. The
+// remaining spans are then grouped into multi-range requests, so distant
+// ranges still share a round trip.
+class RangeDownloadPlanner
+{
+public:
+    static const uint64_t defaultRoundTripTime = 50000;         // Microseconds, until measured.
+    static const uint64_t defaultBytesPerSecond = 2000000;      // Until measured.
+    static const uint64_t maximumMergedRangeSize = 1048576;
+    static const uint32_t maximumRangesPerRequest = 16;
+
+    static uint64_t GetMaximumGapSize(uint64_t roundTripTime, uint64_t bytesPerSecond)
+    {
+        return roundTripTime * bytesPerSecond / 1000000;
+    }
+
+
+    // Sorts and merges the ranges in place.
+    static void CoalesceRanges(
+        _Inout_ std::vector<Range>& ranges,
+        uint64_t maximumGapSize,
+        uint64_t maximumMergedSize = maximumMergedRangeSize
+        )
+    {
+        if (ranges.empty())
+            return;
+
+        std::sort(
+            ranges.begin(),
+            ranges.end(),
+            [](Range const& lhs, Range const& rhs) -> bool
+            {
+                return lhs.begin < rhs.begin || (lhs.begin == rhs.begin && lhs.end < rhs.end);
+            }
+            );
+
+        size_t const oldRangesSize = ranges.size();
+        size_t newRangesSize = 1;
+        for (size_t currentRangeIndex = 1; currentRangeIndex < oldRangesSize; ++currentRangeIndex)
+        {
+            auto& previousRange = ranges[newRangesSize - 1];
+            auto currentRange = ranges[currentRangeIndex];
+            if (currentRange.end <= previousRange.end)
+                continue; // Already covered.
+
+            if (currentRange.begin <= previousRange.end + maximumGapSize)
+            {
+                if (currentRange.end - previousRange.begin <= maximumMergedSize)
+                {
+                    previousRange.end = currentRange.end; // Extend range, absorbing any gap.
+                    continue;
+                }
+
+                // Too big to merge, but never download overlapping bytes twice.
+                currentRange.begin = std::max(currentRange.begin, previousRange.end);
+            }
+            ranges[newRangesSize++] = currentRange; // Copy over a new range.
+        }
+        ranges.resize(newRangesSize);
+    }
+
+
+    // Partitions sorted ranges into consecutive groups, each sent as one
+    // request, returning the number of ranges in each group. Ranges are only
+    // bundled once there are more than targetRequestCount of them, so that
+    // the available connections are still all kept busy.
+    static void GroupRanges(
+        array_ref<Range const> ranges,
+        uint32_t targetRequestCount,
+        uint64_t maximumRequestSize,
+        _Out_ std::vector<uint32_t>& requestRangeCounts
+        )
+    {
+        requestRangeCounts.clear();
+        targetRequestCount = std::max(targetRequestCount, 1u);
+        size_t const rangesPerRequest = std::min<size_t>((ranges.size() + targetRequestCount - 1) / targetRequestCount, maximumRangesPerRequest);
+
+        uint64_t requestSize = 0;
+        for (auto const& range : ranges)
+        {
+            uint64_t const rangeSize = range.end - range.begin;
+            if (requestRangeCounts.empty()
+            ||  requestRangeCounts.back() >= rangesPerRequest
+            ||  requestSize + rangeSize > maximumRequestSize)
+            {
+                requestRangeCounts.push_back(0);
+                requestSize = 0;
+            }
+            ++requestRangeCounts.back();
+            requestSize += rangeSize;
+        }
+    }
+};
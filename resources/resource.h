@@ -31,6 +31,10 @@
 #define IdcReloadSystemFontSet              1013
 #define IdcViewFontPreview                  1014
 #define IdcCopyListNames                    1015
+#define IdcExportFontSetManifest            1016
+#define IdcRecordTrace                      1017
+#define IdcExportTrace                      1018
+#define IdcImportFontSetManifest            1019
 
 #define MenuIdMain                          1
 #define MenuIdOptions                       32769
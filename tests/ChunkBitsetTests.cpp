@@ -0,0 +1,178 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Bitset of the downloaded chunks of a remote font file.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/ChunkBitset.h"
+#include "Tests.h"
+
+
+namespace
+{
+    // Owns the words that the stream would otherwise keep in its mapped view.
+    class TestChunkBitset : public ChunkBitset
+    {
+    public:
+        TestChunkBitset(uint32_t chunkCount)
+        :   storage_(GetWordCount(chunkCount), 0)
+        {
+            Attach(storage_.data(), chunkCount);
+        }
+
+        uint64_t GetWord(uint32_t wordIndex) const
+        {
+            return storage_[wordIndex];
+        }
+
+        void MarkChunksPresent(uint32_t lowChunkIndex, uint32_t highChunkIndex)
+        {
+            uint32_t lowWordIndex, highWordIndex;
+            ChunkBitset::MarkChunksPresent(lowChunkIndex, highChunkIndex, OUT lowWordIndex, OUT highWordIndex);
+        }
+
+    protected:
+        std::vector<uint64_t> storage_;
+    };
+}
+
+
+TEST_CASE(ChunkBitsetWordMasks)
+{
+    CHECK(ChunkBitset::GetWordCount(0) == 0);
+    CHECK(ChunkBitset::GetWordCount(1) == 1);
+    CHECK(ChunkBitset::GetWordCount(64) == 1);
+    CHECK(ChunkBitset::GetWordCount(65) == 2);
+
+    // Whole words, and ranges that start or end exactly on a word boundary.
+    CHECK(ChunkBitset::GetChunkWordMask(0, 0, 64) == ~uint64_t(0));
+    CHECK(ChunkBitset::GetChunkWordMask(1, 0, 128) == ~uint64_t(0));
+    CHECK(ChunkBitset::GetChunkWordMask(0, 0, 65) == ~uint64_t(0));
+    CHECK(ChunkBitset::GetChunkWordMask(1, 0, 65) == 1);
+    CHECK(ChunkBitset::GetChunkWordMask(1, 64, 65) == 1);
+    CHECK(ChunkBitset::GetChunkWordMask(0, 63, 64) == uint64_t(1) << 63);
+
+    // Ranges within one word, and ones straddling two.
+    CHECK(ChunkBitset::GetChunkWordMask(0, 1, 64) == ~uint64_t(1));
+    CHECK(ChunkBitset::GetChunkWordMask(0, 4, 8) == 0xF0);
+    CHECK(ChunkBitset::GetChunkWordMask(0, 60, 70) == uint64_t(0xF) << 60);
+    CHECK(ChunkBitset::GetChunkWordMask(1, 60, 70) == 0x3F);
+}
+
+
+TEST_CASE(ChunkBitsetBitScan)
+{
+    unsigned long bitIndex;
+    CHECK(!ChunkBitset::GetLowestSetBit(0, OUT bitIndex));
+    CHECK(ChunkBitset::GetLowestSetBit(1, OUT bitIndex) && bitIndex == 0);
+    CHECK(ChunkBitset::GetLowestSetBit(uint64_t(1) << 40 | uint64_t(1) << 50, OUT bitIndex) && bitIndex == 40);
+    CHECK(ChunkBitset::GetLowestSetBit(uint64_t(1) << 63, OUT bitIndex) && bitIndex == 63);
+
+    CHECK(ChunkBitset::GetSetBitCount(0) == 0);
+    CHECK(ChunkBitset::GetSetBitCount(~uint64_t(0)) == 64);
+    CHECK(ChunkBitset::GetSetBitCount(uint64_t(0x8000000100000001)) == 3);
+}
+
+
+TEST_CASE(ChunkBitsetFindAcrossWords)
+{
+    TestChunkBitset chunks(130);
+    CHECK(chunks.CountPresentChunks() == 0);
+
+    chunks.MarkChunksPresent(0, 64);
+    chunks.MarkChunksPresent(65, 130);
+    CHECK(chunks.GetWord(0) == ~uint64_t(0));
+    CHECK(chunks.GetWord(1) == ~uint64_t(1));
+    CHECK(chunks.GetWord(2) == 0x3);
+    CHECK(chunks.CountPresentChunks() == 129);
+    CHECK(!chunks.IsChunkPresent(64));
+    CHECK(chunks.IsChunkPresent(129));
+    CHECK(!chunks.IsChunkPresent(130));
+
+    uint32_t chunkIndex;
+    CHECK(chunks.FindFirstMissingChunk(0, 130, OUT chunkIndex) && chunkIndex == 64);
+    CHECK(chunks.FindFirstPresentChunk(64, 130, OUT chunkIndex) && chunkIndex == 65);
+    CHECK(!chunks.FindFirstMissingChunk(65, 130, OUT chunkIndex) && chunkIndex == 130);
+    CHECK(!chunks.FindFirstMissingChunk(0, 64, OUT chunkIndex) && chunkIndex == 64);
+
+    // The unused bits of the last word never count as missing chunks, and a
+    // range past the end reports its own high index.
+    CHECK(!chunks.FindFirstMissingChunk(128, 200, OUT chunkIndex) && chunkIndex == 200);
+    CHECK(!chunks.FindFirstPresentChunk(130, 140, OUT chunkIndex) && chunkIndex == 140);
+    CHECK(!chunks.FindFirstMissingChunk(70, 70, OUT chunkIndex) && chunkIndex == 70);
+}
+
+
+TEST_CASE(ChunkBitsetMarkReturnsWords)
+{
+    TestChunkBitset chunks(130);
+    uint32_t lowWordIndex, highWordIndex;
+
+    chunks.ChunkBitset::MarkChunksPresent(63, 65, OUT lowWordIndex, OUT highWordIndex);
+    CHECK(lowWordIndex == 0 && highWordIndex == 2);
+    CHECK(chunks.GetWord(0) == uint64_t(1) << 63);
+    CHECK(chunks.GetWord(1) == 1);
+
+    // Clamped to the chunk count, and nothing at all past it.
+    chunks.ChunkBitset::MarkChunksPresent(128, 1000, OUT lowWordIndex, OUT highWordIndex);
+    CHECK(lowWordIndex == 2 && highWordIndex == 3);
+    CHECK(chunks.GetWord(2) == 0x3);
+    chunks.ChunkBitset::MarkChunksPresent(130, 1000, OUT lowWordIndex, OUT highWordIndex);
+    CHECK(lowWordIndex == 0 && highWordIndex == 0);
+    CHECK(chunks.CountPresentChunks() == 4);
+}
+
+
+TEST_CASE(ChunkBitsetLastShortChunk)
+{
+    // Three chunks of 100 bytes hold 250 bytes, so the last holds only 50.
+    TestChunkBitset chunks(3);
+    CHECK(chunks.GetPresentByteCount(100, 250) == 0);
+    chunks.MarkChunksPresent(2, 3);
+    CHECK(chunks.GetPresentByteCount(100, 250) == 50);
+    chunks.MarkChunksPresent(0, 1);
+    CHECK(chunks.GetPresentByteCount(100, 250) == 150);
+    chunks.MarkChunksPresent(1, 2);
+    CHECK(chunks.GetPresentByteCount(100, 250) == 250);
+
+    // A last chunk that ends exactly on a word boundary.
+    TestChunkBitset wordChunks(64);
+    wordChunks.MarkChunksPresent(63, 64);
+    CHECK(wordChunks.GetPresentByteCount(1000, 63001) == 1);
+
+    TestChunkBitset noChunks(0);
+    uint32_t chunkIndex;
+    CHECK(noChunks.GetPresentByteCount(100, 0) == 0);
+    CHECK(!noChunks.FindFirstMissingChunk(0, 1, OUT chunkIndex));
+}
+
+
+TEST_CASE(ChunkBitsetReadByteMap)
+{
+    // Maps from before the bitset held one byte per chunk, nonzero when
+    // present. Reading one replaces any bits already set.
+    TestChunkBitset chunks(70);
+    chunks.MarkChunksPresent(0, 70);
+
+    std::vector<uint8_t> byteMap(70, 0);
+    byteMap[0] = 1;
+    byteMap[63] = 0xFF;
+    byteMap[64] = 1;
+    byteMap[69] = 2;
+    chunks.ReadByteMap(byteMap);
+
+    CHECK(chunks.GetWord(0) == (uint64_t(1) | uint64_t(1) << 63));
+    CHECK(chunks.GetWord(1) == (uint64_t(1) | uint64_t(1) << 5));
+    CHECK(chunks.CountPresentChunks() == 4);
+
+    // A short map leaves the rest missing, and a long one is cut off at the
+    // chunk count.
+    byteMap.assign(2, 1);
+    chunks.ReadByteMap(byteMap);
+    CHECK(chunks.CountPresentChunks() == 2);
+
+    byteMap.assign(200, 1);
+    chunks.ReadByteMap(byteMap);
+    CHECK(chunks.CountPresentChunks() == 70);
+    CHECK(chunks.GetWord(1) == 0x3F);
+}
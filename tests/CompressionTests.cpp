@@ -0,0 +1,206 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Block compression and the streaming frame format.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../common/Compression.h"
+#include "Tests.h"
+
+
+namespace
+{
+    // Deterministic filler, so failures reproduce.
+    void FillPseudorandom(OUT std::vector<uint8_t>& data, size_t size, uint32_t seed)
+    {
+        data.resize(size);
+        for (auto& byte : data)
+        {
+            seed = seed * 1664525 + 1013904223;
+            byte = uint8_t(seed >> 24);
+        }
+    }
+
+
+    // Text-like data that compresses, with matches at many offsets and lengths.
+    void FillRepetitive(OUT std::vector<uint8_t>& data, size_t size)
+    {
+        static char const words[] = "glyph cluster advance offset ligature kerning ";
+        data.resize(size);
+        for (size_t i = 0; i < size; ++i)
+        {
+            data[i] = uint8_t(words[(i * 7 / 5 + i / 1000) % (ARRAYSIZE(words) - 1)]);
+        }
+    }
+
+
+    void AppendUint32(IN OUT std::vector<uint8_t>& frame, uint32_t value)
+    {
+        frame.insert(frame.end(), reinterpret_cast<uint8_t const*>(&value), reinterpret_cast<uint8_t const*>(&value) + sizeof(value));
+    }
+
+
+    // Wraps a hand encoded block in a frame, so DecompressBlock can be fed
+    // exactly the sequences under test.
+    std::vector<uint8_t> MakeFrame(const_byte_array_ref encodedBlock, uint64_t totalSize)
+    {
+        std::vector<uint8_t> frame = { 'C', 'L', 'Z', 'F', 1, 16, 0, 0 };
+        AppendUint32(IN OUT frame, uint32_t(encodedBlock.size()));
+        frame.insert(frame.end(), encodedBlock.begin(), encodedBlock.end());
+        AppendUint32(IN OUT frame, 0);
+        frame.insert(frame.end(), reinterpret_cast<uint8_t const*>(&totalSize), reinterpret_cast<uint8_t const*>(&totalSize) + sizeof(totalSize));
+        return frame;
+    }
+
+
+    bool IsRoundTripped(const_byte_array_ref data, uint32_t level)
+    {
+        std::vector<uint8_t> frame, decompressedData;
+        return CompressData(data, level, OUT frame) == S_OK
+            && DecompressData(frame, OUT decompressedData) == S_OK
+            && decompressedData.size() == data.size()
+            && std::equal(data.begin(), data.end(), decompressedData.begin());
+    }
+}
+
+
+TEST_CASE(CompressionRoundTrip)
+{
+    std::vector<uint8_t> repetitive, random, runs;
+    FillRepetitive(OUT repetitive, 200000); // Several blocks, the last partial.
+    FillPseudorandom(OUT random, 70000, 1); // Incompressible, so stored as-is.
+    runs.assign(100000, 'x');               // Matches overlapping themselves at offset 1.
+
+    for (uint32_t level : { uint32_t(CompressionLevelFast), uint32_t(CompressionLevelDefault), uint32_t(CompressionLevelMaximum) })
+    {
+        CHECK(IsRoundTripped({}, level));
+        CHECK(IsRoundTripped(const_byte_array_ref(repetitive.data(), 1), level));
+        CHECK(IsRoundTripped(const_byte_array_ref(repetitive.data(), 17), level));
+        CHECK(IsRoundTripped(repetitive, level));
+        CHECK(IsRoundTripped(random, level));
+        CHECK(IsRoundTripped(runs, level));
+    }
+
+    std::vector<uint8_t> frame;
+    CHECK(CompressData(repetitive, CompressionLevelDefault, OUT frame) == S_OK);
+    CHECK(frame.size() < repetitive.size() / 4);
+}
+
+
+TEST_CASE(CompressionFrameReaderPieces)
+{
+    // The frame may arrive in any split, down to single bytes.
+    std::vector<uint8_t> data, frame, decompressedData;
+    FillRepetitive(OUT data, 150000);
+    CHECK(CompressData(data, CompressionLevelFast, OUT frame) == S_OK);
+
+    CompressionFrameReader reader;
+    auto appendToData = [&](const_byte_array_ref blockData) -> HRESULT
+    {
+        decompressedData.insert(decompressedData.end(), blockData.begin(), blockData.end());
+        return S_OK;
+    };
+    CHECK(reader.Begin(appendToData) == S_OK);
+
+    HRESULT hr = S_OK;
+    for (size_t i = 0; i < frame.size() && SUCCEEDED(hr); ++i)
+    {
+        CHECK(reader.Finish() == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+        hr = reader.Write(const_byte_array_ref(&frame[i], 1));
+    }
+    CHECK(hr == S_OK);
+    CHECK(reader.Finish() == S_OK);
+    CHECK(decompressedData == data);
+
+    // Nothing may follow the end mark.
+    uint8_t const extraByte = 0;
+    CHECK(reader.Write(const_byte_array_ref(&extraByte, 1)) == HRESULT_FROM_WIN32(ERROR_INVALID_DATA));
+}
+
+
+TEST_CASE(CompressionDecompressBlock)
+{
+    // 3 literals "abc", then a match of 9 at offset 3, overlapping itself,
+    // then the final 2 literals "de".
+    uint8_t const block[] = { 0x35, 'a', 'b', 'c', 3, 0, 0x20, 'd', 'e' };
+    std::vector<uint8_t> data;
+    CHECK(DecompressData(MakeFrame(block, 14), OUT data) == S_OK);
+    CHECK(std::string(data.begin(), data.end()) == "abcabcabcabcde");
+
+    // Literal and match lengths of 15 or more continue in extension bytes.
+    std::vector<uint8_t> longBlock = { 0xFF, 255, 1 };          // 15 + 255 + 1 = 271 literals,
+    longBlock.insert(longBlock.end(), 271, 'z');
+    longBlock.insert(longBlock.end(), { 1, 0, 255, 0 });        // a match of 15 + 255 + 0 + 4 = 274,
+    longBlock.push_back(0x10);                                  // and one final literal.
+    longBlock.push_back('!');
+    CHECK(DecompressData(MakeFrame(longBlock, 546), OUT data) == S_OK);
+    CHECK(data.size() == 546 && data.back() == '!' && std::count(data.begin(), data.end(), 'z') == 545);
+}
+
+
+TEST_CASE(CompressionDecompressBlockMalformed)
+{
+    HRESULT const invalidData = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    std::vector<uint8_t> data;
+
+    uint8_t const emptyBlock[] = { 0 };                         // Zero literals then the end is fine,
+    CHECK(DecompressData(MakeFrame(emptyBlock, 0), OUT data) == S_OK);
+    uint8_t const offsetZero[] = { 0x10, 'a', 0, 0, 0x00 };     // but an offset of zero is not,
+    CHECK(DecompressData(MakeFrame(offsetZero, 5), OUT data) == invalidData);
+    uint8_t const offsetBeforeStart[] = { 0x10, 'a', 2, 0, 0x00 }; // nor before the output start,
+    CHECK(DecompressData(MakeFrame(offsetBeforeStart, 5), OUT data) == invalidData);
+    uint8_t const literalsPastEnd[] = { 0x50, 'a', 'b' };       // nor literals beyond the input,
+    CHECK(DecompressData(MakeFrame(literalsPastEnd, 5), OUT data) == invalidData);
+    uint8_t const truncatedOffset[] = { 0x10, 'a', 1 };         // nor half an offset,
+    CHECK(DecompressData(MakeFrame(truncatedOffset, 5), OUT data) == invalidData);
+    uint8_t const truncatedLength[] = { 0xF0, 255 };            // nor an unfinished length,
+    CHECK(DecompressData(MakeFrame(truncatedLength, 5), OUT data) == invalidData);
+    uint8_t const missingFinalToken[] = { 0x10, 'a', 1, 0 };    // nor a match without the final token.
+    CHECK(DecompressData(MakeFrame(missingFinalToken, 5), OUT data) == invalidData);
+
+    // A match longer than the block size limit must not write past the buffer.
+    std::vector<uint8_t> longMatch = { 0x1F, 'a', 1, 0 };
+    longMatch.insert(longMatch.end(), 300, 255);
+    longMatch.push_back(0);
+    longMatch.push_back(0x00);
+    CHECK(DecompressData(MakeFrame(longMatch, 0), OUT data) == invalidData);
+}
+
+
+TEST_CASE(CompressionFrameMalformed)
+{
+    HRESULT const invalidData = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    std::vector<uint8_t> data, frame, damagedFrame;
+    FillRepetitive(OUT data, 100000);
+    CHECK(CompressData(data, CompressionLevelDefault, OUT frame) == S_OK);
+
+    damagedFrame = frame;
+    damagedFrame[0] ^= 1;
+    CHECK(DecompressData(damagedFrame, OUT data) == invalidData);
+
+    damagedFrame = frame;
+    damagedFrame[4] = 2;
+    CHECK(DecompressData(damagedFrame, OUT data) == HRESULT_FROM_WIN32(ERROR_UNSUPPORTED_TYPE));
+
+    damagedFrame = frame;
+    damagedFrame.back() ^= 1; // Total size.
+    CHECK(DecompressData(damagedFrame, OUT data) == invalidData);
+
+    damagedFrame.assign(frame.begin(), frame.end() - 1);
+    CHECK(DecompressData(damagedFrame, OUT data) == HRESULT_FROM_WIN32(ERROR_HANDLE_EOF));
+
+    damagedFrame = frame;
+    damagedFrame[8 + 3] = 0x7F; // First block size beyond the bound.
+    CHECK(DecompressData(damagedFrame, OUT data) == invalidData);
+
+    // Random damage anywhere past the header must fail cleanly or, where it
+    // only changes literal bytes, succeed; it must never read or write out
+    // of bounds.
+    for (uint32_t i = 0; i < 2000; ++i)
+    {
+        damagedFrame = frame;
+        uint32_t const seed = i * 2654435761u;
+        damagedFrame[8 + seed % (frame.size() - 8)] ^= uint8_t(1 + (seed >> 24) % 255);
+        DecompressData(damagedFrame, OUT data);
+    }
+}
@@ -0,0 +1,163 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Path handling of the directory watcher.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "Tests.h"
+
+
+namespace
+{
+    // Appends a FILE_NOTIFY_INFORMATION record, padded to a DWORD boundary.
+    // The previous record's next offset is pointed at it.
+    void AppendNotification(IN OUT std::vector<uint8_t>& notifications, IN OUT size_t& lastRecordOffset, uint32_t action, wchar_t const* fileName)
+    {
+        size_t const recordOffset = notifications.size();
+        if (recordOffset > 0)
+        {
+            uint32_t const nextEntryOffset = static_cast<uint32_t>(recordOffset - lastRecordOffset);
+            memcpy(&notifications[lastRecordOffset], &nextEntryOffset, sizeof(nextEntryOffset));
+        }
+        lastRecordOffset = recordOffset;
+
+        uint32_t const fileNameLength = static_cast<uint32_t>(wcslen(fileName) * sizeof(wchar_t));
+        uint32_t const header[] = { 0, action, fileNameLength };
+        notifications.resize(recordOffset + sizeof(header) + fileNameLength);
+        memcpy(&notifications[recordOffset], header, sizeof(header));
+        memcpy(&notifications[recordOffset + sizeof(header)], fileName, fileNameLength);
+        notifications.resize((notifications.size() + 3) & ~size_t(3));
+    }
+
+
+    // String literals would include their nul as an array_ref.
+    bool IsWithinDirectory(wchar_t const* filePath, wchar_t const* directoryPath)
+    {
+        return IsPathWithinDirectory(std::wstring(filePath), std::wstring(directoryPath));
+    }
+
+
+    bool ArePathsEqual(std::vector<std::wstring> const& paths, std::initializer_list<wchar_t const*> expectedPaths)
+    {
+        return paths.size() == expectedPaths.size()
+            && std::equal(paths.begin(), paths.end(), expectedPaths.begin());
+    }
+}
+
+
+TEST_CASE(DirectoryWatcherPathWithinDirectory)
+{
+    CHECK(IsWithinDirectory(L"c:\\fonts\\a.ttf", L"c:\\fonts"));
+    CHECK(IsWithinDirectory(L"c:\\fonts\\sub\\a.ttf", L"c:\\fonts"));
+    CHECK(IsWithinDirectory(L"c:\\fonts", L"c:\\fonts"));
+
+    // Trailing or forward slashes, and case, do not matter.
+    CHECK(IsWithinDirectory(L"c:\\fonts\\a.ttf", L"c:\\fonts\\"));
+    CHECK(IsWithinDirectory(L"c:\\fonts\\a.ttf", L"c:\\fonts//"));
+    CHECK(IsWithinDirectory(L"c:/fonts/a.ttf", L"c:/fonts"));
+    CHECK(IsWithinDirectory(L"C:\\FONTS\\A.TTF", L"c:\\Fonts"));
+
+    // Only whole path components match.
+    CHECK(!IsWithinDirectory(L"c:\\fontsx\\a.ttf", L"c:\\fonts"));
+    CHECK(!IsWithinDirectory(L"c:\\fonts.ttf", L"c:\\fonts"));
+    CHECK(!IsWithinDirectory(L"c:\\font", L"c:\\fonts"));
+    CHECK(!IsWithinDirectory(L"d:\\fonts\\a.ttf", L"c:\\fonts"));
+}
+
+
+TEST_CASE(DirectoryWatcherRemovesNestedPaths)
+{
+    std::vector<std::wstring> paths = {
+        L"c:\\fonts\\a.ttf",
+        L"c:\\fonts\\sub",
+        L"c:\\fonts\\sub\\b.ttf",
+        L"c:\\fonts\\sub\\deeper\\c.ttf",
+        L"c:\\fontsx\\d.ttf",
+        L"C:\\FONTS\\SUB",
+        L"c:\\other\\e.ttf",
+    };
+    RemoveNestedPaths(IN OUT paths);
+    CHECK(ArePathsEqual(paths, { L"c:\\fonts\\a.ttf", L"c:\\fonts\\sub", L"c:\\fontsx\\d.ttf", L"c:\\other\\e.ttf" }));
+
+    // A whole changed directory absorbs everything beneath it, wherever it
+    // falls in the list.
+    paths = { L"c:\\fonts\\a.ttf", L"c:\\fonts\\sub\\b.ttf", L"c:\\fonts" };
+    RemoveNestedPaths(IN OUT paths);
+    CHECK(ArePathsEqual(paths, { L"c:\\fonts" }));
+
+    paths.clear();
+    RemoveNestedPaths(IN OUT paths);
+    CHECK(paths.empty());
+}
+
+
+TEST_CASE(DirectoryWatcherParsesChanges)
+{
+    std::vector<uint8_t> notifications;
+    size_t lastRecordOffset = 0;
+    AppendNotification(IN OUT notifications, IN OUT lastRecordOffset, FILE_ACTION_ADDED, L"a.ttf");
+    AppendNotification(IN OUT notifications, IN OUT lastRecordOffset, FILE_ACTION_MODIFIED, L"sub\\bb.otf");
+    AppendNotification(IN OUT notifications, IN OUT lastRecordOffset, FILE_ACTION_RENAMED_NEW_NAME, L"c");
+
+    std::wstring const fontsPath = L"c:\\fonts";
+    std::vector<DirectoryChange> changes;
+    ParseDirectoryChanges(fontsPath, notifications, OUT changes);
+    CHECK(changes.size() == 3);
+    if (changes.size() == 3)
+    {
+        CHECK(changes[0].filePath == L"c:\\fonts\\a.ttf" && changes[0].action == FILE_ACTION_ADDED);
+        CHECK(changes[1].filePath == L"c:\\fonts\\sub\\bb.otf" && changes[1].action == FILE_ACTION_MODIFIED);
+        CHECK(changes[2].filePath == L"c:\\fonts\\c" && changes[2].action == FILE_ACTION_RENAMED_NEW_NAME);
+    }
+
+    // Data cut off in the middle of a record's name or header keeps only the
+    // records before it.
+    ParseDirectoryChanges(fontsPath, const_byte_array_ref(notifications.data(), lastRecordOffset + 13), OUT changes);
+    CHECK(changes.size() == 2);
+    ParseDirectoryChanges(fontsPath, const_byte_array_ref(notifications.data(), lastRecordOffset + 11), OUT changes);
+    CHECK(changes.size() == 2);
+
+    // A name length running past the end of the data.
+    uint32_t const hugeFileNameLength = 0x10000;
+    memcpy(&notifications[lastRecordOffset + 8], &hugeFileNameLength, sizeof(hugeFileNameLength));
+    ParseDirectoryChanges(fontsPath, notifications, OUT changes);
+    CHECK(changes.size() == 2);
+
+    ParseDirectoryChanges(fontsPath, const_byte_array_ref(), OUT changes);
+    CHECK(changes.empty());
+}
+
+
+TEST_CASE(DirectoryWatcherDebouncesChanges)
+{
+    ChangedPathSet changedPaths;
+    changedPaths.SetDebounceInterval(500);
+    CHECK(changedPaths.empty());
+
+    std::wstring const firstPaths[] = { L"c:\\fonts\\b.ttf", L"c:\\fonts\\a.ttf", L"c:\\fonts\\b.ttf" };
+    changedPaths.Add(firstPaths, 1000);
+    CHECK(changedPaths.GetTimeUntilSettled(1000) == 500);
+    CHECK(changedPaths.GetTimeUntilSettled(1400) == 100);
+
+    // Each later batch restarts the interval.
+    std::wstring const secondPaths[] = { L"C:\\FONTS\\A.TTF" };
+    changedPaths.Add(secondPaths, 1400);
+    CHECK(changedPaths.GetTimeUntilSettled(1500) == 400);
+    CHECK(changedPaths.GetTimeUntilSettled(1900) == 0);
+    CHECK(changedPaths.GetTimeUntilSettled(100000) == 0);
+
+    // Repeats are taken once, whatever their case, and sorted.
+    std::vector<std::wstring> paths;
+    changedPaths.Take(OUT paths);
+    CHECK(ArePathsEqual(paths, { L"C:\\FONTS\\A.TTF", L"c:\\fonts\\b.ttf" }));
+    CHECK(changedPaths.empty());
+
+    // A changed directory absorbs the files beneath it.
+    std::wstring const directoryPaths[] = { L"c:\\fonts\\sub\\c.ttf", L"c:\\fonts\\sub", L"c:\\fonts\\d.ttf" };
+    changedPaths.Add(directoryPaths, 2000);
+    changedPaths.Take(OUT paths);
+    CHECK(ArePathsEqual(paths, { L"c:\\fonts\\d.ttf", L"c:\\fonts\\sub" }));
+
+    changedPaths.Take(OUT paths);
+    CHECK(paths.empty());
+}
@@ -0,0 +1,105 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Priority ordering of queued font downloads.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/DownloadScheduler.h"
+#include "Tests.h"
+
+
+namespace
+{
+    DownloadScheduler::Key MakeKey(char const* name)
+    {
+        return DownloadScheduler::Key(name, name + strlen(name));
+    }
+
+
+    // Dequeues everything, returning the keys in order, joined by spaces.
+    std::string DequeueAll(DownloadScheduler& scheduler)
+    {
+        std::string keys;
+        DownloadScheduler::Key key;
+        while (scheduler.Dequeue(OUT key))
+        {
+            if (!keys.empty())
+                keys.push_back(' ');
+            keys.append(key.begin(), key.end());
+        }
+        return keys;
+    }
+}
+
+
+TEST_CASE(DownloadSchedulerOrder)
+{
+    // Higher priorities first, then first queued within a priority.
+    DownloadScheduler scheduler;
+    CHECK(scheduler.empty());
+    CHECK(scheduler.Enqueue(MakeKey("b1"), DownloadScheduler::PriorityBackground));
+    CHECK(scheduler.Enqueue(MakeKey("n1"), DownloadScheduler::PriorityNearVisible));
+    CHECK(scheduler.Enqueue(MakeKey("v1"), DownloadScheduler::PriorityVisible));
+    CHECK(scheduler.Enqueue(MakeKey("b2"), DownloadScheduler::PriorityBackground));
+    CHECK(scheduler.Enqueue(MakeKey("v2"), DownloadScheduler::PriorityVisible));
+    CHECK(scheduler.size() == 5);
+    CHECK(scheduler.IsQueued(MakeKey("n1")));
+    CHECK(!scheduler.IsQueued(MakeKey("n2")));
+
+    CHECK(DequeueAll(scheduler) == "v1 v2 n1 b1 b2");
+    CHECK(scheduler.empty());
+
+    DownloadScheduler::Key key;
+    CHECK(!scheduler.Dequeue(OUT key));
+}
+
+
+TEST_CASE(DownloadSchedulerMerge)
+{
+    // Enqueuing a waiting key again only ever raises its priority, and it
+    // keeps its place among entries of the new priority by first queuing.
+    DownloadScheduler scheduler;
+    scheduler.Enqueue(MakeKey("a"), DownloadScheduler::PriorityBackground);
+    scheduler.Enqueue(MakeKey("b"), DownloadScheduler::PriorityVisible);
+    scheduler.Enqueue(MakeKey("c"), DownloadScheduler::PriorityVisible);
+    CHECK(!scheduler.Enqueue(MakeKey("c"), DownloadScheduler::PriorityBackground));
+    CHECK(!scheduler.Enqueue(MakeKey("a"), DownloadScheduler::PriorityVisible));
+    CHECK(scheduler.size() == 3);
+
+    CHECK(DequeueAll(scheduler) == "a b c");
+
+    // Once dequeued, a key may be queued anew, at the back.
+    scheduler.Enqueue(MakeKey("a"), DownloadScheduler::PriorityVisible);
+    scheduler.Enqueue(MakeKey("b"), DownloadScheduler::PriorityVisible);
+    DownloadScheduler::Key key;
+    CHECK(scheduler.Dequeue(OUT key) && key == MakeKey("a"));
+    CHECK(scheduler.Enqueue(MakeKey("a"), DownloadScheduler::PriorityVisible));
+    CHECK(DequeueAll(scheduler) == "b a");
+}
+
+
+TEST_CASE(DownloadSchedulerReprioritizeAndCancel)
+{
+    // Rows scrolling out of view drop in priority, and back in, rise again.
+    DownloadScheduler scheduler;
+    scheduler.Enqueue(MakeKey("row1"), DownloadScheduler::PriorityVisible);
+    scheduler.Enqueue(MakeKey("row2"), DownloadScheduler::PriorityVisible);
+    scheduler.Enqueue(MakeKey("row3"), DownloadScheduler::PriorityNearVisible);
+    scheduler.Enqueue(MakeKey("row4"), DownloadScheduler::PriorityBackground);
+
+    CHECK(scheduler.SetPriority(MakeKey("row1"), DownloadScheduler::PriorityBackground));
+    CHECK(scheduler.SetPriority(MakeKey("row4"), DownloadScheduler::PriorityVisible));
+    CHECK(!scheduler.SetPriority(MakeKey("row5"), DownloadScheduler::PriorityVisible));
+
+    CHECK(scheduler.Cancel(MakeKey("row3")));
+    CHECK(!scheduler.Cancel(MakeKey("row3")));
+    CHECK(!scheduler.IsQueued(MakeKey("row3")));
+    CHECK(scheduler.size() == 3);
+
+    CHECK(DequeueAll(scheduler) == "row2 row4 row1");
+
+    scheduler.Enqueue(MakeKey("x"), DownloadScheduler::PriorityVisible);
+    scheduler.clear();
+    CHECK(scheduler.empty());
+    CHECK(DequeueAll(scheduler).empty());
+}
@@ -0,0 +1,98 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   File name wildcard masks.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../common/FileHelpers.h"
+#include "Tests.h"
+
+
+namespace
+{
+    bool Matches(wchar_t const* mask, wchar_t const* fileName)
+    {
+        FileMaskMatcher matcher(array_ref<const wchar_t>(mask, wcslen(mask)));
+        return matcher.Matches(array_ref<const wchar_t>(fileName, wcslen(fileName)));
+    }
+}
+
+
+TEST_CASE(FileMaskMatcherShapes)
+{
+    // Exact
+    CHECK(Matches(L"arial.ttf", L"arial.ttf"));
+    CHECK(Matches(L"arial.ttf", L"ARIAL.TTF"));
+    CHECK(!Matches(L"arial.ttf", L"arial.tt"));
+    CHECK(!Matches(L"arial.ttf", L"arial.ttf2"));
+
+    // Prefix
+    CHECK(Matches(L"arial*", L"arial"));
+    CHECK(Matches(L"arial*", L"ArialBold.ttf"));
+    CHECK(!Matches(L"arial*", L"aria"));
+    CHECK(!Matches(L"arial*", L"myarial.ttf"));
+
+    // Suffix
+    CHECK(Matches(L"*.ttf", L".ttf"));
+    CHECK(Matches(L"*.ttf", L"times.TTF"));
+    CHECK(!Matches(L"*.ttf", L"times.ttc"));
+    CHECK(!Matches(L"*.ttf", L"ttf"));
+
+    // General
+    CHECK(Matches(L"a*b?.ttf", L"ab1.ttf"));
+    CHECK(Matches(L"a*b?.ttf", L"aXXbXXb2.ttf"));
+    CHECK(!Matches(L"a*b?.ttf", L"ab.ttf"));
+    CHECK(Matches(L"?", L"a"));
+    CHECK(!Matches(L"?", L""));
+    CHECK(!Matches(L"?", L"ab"));
+    CHECK(Matches(L"*a*a*a*", L"banana.ttf"));
+    CHECK(!Matches(L"*a*a*a*a*", L"banana.ttf"));
+    CHECK(Matches(L"*.*.otf", L"noto.sans.otf"));
+    CHECK(!Matches(L"*.*.otf", L"noto.otf"));
+    CHECK(Matches(L"*x", L"xxxxxx")); // Backtracking past partial matches.
+    CHECK(Matches(L"*ab*ab", L"aabab"));
+}
+
+
+TEST_CASE(FileMaskMatcherLists)
+{
+    wchar_t const* const mask = L"*.ttf; *.TTC;fonts?.otf;;";
+    CHECK(Matches(mask, L"a.ttf"));
+    CHECK(Matches(mask, L"a.ttc")); // Leading spaces of each pattern are skipped.
+    CHECK(Matches(mask, L"fonts1.otf"));
+    CHECK(!Matches(mask, L"fonts.otf"));
+    CHECK(!Matches(mask, L"a.fon"));
+    CHECK(!Matches(mask, L""));
+
+    // "*" and "*.*" anywhere in the list match everything, even names without
+    // an extension, as PathMatchSpecEx does.
+    CHECK(Matches(L"*.ttf;*", L"readme"));
+    CHECK(Matches(L"*.ttf;*.*", L"readme"));
+    CHECK(Matches(L"***", L"x"));
+
+    // Runs of '*' are the same as one, so these keep their fast shapes.
+    CHECK(Matches(L"**.ttf", L"a.ttf"));
+    CHECK(Matches(L"a**", L"abc"));
+    CHECK(!Matches(L"a**", L"b"));
+
+    // Empty masks and patterns match nothing.
+    CHECK(!Matches(L"", L"a.ttf"));
+    CHECK(!Matches(L";; ;", L"a.ttf"));
+    CHECK(!FileMaskMatcher().Matches(array_ref<const wchar_t>(L"a", 1)));
+}
+
+
+TEST_CASE(FileMaskMatcherCase)
+{
+    // Case folds beyond ASCII too.
+    CHECK(Matches(L"\x00E9t\x00E9.ttf", L"\x00C9T\x00C9.TTF"));
+    CHECK(Matches(L"*\x00E9.ttf", L"\x00C9\x00C9.ttf"));
+    CHECK(Matches(L"?t\x00C9*", L"\x00E9t\x00E9.otf"));
+    CHECK(!Matches(L"\x00E9.ttf", L"e.ttf"));
+
+    // Recompiling replaces the earlier mask.
+    FileMaskMatcher matcher(array_ref<const wchar_t>(L"*", 1));
+    matcher.Compile(array_ref<const wchar_t>(L"*.otf", 5));
+    CHECK(!matcher.Matches(array_ref<const wchar_t>(L"a.ttf", 5)));
+    CHECK(matcher.Matches(array_ref<const wchar_t>(L"a.otf", 5)));
+}
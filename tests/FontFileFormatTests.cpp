@@ -0,0 +1,249 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Font file format identification from the start of the file.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/DWritEx.h"
+#include "Tests.h"
+
+
+namespace
+{
+    // Big endian writes, as in the files themselves.
+    void AppendUint16(IN OUT std::vector<uint8_t>& data, uint32_t value)
+    {
+        data.push_back(uint8_t(value >> 8));
+        data.push_back(uint8_t(value));
+    }
+
+
+    void AppendUint32(IN OUT std::vector<uint8_t>& data, uint32_t value)
+    {
+        AppendUint16(IN OUT data, value >> 16);
+        AppendUint16(IN OUT data, value);
+    }
+
+
+    void AppendTag(IN OUT std::vector<uint8_t>& data, _In_reads_(4) char const* tag)
+    {
+        data.insert(data.end(), tag, tag + 4);
+    }
+
+
+    uint32_t GetTag(_In_reads_(4) char const* tag)
+    {
+        return (uint32_t(uint8_t(tag[0])) << 24) | (uint32_t(uint8_t(tag[1])) << 16) | (uint32_t(uint8_t(tag[2])) << 8) | uint8_t(tag[3]);
+    }
+
+
+    // Appends an sfnt offset table whose records all point at the same table.
+    void AppendSfntDirectory(
+        IN OUT std::vector<uint8_t>& data,
+        uint32_t version,
+        uint32_t tableCount,
+        uint32_t tableOffset,
+        uint32_t tableLength
+        )
+    {
+        AppendUint32(IN OUT data, version);
+        AppendUint16(IN OUT data, tableCount);
+        AppendUint16(IN OUT data, 16); // searchRange
+        AppendUint16(IN OUT data, 0);  // entrySelector
+        AppendUint16(IN OUT data, 0);  // rangeShift
+
+        for (uint32_t i = 0; i < tableCount; ++i)
+        {
+            AppendTag(IN OUT data, "head");
+            AppendUint32(IN OUT data, 0); // checksum
+            AppendUint32(IN OUT data, tableOffset);
+            AppendUint32(IN OUT data, tableLength);
+        }
+    }
+
+
+    std::vector<uint8_t> MakeSfnt(uint32_t version, uint32_t tableCount = 2, uint32_t tableOffset = 64, uint32_t tableLength = 32)
+    {
+        std::vector<uint8_t> data;
+        AppendSfntDirectory(IN OUT data, version, tableCount, tableOffset, tableLength);
+        data.resize(std::max(data.size(), size_t(tableOffset) + tableLength));
+        return data;
+    }
+
+
+    // A collection whose fonts all share one table directory, placed right
+    // after the header.
+    std::vector<uint8_t> MakeCollection(uint32_t fontCount, uint32_t sfntVersion = 0x00010000)
+    {
+        std::vector<uint8_t> data;
+        uint32_t const directoryOffset = 12 + fontCount * 4;
+        AppendTag(IN OUT data, "ttcf");
+        AppendUint32(IN OUT data, 0x00010000);
+        AppendUint32(IN OUT data, fontCount);
+        for (uint32_t i = 0; i < fontCount; ++i)
+        {
+            AppendUint32(IN OUT data, directoryOffset);
+        }
+        AppendSfntDirectory(IN OUT data, sfntVersion, 1, directoryOffset + 28, 16);
+        data.resize(data.size() + 16);
+        return data;
+    }
+
+
+    // WOFF and WOFF2 headers, with the length field set to the file size.
+    std::vector<uint8_t> MakeWoff(_In_reads_(4) char const* signature, uint32_t flavor, uint32_t tableCount, uint32_t tableOffset, uint32_t compressedLength)
+    {
+        bool const isWoff2 = (GetTag(signature) == GetTag("wOF2"));
+        size_t const headerSize = isWoff2 ? 48 : 44;
+
+        std::vector<uint8_t> data;
+        AppendTag(IN OUT data, signature);
+        AppendUint32(IN OUT data, flavor);
+        AppendUint32(IN OUT data, 0); // length, filled in below
+        AppendUint16(IN OUT data, tableCount);
+        data.resize(headerSize);
+
+        if (!isWoff2)
+        {
+            for (uint32_t i = 0; i < tableCount; ++i)
+            {
+                AppendTag(IN OUT data, "head");
+                AppendUint32(IN OUT data, tableOffset);
+                AppendUint32(IN OUT data, compressedLength);
+                AppendUint32(IN OUT data, compressedLength); // origLength
+                AppendUint32(IN OUT data, 0);                // origChecksum
+            }
+        }
+        data.resize(std::max(data.size(), size_t(tableOffset) + compressedLength));
+
+        uint32_t const fileSize = static_cast<uint32_t>(data.size());
+        data[8]  = uint8_t(fileSize >> 24);
+        data[9]  = uint8_t(fileSize >> 16);
+        data[10] = uint8_t(fileSize >> 8);
+        data[11] = uint8_t(fileSize);
+        return data;
+    }
+
+
+    FontFileFormat GetFormat(std::vector<uint8_t> const& data)
+    {
+        return GetFontFileFormat(data, data.size());
+    }
+}
+
+
+TEST_CASE(FontFileFormatSfnt)
+{
+    CHECK(GetFormat(MakeSfnt(0x00010000)) == FontFileFormatTrueType);
+    CHECK(GetFormat(MakeSfnt(GetTag("true"))) == FontFileFormatTrueType);
+    CHECK(GetFormat(MakeSfnt(GetTag("OTTO"))) == FontFileFormatOpenTypeCff);
+
+    // Other versions, such as the old Mac 'typ1', are not loadable fonts.
+    CHECK(GetFormat(MakeSfnt(GetTag("typ1"))) == FontFileFormatUnknown);
+    CHECK(GetFormat(MakeSfnt(0x00020000)) == FontFileFormatUnknown);
+}
+
+
+TEST_CASE(FontFileFormatContainers)
+{
+    CHECK(GetFormat(MakeCollection(1)) == FontFileFormatCollection);
+    CHECK(GetFormat(MakeCollection(3)) == FontFileFormatCollection);
+    CHECK(GetFormat(MakeWoff("wOFF", 0x00010000, 2, 100, 20)) == FontFileFormatWoff);
+    CHECK(GetFormat(MakeWoff("wOFF", GetTag("OTTO"), 1, 100, 20)) == FontFileFormatWoff);
+    CHECK(GetFormat(MakeWoff("wOF2", 0x00010000, 5, 100, 20)) == FontFileFormatWoff2);
+    CHECK(GetFormat(MakeWoff("wOF2", GetTag("ttcf"), 5, 100, 20)) == FontFileFormatWoff2);
+
+    CHECK(IsLoadableFontFileFormat(FontFileFormatCollection));
+    CHECK(!IsLoadableFontFileFormat(FontFileFormatWoff));
+    CHECK(!IsLoadableFontFileFormat(FontFileFormatWoff2));
+    CHECK(!IsLoadableFontFileFormat(FontFileFormatUnknown));
+}
+
+
+TEST_CASE(FontFileFormatTruncated)
+{
+    // Shorter than an offset table, or a header longer than the file.
+    auto font = MakeSfnt(0x00010000);
+    CHECK(GetFontFileFormat({ font.data(), 11 }, 11) == FontFileFormatUnknown);
+    CHECK(GetFontFileFormat(font, font.size() - 1) == FontFileFormatUnknown);
+
+    // The table directory runs past the end of the file.
+    CHECK(GetFontFileFormat({ font.data(), 20 }, 20) == FontFileFormatUnknown);
+
+    // A table runs past the end of the file.
+    CHECK(GetFormat(MakeSfnt(0x00010000, 2, 64, 32)) == FontFileFormatTrueType);
+    font = MakeSfnt(0x00010000, 2, 64, 32);
+    font.pop_back();
+    CHECK(GetFormat(font) == FontFileFormatUnknown);
+    CHECK(GetFontFileFormat(font, 0xFFFFFFFF) == FontFileFormatTrueType);
+
+    // Only the records within the header are checked, so a large font whose
+    // header ends partway through its directory is still identified.
+    font = MakeSfnt(0x00010000, 20, 64, 32);
+    CHECK(GetFontFileFormat({ font.data(), 12 + 16 * 3 + 5 }, 4096) == FontFileFormatTrueType);
+
+    // A collection whose first font, or a later font offset, lies outside.
+    auto collection = MakeCollection(2);
+    CHECK(GetFontFileFormat({ collection.data(), 16 }, 16) == FontFileFormatUnknown);
+    collection = MakeCollection(2);
+    collection[19] = 0xF0;
+    CHECK(GetFormat(collection) == FontFileFormatUnknown);
+
+    // A WOFF table runs past the end, and a WOFF2 header is cut short.
+    auto woff = MakeWoff("wOFF", 0x00010000, 1, 100, 20);
+    woff[44 + 11] = 21;
+    CHECK(GetFormat(woff) == FontFileFormatUnknown);
+    auto woff2 = MakeWoff("wOF2", 0x00010000, 1, 40, 0);
+    CHECK(woff2.size() == 48);
+    CHECK(GetFontFileFormat({ woff2.data(), 47 }, 48) == FontFileFormatUnknown);
+}
+
+
+TEST_CASE(FontFileFormatBadTableCounts)
+{
+    // No tables at all.
+    CHECK(GetFormat(MakeSfnt(0x00010000, 0, 64, 32)) == FontFileFormatUnknown);
+    CHECK(GetFormat(MakeCollection(0)) == FontFileFormatUnknown);
+    CHECK(GetFormat(MakeWoff("wOFF", 0x00010000, 0, 100, 20)) == FontFileFormatUnknown);
+    CHECK(GetFormat(MakeWoff("wOF2", 0x00010000, 0, 100, 20)) == FontFileFormatUnknown);
+
+    // More tables than the file could hold.
+    auto font = MakeSfnt(0x00010000);
+    font[4] = 0xFF;
+    font[5] = 0xFF;
+    CHECK(GetFormat(font) == FontFileFormatUnknown);
+
+    auto collection = MakeCollection(1);
+    collection[8] = 0xFF;
+    CHECK(GetFormat(collection) == FontFileFormatUnknown);
+
+    auto woff = MakeWoff("wOFF", 0x00010000, 1, 100, 20);
+    woff[12] = 0xFF;
+    CHECK(GetFormat(woff) == FontFileFormatUnknown);
+
+    // A collection whose first font is not an sfnt.
+    CHECK(GetFormat(MakeCollection(1, GetTag("wOFF"))) == FontFileFormatUnknown);
+}
+
+
+TEST_CASE(FontFileFormatNonFonts)
+{
+    std::vector<uint8_t> data(256, 0);
+    CHECK(GetFormat(data) == FontFileFormatUnknown);
+
+    char const text[] = "%PDF-1.4\n%\xE2\xE3\xCF\xD3\n1 0 obj << /Type /Catalog >> endobj\n";
+    data.assign(text, text + sizeof(text) - 1);
+    CHECK(GetFormat(data) == FontFileFormatUnknown);
+
+    data.assign(256, 0xFF);
+    CHECK(GetFormat(data) == FontFileFormatUnknown);
+
+    CHECK(GetFontFileFormat({}, 0) == FontFileFormatUnknown);
+
+    // A WOFF whose length field does not match the file size, and one that
+    // wraps something other than an sfnt.
+    auto woff = MakeWoff("wOFF", 0x00010000, 1, 100, 20);
+    woff.push_back(0);
+    CHECK(GetFormat(woff) == FontFileFormatUnknown);
+    CHECK(GetFormat(MakeWoff("wOFF", GetTag("wOFF"), 1, 100, 20)) == FontFileFormatUnknown);
+}
@@ -0,0 +1,219 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Decoding of OpenType 'name' tables.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/DWritEx.h"
+#include "Tests.h"
+
+
+namespace
+{
+    struct NameTableRecord
+    {
+        uint16_t platformId;
+        uint16_t encodingId;
+        uint16_t languageId;
+        uint16_t nameId;
+        std::vector<uint8_t> stringBytes;
+    };
+
+
+    std::vector<uint8_t> MakeUtf16String(wchar_t const* text)
+    {
+        std::vector<uint8_t> stringBytes;
+        for ( ; *text != '\0'; ++text)
+        {
+            stringBytes.push_back(uint8_t(*text >> 8));
+            stringBytes.push_back(uint8_t(*text));
+        }
+        return stringBytes;
+    }
+
+
+    std::vector<uint8_t> MakeByteString(char const* text)
+    {
+        return std::vector<uint8_t>(text, text + strlen(text));
+    }
+
+
+    // Builds a format 0 name table, each string stored after the last.
+    std::vector<uint8_t> MakeNameTable(std::vector<NameTableRecord> const& records)
+    {
+        std::vector<uint8_t> table;
+        auto appendUint16 = [&](size_t value)
+        {
+            table.push_back(uint8_t(value >> 8));
+            table.push_back(uint8_t(value));
+        };
+
+        appendUint16(0);
+        appendUint16(records.size());
+        appendUint16(6 + records.size() * 12);
+
+        size_t stringOffset = 0;
+        for (auto const& record : records)
+        {
+            appendUint16(record.platformId);
+            appendUint16(record.encodingId);
+            appendUint16(record.languageId);
+            appendUint16(record.nameId);
+            appendUint16(record.stringBytes.size());
+            appendUint16(stringOffset);
+            stringOffset += record.stringBytes.size();
+        }
+        for (auto const& record : records)
+        {
+            table.insert(table.end(), record.stringBytes.begin(), record.stringBytes.end());
+        }
+
+        return table;
+    }
+
+
+    std::wstring GetName(FontNameCatalog const& catalog, uint32_t fontIndex, uint16_t nameId)
+    {
+        auto name = catalog.GetName(fontIndex, nameId);
+        return std::wstring(name.begin(), name.end());
+    }
+
+
+    uint16_t const windowsPlatformId = 3;
+    uint16_t const macintoshPlatformId = 1;
+    uint16_t const unicodePlatformId = 0;
+    uint16_t const windowsUnicodeBmpEncodingId = 1;
+}
+
+
+TEST_CASE(FontNameCatalogLanguages)
+{
+    auto const nameTable = MakeNameTable({
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x040C, FontNameCatalog::NameIdFamily, MakeUtf16String(L"Famille") },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdFamily, MakeUtf16String(L"Family") },
+        { macintoshPlatformId, 0, 0, FontNameCatalog::NameIdFamily, MakeByteString("Mac Family") },
+        { macintoshPlatformId, 0, 0, FontNameCatalog::NameIdFullName, MakeByteString("Mac Full") },
+        { unicodePlatformId, 3, 0, FontNameCatalog::NameIdFullName, MakeUtf16String(L"Unicode Full") },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0411, FontNameCatalog::NameIdSubfamily, MakeUtf16String(L"\x592A\x5B57") },
+        });
+
+    FontNameCatalog catalog;
+    uint32_t fontIndex;
+    CHECK(catalog.AddNameTable(nameTable, OUT fontIndex) == S_OK);
+    CHECK(fontIndex == 0);
+
+    // Windows US English, then Macintosh English, then anything.
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFamily) == L"Family");
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFullName) == L"Mac Full");
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdSubfamily) == L"\x592A\x5B57");
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdPostscriptName).empty());
+
+    // The preferred language comes first, and applies to fonts already added.
+    catalog.SetPreferredLanguage(L"fr-FR");
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFamily) == L"Famille");
+    catalog.SetPreferredLanguage(nullptr);
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFamily) == L"Family");
+
+    CHECK(GetName(catalog, 1, FontNameCatalog::NameIdFamily).empty());
+}
+
+
+TEST_CASE(FontNameCatalogEncodings)
+{
+    // UTF-16 beyond the BMP, a legacy Windows encoding holding plain ASCII
+    // in 16-bit units, an odd trailing byte, and strings that are skipped:
+    // the license, unknown encodings and platforms, and strings past the end.
+    std::vector<uint8_t> legacyString = { 0, 'M', 0, 'S', 0, ' ', 0, 'S', 0, 'o', 0, 'n', 0, 'g' };
+    std::vector<uint8_t> oddString = MakeUtf16String(L"Odd");
+    oddString.push_back('!');
+
+    auto nameTable = MakeNameTable({
+        { windowsPlatformId, 10, 0x0409, FontNameCatalog::NameIdFullName, MakeUtf16String(L"Emoji \xD83D\xDE00") },
+        { windowsPlatformId, 3, 0x0804, FontNameCatalog::NameIdFamily, legacyString },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdSubfamily, oddString },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, 13, MakeUtf16String(L"License") },
+        { windowsPlatformId, 7, 0x0409, FontNameCatalog::NameIdPostscriptName, MakeUtf16String(L"Unknown") },
+        { 2, 0, 0, FontNameCatalog::NameIdPostscriptName, MakeByteString("ISO") },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdTypographicFamily, MakeUtf16String(L"Truncated") },
+        });
+    nameTable.resize(nameTable.size() - 2); // Cut the last string short.
+
+    FontNameCatalog catalog;
+    uint32_t fontIndex;
+    CHECK(catalog.AddNameTable(nameTable, OUT fontIndex) == S_OK);
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFullName) == L"Emoji \xD83D\xDE00");
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFamily) == L"MS Song");
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdSubfamily) == L"Odd");
+    CHECK(GetName(catalog, fontIndex, 13).empty());
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdPostscriptName).empty());
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdTypographicFamily).empty());
+}
+
+
+TEST_CASE(FontNameCatalogSharedStrings)
+{
+    // Faces of a family repeat the same strings, which are stored once.
+    auto const regularTable = MakeNameTable({
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdFamily, MakeUtf16String(L"Family") },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdSubfamily, MakeUtf16String(L"Regular") },
+        });
+    auto const boldTable = MakeNameTable({
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdFamily, MakeUtf16String(L"Family") },
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdSubfamily, MakeUtf16String(L"Bold") },
+        { macintoshPlatformId, 0, 0, FontNameCatalog::NameIdFamily, MakeByteString("Family") },
+        });
+
+    FontNameCatalog catalog;
+    uint32_t regularFontIndex, boldFontIndex;
+    CHECK(catalog.AddNameTable(regularTable, OUT regularFontIndex) == S_OK);
+    CHECK(catalog.AddNameTable(boldTable, OUT boldFontIndex) == S_OK);
+    CHECK(regularFontIndex == 0 && boldFontIndex == 1);
+
+    CHECK(GetName(catalog, boldFontIndex, FontNameCatalog::NameIdSubfamily) == L"Bold");
+    CHECK(GetName(catalog, regularFontIndex, FontNameCatalog::NameIdSubfamily) == L"Regular");
+    CHECK(catalog.GetName(regularFontIndex, FontNameCatalog::NameIdFamily).data() == catalog.GetName(boldFontIndex, FontNameCatalog::NameIdFamily).data());
+
+    catalog.clear();
+    CHECK(GetName(catalog, regularFontIndex, FontNameCatalog::NameIdFamily).empty());
+    CHECK(catalog.AddNameTable(boldTable, OUT boldFontIndex) == S_OK);
+    CHECK(boldFontIndex == 0);
+}
+
+
+TEST_CASE(FontNameCatalogMalformed)
+{
+    FontNameCatalog catalog;
+    uint32_t fontIndex;
+
+    auto nameTable = MakeNameTable({
+        { windowsPlatformId, windowsUnicodeBmpEncodingId, 0x0409, FontNameCatalog::NameIdFamily, MakeUtf16String(L"Family") },
+        });
+
+    // Too short for the header or the records.
+    CHECK(catalog.AddNameTable({}, OUT fontIndex) == DWRITE_E_FILEFORMAT);
+    CHECK(catalog.AddNameTable({ nameTable.data(), 4 }, OUT fontIndex) == DWRITE_E_FILEFORMAT);
+    CHECK(catalog.AddNameTable({ nameTable.data(), 6 + 11 }, OUT fontIndex) == DWRITE_E_FILEFORMAT);
+
+    // Storage past the end.
+    auto badStorageTable = nameTable;
+    badStorageTable[4] = 0xFF;
+    CHECK(catalog.AddNameTable(badStorageTable, OUT fontIndex) == DWRITE_E_FILEFORMAT);
+
+    // Every prefix of a valid table either fails or yields valid names.
+    for (size_t size = 0; size <= nameTable.size(); ++size)
+    {
+        if (SUCCEEDED(catalog.AddNameTable({ nameTable.data(), size }, OUT fontIndex)))
+        {
+            auto const name = GetName(catalog, fontIndex, FontNameCatalog::NameIdFamily);
+            CHECK(name.empty() || name == L"Family");
+        }
+    }
+
+    // An empty table is valid, with no names.
+    auto const emptyTable = MakeNameTable({});
+    CHECK(catalog.AddNameTable(emptyTable, OUT fontIndex) == S_OK);
+    CHECK(GetName(catalog, fontIndex, FontNameCatalog::NameIdFamily).empty());
+
+    CHECK(FontNameCatalog::GetNameId(DWRITE_INFORMATIONAL_STRING_FULL_NAME) == FontNameCatalog::NameIdFullName);
+    CHECK(FontNameCatalog::GetNameId(DWRITE_INFORMATIONAL_STRING_COPYRIGHT_NOTICE) == 0);
+}
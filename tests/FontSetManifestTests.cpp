@@ -0,0 +1,134 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Font set manifest export and import.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/DWritEx.h"
+#include "Tests.h"
+
+
+namespace
+{
+    bool AreEntriesEqual(FontSetManifestEntry const& a, FontSetManifestEntry const& b)
+    {
+        return a.filePath == b.filePath
+            && a.faceIndex == b.faceIndex
+            && a.fullName == b.fullName
+            && a.wssFamilyName == b.wssFamilyName
+            && a.weight == b.weight
+            && a.stretch == b.stretch
+            && a.slope == b.slope;
+    }
+
+
+    HRESULT WriteManifest(array_ref<FontSetManifestEntry const> entries, OUT std::wstring& text)
+    {
+        std::vector<uint8_t> utf8Text;
+        JsonexWriter writer(JsonexWriter::OptionsDefault);
+
+        // A small buffer so that the rows are streamed out in several pieces.
+        writer.SetOutputSink(
+            [&](const_byte_array_ref bytes) -> HRESULT
+            {
+                utf8Text.insert(utf8Text.end(), bytes.begin(), bytes.end());
+                return S_OK;
+            },
+            64
+            );
+
+        IFR(writer.BeginArray());
+        for (auto const& entry : entries)
+        {
+            IFR(WriteFontSetManifestEntry(writer, entry));
+        }
+        IFR(writer.EndScope());
+        IFR(writer.Flush());
+
+        ConvertText(array_ref<char const>(reinterpret_cast<char const*>(utf8Text.data()), utf8Text.size()), OUT text);
+        return S_OK;
+    }
+}
+
+
+TEST_CASE(FontSetManifestRoundTrip)
+{
+    // Paths have backslashes and quotes that must be escaped, and names are
+    // beyond ASCII. Unknown properties are written as empty strings.
+    FontSetManifestEntry const entries[] = {
+        { L"c:\\fonts\\arial.ttf", 0, L"Arial", L"Arial", L"400", L"5", L"0" },
+        { L"d:\\my \"fonts\"\\\x00E9t\x00E9.ttc", 3, L"\x00C9t\x00E9 Bold", L"\x00C9t\x00E9", L"", L"", L"" },
+    };
+
+    std::wstring text;
+    CHECK(WriteManifest({ entries, ARRAYSIZE(entries) }, OUT text) == S_OK);
+
+    std::vector<FontSetManifestEntry> readEntries;
+    CHECK(ReadFontSetManifest(text, OUT readEntries) == S_OK);
+    CHECK(readEntries.size() == ARRAYSIZE(entries));
+
+    for (size_t i = 0; i < readEntries.size() && i < ARRAYSIZE(entries); ++i)
+    {
+        CHECK(AreEntriesEqual(readEntries[i], entries[i]));
+    }
+}
+
+
+TEST_CASE(FontSetManifestFileData)
+{
+    // File contents may be UTF-8 text or a binary snapshot of the parsed
+    // tree, and both must give the same entries.
+    FontSetManifestEntry const entries[] = {
+        { L"c:\\fonts\\\x00E9t\x00E9.ttf", 1, L"\x00C9t\x00E9", L"\x00C9t\x00E9", L"700", L"5", L"1" },
+    };
+
+    std::wstring text;
+    CHECK(WriteManifest({ entries, ARRAYSIZE(entries) }, OUT text) == S_OK);
+
+    std::string utf8Text;
+    ConvertText(text, OUT utf8Text);
+    std::vector<FontSetManifestEntry> readEntries;
+    CHECK(ReadFontSetManifestData(const_byte_array_ref(reinterpret_cast<uint8_t const*>(utf8Text.data()), utf8Text.size()), OUT readEntries) == S_OK);
+    CHECK(readEntries.size() == 1 && AreEntriesEqual(readEntries[0], entries[0]));
+
+    std::vector<uint8_t> snapshot;
+    CHECK(WriteFontSetManifestBinary(text, OUT snapshot) == S_OK);
+    CHECK(TextTree::IsBinary(snapshot));
+    CHECK(ReadFontSetManifestData(const_byte_array_ref(snapshot), OUT readEntries) == S_OK);
+    CHECK(readEntries.size() == 1 && AreEntriesEqual(readEntries[0], entries[0]));
+
+    // A damaged snapshot is rejected rather than read as text.
+    snapshot.back() ^= 0xFF;
+    CHECK(FAILED(ReadFontSetManifestData(const_byte_array_ref(snapshot), OUT readEntries)));
+    CHECK(readEntries.empty());
+}
+
+
+TEST_CASE(FontSetManifestEmpty)
+{
+    std::wstring text;
+    CHECK(WriteManifest({}, OUT text) == S_OK);
+
+    std::vector<FontSetManifestEntry> readEntries;
+    CHECK(ReadFontSetManifest(text, OUT readEntries) == S_OK);
+    CHECK(readEntries.empty());
+}
+
+
+TEST_CASE(FontSetManifestSkipsEntriesWithoutPath)
+{
+    std::wstring const text = L"[{\"FaceIndex\": 1}, {\"Path\": \"a.ttf\", \"FaceIndex\": 2}, 42]";
+
+    std::vector<FontSetManifestEntry> readEntries;
+    CHECK(ReadFontSetManifest(text, OUT readEntries) == S_OK);
+    CHECK(readEntries.size() == 1);
+    CHECK(!readEntries.empty() && readEntries[0].filePath == L"a.ttf" && readEntries[0].faceIndex == 2);
+}
+
+
+TEST_CASE(FontSetManifestRejectsNonArray)
+{
+    std::vector<FontSetManifestEntry> readEntries;
+    CHECK(ReadFontSetManifest(std::wstring(L"{\"Path\": \"a.ttf\"}"), OUT readEntries) == E_INVALIDARG);
+    CHECK(readEntries.empty());
+}
@@ -0,0 +1,108 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Least recently used eviction for the font download cache.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/LruCachePolicy.h"
+#include "Tests.h"
+
+
+namespace
+{
+    void AddEntry(LruCachePolicy& policy, wchar_t const* name, uint64_t size, uint64_t accessTime)
+    {
+        policy.SetSize(name, size);
+        policy.Touch(name, accessTime);
+    }
+
+
+    std::vector<std::wstring> SelectVictims(LruCachePolicy const& policy, uint64_t targetSize)
+    {
+        std::vector<std::wstring> victims;
+        policy.SelectVictims(targetSize, OUT victims);
+        return victims;
+    }
+}
+
+
+TEST_CASE(LruCachePolicySizes)
+{
+    LruCachePolicy policy;
+    AddEntry(policy, L"a", 100, 1);
+    AddEntry(policy, L"b", 200, 2);
+    CHECK(policy.GetTotalSize() == 300);
+    CHECK(policy.GetEntryCount() == 2);
+
+    // Files grow and shrink as chunks arrive or are discarded.
+    policy.SetSize(L"a", 150);
+    CHECK(policy.GetTotalSize() == 350);
+    policy.SetSize(L"b", 50);
+    CHECK(policy.GetTotalSize() == 200);
+
+    policy.Remove(L"a");
+    policy.Remove(L"missing");
+    CHECK(policy.GetTotalSize() == 50);
+    CHECK(policy.GetEntryCount() == 1);
+
+    // Touching or pinning an unknown entry adds it with no size, but
+    // unpinning one does not.
+    policy.Touch(L"c", 3);
+    policy.Pin(L"d");
+    policy.Unpin(L"e");
+    CHECK(policy.GetEntryCount() == 3);
+    CHECK(policy.GetTotalSize() == 50);
+
+    policy.clear();
+    CHECK(policy.GetTotalSize() == 0);
+    CHECK(policy.GetEntryCount() == 0);
+}
+
+
+TEST_CASE(LruCachePolicyVictims)
+{
+    LruCachePolicy policy;
+    AddEntry(policy, L"newest", 100, 30);
+    AddEntry(policy, L"oldest", 100, 10);
+    AddEntry(policy, L"middle", 100, 20);
+
+    CHECK(SelectVictims(policy, 300).empty());
+    CHECK(SelectVictims(policy, 250) == std::vector<std::wstring>({ L"oldest" }));
+    CHECK(SelectVictims(policy, 200) == std::vector<std::wstring>({ L"oldest" }));
+    CHECK(SelectVictims(policy, 199) == std::vector<std::wstring>({ L"oldest", L"middle" }));
+    CHECK(SelectVictims(policy, 0) == std::vector<std::wstring>({ L"oldest", L"middle", L"newest" }));
+
+    // Access times only move forward, so a late report of an older access
+    // does not age an entry.
+    policy.Touch(L"oldest", 40);
+    policy.Touch(L"oldest", 5);
+    CHECK(SelectVictims(policy, 200) == std::vector<std::wstring>({ L"middle" }));
+}
+
+
+TEST_CASE(LruCachePolicyPinning)
+{
+    LruCachePolicy policy;
+    AddEntry(policy, L"a", 100, 1);
+    AddEntry(policy, L"b", 100, 2);
+    AddEntry(policy, L"c", 100, 3);
+
+    // Pinned entries are passed over, even if oldest.
+    policy.Pin(L"a");
+    policy.Pin(L"a");
+    CHECK(SelectVictims(policy, 200) == std::vector<std::wstring>({ L"b" }));
+
+    // Pins are counted.
+    policy.Unpin(L"a");
+    CHECK(SelectVictims(policy, 200) == std::vector<std::wstring>({ L"b" }));
+    policy.Unpin(L"a");
+    CHECK(SelectVictims(policy, 200) == std::vector<std::wstring>({ L"a" }));
+    policy.Unpin(L"a"); // Extra unpins are ignored.
+    CHECK(SelectVictims(policy, 200) == std::vector<std::wstring>({ L"a" }));
+
+    // If the pinned entries alone are over the target, all the others go.
+    policy.Pin(L"a");
+    policy.Pin(L"b");
+    policy.SetSize(L"a", 500);
+    CHECK(SelectVictims(policy, 300) == std::vector<std::wstring>({ L"c" }));
+}
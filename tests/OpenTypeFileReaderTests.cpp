@@ -0,0 +1,432 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Reading the table structure of partially downloaded fonts.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/OpenTypeFileReader.h"
+#include "Tests.h"
+
+
+namespace
+{
+    typedef OpenTypeFileReader Reader;
+
+    // Big endian writing, as stored in the font file.
+    class FontDataWriter
+    {
+    public:
+        std::vector<uint8_t> data;
+
+        FontDataWriter& Uint16(uint32_t value)
+        {
+            data.push_back(uint8_t(value >> 8));
+            data.push_back(uint8_t(value));
+            return *this;
+        }
+
+        FontDataWriter& Uint32(uint32_t value)
+        {
+            return Uint16(value >> 16).Uint16(value & 0xFFFF);
+        }
+
+        FontDataWriter& Bytes(std::initializer_list<uint8_t> bytes)
+        {
+            data.insert(data.end(), bytes);
+            return *this;
+        }
+
+        FontDataWriter& Zeros(size_t count)
+        {
+            data.resize(data.size() + count);
+            return *this;
+        }
+    };
+
+
+    // Composite component flags.
+    enum
+    {
+        ArgumentsAreWords   = 0x0001,
+        HaveScale           = 0x0008,
+        MoreComponents      = 0x0020,
+        HaveXYScale         = 0x0040,
+        HaveTwoByTwo        = 0x0080,
+    };
+
+
+    // Glyphs of the test font:
+    //  0 .notdef, 1 'A', 3 U+1F600: simple outlines
+    //  2 'B': composite of 1 and 3
+    //  4 'C': composite of 2 (nested), 1 and 99 (beyond the glyph count)
+    //  5 ' ': empty
+    uint32_t const testGlyphCount = 6;
+    uint32_t const testGlyphOffsets[testGlyphCount + 1] = { 0, 12, 24, 50, 62, 102, 102 };
+
+
+    std::vector<uint8_t> MakeGlyfTable()
+    {
+        FontDataWriter glyf;
+        auto simpleGlyph = [&]() { glyf.Uint16(1).Zeros(10); };
+        auto compositeHeader = [&]() { glyf.Uint16(0xFFFF).Zeros(8); };
+
+        simpleGlyph();
+        simpleGlyph();
+
+        compositeHeader();
+        glyf.Uint16(MoreComponents | ArgumentsAreWords).Uint16(1).Zeros(4);
+        glyf.Uint16(HaveScale).Uint16(3).Zeros(2 + 2);
+
+        simpleGlyph();
+
+        compositeHeader();
+        glyf.Uint16(MoreComponents | HaveTwoByTwo).Uint16(2).Zeros(2 + 8);
+        glyf.Uint16(MoreComponents | HaveXYScale).Uint16(1).Zeros(2 + 4);
+        glyf.Uint16(0).Uint16(99).Zeros(2);
+
+        return glyf.data;
+    }
+
+
+    std::vector<uint8_t> MakeLocaTable(bool isLongFormat)
+    {
+        FontDataWriter loca;
+        for (auto offset : testGlyphOffsets)
+        {
+            if (isLongFormat)
+                loca.Uint32(offset);
+            else
+                loca.Uint16(offset / 2);
+        }
+        return loca.data;
+    }
+
+
+    // Format 4 maps ' ' by delta and 'A' to 'C' through the glyph array.
+    // Format 12 maps the same, plus U+1F600.
+    std::vector<uint8_t> MakeCmapTable(_Out_ uint32_t& format4Offset, _Out_ uint32_t& format12Offset)
+    {
+        format4Offset = 4 + 2 * 8;
+        format12Offset = format4Offset + 14 + 4 * 2 * 3 + 2 + 3 * 2;
+
+        FontDataWriter cmap;
+        cmap.Uint16(0).Uint16(2);
+        cmap.Uint16(3).Uint16(1).Uint32(format4Offset);
+        cmap.Uint16(3).Uint16(10).Uint32(format12Offset);
+
+        cmap.Uint16(4).Uint16(0).Uint16(0).Uint16(3 * 2).Zeros(6);
+        cmap.Uint16(0x20).Uint16(0x43).Uint16(0xFFFF);   // End codes
+        cmap.Uint16(0);                                 // Reserved pad
+        cmap.Uint16(0x20).Uint16(0x41).Uint16(0xFFFF);   // Start codes
+        cmap.Uint16((5 - 0x20) & 0xFFFF).Uint16(0).Uint16(1); // Deltas
+        cmap.Uint16(0).Uint16(4).Uint16(0);             // Range offsets, the second reaching the glyph array
+        cmap.Uint16(1).Uint16(2).Uint16(4);             // Glyph array
+
+        cmap.Uint16(12).Uint16(0).Uint32(16 + 4 * 12).Uint32(0).Uint32(4);
+        cmap.Uint32(0x20).Uint32(0x20).Uint32(5);
+        cmap.Uint32(0x41).Uint32(0x42).Uint32(1);
+        cmap.Uint32(0x43).Uint32(0x43).Uint32(4);
+        cmap.Uint32(0x1F600).Uint32(0x1F600).Uint32(3);
+
+        return cmap.data;
+    }
+
+
+    // Lays out a font file with the given tables, 4 byte aligned, in the
+    // order given.
+    std::vector<uint8_t> MakeFontFile(std::vector<std::pair<uint32_t, std::vector<uint8_t> > > const& tables)
+    {
+        uint32_t const tableCount = uint32_t(tables.size());
+        uint32_t offset = Reader::offsetTableSize + tableCount * Reader::tableRecordSize;
+
+        FontDataWriter font;
+        font.Uint32(0x00010000).Uint16(tableCount).Zeros(6);
+        for (auto const& table : tables)
+        {
+            font.Uint32(table.first).Uint32(0).Uint32(offset).Uint32(uint32_t(table.second.size()));
+            offset += (uint32_t(table.second.size()) + 3) & ~3u;
+        }
+        for (auto const& table : tables)
+        {
+            font.data.insert(font.data.end(), table.second.begin(), table.second.end());
+            font.data.resize((font.data.size() + 3) & ~size_t(3));
+        }
+        return font.data;
+    }
+
+
+    std::vector<uint8_t> MakeTestFont(bool isLongFormat)
+    {
+        FontDataWriter head, maxp;
+        head.Zeros(50).Uint16(isLongFormat ? 1 : 0).Uint16(0);
+        maxp.Uint32(0x00005000).Uint16(testGlyphCount);
+
+        uint32_t format4Offset, format12Offset;
+        return MakeFontFile({
+            { Reader::MakeTag('c','m','a','p'), MakeCmapTable(OUT format4Offset, OUT format12Offset) },
+            { Reader::MakeTag('g','l','y','f'), MakeGlyfTable() },
+            { Reader::MakeTag('h','e','a','d'), head.data },
+            { Reader::MakeTag('l','o','c','a'), MakeLocaTable(isLongFormat) },
+            { Reader::MakeTag('m','a','x','p'), maxp.data },
+            });
+    }
+
+
+    const_byte_array_ref GetTable(std::vector<uint8_t> const& font, std::vector<Reader::TableRecord> const& tableRecords, char const* tag)
+    {
+        auto* tableRecord = Reader::FindTable(tableRecords, Reader::MakeTag(tag[0], tag[1], tag[2], tag[3]));
+        if (tableRecord == nullptr || tableRecord->offset > font.size() || font.size() - tableRecord->offset < tableRecord->length)
+            return const_byte_array_ref();
+
+        return const_byte_array_ref(&font[tableRecord->offset], tableRecord->length);
+    }
+
+
+    bool IsRangeEqual(Range const& range, uint64_t begin, uint64_t end)
+    {
+        return range.begin == begin && range.end == end;
+    }
+}
+
+
+TEST_CASE(OpenTypeFileReaderDirectory)
+{
+    auto const font = MakeTestFont(false);
+
+    std::vector<uint32_t> directoryOffsets;
+    uint64_t requiredSize;
+    CHECK(Reader::ReadFontDirectoryOffsets(font, OUT directoryOffsets, OUT requiredSize));
+    CHECK(directoryOffsets == std::vector<uint32_t>({ 0 }));
+
+    std::vector<Reader::TableRecord> tableRecords;
+    CHECK(Reader::ReadTableRecords(font, 0, OUT tableRecords, OUT requiredSize));
+    CHECK(tableRecords.size() == 5);
+    CHECK(requiredSize == 12 + 5 * 16);
+
+    auto* glyfRecord = Reader::FindTable(tableRecords, Reader::MakeTag('g','l','y','f'));
+    CHECK(glyfRecord != nullptr && glyfRecord->length == 102 && glyfRecord->offset % 4 == 0);
+    CHECK(Reader::FindTable(tableRecords, Reader::MakeTag('C','F','F',' ')) == nullptr);
+
+    CHECK(Reader::ReadGlyphCount(GetTable(font, tableRecords, "maxp")) == testGlyphCount);
+    CHECK(!Reader::IsLongGlyphLocationFormat(GetTable(font, tableRecords, "head")));
+
+    // Short data reports how much more is needed.
+    CHECK(!Reader::ReadFontDirectoryOffsets(const_byte_array_ref(font.data(), 2), OUT directoryOffsets, OUT requiredSize));
+    CHECK(requiredSize == 12);
+    CHECK(!Reader::ReadTableRecords(const_byte_array_ref(font.data(), 20), 0, OUT tableRecords, OUT requiredSize));
+    CHECK(requiredSize == 12 + 5 * 16);
+    CHECK(tableRecords.empty());
+
+    // Neither a font nor a collection.
+    std::vector<uint8_t> notFont(font);
+    notFont[0] = 'w';
+    CHECK(!Reader::ReadFontDirectoryOffsets(notFont, OUT directoryOffsets, OUT requiredSize));
+    CHECK(!Reader::ReadTableRecords(notFont, 0, OUT tableRecords, OUT requiredSize));
+}
+
+
+TEST_CASE(OpenTypeFileReaderCollection)
+{
+    // Two faces sharing one directory, after the collection header.
+    auto const font = MakeTestFont(false);
+    FontDataWriter collection;
+    collection.Uint32(Reader::MakeTag('t','t','c','f')).Uint32(0x00010000).Uint32(2).Uint32(20).Uint32(20);
+    collection.data.insert(collection.data.end(), font.begin(), font.end());
+
+    std::vector<uint32_t> directoryOffsets;
+    uint64_t requiredSize;
+    CHECK(Reader::ReadFontDirectoryOffsets(collection.data, OUT directoryOffsets, OUT requiredSize));
+    CHECK(directoryOffsets == std::vector<uint32_t>({ 20, 20 }));
+
+    std::vector<Reader::TableRecord> tableRecords;
+    CHECK(Reader::ReadTableRecords(collection.data, 20, OUT tableRecords, OUT requiredSize));
+    CHECK(tableRecords.size() == 5);
+
+    // The offsets run past the first 12 bytes.
+    CHECK(!Reader::ReadFontDirectoryOffsets(const_byte_array_ref(collection.data.data(), 16), OUT directoryOffsets, OUT requiredSize));
+    CHECK(requiredSize == 20);
+    CHECK(!Reader::ReadTableRecords(collection.data, uint32_t(collection.data.size() - 4), OUT tableRecords, OUT requiredSize));
+}
+
+
+TEST_CASE(OpenTypeFileReaderCmap)
+{
+    uint32_t format4Offset, format12Offset;
+    auto const cmap = MakeCmapTable(OUT format4Offset, OUT format12Offset);
+
+    // The full repertoire subtable is preferred.
+    CHECK(Reader::FindUnicodeCmapSubtable(cmap) == format12Offset);
+
+    for (auto subtableOffset : { format4Offset, format12Offset })
+    {
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, ' ') == 5);
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, 'A') == 1);
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, 'B') == 2);
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, 'C') == 4);
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, 'D') == 0);
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, '!') == 0);
+        CHECK(Reader::MapCharacter(cmap, subtableOffset, 0) == 0);
+    }
+    CHECK(Reader::MapCharacter(cmap, format4Offset, 0x1F600) == 0);
+    CHECK(Reader::MapCharacter(cmap, format12Offset, 0x1F600) == 3);
+
+    // Without the format 12 record, format 4 is used. Non-Unicode subtables
+    // are never picked.
+    std::vector<uint8_t> bmpOnlyCmap(cmap);
+    bmpOnlyCmap[3] = 1;
+    CHECK(Reader::FindUnicodeCmapSubtable(bmpOnlyCmap) == format4Offset);
+    std::vector<uint8_t> macintoshCmap(bmpOnlyCmap);
+    macintoshCmap[5] = 1; // Platform 1
+    macintoshCmap[7] = 0;
+    CHECK(Reader::FindUnicodeCmapSubtable(macintoshCmap) == 0);
+
+    // Truncated tables read as unmapped rather than out of bounds.
+    for (size_t size = 0; size < cmap.size(); ++size)
+    {
+        const_byte_array_ref const truncatedCmap(cmap.data(), size);
+        uint32_t const subtableOffset = Reader::FindUnicodeCmapSubtable(truncatedCmap);
+        CHECK(subtableOffset == 0 || subtableOffset == format4Offset || subtableOffset == format12Offset);
+        CHECK(Reader::MapCharacter(truncatedCmap, format4Offset, 'C') == ((size >= format12Offset) ? 4 : 0));
+        CHECK(Reader::MapCharacter(truncatedCmap, format12Offset, 0x1F600) == ((size >= cmap.size()) ? 3 : 0));
+    }
+}
+
+
+TEST_CASE(OpenTypeFileReaderGlyphLocations)
+{
+    for (bool isLongFormat : { false, true })
+    {
+        auto const font = MakeTestFont(isLongFormat);
+        std::vector<Reader::TableRecord> tableRecords;
+        uint64_t requiredSize;
+        CHECK(Reader::ReadTableRecords(font, 0, OUT tableRecords, OUT requiredSize));
+        CHECK(Reader::IsLongGlyphLocationFormat(GetTable(font, tableRecords, "head")) == isLongFormat);
+
+        auto const locaTable = GetTable(font, tableRecords, "loca");
+        Range range;
+        CHECK(Reader::ReadGlyphDataRange(locaTable, isLongFormat, 0, OUT range) && IsRangeEqual(range, 0, 12));
+        CHECK(Reader::ReadGlyphDataRange(locaTable, isLongFormat, 2, OUT range) && IsRangeEqual(range, 24, 50));
+        CHECK(Reader::ReadGlyphDataRange(locaTable, isLongFormat, 5, OUT range) && IsRangeEqual(range, 102, 102));
+        CHECK(!Reader::ReadGlyphDataRange(locaTable, isLongFormat, 6, OUT range));
+    }
+
+    // Decreasing offsets are malformed.
+    FontDataWriter loca;
+    loca.Uint16(10).Uint16(4);
+    Range range;
+    CHECK(!Reader::ReadGlyphDataRange(loca.data, false, 0, OUT range));
+}
+
+
+TEST_CASE(OpenTypeFileReaderCompositeGlyphs)
+{
+    auto const glyf = MakeGlyfTable();
+    auto getGlyphData = [&](uint32_t glyphId)
+    {
+        return const_byte_array_ref(glyf.data() + testGlyphOffsets[glyphId], testGlyphOffsets[glyphId + 1] - testGlyphOffsets[glyphId]);
+    };
+
+    std::vector<uint16_t> componentGlyphIds;
+    CHECK(Reader::ReadCompositeGlyphComponents(getGlyphData(1), IN OUT componentGlyphIds));
+    CHECK(componentGlyphIds.empty());
+    CHECK(Reader::ReadCompositeGlyphComponents(getGlyphData(5), IN OUT componentGlyphIds));
+    CHECK(componentGlyphIds.empty());
+
+    // Each argument and transform size is skipped correctly.
+    CHECK(Reader::ReadCompositeGlyphComponents(getGlyphData(2), IN OUT componentGlyphIds));
+    CHECK(Reader::ReadCompositeGlyphComponents(getGlyphData(4), IN OUT componentGlyphIds));
+    CHECK(componentGlyphIds == std::vector<uint16_t>({ 1, 3, 2, 1, 99 }));
+
+    // Truncated composites fail, keeping the components read so far.
+    componentGlyphIds.clear();
+    const_byte_array_ref const compositeGlyph = getGlyphData(4);
+    CHECK(!Reader::ReadCompositeGlyphComponents(const_byte_array_ref(compositeGlyph.data(), 1), IN OUT componentGlyphIds));
+    CHECK(!Reader::ReadCompositeGlyphComponents(const_byte_array_ref(compositeGlyph.data(), 24), IN OUT componentGlyphIds));
+    CHECK(componentGlyphIds == std::vector<uint16_t>({ 2 }));
+}
+
+
+TEST_CASE(OpenTypeFileReaderGlyphClosure)
+{
+    // Follow characters through the cmap to glyphs, and through loca and
+    // glyf to their components, a level at a time as DownloadGlyphs does.
+    auto const font = MakeTestFont(false);
+    std::vector<Reader::TableRecord> tableRecords;
+    uint64_t requiredSize;
+    CHECK(Reader::ReadTableRecords(font, 0, OUT tableRecords, OUT requiredSize));
+
+    auto const cmapTable = GetTable(font, tableRecords, "cmap");
+    auto const locaTable = GetTable(font, tableRecords, "loca");
+    auto const glyfTable = GetTable(font, tableRecords, "glyf");
+    uint32_t const subtableOffset = Reader::FindUnicodeCmapSubtable(cmapTable);
+
+    std::vector<bool> isGlyphRequested(Reader::ReadGlyphCount(GetTable(font, tableRecords, "maxp")));
+    std::vector<uint16_t> pendingGlyphIds = { Reader::MapCharacter(cmapTable, subtableOffset, 'C') };
+    isGlyphRequested[pendingGlyphIds[0]] = true;
+
+    std::vector<std::vector<uint16_t> > levels;
+    std::vector<uint16_t> componentGlyphIds;
+    while (!pendingGlyphIds.empty() && levels.size() < 10)
+    {
+        levels.push_back(pendingGlyphIds);
+        Reader::ReadComponentGlyphs(locaTable, false, glyfTable, pendingGlyphIds, IN OUT isGlyphRequested, OUT componentGlyphIds);
+        pendingGlyphIds.swap(componentGlyphIds);
+    }
+
+    // Glyph 1 is reached from both 4 and 2 but only taken once, and the
+    // out of range 99 is dropped.
+    CHECK(levels.size() == 3);
+    CHECK(levels.size() == 3 && levels[0] == std::vector<uint16_t>({ 4 }));
+    CHECK(levels.size() == 3 && levels[1] == std::vector<uint16_t>({ 2, 1 }));
+    CHECK(levels.size() == 3 && levels[2] == std::vector<uint16_t>({ 3 }));
+    CHECK(isGlyphRequested == std::vector<bool>({ false, true, true, true, true, false }));
+
+    // Outlines not yet downloaded contribute nothing, so the level is
+    // simply read again once they arrive.
+    std::fill(isGlyphRequested.begin(), isGlyphRequested.end(), false);
+    uint16_t const compositeGlyphId = 4;
+    Reader::ReadComponentGlyphs(locaTable, false, const_byte_array_ref(glyfTable.data(), 70), { &compositeGlyphId, 1 }, IN OUT isGlyphRequested, OUT componentGlyphIds);
+    CHECK(componentGlyphIds.empty());
+}
+
+
+TEST_CASE(OpenTypeFileReaderCff)
+{
+    // Header, Name INDEX, Top DICT INDEX pointing to the CharStrings INDEX
+    // at 17, holding two outlines of 2 and 3 bytes.
+    FontDataWriter cff;
+    cff.Bytes({ 1, 0, 4, 1 });
+    cff.Uint16(1).Bytes({ 1, 1, 2, 'A' });
+    cff.Uint16(1).Bytes({ 1, 1, 3, 17 + 139, 17 });
+    cff.Uint16(2).Bytes({ 1, 1, 3, 6, 0xA1, 0xA2, 0xB1, 0xB2, 0xB3 });
+
+    Reader::CffIndex charStringsIndex;
+    uint64_t requiredSize;
+    CHECK(Reader::ReadCffCharStringsIndex(cff.data, false, OUT charStringsIndex, OUT requiredSize));
+    CHECK(charStringsIndex.count == 2);
+    CHECK(charStringsIndex.endOffset == cff.data.size());
+
+    Range const outline = Reader::GetCffIndexItem(cff.data, charStringsIndex, 1);
+    CHECK(IsRangeEqual(outline, 25, 28) && cff.data[25] == 0xB1);
+    CHECK(IsRangeEqual(Reader::GetCffIndexItem(cff.data, charStringsIndex, 2), 0, 0));
+
+    // The offsets must have arrived, though not the outlines.
+    CHECK(Reader::ReadCffCharStringsIndex(const_byte_array_ref(cff.data.data(), 23), false, OUT charStringsIndex, OUT requiredSize));
+    CHECK(!Reader::ReadCffCharStringsIndex(const_byte_array_ref(cff.data.data(), 20), false, OUT charStringsIndex, OUT requiredSize));
+    CHECK(requiredSize == 23);
+    CHECK(!Reader::ReadCffCharStringsIndex(const_byte_array_ref(cff.data.data(), 12), false, OUT charStringsIndex, OUT requiredSize));
+    CHECK(requiredSize == 13);
+
+    // Integer operands of each size are read from the DICT.
+    FontDataWriter dict;
+    dict.Bytes({ 28, 0x12, 0x34, 1, 29, 0xFF, 0xFF, 0xFF, 0xFE, 2, 247, 0, 3, 254, 1, 4, 30, 0x1F, 5, 12, 36 });
+    Range const dictRange = { 0, dict.data.size() };
+    int32_t value;
+    CHECK(Reader::ReadCffDictInteger(dict.data, dictRange, 1, OUT value) && value == 0x1234);
+    CHECK(Reader::ReadCffDictInteger(dict.data, dictRange, 2, OUT value) && value == -2);
+    CHECK(Reader::ReadCffDictInteger(dict.data, dictRange, 3, OUT value) && value == 108);
+    CHECK(Reader::ReadCffDictInteger(dict.data, dictRange, 4, OUT value) && value == -877);
+    CHECK(Reader::ReadCffDictInteger(dict.data, dictRange, 5, OUT value) && value == 0);
+    CHECK(Reader::ReadCffDictInteger(dict.data, dictRange, 0x0C24, OUT value) && value == 0);
+    CHECK(!Reader::ReadCffDictInteger(dict.data, dictRange, 6, OUT value));
+}
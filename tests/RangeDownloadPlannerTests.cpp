@@ -0,0 +1,137 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Coalescing and grouping of byte range requests.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "../font/RangeDownloadPlanner.h"
+#include "Tests.h"
+
+
+namespace
+{
+    bool AreRangesEqual(std::vector<Range> const& ranges, std::initializer_list<Range> expectedRanges)
+    {
+        return ranges.size() == expectedRanges.size()
+            && std::equal(
+                ranges.begin(),
+                ranges.end(),
+                expectedRanges.begin(),
+                [](Range const& a, Range const& b) -> bool { return a.begin == b.begin && a.end == b.end; }
+                );
+    }
+
+
+    std::vector<Range> Coalesce(std::initializer_list<Range> ranges, uint64_t maximumGapSize, uint64_t maximumMergedSize = RangeDownloadPlanner::maximumMergedRangeSize)
+    {
+        std::vector<Range> coalescedRanges(ranges);
+        RangeDownloadPlanner::CoalesceRanges(IN OUT coalescedRanges, maximumGapSize, maximumMergedSize);
+        return coalescedRanges;
+    }
+}
+
+
+TEST_CASE(RangeDownloadPlannerCoalesce)
+{
+    CHECK(Coalesce({}, 0).empty());
+    CHECK(AreRangesEqual(Coalesce({ { 3, 7 } }, 0), { { 3, 7 } }));
+
+    // Sorted, with overlapping, adjacent, contained and duplicate ranges merged.
+    CHECK(AreRangesEqual(Coalesce({ { 10, 20 }, { 0, 5 }, { 15, 30 } }, 0), { { 0, 5 }, { 10, 30 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 0, 5 }, { 5, 10 } }, 0), { { 0, 10 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 0, 100 }, { 10, 20 }, { 90, 100 } }, 0), { { 0, 100 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 0, 10 }, { 0, 5 }, { 0, 10 } }, 0), { { 0, 10 } }));
+
+    // Gaps up to the maximum are downloaded rather than split into requests.
+    CHECK(AreRangesEqual(Coalesce({ { 0, 10 }, { 15, 20 } }, 4), { { 0, 10 }, { 15, 20 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 0, 10 }, { 15, 20 } }, 5), { { 0, 20 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 40, 50 }, { 0, 10 }, { 20, 30 } }, 10), { { 0, 50 } }));
+
+    // Merged ranges are capped, but still never overlap.
+    CHECK(AreRangesEqual(Coalesce({ { 0, 600 }, { 700, 1200 } }, 200, 1000), { { 0, 600 }, { 700, 1200 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 0, 800 }, { 500, 1500 } }, 0, 1000), { { 0, 800 }, { 800, 1500 } }));
+    CHECK(AreRangesEqual(Coalesce({ { 0, 400 }, { 500, 1000 }, { 1100, 1500 } }, 200, 1000), { { 0, 1000 }, { 1100, 1500 } }));
+}
+
+
+TEST_CASE(RangeDownloadPlannerCoalesceCoverage)
+{
+    // For any input, the result is sorted and disjoint, covers every wanted
+    // byte, and downloads no gap larger than allowed.
+    uint32_t seed = 1;
+    auto random = [&](uint32_t limit) -> uint32_t
+    {
+        seed = seed * 1664525 + 1013904223;
+        return (seed >> 8) % limit;
+    };
+
+    for (uint32_t iteration = 0; iteration < 500; ++iteration)
+    {
+        uint64_t const maximumGapSize = random(64);
+        uint64_t const maximumMergedSize = 64 + random(512);
+
+        std::vector<Range> ranges(1 + random(20));
+        std::vector<bool> isWanted(1200), isCovered(1200);
+        for (auto& range : ranges)
+        {
+            range.begin = random(1000);
+            range.end = range.begin + 1 + random(150);
+            std::fill(isWanted.begin() + size_t(range.begin), isWanted.begin() + size_t(range.end), true);
+        }
+
+        RangeDownloadPlanner::CoalesceRanges(IN OUT ranges, maximumGapSize, maximumMergedSize);
+
+        bool isValid = true;
+        for (size_t i = 0; i < ranges.size(); ++i)
+        {
+            isValid &= ranges[i].begin < ranges[i].end;
+            isValid &= (i == 0 || ranges[i - 1].end <= ranges[i].begin);
+            std::fill(isCovered.begin() + size_t(ranges[i].begin), isCovered.begin() + size_t(ranges[i].end), true);
+        }
+
+        // Count the unwanted bytes in each run, which only merging adds.
+        uint64_t gapSize = 0;
+        for (size_t i = 0; i < isWanted.size(); ++i)
+        {
+            isValid &= !isWanted[i] || isCovered[i];
+            gapSize = (isCovered[i] && !isWanted[i]) ? gapSize + 1 : 0;
+            isValid &= gapSize <= maximumGapSize;
+        }
+        CHECK(isValid);
+    }
+}
+
+
+TEST_CASE(RangeDownloadPlannerGroup)
+{
+    std::vector<Range> ranges;
+    for (uint64_t i = 0; i < 10; ++i)
+    {
+        ranges.push_back({ i * 100, i * 100 + 10 });
+    }
+
+    // Spread over the connections first, up to the maximum per request.
+    std::vector<uint32_t> requestRangeCounts;
+    RangeDownloadPlanner::GroupRanges(ranges, 4, UINT64_MAX, OUT requestRangeCounts);
+    CHECK(requestRangeCounts == std::vector<uint32_t>({ 3, 3, 3, 1 }));
+
+    RangeDownloadPlanner::GroupRanges(ranges, 20, UINT64_MAX, OUT requestRangeCounts);
+    CHECK(requestRangeCounts == std::vector<uint32_t>(10, 1));
+
+    RangeDownloadPlanner::GroupRanges(ranges, 0, UINT64_MAX, OUT requestRangeCounts);
+    CHECK(requestRangeCounts == std::vector<uint32_t>({ 10 }));
+
+    // Requests are split once they would be too large.
+    RangeDownloadPlanner::GroupRanges(ranges, 1, 25, OUT requestRangeCounts);
+    CHECK(requestRangeCounts == std::vector<uint32_t>({ 2, 2, 2, 2, 2 }));
+
+    ranges.resize(40, ranges.back());
+    RangeDownloadPlanner::GroupRanges(ranges, 1, UINT64_MAX, OUT requestRangeCounts);
+    CHECK(requestRangeCounts == std::vector<uint32_t>({ 16, 16, 8 }));
+
+    RangeDownloadPlanner::GroupRanges({}, 4, UINT64_MAX, OUT requestRangeCounts);
+    CHECK(requestRangeCounts.empty());
+
+    // 50ms at 2MB/s is worth 100KB of gap.
+    CHECK(RangeDownloadPlanner::GetMaximumGapSize(50000, 2000000) == 100000);
+}
@@ -0,0 +1,64 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Console runner for the unit tests.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include <stdio.h>
+#include "Tests.h"
+
+
+TestCase* TestCase::first_ = nullptr;
+TestCase* TestCase::last_ = nullptr;
+bool TestCase::isCurrentTestPassed_ = true;
+
+
+TestCase::TestCase(_In_z_ char const* name, TestFunction* function) throw()
+:   name_(name),
+    function_(function),
+    next_(nullptr)
+{
+    if (last_ == nullptr)
+        first_ = this;
+    else
+        last_->next_ = this;
+
+    last_ = this;
+}
+
+
+void TestCase::ReportCheck(bool isPassed, _In_z_ char const* expression, _In_z_ char const* fileName, uint32_t lineNumber) throw()
+{
+    if (!isPassed)
+    {
+        printf("    %s(%u): CHECK(%s) failed\n", fileName, lineNumber, expression);
+        isCurrentTestPassed_ = false;
+    }
+}
+
+
+uint32_t TestCase::RunAll()
+{
+    uint32_t testCount = 0;
+    uint32_t failedTestCount = 0;
+
+    for (TestCase* testCase = first_; testCase != nullptr; testCase = testCase->next_)
+    {
+        printf("%s\n", testCase->name_);
+        isCurrentTestPassed_ = true;
+        testCase->function_();
+
+        ++testCount;
+        if (!isCurrentTestPassed_)
+            ++failedTestCount;
+    }
+
+    printf("%u of %u tests passed\n", testCount - failedTestCount, testCount);
+    return failedTestCount;
+}
+
+
+int __cdecl main()
+{
+    return TestCase::RunAll() == 0 ? 0 : 1;
+}
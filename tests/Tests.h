@@ -0,0 +1,45 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Minimal self-registering test cases for the console runner.
+//
+//----------------------------------------------------------------------------
+#pragma once
+
+
+// Each TEST_CASE registers itself at static initialization, and TestMain runs
+// them all in order of registration. A failed CHECK reports the expression
+// and location and marks the test failed, but lets the test continue.
+//
+//  TEST_CASE(CompressionRoundTrip)
+//  {
+//      CHECK(DecompressBlock(...) == S_OK);
+//  }
+//
+class TestCase
+{
+public:
+    typedef void TestFunction();
+
+    TestCase(_In_z_ char const* name, TestFunction* function) throw();
+
+    static uint32_t RunAll();
+    static void ReportCheck(bool isPassed, _In_z_ char const* expression, _In_z_ char const* fileName, uint32_t lineNumber) throw();
+
+protected:
+    char const* name_;
+    TestFunction* function_;
+    TestCase* next_;
+
+    static TestCase* first_;
+    static TestCase* last_;
+    static bool isCurrentTestPassed_;
+};
+
+
+#define TEST_CASE(name) \
+    static void name(); \
+    static TestCase name##TestCase(#name, &name); \
+    static void name()
+
+#define CHECK(expression) \
+    TestCase::ReportCheck(!!(expression), #expression, __FILE__, __LINE__)
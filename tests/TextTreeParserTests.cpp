@@ -0,0 +1,680 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Text tree editing, lookup, binary snapshots, and writing.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "Tests.h"
+
+
+namespace
+{
+    struct TestNode
+    {
+        uint32_t level;
+        wchar_t const* text;
+    };
+
+
+    // Appends the nodes in pre-order, the first being the root.
+    void AppendNodes(TextTree& textTree, array_ref<TestNode const> nodes)
+    {
+        for (auto const& node : nodes)
+        {
+            auto type = (node.level == 0) ? TextTree::Node::TypeRoot : TextTree::Node::TypeKey;
+            textTree.Append(type, node.level, node.text, static_cast<uint32_t>(wcslen(node.text)));
+        }
+    }
+
+
+    std::wstring GetDecimalText(uint32_t value)
+    {
+        std::wstring text;
+        do
+        {
+            text.insert(text.begin(), wchar_t('0' + value % 10));
+            value /= 10;
+        } while (value > 0);
+        return text;
+    }
+
+
+    // Describes the tree as "level:text" per node, which is easy to compare.
+    std::wstring DescribeTree(TextTree const& textTree)
+    {
+        std::wstring description;
+        std::wstring text;
+        for (uint32_t nodeIndex = 0, nodeCount = textTree.GetNodeCount(); nodeIndex < nodeCount; ++nodeIndex)
+        {
+            textTree.GetText(nodeIndex, OUT text);
+            if (!description.empty())
+                description.push_back(' ');
+            description.append(GetDecimalText(textTree.GetNode(nodeIndex).level));
+            description.push_back(':');
+            description.append(text);
+        }
+        return description;
+    }
+
+
+    void BuildItems(TextTree& textTree, uint32_t itemCount)
+    {
+        textTree.Append(TextTree::Node::TypeRoot, 0, L"", 0);
+        for (uint32_t itemIndex = 0; itemIndex < itemCount; ++itemIndex)
+        {
+            uint32_t objectNodeIndex;
+            CHECK(textTree.AppendChild(0, TextTree::Node::TypeObject, L"", 0, OUT objectNodeIndex));
+            CHECK(textTree.SetKeyValue(objectNodeIndex, L"name", L"font" + GetDecimalText(itemIndex)));
+            CHECK(textTree.SetKeyValue(objectNodeIndex, L"index", itemIndex));
+        }
+    }
+
+    // Byte offsets within a snapshot, matching TextTreeBinaryHeader and the
+    // TextTree::Node fields that follow it.
+    size_t const snapshotHeaderSize = 24;
+    size_t const snapshotVersionOffset = 4;
+    size_t const snapshotNodeCountOffset = 12;
+    size_t const snapshotChecksumOffset = 20;
+    size_t const snapshotNodeSize = 16;
+    size_t const snapshotNodeTypeOffset = 0;
+    size_t const snapshotNodeStartOffset = 4;
+    size_t const snapshotNodeLengthOffset = 8;
+    size_t const snapshotNodeLevelOffset = 12;
+
+
+    void WriteUint32(IN OUT std::vector<uint8_t>& data, size_t offset, uint32_t value)
+    {
+        memcpy(&data[offset], &value, sizeof(value));
+    }
+
+
+    void WriteSnapshotNodeField(IN OUT std::vector<uint8_t>& snapshot, uint32_t nodeIndex, size_t fieldOffset, uint32_t value)
+    {
+        WriteUint32(IN OUT snapshot, snapshotHeaderSize + nodeIndex * snapshotNodeSize + fieldOffset, value);
+    }
+
+
+    // Recomputes the checksum of a patched uncompressed snapshot, the same way
+    // as the reader, so that its later checks are reached.
+    void UpdateSnapshotChecksum(IN OUT std::vector<uint8_t>& snapshot)
+    {
+        uint64_t sum1 = 0, sum2 = 0;
+        size_t i = snapshotHeaderSize;
+        for (; i + sizeof(uint32_t) <= snapshot.size(); i += sizeof(uint32_t))
+        {
+            uint32_t word;
+            memcpy(&word, &snapshot[i], sizeof(word));
+            sum1 = (sum1 + word) % 0xFFFFFFFF;
+            sum2 = (sum2 + sum1) % 0xFFFFFFFF;
+        }
+        for (; i < snapshot.size(); ++i)
+        {
+            sum1 = (sum1 + snapshot[i]) % 0xFFFFFFFF;
+            sum2 = (sum2 + sum1) % 0xFFFFFFFF;
+        }
+        WriteUint32(IN OUT snapshot, snapshotChecksumOffset, static_cast<uint32_t>(sum1 ^ (sum2 << 16) ^ (sum2 >> 16)));
+    }
+
+
+    // Rewrites an uncompressed snapshot as a compressed one.
+    std::vector<uint8_t> CompressSnapshot(std::vector<uint8_t> const& snapshot)
+    {
+        std::vector<uint8_t> frame;
+        CHECK(CompressData(const_byte_array_ref(snapshot.data() + snapshotHeaderSize, snapshot.size() - snapshotHeaderSize), CompressionLevelFast, OUT frame) == S_OK);
+
+        std::vector<uint8_t> compressedSnapshot(snapshot.begin(), snapshot.begin() + snapshotHeaderSize);
+        compressedSnapshot.insert(compressedSnapshot.end(), frame.begin(), frame.end());
+        compressedSnapshot[snapshotVersionOffset] = 2;
+        return compressedSnapshot;
+    }
+
+
+    // A small tree with keys and a value beyond ASCII, in both snapshot forms.
+    void BuildSnapshotTree(OUT TextTree& textTree)
+    {
+        TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {2, L"a1"}, {1, L"b"} };
+        textTree.Clear();
+        AppendNodes(textTree, nodes);
+        textTree.Append(TextTree::Node::TypeString, 2, L"\x00E9t\x00E9", 3);
+    }
+
+
+    // Expects the snapshot to be rejected with the error, leaving the tree's
+    // existing contents alone.
+    bool IsSnapshotRejected(std::vector<uint8_t> const& snapshot, HRESULT expectedError)
+    {
+        TestNode const nodes[] = { {0, L"old"} };
+        TextTree textTree;
+        AppendNodes(textTree, nodes);
+
+        HRESULT hr = textTree.ReadBinary(snapshot);
+        return (expectedError == E_FAIL ? FAILED(hr) : hr == expectedError) && DescribeTree(textTree) == L"0:old";
+    }
+
+
+    // Writes each node's text as-is, so a test controls exactly where the
+    // buffered text ends when the writer flushes.
+    class RawTextWriter : public TextTreeWriter
+    {
+    public:
+        RawTextWriter() : TextTreeWriter(OptionsDefault) {}
+
+        virtual HRESULT WriteNode(
+            TextTree::Node::Type type,
+            __in_ecount(textLength) const wchar_t* text,
+            uint32_t textLength
+            ) override
+        {
+            text_.append(text, textLength);
+            return FlushIfNeeded();
+        }
+    };
+
+
+    // Collects each flush separately, to see where the text was split.
+    struct OutputFlushes
+    {
+        std::vector<std::string> flushes;
+
+        TextTreeWriter::OutputSink GetSink()
+        {
+            return [this](const_byte_array_ref utf8Text) -> HRESULT
+            {
+                flushes.push_back(std::string(utf8Text.begin(), utf8Text.end()));
+                return S_OK;
+            };
+        }
+
+        std::string GetJoinedText() const
+        {
+            std::string text;
+            for (auto const& flush : flushes)
+                text += flush;
+            return text;
+        }
+    };
+}
+
+
+TEST_CASE(TextTreeBuilderModeMatchesNormalInsertion)
+{
+    TextTree builtTree;
+    builtTree.SetBuilderMode(true);
+    BuildItems(builtTree, 100);
+    builtTree.SetBuilderMode(false);
+
+    TextTree insertedTree;
+    BuildItems(insertedTree, 100);
+
+    CHECK(builtTree.GetNodeCount() == 1 + 100 * 5);
+    CHECK(DescribeTree(builtTree) == DescribeTree(insertedTree));
+
+    // Normal edits still work afterwards, replacing the value in place.
+    CHECK(builtTree.SetKeyValue(1, L"name", L"renamed"));
+    std::wstring value;
+    CHECK(builtTree.GetKeyValue(1, L"name", OUT value) && value == L"renamed");
+    CHECK(builtTree.GetNodeCount() == 1 + 100 * 5);
+}
+
+
+TEST_CASE(TextTreeBuilderModeBuildsMillionNodes)
+{
+    // Without builder mode each append searches the parent's children and
+    // shifts the tail, so this would take hours rather than moments.
+    uint32_t const itemCount = 200000;
+    TextTree textTree;
+    textTree.SetBuilderMode(true);
+    BuildItems(textTree, itemCount);
+    textTree.SetBuilderMode(false);
+
+    CHECK(textTree.GetNodeCount() == 1 + itemCount * 5);
+
+    uint32_t objectNodeIndex = 1 + (itemCount - 1) * 5;
+    std::wstring value;
+    CHECK(textTree.GetKeyValue(objectNodeIndex, L"index", OUT value) && value == GetDecimalText(itemCount - 1));
+    CHECK(textTree.GetNode(objectNodeIndex).level == 1);
+    CHECK(textTree.GetNode(objectNodeIndex + 4).level == 3);
+}
+
+
+TEST_CASE(TextTreeBuilderModeFallsBackOffRightmostPath)
+{
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {1, L"b"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+    textTree.SetBuilderMode(true);
+
+    // The first child is not on the rightmost path, so this inserts normally
+    // rather than appending at the end.
+    uint32_t newNodeIndex;
+    CHECK(textTree.AppendChild(1, TextTree::Node::TypeKey, L"a1", 2, OUT newNodeIndex));
+    CHECK(newNodeIndex == 2);
+    CHECK(textTree.AppendChild(3, TextTree::Node::TypeKey, L"b1", 2, OUT newNodeIndex));
+    CHECK(newNodeIndex == 4);
+    CHECK(DescribeTree(textTree) == L"0:root 1:a 2:a1 1:b 2:b1");
+}
+
+
+TEST_CASE(TextTreeBatchInsertParentThenChild)
+{
+    // A new parent and child recorded at the same index, ahead of an existing
+    // node that becomes the new child's child.
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {2, L"b"}, {3, L"c"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+
+    CHECK(textTree.BatchInsert(3, TextTree::Node::TypeKey, 1, L"p", 1));
+    CHECK(textTree.BatchInsert(3, TextTree::Node::TypeKey, 2, L"q", 1));
+    CHECK(textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == L"0:root 1:a 2:b 1:p 2:q 3:c");
+}
+
+
+TEST_CASE(TextTreeBatchInsertOutOfOrder)
+{
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {1, L"b"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+
+    // Recorded out of index order, each checked against its neighbours in
+    // the merged result rather than the most recently recorded insert.
+    CHECK(textTree.BatchInsert(2, TextTree::Node::TypeKey, 2, L"a1", 2));
+    CHECK(textTree.BatchInsert(1, TextTree::Node::TypeKey, 1, L"z", 1));
+    CHECK(textTree.BatchInsert(2, TextTree::Node::TypeKey, 3, L"a11", 3));
+    CHECK(textTree.BatchInsert(3, TextTree::Node::TypeKey, 1, L"c", 1));
+    CHECK(textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == L"0:root 1:z 1:a 2:a1 3:a11 1:b 1:c");
+}
+
+
+TEST_CASE(TextTreeBatchInsertRejectsMisfitLevels)
+{
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {1, L"b"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+    std::wstring const originalDescription = DescribeTree(textTree);
+
+    // Two levels below the root.
+    CHECK(textTree.BatchInsert(2, TextTree::Node::TypeKey, 2, L"ok", 2));
+    CHECK(textTree.BatchInsert(1, TextTree::Node::TypeKey, 2, L"bad", 3));
+    CHECK(!textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == originalDescription);
+
+    // A second root ahead of the first.
+    CHECK(textTree.BatchInsert(0, TextTree::Node::TypeKey, 1, L"bad", 3));
+    CHECK(!textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == originalDescription);
+
+    CHECK(!textTree.BatchInsert(4, TextTree::Node::TypeKey, 1, L"bad", 3));
+    CHECK(textTree.ApplyBatchEdits()); // Nothing pending.
+    CHECK(DescribeTree(textTree) == originalDescription);
+}
+
+
+TEST_CASE(TextTreeBatchInsertUnderDeletedNode)
+{
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {2, L"a1"}, {1, L"b"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+
+    // Children added to a removed node, both inside its range and as its new
+    // last child, go with it rather than being left without a parent. The
+    // sibling recorded at the same index stays.
+    CHECK(textTree.BatchDelete(1));
+    CHECK(textTree.BatchInsert(2, TextTree::Node::TypeKey, 2, L"a0", 2));
+    CHECK(textTree.BatchInsert(3, TextTree::Node::TypeKey, 2, L"a2", 2));
+    CHECK(textTree.BatchInsert(3, TextTree::Node::TypeKey, 1, L"c", 1));
+    CHECK(textTree.BatchInsert(3, TextTree::Node::TypeKey, 2, L"c1", 2));
+    CHECK(textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == L"0:root 1:c 2:c1 1:b");
+}
+
+
+TEST_CASE(TextTreeBatchEditsAfterOtherChanges)
+{
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+
+    CHECK(textTree.BatchInsert(2, TextTree::Node::TypeKey, 1, L"b", 1));
+    textTree.Append(TextTree::Node::TypeKey, 1, L"c", 1);
+    CHECK(!textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == L"0:root 1:a 1:c");
+}
+
+
+TEST_CASE(TextTreeBinaryRoundTrip)
+{
+    TextTree textTree;
+    BuildSnapshotTree(OUT textTree);
+
+    for (uint32_t compressionLevel : { 0u, uint32_t(CompressionLevelFast) })
+    {
+        std::vector<uint8_t> snapshot;
+        CHECK(textTree.WriteBinary(OUT snapshot, compressionLevel) == S_OK);
+        CHECK(TextTree::IsBinary(snapshot));
+        CHECK(snapshot[snapshotVersionOffset] == (compressionLevel == 0 ? 1 : 2));
+
+        TextTree readTree;
+        CHECK(readTree.ReadBinary(snapshot) == S_OK);
+        CHECK(DescribeTree(readTree) == L"0:root 1:a 2:a1 1:b 2:\x00E9t\x00E9");
+        CHECK(readTree.GetNodeCount() == textTree.GetNodeCount());
+        for (uint32_t nodeIndex = 0; nodeIndex < readTree.GetNodeCount() && nodeIndex < textTree.GetNodeCount(); ++nodeIndex)
+        {
+            CHECK(readTree.GetNode(nodeIndex).type == textTree.GetNode(nodeIndex).type);
+        }
+    }
+
+    // An empty tree round trips too, and text is never taken for a snapshot.
+    TextTree emptyTree;
+    std::vector<uint8_t> snapshot;
+    CHECK(emptyTree.WriteBinary(OUT snapshot, 0) == S_OK);
+    CHECK(snapshot.size() == snapshotHeaderSize);
+    CHECK(textTree.ReadBinary(snapshot) == S_OK);
+    CHECK(textTree.GetNodeCount() == 0);
+
+    char const text[] = "[{\"name\":\"not a snapshot at all\"}]";
+    CHECK(!TextTree::IsBinary(const_byte_array_ref(reinterpret_cast<uint8_t const*>(text), sizeof(text) - 1)));
+}
+
+
+TEST_CASE(TextTreeBinaryRejectsDamagedSnapshots)
+{
+    TextTree textTree;
+    BuildSnapshotTree(OUT textTree);
+    std::vector<uint8_t> originalSnapshot;
+    CHECK(textTree.WriteBinary(OUT originalSnapshot, 0) == S_OK);
+
+    auto snapshot = originalSnapshot;
+    snapshot.resize(snapshotHeaderSize - 1);
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+
+    snapshot = originalSnapshot;
+    snapshot[0] ^= 0x20;
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+
+    snapshot = originalSnapshot;
+    snapshot[snapshotVersionOffset] = 3;
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_UNSUPPORTED_TYPE)));
+
+    // A changed text byte, with the checksum left as written.
+    snapshot = originalSnapshot;
+    snapshot.back() ^= 0x01;
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_CRC)));
+
+    // Truncated partway through the nodes or text, or claiming more nodes
+    // than are present, even with a matching checksum.
+    snapshot = originalSnapshot;
+    snapshot.resize(snapshotHeaderSize + snapshotNodeSize * 2 + 3);
+    UpdateSnapshotChecksum(IN OUT snapshot);
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+
+    snapshot = originalSnapshot;
+    WriteUint32(IN OUT snapshot, snapshotNodeCountOffset, textTree.GetNodeCount() + 1);
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+
+    // A compressed snapshot with a damaged frame, or labelled uncompressed.
+    snapshot = CompressSnapshot(originalSnapshot);
+    CHECK(TextTree().ReadBinary(snapshot) == S_OK);
+    snapshot[snapshotVersionOffset] = 1;
+    CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+
+    snapshot = CompressSnapshot(originalSnapshot);
+    snapshot.resize(snapshot.size() - 1);
+    CHECK(IsSnapshotRejected(snapshot, E_FAIL));
+}
+
+
+TEST_CASE(TextTreeBinaryRejectsBadNodes)
+{
+    TextTree textTree;
+    BuildSnapshotTree(OUT textTree);
+    std::vector<uint8_t> originalSnapshot;
+    CHECK(textTree.WriteBinary(OUT originalSnapshot, 0) == S_OK);
+    uint32_t const textLength = 4 + 1 + 2 + 1 + 3;
+
+    struct NodePatch
+    {
+        uint32_t nodeIndex;
+        size_t fieldOffset;
+        uint32_t value;
+    };
+    NodePatch const patches[] = {
+        { 0, snapshotNodeLevelOffset, 1 },          // The root is not at level 0.
+        { 2, snapshotNodeLevelOffset, 3 },          // Two deeper than the previous node.
+        { 3, snapshotNodeLevelOffset, 0 },          // A second root.
+        { 1, snapshotNodeTypeOffset, 0x99 },        // Types that were never declared.
+        { 1, snapshotNodeTypeOffset, TextTree::Node::TypeGenericMask },
+        { 1, snapshotNodeTypeOffset, TextTree::Node::TypeValue + 6 },
+        { 4, snapshotNodeStartOffset, textLength + 1 }, // Text outside the pool.
+        { 4, snapshotNodeLengthOffset, 4 },
+        { 4, snapshotNodeLengthOffset, 0xFFFFFFFF },
+    };
+
+    for (auto const& patch : patches)
+    {
+        auto snapshot = originalSnapshot;
+        WriteSnapshotNodeField(IN OUT snapshot, patch.nodeIndex, patch.fieldOffset, patch.value);
+        UpdateSnapshotChecksum(IN OUT snapshot);
+        CHECK(IsSnapshotRejected(snapshot, HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+        CHECK(IsSnapshotRejected(CompressSnapshot(snapshot), HRESULT_FROM_WIN32(ERROR_INVALID_DATA)));
+    }
+
+    // The same nodes with the text at its very end still load.
+    auto snapshot = originalSnapshot;
+    WriteSnapshotNodeField(IN OUT snapshot, 4, snapshotNodeLengthOffset, 3);
+    UpdateSnapshotChecksum(IN OUT snapshot);
+    CHECK(TextTree().ReadBinary(snapshot) == S_OK);
+}
+
+
+TEST_CASE(TextTreeBinaryDropsPendingEdits)
+{
+    TextTree textTree;
+    BuildSnapshotTree(OUT textTree);
+    std::vector<uint8_t> snapshot;
+    CHECK(textTree.WriteBinary(OUT snapshot) == S_OK);
+
+    // Edits recorded against a tree of the same node count must not be
+    // applied to the snapshot that replaced it.
+    CHECK(textTree.BatchDelete(1));
+    CHECK(textTree.BatchInsert(4, TextTree::Node::TypeKey, 2, L"x", 1));
+    CHECK(textTree.ReadBinary(snapshot) == S_OK);
+    CHECK(textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == L"0:root 1:a 2:a1 1:b 2:\x00E9t\x00E9");
+
+    CHECK(textTree.BatchDelete(1));
+    textTree.Clear();
+    BuildSnapshotTree(OUT textTree);
+    CHECK(textTree.ApplyBatchEdits());
+    CHECK(DescribeTree(textTree) == L"0:root 1:a 2:a1 1:b 2:\x00E9t\x00E9");
+}
+
+
+TEST_CASE(TextTreeKeyLookupFoldsCase)
+{
+    // The same children under a parent too small to index and under one wide
+    // enough to be indexed must give the same answers. A string value that
+    // matches the name comes first, and the key appears twice with different
+    // case, so the first key is the answer.
+    for (uint32_t extraKeyCount : { 0u, 8u })
+    {
+        TextTree textTree;
+        textTree.Append(TextTree::Node::TypeRoot, 0, L"root", 4);
+        textTree.Append(TextTree::Node::TypeString, 1, L"alpha", 5);
+        textTree.Append(TextTree::Node::TypeKey, 1, L"Alpha", 5);
+        textTree.Append(TextTree::Node::TypeKey, 1, L"ALPHA", 5);
+        for (uint32_t i = 0; i < extraKeyCount; ++i)
+        {
+            std::wstring const keyName = L"key" + GetDecimalText(i);
+            textTree.Append(TextTree::Node::TypeKey, 1, keyName.c_str(), static_cast<uint32_t>(keyName.size()));
+        }
+        textTree.Append(TextTree::Node::TypeKey, 1, L"Beta", 4);
+        textTree.Append(TextTree::Node::TypeString, 2, L"2", 1);
+
+        uint32_t nodeIndex = 0;
+        CHECK(textTree.FindKey(0, L"alpha", OUT nodeIndex) && nodeIndex == 2);
+        CHECK(textTree.FindKey(0, L"ALPHA", OUT nodeIndex) && nodeIndex == 2);
+        CHECK(textTree.FindKey(0, L"bEtA", OUT nodeIndex) && nodeIndex == 4 + extraKeyCount);
+
+        // Any type matches the string value ahead of the keys.
+        CHECK(textTree.Find(0, true, L"ALPHA", 5, TextTree::Node::TypeNone, OUT nodeIndex) && nodeIndex == 1);
+
+        // Prefixes, longer names, and the value under a key do not match,
+        // leaving the index alone.
+        nodeIndex = 77;
+        CHECK(!textTree.FindKey(0, L"alph", OUT nodeIndex));
+        CHECK(!textTree.FindKey(0, L"alphas", OUT nodeIndex));
+        CHECK(!textTree.FindKey(0, L"2", OUT nodeIndex));
+        CHECK(nodeIndex == 77);
+
+        std::wstring value;
+        CHECK(textTree.GetKeyValue(0, L"BETA", OUT value) && value == L"2");
+    }
+}
+
+
+TEST_CASE(TextTreeKeyIndexFollowsEdits)
+{
+    TestNode const nodes[] = { {0, L"root"}, {1, L"a"}, {1, L"b"}, {1, L"c"}, {1, L"d"}, {1, L"e"}, {1, L"f"} };
+    TextTree textTree;
+    AppendNodes(textTree, nodes);
+
+    uint32_t nodeIndex = 0;
+    CHECK(textTree.FindKey(0, L"e", OUT nodeIndex) && nodeIndex == 5);
+
+    // Inserting a duplicate ahead of it makes that one the first match.
+    uint32_t newNodeIndex;
+    CHECK(textTree.Insert(1, /*insertAfter*/ false, /*nodeIndexIsParent*/ false, TextTree::Node::TypeKey, L"E", 1, OUT newNodeIndex));
+    CHECK(newNodeIndex == 1);
+    CHECK(textTree.FindKey(0, L"e", OUT nodeIndex) && nodeIndex == 1);
+    CHECK(textTree.FindKey(0, L"f", OUT nodeIndex) && nodeIndex == 7);
+
+    // Removing it shifts the original back.
+    CHECK(textTree.Delete(1, /*shouldRemove*/ true));
+    CHECK(textTree.FindKey(0, L"e", OUT nodeIndex) && nodeIndex == 5);
+
+    // Renaming a key, which only adds text, is seen too.
+    textTree.SetText(textTree.GetNode(2), L"renamed");
+    CHECK(!textTree.FindKey(0, L"b", OUT nodeIndex));
+    CHECK(textTree.FindKey(0, L"RENAMED", OUT nodeIndex) && nodeIndex == 2);
+
+    // So are batch edits.
+    CHECK(textTree.BatchDelete(1));
+    CHECK(textTree.BatchInsert(7, TextTree::Node::TypeKey, 1, L"a", 1));
+    CHECK(textTree.ApplyBatchEdits());
+    CHECK(textTree.FindKey(0, L"a", OUT nodeIndex) && nodeIndex == 6);
+    CHECK(textTree.FindKey(0, L"f", OUT nodeIndex) && nodeIndex == 5);
+}
+
+
+TEST_CASE(TextTreeKeyIndexManyParents)
+{
+    // More indexed parents than the cache holds, looked up twice over, so
+    // some parents are indexed again after the cache is dropped.
+    uint32_t const itemCount = 600;
+    TextTree textTree;
+    textTree.SetBuilderMode(true);
+    textTree.Append(TextTree::Node::TypeRoot, 0, L"", 0);
+    for (uint32_t itemIndex = 0; itemIndex < itemCount; ++itemIndex)
+    {
+        uint32_t objectNodeIndex;
+        CHECK(textTree.AppendChild(0, TextTree::Node::TypeObject, L"", 0, OUT objectNodeIndex));
+        for (wchar_t const* keyName : { L"a", L"b", L"c", L"d" })
+        {
+            CHECK(textTree.SetKeyValue(objectNodeIndex, keyName, itemIndex));
+        }
+    }
+    textTree.SetBuilderMode(false);
+
+    bool areAllFound = true;
+    for (uint32_t pass = 0; pass < 2; ++pass)
+    {
+        for (uint32_t itemIndex = 0; itemIndex < itemCount; ++itemIndex)
+        {
+            std::wstring value;
+            uint32_t const objectNodeIndex = 1 + itemIndex * 9;
+            areAllFound &= textTree.GetKeyValue(objectNodeIndex, L"D", OUT value) && value == GetDecimalText(itemIndex);
+        }
+    }
+    CHECK(areAllFound);
+}
+
+
+TEST_CASE(TextTreeWriterHoldsBackSplitSurrogates)
+{
+    // U+1F600 as a surrogate pair, written in two nodes so that the buffer
+    // fills right after the leading half.
+    RawTextWriter writer;
+    OutputFlushes output;
+    writer.SetOutputSink(output.GetSink(), 3);
+
+    CHECK(writer.WriteNode(TextTree::Node::TypeText, L"ab\xD83D", 3) == S_OK);
+    CHECK(output.flushes.size() == 1 && output.flushes[0] == "ab");
+
+    std::wstring text;
+    writer.GetText(OUT text);
+    CHECK(text == L"\xD83D");
+
+    CHECK(writer.WriteNode(TextTree::Node::TypeText, L"\xDE00" L"cd", 3) == S_OK);
+    CHECK(output.flushes.size() == 2 && output.flushes[1] == "\xF0\x9F\x98\x80" "cd");
+    CHECK(writer.Flush() == S_OK);
+    CHECK(output.flushes.size() == 2);
+
+    // A leading half that fills the buffer alone is held back too, and the
+    // final flush writes an unpaired one as U+FFFD rather than dropping it.
+    CHECK(writer.WriteNode(TextTree::Node::TypeText, L"\xD83D\xD83D\xD83D", 3) == S_OK);
+    CHECK(output.flushes.size() == 3 && output.flushes[2] == "\xEF\xBF\xBD\xEF\xBF\xBD");
+    CHECK(writer.Flush() == S_OK);
+    CHECK(output.flushes.size() == 4 && output.flushes[3] == "\xEF\xBF\xBD");
+    writer.GetText(OUT text);
+    CHECK(text.empty());
+}
+
+
+TEST_CASE(TextTreeWriterStreamsSameTextAsBuffered)
+{
+    // Every node is flushed as soon as it is written, and the pieces still
+    // join into the UTF-8 of the whole document.
+    TestNode const nodes[] = { {0, L""}, {1, L"name"}, {2, L"\x00E9t\x00E9 \xD83D\xDE00"}, {1, L"list"}, {2, L"1"}, {2, L"\x4E2D"} };
+    TextTree textTree;
+    for (auto const& node : nodes)
+    {
+        auto type = (node.level == 0) ? TextTree::Node::TypeObject : (node.level == 1) ? TextTree::Node::TypeKey : TextTree::Node::TypeString;
+        textTree.Append(type, node.level, node.text, static_cast<uint32_t>(wcslen(node.text)));
+    }
+
+    JsonexWriter bufferedWriter(JsonexWriter::OptionsDefault);
+    CHECK(bufferedWriter.WriteNodes(textTree) == S_OK);
+    std::wstring bufferedText;
+    bufferedWriter.GetText(OUT bufferedText);
+    std::string bufferedUtf8Text;
+    ConvertText(bufferedText, OUT bufferedUtf8Text);
+
+    JsonexWriter streamingWriter(JsonexWriter::OptionsDefault);
+    OutputFlushes output;
+    streamingWriter.SetOutputSink(output.GetSink(), 1);
+    CHECK(streamingWriter.WriteNodes(textTree) == S_OK);
+    CHECK(streamingWriter.Flush() == S_OK);
+    CHECK(output.flushes.size() > 1);
+    CHECK(output.GetJoinedText() == bufferedUtf8Text);
+}
+
+
+TEST_CASE(TextTreeWriterSinkFailureStops)
+{
+    RawTextWriter writer;
+    writer.SetOutputSink(
+        [](const_byte_array_ref) -> HRESULT { return E_ACCESSDENIED; },
+        2
+        );
+
+    CHECK(writer.WriteNode(TextTree::Node::TypeText, L"a", 1) == S_OK);
+    CHECK(writer.WriteNode(TextTree::Node::TypeText, L"b", 1) == E_ACCESSDENIED);
+    CHECK(writer.Flush() == E_ACCESSDENIED);
+
+    // The text the sink refused is kept rather than lost.
+    std::wstring text;
+    writer.GetText(OUT text);
+    CHECK(text == L"ab");
+}
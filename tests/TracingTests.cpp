@@ -0,0 +1,99 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   Trace recording across threads.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "Tests.h"
+#include <thread>
+
+
+namespace
+{
+    HRESULT ExportTrace(OUT std::wstring& text)
+    {
+        std::vector<uint8_t> utf8Text;
+        JsonexWriter writer(JsonexWriter::OptionsDefault);
+        writer.SetOutputSink(
+            [&](const_byte_array_ref bytes) -> HRESULT
+            {
+                utf8Text.insert(utf8Text.end(), bytes.begin(), bytes.end());
+                return S_OK;
+            }
+            );
+
+        IFR(Tracer::ExportChromeTrace(writer));
+        IFR(writer.Flush());
+
+        ConvertText(array_ref<char const>(reinterpret_cast<char const*>(utf8Text.data()), utf8Text.size()), OUT text);
+        return S_OK;
+    }
+
+
+    uint32_t CountSpans(std::wstring const& text, _In_z_ wchar_t const* name)
+    {
+        std::wstring const quotedName = std::wstring(L"\"") + name + L"\"";
+        uint32_t count = 0;
+        for (size_t i = text.find(quotedName); i != std::wstring::npos; i = text.find(quotedName, i + 1))
+        {
+            ++count;
+        }
+        return count;
+    }
+
+
+    // Runs each thread to completion before starting the next, so no more
+    // than one is alive at a time.
+    void RunTracedThreads(uint32_t threadCount, _In_z_ wchar_t const* name)
+    {
+        for (uint32_t i = 0; i < threadCount; ++i)
+        {
+            std::thread thread([name]() { TraceSpan traceSpan(name); });
+            thread.join();
+        }
+    }
+}
+
+
+TEST_CASE(TracerReusesExitedThreadBuffers)
+{
+    // Far more threads than slots come and go, and each one still records
+    // its span, into a buffer left by an earlier one.
+    Tracer::Enable(true);
+    Tracer::Clear();
+    RunTracedThreads(Tracer::MaximumThreadCount * 3, L"ShortLivedThread");
+
+    std::wstring text;
+    CHECK(ExportTrace(OUT text) == S_OK);
+    CHECK(text.find(L"\"droppedEventCount\": 0") != std::wstring::npos);
+
+    // Only the latest threads' spans are kept, one per slot.
+    uint32_t const spanCount = CountSpans(text, L"ShortLivedThread");
+    CHECK(spanCount > 0 && spanCount <= Tracer::MaximumThreadCount);
+
+    Tracer::Enable(false);
+    Tracer::Clear();
+}
+
+
+TEST_CASE(TracerClearFreesExitedThreadBuffers)
+{
+    Tracer::Enable(true);
+    Tracer::Clear();
+    RunTracedThreads(4, L"ExitedThread");
+
+    std::wstring text;
+    CHECK(ExportTrace(OUT text) == S_OK);
+    CHECK(CountSpans(text, L"ExitedThread") == 4);
+
+    // Exited threads' events go with their buffers, and later threads still
+    // get one.
+    Tracer::Clear();
+    RunTracedThreads(1, L"LaterThread");
+    CHECK(ExportTrace(OUT text) == S_OK);
+    CHECK(CountSpans(text, L"ExitedThread") == 0);
+    CHECK(CountSpans(text, L"LaterThread") == 1);
+
+    Tracer::Enable(false);
+    Tracer::Clear();
+}
@@ -0,0 +1,165 @@
+//+---------------------------------------------------------------------------
+//
+//  Contents:   UTF-8 and UTF-16 conversion.
+//
+//----------------------------------------------------------------------------
+#include "precomp.h"
+#include "Tests.h"
+
+
+namespace
+{
+    std::wstring ToUtf16(std::string const& utf8Text)
+    {
+        std::wstring utf16Text(utf8Text.size(), '\0');
+        utf16Text.resize(ConvertUtf8ToUtf16(utf8Text.data(), utf8Text.size(), OUT &utf16Text[0], utf16Text.size()));
+        return utf16Text;
+    }
+
+
+    std::string ToUtf8(std::wstring const& utf16Text)
+    {
+        std::string utf8Text(GetUtf8Length(utf16Text.data(), utf16Text.size()), '\0');
+        size_t const length = ConvertUtf16ToUtf8(utf16Text.data(), utf16Text.size(), OUT &utf8Text[0], utf8Text.size());
+        CHECK(length == utf8Text.size());
+        utf8Text.resize(length);
+        return utf8Text;
+    }
+
+
+    struct ConversionCase
+    {
+        char const* utf8Text;
+        wchar_t const* utf16Text;
+    };
+
+
+    // Invalid UTF-8 reads as one U+FFFD per maximal valid prefix, as with
+    // MultiByteToWideChar.
+    ConversionCase const utf8ToUtf16Cases[] = {
+        { "\xC3\xA9",           L"\x00E9" },
+        { "\xE2\x82\xAC",       L"\x20AC" },
+        { "\xF0\x9F\x98\x80",   L"\xD83D\xDE00" },
+        { "\xF4\x8F\xBF\xBF",   L"\xDBFF\xDFFF" },
+        { "\x80",               L"\xFFFD" },                // Lone trail byte
+        { "\xC0\xAF",           L"\xFFFD\xFFFD" },          // Overlong lead
+        { "\xE0\x80\x80",       L"\xFFFD\xFFFD\xFFFD" },    // Overlong
+        { "\xED\xA0\x80",       L"\xFFFD\xFFFD\xFFFD" },    // Surrogate
+        { "\xF4\x90\x80\x80",   L"\xFFFD\xFFFD\xFFFD\xFFFD" }, // Beyond U+10FFFF
+        { "\xF8\x88\x80\x80",   L"\xFFFD\xFFFD\xFFFD\xFFFD" }, // Five byte lead
+        { "\xE2\x82" "a",       L"\xFFFD" L"a" },           // Truncated, consuming only the valid prefix
+        { "\xF0\x9F\x98",       L"\xFFFD" },                // Truncated at the end
+    };
+
+
+    // Unpaired surrogates become U+FFFD.
+    ConversionCase const utf16ToUtf8Cases[] = {
+        { "\xC3\xA9",           L"\x00E9" },
+        { "\xDF\xBF",           L"\x07FF" },
+        { "\xE0\xA0\x80",       L"\x0800" },
+        { "\xEF\xBF\xBF",       L"\xFFFF" },
+        { "\xF0\x9F\x98\x80",   L"\xD83D\xDE00" },
+        { "\xEF\xBF\xBD" "a",   L"\xD800" L"a" },
+        { "\xEF\xBF\xBD" "a",   L"\xDC00" L"a" },
+        { "\xEF\xBF\xBD\xEF\xBF\xBD", L"\xDC00\xD800" },
+        { "\xEF\xBF\xBD",       L"\xD800" },
+    };
+}
+
+
+TEST_CASE(UnicodeUtf8ToUtf16)
+{
+    // Place each case at every offset within and across the 16 byte blocks
+    // the vectorized loop takes, with ASCII before and after.
+    for (auto const& testCase : utf8ToUtf16Cases)
+    {
+        for (size_t prefixLength = 0; prefixLength <= 40; ++prefixLength)
+        {
+            for (size_t suffixLength : { 0, 1, 15, 16, 17, 33 })
+            {
+                std::string const prefix(prefixLength, 'p'), suffix(suffixLength, 's');
+                std::wstring const widePrefix(prefixLength, 'p'), wideSuffix(suffixLength, 's');
+                CHECK(ToUtf16(prefix + testCase.utf8Text + suffix) == widePrefix + testCase.utf16Text + wideSuffix);
+            }
+        }
+    }
+
+    // Byte order marks pass through, as does nul.
+    CHECK(ToUtf16(std::string("\xEF\xBB\xBF" "a\0b", 6)) == std::wstring(L"\xFEFF" L"a\0b", 4));
+    CHECK(ToUtf16("").empty());
+}
+
+
+TEST_CASE(UnicodeUtf16ToUtf8)
+{
+    for (auto const& testCase : utf16ToUtf8Cases)
+    {
+        for (size_t prefixLength = 0; prefixLength <= 40; ++prefixLength)
+        {
+            for (size_t suffixLength : { 0, 1, 7, 8, 9, 15, 16, 17, 33 })
+            {
+                std::string const prefix(prefixLength, 'p'), suffix(suffixLength, 's');
+                std::wstring const widePrefix(prefixLength, 'p'), wideSuffix(suffixLength, 's');
+                std::wstring const utf16Text = widePrefix + testCase.utf16Text + wideSuffix;
+                std::string const utf8Text = prefix + testCase.utf8Text + suffix;
+                CHECK(GetUtf8Length(utf16Text.data(), utf16Text.size()) == utf8Text.size());
+                CHECK(ToUtf8(utf16Text) == utf8Text);
+            }
+        }
+    }
+
+    // Characters beyond ASCII within blocks, which must not take the ASCII path.
+    std::wstring text(64, 'a');
+    text[20] = 0x0080;
+    text[47] = 0x0100;
+    CHECK(GetUtf8Length(text.data(), text.size()) == 66);
+    CHECK(ToUtf16(ToUtf8(text)) == text);
+}
+
+
+TEST_CASE(UnicodeConversionRoundTrip)
+{
+    // Every valid code point, mixed with ASCII runs of varying length.
+    std::wstring text;
+    for (char32_t ch = 0; ch <= UnicodeMax; ch += (ch < 0x3000) ? 1 : 37)
+    {
+        if (IsSurrogate(ch))
+            continue;
+
+        if (IsCharacterBeyondBmp(ch))
+        {
+            text.push_back(GetLeadingSurrogate(ch));
+            text.push_back(GetTrailingSurrogate(ch));
+        }
+        else
+        {
+            text.push_back(wchar_t(ch));
+        }
+        text.append(ch % 23, 'x');
+    }
+
+    CHECK(ToUtf16(ToUtf8(text)) == text);
+}
+
+
+TEST_CASE(UnicodeConversionShortDestination)
+{
+    // Conversion stops before a character that does not fit, never writing
+    // past the destination, including from the vectorized loops.
+    std::string const asciiText(40, 'a');
+    std::vector<wchar_t> utf16Buffer(20);
+    CHECK(ConvertUtf8ToUtf16(asciiText.data(), asciiText.size(), OUT utf16Buffer.data(), utf16Buffer.size()) == 20);
+
+    std::wstring const wideAsciiText(40, 'a');
+    std::vector<char> utf8Buffer(20);
+    CHECK(ConvertUtf16ToUtf8(wideAsciiText.data(), wideAsciiText.size(), OUT utf8Buffer.data(), utf8Buffer.size()) == 20);
+
+    // A surrogate pair is not split.
+    std::string const emoji = "a\xF0\x9F\x98\x80";
+    CHECK(ConvertUtf8ToUtf16(emoji.data(), emoji.size(), OUT utf16Buffer.data(), 2) == 1);
+
+    // Nor is a multibyte sequence.
+    std::wstring const euro = L"a\x20AC";
+    CHECK(ConvertUtf16ToUtf8(euro.data(), euro.size(), OUT utf8Buffer.data(), 3) == 1);
+    CHECK(ConvertUtf16ToUtf8(euro.data(), euro.size(), OUT utf8Buffer.data(), 4) == 4);
+}